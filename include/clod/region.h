@@ -27,11 +27,17 @@
  * Backwards compatability with old ABI versions/behaviours will be ensured, at least until a major SO version bump,
  * this identifies which ABI version the program is expecting.
  */
-#define CLOD_REGION_VERSION 1
+#define CLOD_REGION_VERSION 2
 
 struct clod_region;
 struct clod_region_opts;
 struct clod_region_iter;
+struct clod_region_view;
+struct clod_region_read_request;
+struct clod_region_write_request;
+struct clod_region_scan_opts;
+struct clod_region_convert_opts;
+struct clod_region_stats;
 
 /**
  * Result of a call to a libregion library method.
@@ -53,7 +59,10 @@ enum clod_region_result {
 	CLOD_REGION_MALFORMED = 2,
 	/** The chunk does not exist.
 	 * The program can write to the chunk to make it exist. */
-	CLOD_REGION_NOT_FOUND = 3
+	CLOD_REGION_NOT_FOUND = 3,
+	/** The provided buffer is too small to hold the chunk data.
+	 * If the size of the chunk data could be discerned, it is returned so the program can retry with a larger buffer. */
+	CLOD_REGION_SHORT_BUFFER = 4
 };
 
 /**
@@ -68,6 +77,8 @@ clod_region_open(const char *path, const struct clod_region_opts *opts);
 
 /**
  * Read chunk data.
+ * Like clod_decompress, the nullability of \p size informs the method if the size of the chunk is known.
+ * If \p size is null, \p buff_size must be the exact size of the chunk data.
  * @param[in] region Region handle.
  * @param[in] pos Chunk position.
  * @param[in] buff The buffer where data is written to.
@@ -77,11 +88,72 @@ clod_region_open(const char *path, const struct clod_region_opts *opts);
  * @throws CLOD_REGION_INVALID_USAGE On invalid usage.
  * @throws CLOD_REGION_MALFORMED Chunk data is corrupted.
  * @throws CLOD_REGION_NOT_FOUND Chunk does not exist.
+ * @throws CLOD_REGION_SHORT_BUFFER \p buff is too small to hold the chunk data.
  */
 CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2, 3)
 enum clod_region_result
 clod_region_read(struct clod_region *region, const int64_t *pos, uint8_t *buff, size_t buff_size, size_t *size);
 
+/**
+ * Read many chunks.
+ * Chunks are grouped by region file, so each region file is looked up and locked once,
+ * and chunks in a region file are read in the order they are stored.
+ * This is faster than calling clod_region_read for each chunk when loading many nearby chunks.
+ * @param[in] region Region handle.
+ * @param[in,out] requests Chunks to read. The result of each read is written to its request.
+ * @param[in] count Number of requests.
+ * @throws CLOD_REGION_OK If every chunk was read.
+ * @throws CLOD_REGION_* The result of the first request that failed.
+ */
+CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1)
+enum clod_region_result
+clod_region_read_many(struct clod_region *region, struct clod_region_read_request *requests, size_t count);
+
+/**
+ * Hint that chunks are about to be read.
+ * Reading the stored chunk data into memory is started in the background, and this doesn't wait for it.
+ * Missing chunks and region files are ignored.
+ * @param[in] region Region handle.
+ * @param[in] positions Positions of the chunks, one after another.
+ * @param[in] count Number of positions.
+ * @throws CLOD_REGION_OK On success.
+ * @throws CLOD_REGION_INVALID_USAGE On invalid usage.
+ */
+CLOD_API CLOD_NONNULL(1)
+enum clod_region_result
+clod_region_prefetch(struct clod_region *region, const int64_t *positions, size_t count);
+
+/**
+ * Get a view of the stored chunk data without copying or decompressing it.
+ * The view points directly into the region file's memory map,
+ * and writers of the chunk, and of some other chunks in the same region file, are blocked until the view is released.
+ * Views should be released promptly, and on the thread that acquired them.
+ * With opts.shared, writers in other processes aren't blocked, and may overwrite the data while the view is held.
+ * clod_region_read and clod_region_read_many read the chunk again when that happens, and should be preferred.
+ * While a thread holds a view, anything it does that needs the region file to itself fails with
+ * CLOD_REGION_INVALID_USAGE instead of waiting for the view: writes that create or grow the file, compacting it,
+ * and, with opts.shared, reads that find another process grew it.
+ * @param[in] region Region handle.
+ * @param[in] pos Chunk position.
+ * @param[out] view The view of the chunk data.
+ * @throws CLOD_REGION_OK On success. The view must be released with clod_region_view_release.
+ * @throws CLOD_REGION_INVALID_USAGE On invalid usage.
+ * @throws CLOD_REGION_MALFORMED Chunk data is corrupted.
+ * @throws CLOD_REGION_NOT_FOUND Chunk does not exist.
+ */
+CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2, 3)
+enum clod_region_result
+clod_region_read_view(struct clod_region *region, const int64_t *pos, struct clod_region_view *view);
+
+/**
+ * Release a view acquired with clod_region_read_view.
+ * @param[in] region Region handle.
+ * @param[in] view The view to release.
+ */
+CLOD_API CLOD_NONNULL(1, 2)
+void
+clod_region_view_release(struct clod_region *region, struct clod_region_view *view);
+
 /**
  * Write chunk data or delete a chunk.
  * Delete a chunk by passing a null buffer.
@@ -97,8 +169,24 @@ CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2)
 enum clod_region_result
 clod_region_write(struct clod_region *region, const int64_t *pos, const uint8_t *buff, size_t buff_size);
 
+/**
+ * Write or delete many chunks.
+ * Writes are grouped by region file, and each region file's header is updated once for the whole group.
+ * Unlike clod_region_write, the chunks are durable once this returns, with one sync per region file.
+ * If a chunk is written more than once, the last request for it is the one that is kept.
+ * @param[in] region Region handle.
+ * @param[in,out] requests Chunks to write. The result of each write is written to its request.
+ * @param[in] count Number of requests.
+ * @throws CLOD_REGION_OK If every chunk was written.
+ * @throws CLOD_REGION_* The result of the first request that failed.
+ */
+CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1)
+enum clod_region_result
+clod_region_write_batch(struct clod_region *region, struct clod_region_write_request *requests, size_t count);
+
 /**
  * Get the last modification time of the chunk.
+ * With opts.index set, the chunk is looked up in the chunk index without opening its region file.
  * @param[in] region Region handle.
  * @param[in] pos Chunk position.
  * @param[out] mtime Last modification time.
@@ -111,8 +199,144 @@ CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2)
 enum clod_region_result
 clod_region_mtime(struct clod_region *region, const int64_t *pos, time_t *mtime);
 
+/**
+ * Check every chunk in the region file holding a chunk against its checksum, regardless of opts.verify.
+ * @param[in] region Region handle.
+ * @param[in] pos Position of a chunk in the region file.
+ * @param[in] corrupt Called with the position of each chunk that is corrupted. Can be null.
+ * @param[in] user Passed to \p corrupt.
+ * @throws CLOD_REGION_OK If no chunk is corrupted, or the region file doesn't exist.
+ * @throws CLOD_REGION_INVALID_USAGE On invalid usage.
+ * @throws CLOD_REGION_MALFORMED A chunk is corrupted.
+ */
+CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2)
+enum clod_region_result
+clod_region_scrub(
+	struct clod_region *region,
+	const int64_t *pos,
+	void (*corrupt)(void *user, const int64_t *pos),
+	void *user
+);
+
+/**
+ * Rewrite the region file holding a chunk with its chunks stored one after another, in the order set by
+ * opts.compact_order, leaving out the space left behind by chunks that moved or were deleted.
+ * The chunks are copied into a new file at the rate set by opts.compact_budget, which then replaces the old one.
+ * Chunks can be read while they are copied, but writers to the region file wait until it has been replaced.
+ * @param[in] region Region handle.
+ * @param[in] pos Position of a chunk in the region file.
+ * @throws CLOD_REGION_OK On success, or if the region file doesn't exist.
+ * @throws CLOD_REGION_INVALID_USAGE On invalid usage, including compacting a region shared between processes.
+ * @throws CLOD_REGION_MALFORMED A chunk location is corrupted.
+ */
+CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2)
+enum clod_region_result
+clod_region_compact(struct clod_region *region, const int64_t *pos);
+
+/**
+ * Compress every chunk in the region again with another compression method or level, using many threads.
+ * Each thread rewrites whole region files into new files the way clod_region_compact does,
+ * and each new file replaces the old one once it's complete, so a crash leaves one or the other.
+ * Chunks can be read throughout, including by processes that have the region open read-only,
+ * which read the old file until they open it again. Writers to a region file wait while it's rewritten.
+ * Region files whose header can't record \p method are given a libclod header, which minecraft can't read.
+ * Corrupted chunks, and chunks stored in chunk files of their own, are kept as they are.
+ * Chunks written afterwards are still compressed with opts.compression.
+ * @param[in] region Region handle.
+ * @param[in] method Compression method to use.
+ * @param[in] level Compression level to use.
+ * @param[in] threads Number of threads rewriting region files, or 0 for the number of processors.
+ * @throws CLOD_REGION_OK On success.
+ * @throws CLOD_REGION_INVALID_USAGE On invalid usage, including recompressing a region shared between processes.
+ * @throws CLOD_REGION_MALFORMED A chunk is corrupted, or a region file's chunk locations are, in which case the file is left alone.
+ * Other files are still recompressed.
+ */
+CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1)
+enum clod_region_result
+clod_region_recompress(
+	struct clod_region *region,
+	enum clod_compression_method method,
+	enum clod_compression_level level,
+	uint32_t threads
+);
+
+/**
+ * Visit every chunk in the region, using many threads.
+ * Chunks are read on opts->io_threads threads, and decompressed and visited on opts->workers threads,
+ * so reading from disk and decompressing happen at the same time.
+ * Chunks are visited in no particular order, and several are visited at once.
+ * @param[in] region Region handle.
+ * @param[in] opts Visitor and configuration.
+ * @throws CLOD_REGION_OK When every chunk was visited, or the visitor stopped the scan.
+ * @throws CLOD_REGION_INVALID_USAGE On invalid usage.
+ * @throws CLOD_REGION_* The result of the first chunk that couldn't be read, if there is no error callback.
+ */
+CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2)
+enum clod_region_result
+clod_region_scan(struct clod_region *region, const struct clod_region_scan_opts *opts);
+
+/**
+ * Copy every chunk of one region into another, such as a vanilla world into a libclod region, using many threads.
+ * Each thread converts whole region files. Chunks are checked against their checksum and decompressed before they're
+ * copied, and are stored with \p dst's compression, keeping their modification times.
+ * Chunks already compressed that way are copied as they are, and the rest are compressed again.
+ * Files are written with one sync per opts->batch_size bytes of chunk data,
+ * and which files are done is recorded in a file in \p dst's directory named its prefix followed by ".convert".
+ * A conversion that is stopped or cut short skips those files when it's run again,
+ * and the file is removed once every region file has been converted.
+ * @param[in] src Region to convert.
+ * @param[in] dst Region to convert into. Must be writeable and have the same number of dimensions as \p src.
+ * @param[in] opts Configuration. Can be null for the defaults.
+ * @throws CLOD_REGION_OK When every region file was converted, or the conversion was stopped by opts->converted.
+ * @throws CLOD_REGION_INVALID_USAGE On invalid usage.
+ * @throws CLOD_REGION_* The result of the first chunk that couldn't be converted, if there is no error callback.
+ */
+CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2)
+enum clod_region_result
+clod_region_convert(struct clod_region *src, struct clod_region *dst, const struct clod_region_convert_opts *opts);
+
+/**
+ * List the chunks inside a box, with their modification time and size once decompressed.
+ * With opts.index set, chunks are listed from the chunk index without opening any region file.
+ * Otherwise, the header of every region file overlapping the box is read.
+ * Chunks are listed a region file at a time, in no particular order. Region files created while listing aren't listed.
+ * @param[in] region Region handle.
+ * @param[in] min Lowest position of the box in each dimension.
+ * @param[in] max Highest position of the box in each dimension, inclusive.
+ * @param[in] found Called with each chunk. Its size is 0 if it isn't known.
+ * Returning false stops the listing. Can write to the region.
+ * @param[in] user Passed to \p found.
+ * @throws CLOD_REGION_OK On success, including when stopped.
+ * @throws CLOD_REGION_INVALID_USAGE On invalid usage.
+ * @throws CLOD_REGION_MALFORMED A region file's header is corrupted. Chunks listed before it was found stay listed.
+ */
+CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2, 3, 4)
+enum clod_region_result
+clod_region_list(
+	struct clod_region *region,
+	const int64_t *min,
+	const int64_t *max,
+	bool (*found)(void *user, const int64_t *pos, time_t mtime, size_t size),
+	void *user
+);
+
+/**
+ * Get counters of what the region has done since it was opened.
+ * Counting is cheap, and the counters are only totalled when this is called,
+ * so they are slightly behind calls that are still running on other threads.
+ * @param[in] region Region handle.
+ * @param[out] stats Counters.
+ */
+CLOD_API CLOD_NONNULL(1, 2)
+void
+clod_region_stats(struct clod_region *region, struct clod_region_stats *stats);
+
 /**
  * Start iterating over chunks.
+ * Chunks are handed out a region file at a time, in the order they are stored,
+ * so threads sharing an iterator each read through whole region files.
+ * The chunks of a region file are listed when its first chunk is handed out.
+ * The region can't be closed until the iterator is ended.
  * @param[in] region Region handle.
  * @return New iterator, or nullptr on allocation failure.
  */
@@ -126,6 +350,7 @@ clod_region_iter_start(struct clod_region *region);
  * @param[in] iter Iterator.
  * @param[out] pos Next chunk position.
  * @return True if the next position existed and was returned in pos.
+ * False once every position has been returned, or is about to be returned to another thread.
  */
 CLOD_API CLOD_USE_RETURN CLOD_NONNULL(1, 2)
 bool
@@ -154,6 +379,57 @@ clod_region_close(struct clod_region *region);
 #define CLOD_REGION_MODE_RDWR 2
 /** @} */
 
+/** @name I/O engines
+ * @{ */
+/** Chunk data is read from memory mapped region files. */
+#define CLOD_REGION_IO_MMAP 1
+/** Chunk data is read with io_uring, keeping many reads in flight when reading many chunks at once.
+ * Linux only. Views and writes still use memory mapped region files. */
+#define CLOD_REGION_IO_URING 2
+/** @} */
+
+/** @name Access patterns
+ * Hints to the kernel about how region files are read, which set how far it reads ahead.
+ * Scans read ahead through each region file whatever the hint, as they read files in the order they're stored.
+ * @{ */
+/** The kernel's default readahead. */
+#define CLOD_REGION_ACCESS_NORMAL 1
+/** Chunks are read one at a time, in no particular order, so nothing is read ahead. Suits gameplay. */
+#define CLOD_REGION_ACCESS_RANDOM 2
+/** Region files are read from start to end, so a lot is read ahead. Suits tools that read whole files. */
+#define CLOD_REGION_ACCESS_SEQUENTIAL 3
+/** @} */
+
+/** @name Mapping flags
+ * @{ */
+/** Ask for region files to be mapped with huge pages, where the filesystem supports it. */
+#define CLOD_REGION_MAP_HUGE_PAGES 1
+/** Lock the headers of open region files in memory, as far as the process's locked memory limit allows,
+ * so finding a chunk never waits for the disk. */
+#define CLOD_REGION_MAP_LOCK_HEADERS 2
+/** @} */
+
+/** @name Compaction orders
+ * @{ */
+/** Chunks are stored near the chunks around them, so nearby chunks are read together. */
+#define CLOD_REGION_ORDER_SPATIAL 1
+/** Recently modified chunks are stored first. Chunks that are modified are usually the ones that are read. */
+#define CLOD_REGION_ORDER_RECENT 2
+/** @} */
+
+/** @name Checksum verification policies
+ * Chunk data is checked against its checksum in the same pass that copies or decompresses it.
+ * @{ */
+/** Every read is checked. */
+#define CLOD_REGION_VERIFY_ALWAYS 1
+/** The first read of each chunk after its region file is opened is checked. */
+#define CLOD_REGION_VERIFY_FIRST 2
+/** One in opts.verify_sample reads is checked. */
+#define CLOD_REGION_VERIFY_SAMPLED 3
+/** Reads aren't checked. Chunks are only checked by clod_region_scrub. */
+#define CLOD_REGION_VERIFY_SCRUB 4
+/** @} */
+
 /** @name Limits
  * @{ */
 #define CLOD_REGION_PREFIX_MAX 30
@@ -161,6 +437,169 @@ clod_region_close(struct clod_region *region);
 #define CLOD_REGION_DIMENSIONS_MAX 10
 /** @} */
 
+/**
+ * View of stored chunk data, returned by clod_region_read_view.
+ */
+struct clod_region_view {
+	/** Chunk data as it is stored, compressed with \p compression. */
+	const uint8_t *data;
+	/** Size of \p data in bytes. */
+	size_t size;
+	/** Compression method used for \p data.
+	 * CLOD_UNCOMPRESSED means \p data is the chunk data itself. */
+	enum clod_compression_method compression;
+	/** Size of the chunk data once decompressed, or 0 if the region file doesn't record it.
+	 * When it's known, the data can be decompressed in one pass with clod_decompress given the exact size. */
+	size_t uncompressed_size;
+	/** CRC-32 of \p data recorded when the chunk was written, or 0 if the region file doesn't record it.
+	 * Views aren't checked against it, as the library doesn't touch the data. */
+	uint32_t checksum;
+	/** Used internally. */
+	uintptr_t _internal[3];
+};
+
+/**
+ * A chunk to read with clod_region_read_many.
+ */
+struct clod_region_read_request {
+	/** Chunk position. */
+	const int64_t *pos;
+	/** The buffer where data is written to. */
+	uint8_t *buff;
+	/** Size of \p buff. */
+	size_t buff_size;
+	/** Set to the actual size of the chunk data. */
+	size_t size;
+	/** Set to the result of reading the chunk, as it would be returned by clod_region_read. */
+	enum clod_region_result result;
+};
+
+/**
+ * A chunk to write with clod_region_write_batch.
+ */
+struct clod_region_write_request {
+	/** Chunk position. */
+	const int64_t *pos;
+	/** Chunk data to write, or null to delete the chunk. */
+	const uint8_t *buff;
+	/** Size of \p buff. */
+	size_t buff_size;
+	/** Set to the result of writing the chunk, as it would be returned by clod_region_write. */
+	enum clod_region_result result;
+};
+
+/**
+ * Configuration of clod_region_scan.
+ * Zero values imply defaults.
+ */
+struct clod_region_scan_opts {
+	/** Called with the decompressed data of every chunk. Called from many threads at once.
+	 * \p data is only valid until the call returns. Returning false stops the scan. */
+	bool (*visit)(void *user, const int64_t *pos, const uint8_t *data, size_t size);
+
+	/** Called for chunks that couldn't be read or decompressed, from any thread. The scan carries on afterwards.
+	 * If null, the scan stops at the first chunk that couldn't be read. */
+	void (*error)(void *user, const int64_t *pos, enum clod_region_result result);
+
+	/** Passed to \p visit and \p error. */
+	void *user;
+
+	/** Number of threads reading stored chunk data. Defaults to 2. */
+	uint32_t io_threads;
+
+	/** Number of threads decompressing and visiting chunks. Defaults to the number of processors. */
+	uint32_t workers;
+
+	/** Number of chunks that can be read and waiting to be visited.
+	 * Bounds the memory the scan uses. Defaults to 4 per worker. */
+	uint32_t queue_depth;
+};
+
+/**
+ * Configuration of clod_region_convert.
+ * Zero values imply defaults.
+ */
+struct clod_region_convert_opts {
+	/** Called with the position of each region file once it's converted and durable, from any thread.
+	 * Returning false stops the conversion. Can be null. */
+	bool (*converted)(void *user, const int64_t *region_pos);
+
+	/** Called for chunks that couldn't be read, checked or written, from any thread.
+	 * The conversion carries on without them. If null, the conversion stops at the first such chunk. */
+	void (*error)(void *user, const int64_t *pos, enum clod_region_result result);
+
+	/** Passed to \p converted and \p error. */
+	void *user;
+
+	/** Number of threads converting region files. Defaults to the number of processors. */
+	uint32_t threads;
+
+	/** Bytes of converted chunk data each thread gathers before writing it out.
+	 * Bounds the memory the conversion uses. Defaults to 32 MiB. */
+	uint32_t batch_size;
+};
+
+/** Number of buckets in each latency histogram of struct clod_region_stats. */
+#define CLOD_REGION_LATENCY_BUCKETS 32
+
+/**
+ * Counters returned by clod_region_stats.
+ * Latency histograms count calls by how long they took: bucket i counts calls taking
+ * from 2^i up to 2^(i+1) nanoseconds, and the last bucket also counts every slower call.
+ */
+struct clod_region_stats {
+	/** Region files found open in the file cache. */
+	uint64_t file_hits;
+	/** Region files not found open in the file cache. */
+	uint64_t file_misses;
+	/** Region files opened. Less than \p file_misses by the files that didn't exist. */
+	uint64_t file_opens;
+	/** Region files closed to keep within opts.max_open_files. */
+	uint64_t file_evictions;
+	/** Chunk files of external chunks found open. */
+	uint64_t external_hits;
+	/** Chunk files of external chunks opened. */
+	uint64_t external_misses;
+
+	/** Chunks read by clod_region_read, clod_region_read_many, clod_region_read_view and clod_region_scan. */
+	uint64_t chunks_read;
+	/** Bytes of stored chunk data those reads used. */
+	uint64_t bytes_read;
+	/** Bytes of chunk data those reads returned once decompressed. Views aren't decompressed, so aren't counted. */
+	uint64_t bytes_read_uncompressed;
+	/** Chunks written. Deletions aren't counted. */
+	uint64_t chunks_written;
+	/** Bytes of chunk data stored by those writes. */
+	uint64_t bytes_written;
+	/** Bytes of chunk data given to those writes, before compression. */
+	uint64_t bytes_written_uncompressed;
+
+	/** Times a region file was resized. */
+	uint64_t file_truncates;
+	/** Times a region file's mapping moved to a new address when it was resized. */
+	uint64_t file_remaps;
+
+	/** Times a region file's lock had to be waited for. */
+	uint64_t file_lock_waits;
+	/** Nanoseconds spent waiting for region files' locks. */
+	uint64_t file_lock_wait_ns;
+	/** Times the lock of a stripe of chunks had to be waited for. */
+	uint64_t stripe_lock_waits;
+	/** Nanoseconds spent waiting for stripe locks. */
+	uint64_t stripe_lock_wait_ns;
+
+	/** Latency of clod_region_read. */
+	uint64_t read_latency[CLOD_REGION_LATENCY_BUCKETS];
+	/** Latency of clod_region_read_many. */
+	uint64_t read_many_latency[CLOD_REGION_LATENCY_BUCKETS];
+	/** Latency of clod_region_read_view, until the view is returned. */
+	uint64_t read_view_latency[CLOD_REGION_LATENCY_BUCKETS];
+	/** Latency of clod_region_write. */
+	uint64_t write_latency[CLOD_REGION_LATENCY_BUCKETS];
+	/** Latency of clod_region_write_batch. */
+	uint64_t write_batch_latency[CLOD_REGION_LATENCY_BUCKETS];
+};
+
 /**
  * Configuration options passed to region_open.
  * Zero values imply defaults.
@@ -182,7 +621,7 @@ struct clod_region_opts {
 
 	/** Size of region file sectors. This should be sized so that 255 * sector_size
 	 * is large enough to hold almost all chunks. Chunks greater than this size are supported,
-	 * but do so using dedicated files for each chunk, which is significantly slower. */
+	 * but do so using dedicated files for each chunk, which are slower to write and to read when not recently used. */
 	uint32_t sector_size;
 
 	/** File descriptor for the directory relative to which path is resolved.
@@ -205,6 +644,65 @@ struct clod_region_opts {
 	/** File extension for chunk files. Defaults to "mcc".
 	 * Max CLOD_REGION_EXTENSION_MAX characters. Must be valid in a filename. */
 	char chunk_ext[CLOD_REGION_EXTENSION_MAX + 1];
+
+	/* Fields from here on were added in version 2.
+	 * New fields are only ever appended, so the options of every older version are a prefix of these. */
+
+	/** How chunk data is read. Defaults to CLOD_REGION_IO_MMAP.
+	 * CLOD_REGION_IO_URING falls back to CLOD_REGION_IO_MMAP if io_uring isn't available. */
+	uint8_t io_engine;
+
+	/** How region files are read, one of the CLOD_REGION_ACCESS_* patterns. Defaults to CLOD_REGION_ACCESS_NORMAL. */
+	uint8_t access;
+
+	/** CLOD_REGION_MAP_* flags for how region files are mapped. Defaults to none. */
+	uint8_t map_flags;
+
+	/** Region files no larger than this many bytes are read into memory as a whole when they're opened,
+	 * so reading them never waits for the disk. Suits small files that are read often. Defaults to 0, which disables it. */
+	uint32_t populate_max;
+
+	/** Number of region files kept open. Defaults to 256.
+	 * Files in use are never closed, so more files than this are open while more than this are in use. */
+	uint32_t max_open_files;
+
+	/** Order chunks are stored in by compaction. Defaults to CLOD_REGION_ORDER_SPATIAL. */
+	uint8_t compact_order;
+
+	/** Percentage of a region file that must be unused before a background thread compacts it.
+	 * Only region files the region has open are checked, and a write that leaves one over the threshold wakes the thread.
+	 * 0 disables background compaction, which is the default.
+	 * Ignored unless \p mode is CLOD_REGION_MODE_RDWR, and for regions shared between processes. */
+	uint8_t compact_threshold;
+
+	/** Bytes per second compaction copies, so that it doesn't starve other I/O. Defaults to 16 MiB. */
+	uint32_t compact_budget;
+
+	/** When reads check chunk data against its checksum. Defaults to CLOD_REGION_VERIFY_FIRST. */
+	uint8_t verify;
+
+	/** With CLOD_REGION_VERIFY_SAMPLED, one in this many reads on each thread is checked. Defaults to 64. */
+	uint32_t verify_sample;
+
+	/** Set to 1 to share the region with other processes that set it too, so that they can all write to it at once.
+	 * Writers to a region file lock out writers in other processes through robust process-shared mutexes,
+	 * kept in a file in the region directory named \p prefix followed by ".shared".
+	 * Readers in other processes don't wait for them, and retry reads that overlapped a write.
+	 * A process that dies while writing leaves the mutex to the next writer, which repairs the region file first.
+	 * Compaction isn't available to shared regions.
+	 * Needs robust process-shared mutexes, which Linux and the BSDs have but macOS and Windows don't. Defaults to 0. */
+	uint8_t shared;
+
+	/** Set to 1 to keep an index of the chunks in every region file, kept up to date by every write,
+	 * so clod_region_mtime and clod_region_list answer without opening region files.
+	 * It's a file in the region directory named \p prefix followed by ".index", which is mapped as a whole,
+	 * taking about 8 KiB for each region file.
+	 * Writeable regions build it from the region files when it's missing, or when it was left out of date
+	 * by a crash or by a region opened for writing without it, or shared between processes, which don't keep it.
+	 * Read-only regions use it while no other process is writing to the region, and read region files otherwise.
+	 * Other programs, such as minecraft, don't know about it, so it must be deleted after they write to the region.
+	 * Defaults to 0. */
+	uint8_t index;
 };
 
 /** @} */
@@ -26,7 +26,7 @@ divi64(const int64_t x, const int64_t divisor) {
 	res.quot = x / divisor;
 	res.rem = x % divisor;
 
-	if (res.rem != 0 && res.rem < 0 != divisor < 0) {
+	if (res.rem != 0 && (res.rem < 0) != (divisor < 0)) {
 		res.rem += divisor;
 		res.quot--;
 	}
@@ -59,7 +59,7 @@ static inline uint64_t vec_group(int64_t *restrict vec, uint8_t vec_len, uint8_t
 	uint64_t res = 0;
 	uint8_t res_bits = 0;
 	for (uint8_t i = 0; i < vec_len; i++) {
-		const uint8_t take_bits = (group_bits - res_bits + vec_len - i - 1) / (vec_len - i);
+		const uint8_t take_bits = (uint8_t)((group_bits - res_bits + vec_len - i - 1) / (vec_len - i));
 		res |= ((uint64_t)vec[i] & mask64(take_bits)) << res_bits;
 		vec[i] >>= take_bits;
 		res_bits += take_bits;
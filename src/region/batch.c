@@ -0,0 +1,37 @@
+#include "batch.h"
+#include "region_impl.h"
+#include <stdlib.h>
+#include <string.h>
+
+void batch_entry_init(struct batch_entry *e, const int64_t *pos, const uint8_t dims, const size_t request) {
+	memset(e->region_pos, 0, sizeof(e->region_pos));
+	e->index = chunk_index(pos, e->region_pos, dims);
+	e->request = request;
+	e->key = 0;
+}
+
+static int file_cmp(const struct batch_entry *a, const struct batch_entry *b) {
+	for (size_t i = 0; i < CLOD_REGION_DIMENSIONS_MAX; i++) {
+		if (a->region_pos[i] != b->region_pos[i]) return a->region_pos[i] < b->region_pos[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+static int entry_cmp(const void *a_ptr, const void *b_ptr) {
+	const struct batch_entry *a = a_ptr, *b = b_ptr;
+	const int cmp = file_cmp(a, b);
+	if (cmp) return cmp;
+	if (a->key != b->key) return a->key < b->key ? -1 : 1;
+	if (a->request != b->request) return a->request < b->request ? -1 : 1;
+	return 0;
+}
+
+void batch_sort(struct batch_entry *entries, const size_t count) {
+	if (count > 1) qsort(entries, count, sizeof(entries[0]), entry_cmp);
+}
+
+size_t batch_file_end(const struct batch_entry *entries, const size_t count, const size_t start) {
+	size_t end = start + 1;
+	while (end < count && file_cmp(&entries[start], &entries[end]) == 0) end++;
+	return end;
+}
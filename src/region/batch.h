@@ -0,0 +1,36 @@
+#ifndef CLOD_REGION_BATCH_H
+#define CLOD_REGION_BATCH_H
+
+#include <clod/region.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A chunk in a batched operation.
+ * Batches are sorted so that chunks in the same region file are adjacent,
+ * letting each region file be looked up and locked once for the whole batch.
+ */
+struct batch_entry {
+	// Position of the region file containing the chunk. Unused dimensions are zero.
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	// Index of the chunk in its region file.
+	size_t index;
+	// Index of the chunk in the caller's batch.
+	size_t request;
+	// Order of the chunk within its region file.
+	uint64_t key;
+};
+
+void batch_entry_init(struct batch_entry *e, const int64_t *pos, uint8_t dims, size_t request);
+
+/**
+ * Sort entries by region file, then key.
+ */
+void batch_sort(struct batch_entry *entries, size_t count);
+
+/**
+ * Get the end of the run of entries in the same region file as entries[start].
+ */
+size_t batch_file_end(const struct batch_entry *entries, size_t count, size_t start);
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ * Compression contexts hold large tables that are expensive to create,
+ * so idle ones are kept in a pool shared by all threads using the region.
+ */
+#include "region_impl.h"
+#include "error.h"
+#include <clod/compression.h>
+#include <stdlib.h>
+
+struct clod_compressor *codec_compressor_get(struct clod_region *r) {
+	struct clod_compressor *ctx = nullptr;
+
+	mutex_lock(&r->codec_mtx);
+	if (r->compressors_len > 0) {
+		ctx = r->compressors[--r->compressors_len];
+	}
+	mutex_unlock(&r->codec_mtx);
+
+	if (!ctx) ctx = clod_compressor_init();
+	return ctx;
+}
+
+void codec_compressor_put(struct clod_region *r, struct clod_compressor *ctx) {
+	mutex_lock(&r->codec_mtx);
+	if (r->compressors_len < CODEC_POOL_MAX) {
+		r->compressors[r->compressors_len++] = ctx;
+		ctx = nullptr;
+	}
+	mutex_unlock(&r->codec_mtx);
+
+	if (ctx) clod_compressor_free(ctx);
+}
+
+struct clod_decompressor *codec_decompressor_get(struct clod_region *r) {
+	struct clod_decompressor *ctx = nullptr;
+
+	mutex_lock(&r->codec_mtx);
+	if (r->decompressors_len > 0) {
+		ctx = r->decompressors[--r->decompressors_len];
+	}
+	mutex_unlock(&r->codec_mtx);
+
+	if (!ctx) ctx = clod_decompressor_init();
+	return ctx;
+}
+
+void codec_decompressor_put(struct clod_region *r, struct clod_decompressor *ctx) {
+	mutex_lock(&r->codec_mtx);
+	if (r->decompressors_len < CODEC_POOL_MAX) {
+		r->decompressors[r->decompressors_len++] = ctx;
+		ctx = nullptr;
+	}
+	mutex_unlock(&r->codec_mtx);
+
+	if (ctx) clod_decompressor_free(ctx);
+}
+
+void codec_destroy(struct clod_region *r) {
+	for (size_t i = 0; i < r->compressors_len; i++) {
+		clod_compressor_free(r->compressors[i]);
+	}
+	r->compressors_len = 0;
+	for (size_t i = 0; i < r->decompressors_len; i++) {
+		clod_decompressor_free(r->decompressors[i]);
+	}
+	r->decompressors_len = 0;
+}
+
+// Grow a decompression buffer to hold at least n bytes.
+static enum clod_region_result buffer_reserve(uint8_t **buff, size_t *cap, const size_t n) {
+	if (n <= *cap) return CLOD_REGION_OK;
+	if (n > DECOMPRESS_MAX) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk data decompresses to more than %zu bytes.", DECOMPRESS_MAX);
+	}
+	uint8_t *grown = realloc(*buff, n);
+	if (!grown) return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for decompressed chunk.");
+	*buff = grown;
+	*cap = n;
+	return CLOD_REGION_OK;
+}
+
+enum clod_region_result codec_decompress(
+	struct clod_decompressor *ctx,
+	const void *data, const size_t data_size,
+	const enum clod_compression_method compression,
+	const size_t known,
+	uint8_t **buff, size_t *cap, size_t *size
+) {
+	// When the size is known, the buffer is grown to fit beforehand and the chunk decompressed in one pass.
+	if (known) {
+		auto const res = buffer_reserve(buff, cap, known);
+		if (res != CLOD_REGION_OK) return res;
+		if (clod_decompress(ctx, *buff, known, data, data_size, nullptr, compression) == CLOD_COMPRESSION_SUCCESS) {
+			*size = known;
+			return CLOD_REGION_OK;
+		}
+		// The size might be stale, so the chunk is decompressed again as if it wasn't known.
+	}
+
+	for (;;) {
+		auto const res = clod_decompress(ctx, *buff, *cap, data, data_size, size, compression);
+		switch (res) {
+			case CLOD_COMPRESSION_SUCCESS:
+				return CLOD_REGION_OK;
+			case CLOD_COMPRESSION_SHORT_BUFFER:
+				break;
+			case CLOD_COMPRESSION_MALFORMED:
+				return region_error(CLOD_REGION_MALFORMED, "Failed to decompress chunk data.");
+			case CLOD_COMPRESSION_UNSUPPORTED:
+				return region_error(CLOD_REGION_INVALID_USAGE,
+					"Chunk is compressed with %d, which is not supported by this build.", compression);
+			default:
+				return region_error(CLOD_REGION_INVALID_USAGE, "Failed to decompress chunk data (%d).", res);
+		}
+
+		// The decompressor might have found out the size it needs.
+		auto const grow = buffer_reserve(buff, cap, *size > *cap ? *size : *cap * 2);
+		if (grow != CLOD_REGION_OK) return grow;
+	}
+}
+
+enum clod_region_result codec_compress(
+	struct clod_compressor *ctx,
+	const void *data, const size_t data_size,
+	const enum clod_compression_method compression,
+	const enum clod_compression_level level,
+	const codec_reserve reserve, void *user,
+	size_t *size
+) {
+	// Room for data that doesn't compress is tried first, and doubled a few times for methods with more overhead.
+	size_t capacity = data_size + data_size / 2 + 4096;
+	for (;;) {
+		uint8_t *dst;
+		auto const res = reserve(user, capacity, &dst);
+		if (res != CLOD_REGION_OK) return res;
+
+		auto const cres = clod_compress(ctx, dst, capacity, data, data_size, size, compression, level);
+		if (cres == CLOD_COMPRESSION_SUCCESS) return CLOD_REGION_OK;
+		if (cres != CLOD_COMPRESSION_SHORT_BUFFER || capacity > data_size * 4 + 65536) {
+			return region_error(CLOD_REGION_INVALID_USAGE, "Failed to compress chunk with %d (%d).", compression, cres);
+		}
+		capacity *= 2;
+	}
+}
@@ -4,12 +4,20 @@
 #include <stdio.h>
 #include <stdarg.h>
 
+// Errors held back on this thread.
+static thread_local struct {
+	unsigned depth;
+	size_t len;
+	char buff[4096];
+} held;
+
 const char *result_string(const enum clod_region_result result) {
 	switch (result) {
 		case CLOD_REGION_OK: return "CLOD_REGION_OK";
 		case CLOD_REGION_INVALID_USAGE: return "CLOD_REGION_INVALID_USAGE";
 		case CLOD_REGION_MALFORMED: return "CLOD_REGION_MALFORMED";
 		case CLOD_REGION_NOT_FOUND: return "CLOD_REGION_NOT_FOUND";
+		case CLOD_REGION_SHORT_BUFFER: return "CLOD_REGION_SHORT_BUFFER";
 	}
 	return "CLOD_REGION_RESULT_UNKNOWN";
 }
@@ -20,6 +28,28 @@ enum clod_region_result print_error(const enum clod_region_result result, const
 	va_start(va, msg);
 	vsnprintf(buff, sizeof(buff), msg, va);
 	va_end(va);
-	fprintf(stderr, "%s ("CLOD_COMMIT_HASH":%s:%d): %s\n", result_string(result), source_name, source_line, buff);
+	if (held.depth == 0) {
+		fprintf(stderr, "%s ("CLOD_COMMIT_HASH":%s:%d): %s\n", result_string(result), source_name, source_line, buff);
+		return result;
+	}
+
+	// Errors that don't fit are lost, which only happens to a flood of them.
+	const int n = snprintf(held.buff + held.len, sizeof(held.buff) - held.len,
+		"%s ("CLOD_COMMIT_HASH":%s:%d): %s\n", result_string(result), source_name, source_line, buff);
+	if (n > 0 && (size_t)n < sizeof(held.buff) - held.len) held.len += (size_t)n;
+	else held.buff[held.len] = 0;
 	return result;
 }
+
+size_t error_hold(void) {
+	held.depth++;
+	return held.len;
+}
+
+void error_release(const size_t mark, const bool keep) {
+	if (!keep) held.len = mark;
+	held.buff[held.len] = 0;
+	if (--held.depth > 0 || held.len == 0) return;
+	fputs(held.buff, stderr);
+	held.len = 0;
+}
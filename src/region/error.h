@@ -2,10 +2,17 @@
 #define CLOD_REGION_ERROR_H
 
 #include <clod/region.h>
+#include <stddef.h>
 
 __attribute__((cold)) __attribute__((format(printf, 4, 5)))
 enum clod_region_result
 print_error(enum clod_region_result result, const char *source_name, int source_line, const char *msg, ...);
 #define region_error(result, msg, ...) print_error(result, __FILE__, __LINE__, msg __VA_OPT__(,) __VA_ARGS__)
 
+// Hold back errors reported on this thread, for work that's tried again if it turns out to have raced a writer.
+// Returns a mark to pass to error_release, which drops the errors held since unless keep is set.
+// Holds nest, and what's kept is printed once the outermost is released.
+size_t error_hold(void);
+void error_release(size_t mark, bool keep);
+
 #endif
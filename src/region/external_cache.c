@@ -0,0 +1,146 @@
+/**
+ * Chunks too large for their region file are stored in files of their own, which are much slower to read
+ * than chunks in a region file if each read opens, maps and faults in the file again.
+ * The most recently used chunk files are kept open and mapped, so reads of hot chunks go straight to memory,
+ * and a file is prefetched as a whole when it's opened, so a cold read doesn't fault in one page at a time.
+ *
+ * Chunk files are replaced rather than rewritten, so a file that's still open keeps its old contents,
+ * but writers drop it from the cache so that later reads see the new one.
+ */
+#include "region_impl.h"
+#include "filename.h"
+#include "error.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+static bool pos_equal(const int64_t *a, const int64_t *b, const uint8_t dims) {
+	return memcmp(a, b, sizeof(a[0]) * dims) == 0;
+}
+
+// Find a cached file, moving it to the back as the most recently used. The cache mutex must be held.
+static struct external_file *cache_find(struct clod_region *r, const int64_t *pos) {
+	for (size_t i = 0; i < r->externals_len; i++) {
+		auto const ext = r->externals[i];
+		if (!pos_equal(ext->pos, pos, r->opts.dims)) continue;
+
+		memmove(&r->externals[i], &r->externals[i + 1], (r->externals_len - i - 1) * sizeof(r->externals[0]));
+		r->externals[r->externals_len - 1] = ext;
+		return ext;
+	}
+	return nullptr;
+}
+
+// Remove a file from the cache. Returns the file if nobody is using it, for the caller to close.
+static struct external_file *cache_remove(struct clod_region *r, const size_t i) {
+	auto const ext = r->externals[i];
+	memmove(&r->externals[i], &r->externals[i + 1], (r->externals_len - i - 1) * sizeof(r->externals[0]));
+	r->externals_len--;
+	ext->evicted = true;
+	return ext->users == 0 ? ext : nullptr;
+}
+
+static void external_close(struct external_file *ext) {
+	if (!ext) return;
+	(void)file_close(ext->f);
+	free(ext);
+}
+
+enum clod_region_result external_get(struct clod_region *r, const int64_t *pos, struct external_file **ext_ptr) {
+	mutex_lock(&r->external_mtx);
+	struct external_file *ext = cache_find(r, pos);
+	if (ext) ext->users++;
+	mutex_unlock(&r->external_mtx);
+	if (ext) {
+		stats_add(r->stats, STATS_WORD(external_hits), 1);
+		*ext_ptr = ext;
+		return CLOD_REGION_OK;
+	}
+	stats_add(r->stats, STATS_WORD(external_misses), 1);
+
+	char filename[REGION_FILENAME_MAX + 1];
+	external_filename(r, filename, pos, "");
+
+	file f;
+	auto const res = file_open(&f, r->d, filename, false, &r->opts);
+	if (res == CLOD_REGION_NOT_FOUND) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk file \"%s\" is missing.", filename);
+	}
+	if (res != CLOD_REGION_OK) return res;
+
+	void *data;
+	size_t size;
+	(void)file_get(f, &data, &size);
+	file_prefetch(f, 0, size);
+
+	ext = malloc(sizeof(*ext));
+	if (!ext) {
+		file_close(f);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for chunk file.");
+	}
+	memcpy(ext->pos, pos, sizeof(pos[0]) * r->opts.dims);
+	ext->f = f;
+	ext->users = 1;
+	ext->evicted = false;
+
+	// Another reader may have opened the file in the meantime.
+	struct external_file *evict = nullptr;
+	mutex_lock(&r->external_mtx);
+	auto const cached = cache_find(r, pos);
+	if (cached) {
+		cached->users++;
+		mutex_unlock(&r->external_mtx);
+		external_close(ext);
+		*ext_ptr = cached;
+		return CLOD_REGION_OK;
+	}
+	if (r->externals_len == EXTERNAL_CACHE_MAX) {
+		// The least recently used file nobody is using makes room.
+		for (size_t i = 0; i < r->externals_len; i++) {
+			if (r->externals[i]->users > 0) continue;
+			evict = cache_remove(r, i);
+			break;
+		}
+	}
+	if (r->externals_len < EXTERNAL_CACHE_MAX && !r->opts.shared) {
+		r->externals[r->externals_len++] = ext;
+	} else {
+		// Every cached file is in use, so this one is closed once it's released.
+		// Files aren't cached at all when other processes can replace them without telling this one.
+		ext->evicted = true;
+	}
+	mutex_unlock(&r->external_mtx);
+
+	external_close(evict);
+	*ext_ptr = ext;
+	return CLOD_REGION_OK;
+}
+
+void external_put(struct clod_region *r, struct external_file *ext) {
+	mutex_lock(&r->external_mtx);
+	const bool close = --ext->users == 0 && ext->evicted;
+	mutex_unlock(&r->external_mtx);
+	if (close) external_close(ext);
+}
+
+void external_filename(const struct clod_region *r, char *filename, const int64_t *pos, const char *suffix) {
+	char extension[EXTENSION_MAX + 1];
+	snprintf(extension, sizeof(extension), "%s%s", r->opts.chunk_ext, suffix);
+	filename_make(filename, CHUNK_FILE_PREFIX, extension, pos, r->opts.dims);
+}
+
+void external_forget(struct clod_region *r, const int64_t *pos) {
+	struct external_file *ext = nullptr;
+	mutex_lock(&r->external_mtx);
+	for (size_t i = 0; i < r->externals_len; i++) {
+		if (!pos_equal(r->externals[i]->pos, pos, r->opts.dims)) continue;
+		ext = cache_remove(r, i);
+		break;
+	}
+	mutex_unlock(&r->external_mtx);
+	external_close(ext);
+}
+
+void external_cache_destroy(struct clod_region *r) {
+	for (size_t i = 0; i < r->externals_len; i++) external_close(r->externals[i]);
+	r->externals_len = 0;
+}
@@ -1,113 +1,308 @@
 /**
  * The file cache wraps the region_file_open and region_file_close methods to
  * provide a single region_file_get method.
+ *
+ * Open files are indexed by position, and evicted with the CLOCK algorithm
+ * once more than the configured number of files are open.
+ *
+ * The cache is split into shards by position so that threads using different files rarely meet.
+ * Finding an open file only takes its shard's index lock for reading, so hits on the same file run in parallel.
+ * Changing a shard needs its mutex, and its index lock for writing while the index itself is changed.
+ *
+ * Opening and closing files is slow, so it happens without any cache lock.
+ * A file being opened has an entry without a region file, and anyone else looking for it waits for that open.
  */
 #include "region_impl.h"
 #include "region_file.h"
 #include "error.h"
+#include <clod/table.h>
 #include <stdint.h>
-#include <stdckdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define INDEX_NIL SIZE_MAX
+// Number of independently locked parts of the cache.
+#define CACHE_SHARDS 16
 
-struct file_cache {
+struct file_cache_entry {
+	// Key in the index. Only the region's dimensions are used.
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+	// Null while the file is being opened.
 	struct region_file *rf;
-	struct timespec last_access;
-	int64_t pos[];
+	// Index of the entry in the clock.
+	size_t slot;
+	// Set when the file is used, and cleared as the clock hand passes.
+	atomic bool referenced;
+};
+
+struct cache_shard {
+	// Held while changing the shard.
+	mutex mtx;
+	// Broadcast when a file in the shard has finished opening.
+	condvar opened;
+	// Read locked to use the index, write locked (with mtx held) to change it.
+	rbmutex index_mtx;
+	struct clod_table *index;
+	struct file_cache_entry **clock;
+	size_t len;
+	size_t cap;
+	size_t hand;
+};
+
+struct file_cache {
+	struct cache_shard shards[CACHE_SHARDS];
+	// Files open or being opened across every shard.
+	atomic size_t open;
+	// Shard to evict from next.
+	atomic size_t hand;
 };
 
-CLOD_CONST static size_t file_cache_size(const uint8_t dims) {
-	const size_t unaligned = sizeof(struct file_cache) + sizeof(int64_t) * dims;
-	return (unaligned + alignof(struct file_cache) - 1) &~ (alignof(struct file_cache) - 1);
+static struct cache_shard *shard_of(struct file_cache *cache, const int64_t *pos, const uint8_t dims) {
+	uint64_t h = 0;
+	for (uint8_t i = 0; i < dims; i++) {
+		h = (h ^ (uint64_t)pos[i]) * 0x9E3779B97F4A7C15;
+	}
+	return &cache->shards[(h >> 32) % CACHE_SHARDS];
 }
-static int64_t evictable_duration_ns(const size_t cache_size) {
-	constexpr int64_t evictable_max = UINT64_C(10 * 1000 * 1000 * 1000);
-	static atomic int cache_max = 0;
-	if (cache_max == 0) cache_max = num_procs();
-	return evictable_max - evictable_max / (int64_t)cache_max * (int64_t)cache_size;
+
+enum clod_region_result file_cache_create(struct clod_region *r) {
+	struct file_cache *cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for file cache.");
+	}
+
+	const struct clod_table_opts opts = { .min_capacity = r->opts.max_open_files / CACHE_SHARDS };
+	for (size_t i = 0; i < CACHE_SHARDS; i++) {
+		auto const shard = &cache->shards[i];
+		shard->index = clod_table_create(&opts);
+		if (!shard->index) {
+			while (i-- > 0) {
+				clod_table_destroy(cache->shards[i].index);
+			}
+			free(cache);
+			return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for file cache.");
+		}
+	}
+
+	for (size_t i = 0; i < CACHE_SHARDS; i++) {
+		auto const shard = &cache->shards[i];
+		mutex_init(&shard->mtx);
+		condvar_init(&shard->opened);
+		rbmutex_init(&shard->index_mtx);
+	}
+	r->cache = cache;
+	return CLOD_REGION_OK;
 }
-static int64_t timespec_diff_ns(const struct timespec from, const struct timespec to) {
-	int64_t sec_diff;
-	if (ckd_sub(&sec_diff, to.tv_sec, from.tv_sec))
-		return to.tv_sec > from.tv_sec ? INT64_MAX : INT64_MIN;
-	if (ckd_mul(&sec_diff, sec_diff, 1000000000))
-		return to.tv_sec > from.tv_sec ? INT64_MAX : INT64_MIN;
-	int64_t nsec_diff;
-	if (ckd_sub(&nsec_diff, to.tv_nsec, from.tv_nsec))
-		return to.tv_nsec > from.tv_nsec ? INT64_MAX : INT64_MIN;
-	if (ckd_add(&nsec_diff, nsec_diff, sec_diff))
-		return to.tv_sec > from.tv_sec ? INT64_MAX : INT64_MIN;
-	return nsec_diff;
+
+// Shard mutex and index write lock must be held.
+static void entry_remove(struct cache_shard *shard, struct file_cache_entry *e, const uint8_t dims) {
+	[[maybe_unused]] auto const removed = clod_table_del(shard->index, e->pos, sizeof(e->pos[0]) * dims);
+	assert(removed == e);
+
+	shard->len--;
+	if (e->slot != shard->len) {
+		shard->clock[e->slot] = shard->clock[shard->len];
+		shard->clock[e->slot]->slot = e->slot;
+	}
+	if (shard->hand >= shard->len) shard->hand = 0;
 }
 
-#define index(i) (assert(i < r->cache_len), (struct file_cache*)((char*)r->cache + i * file_cache_size(r->opts.dims)))
-#define fc_size file_cache_size(r->opts.dims)
-// global mutex must be held.
-enum clod_region_result region_file_get(struct clod_region *r, struct region_file **rf_ptr, const int64_t *pos, const bool create) {
-	struct timespec now;
-	if (!monotonic_now(&now)) {
-		region_error(CLOD_REGION_INVALID_USAGE, "Failed to get current time.");
-		return CLOD_REGION_INVALID_USAGE;
-	}
-
-	const int64_t evictable_duration = evictable_duration_ns(r->cache_len);
-
-	size_t empty = INDEX_NIL;
-	for (size_t i = 0; i < r->cache_len; i++) {
-		auto const fc = index(i);
-
-		if (fc->rf == nullptr) {
-			if (empty == INDEX_NIL) empty = i;
-		} else if (memcmp(pos, fc->pos, sizeof(fc->pos[0]) * r->opts.dims) == 0) {
-			fc->last_access = now;
-			*rf_ptr = fc->rf;
-			return CLOD_REGION_OK;
-		} else if (timespec_diff_ns(fc->last_access, now) > evictable_duration) {
-			auto const res = region_file_close(fc->rf);
-			fc->rf = nullptr;
-			if (res != CLOD_REGION_OK) return res;
+// Close a file in the shard that nobody is using. Returns false if every file is in use.
+static bool shard_evict(struct clod_region *r, struct cache_shard *shard) {
+	struct file_cache_entry *victim = nullptr;
+
+	mutex_lock(&shard->mtx);
+	// Pins are only taken with the index locked, so none can be taken while it's write locked.
+	rbmutex_wrlock(&shard->index_mtx);
+
+	// Two passes clear every referenced bit, so a third finding nothing means every file is held.
+	for (size_t i = 0; i < shard->len * 3; i++) {
+		auto const e = shard->clock[shard->hand];
+		shard->hand = (shard->hand + 1) % shard->len;
+
+		if (!e->rf || e->rf->pins > 0) continue;
+		if (e->referenced) {
+			e->referenced = false;
+			continue;
 		}
+
+		// Nobody holds the file, and nobody can start to without pinning it.
+		if (!rbmutex_trywrlock(&e->rf->mtx)) continue;
+		rbmutex_wrunlock(&e->rf->mtx);
+
+		entry_remove(shard, e, r->opts.dims);
+		victim = e;
+		break;
 	}
 
-	struct region_file *rf;
+	rbmutex_wrunlock(&shard->index_mtx);
+	mutex_unlock(&shard->mtx);
+
+	if (!victim) return false;
+	stats_add(r->stats, STATS_WORD(file_evictions), 1);
+	region_file_close(victim->rf);
+	free(victim);
+	r->cache->open--;
+	return true;
+}
+
+// Evict files from each shard in turn until the cache is within budget.
+// Files in use can't be closed, so the budget is exceeded rather than failing when they all are.
+static void cache_trim(struct clod_region *r) {
+	auto const cache = r->cache;
+	for (size_t i = 0; i < CACHE_SHARDS && cache->open >= r->opts.max_open_files; i++) {
+		auto const shard = &cache->shards[cache->hand++ % CACHE_SHARDS];
+		while (cache->open >= r->opts.max_open_files && shard_evict(r, shard));
+	}
+}
+
+// Add an entry for a file that is about to be opened. Shard mutex must be held.
+static struct file_cache_entry *entry_reserve(struct cache_shard *shard, const int64_t *pos, const size_t key_size) {
+	if (shard->len == shard->cap) {
+		const size_t cap = shard->cap ? shard->cap * 2 : 16;
+		struct file_cache_entry **clock = realloc(shard->clock, cap * sizeof(clock[0]));
+		if (!clock) return nullptr;
+		shard->clock = clock;
+		shard->cap = cap;
+	}
+
+	struct file_cache_entry *e = malloc(sizeof(*e));
+	if (!e) return nullptr;
+	memset(e->pos, 0, sizeof(e->pos));
+	memcpy(e->pos, pos, key_size);
+	e->rf = nullptr;
+	e->referenced = true;
+
+	rbmutex_wrlock(&shard->index_mtx);
+	auto const existing = clod_table_add(shard->index, e, key_size);
+	if (!existing) {
+		e->slot = shard->len;
+		shard->clock[shard->len++] = e;
+	}
+	rbmutex_wrunlock(&shard->index_mtx);
+
+	if (existing) {
+		free(e);
+		return nullptr;
+	}
+	return e;
+}
+
+// Pin the open file in an entry. Index must be locked, or the shard mutex held.
+static void entry_pin(struct file_cache_entry *e, struct region_file **rf_ptr) {
+	// Avoid writing a line many readers share when the bit is already set.
+	if (!e->referenced) e->referenced = true;
+	e->rf->pins++;
+	*rf_ptr = e->rf;
+}
+
+enum clod_region_result region_file_get(struct clod_region *r, struct region_file **rf_ptr, const int64_t *pos, const bool create) {
+	auto const cache = r->cache;
+	auto const shard = shard_of(cache, pos, r->opts.dims);
+	const size_t key_size = sizeof(pos[0]) * r->opts.dims;
+
+	rbmutex_rdlock(&shard->index_mtx);
+	struct file_cache_entry *e = clod_table_get(shard->index, pos, key_size);
+	const bool hit = e && e->rf;
+	if (hit) entry_pin(e, rf_ptr);
+	rbmutex_rdunlock(&shard->index_mtx);
+	if (hit) {
+		stats_add(r->stats, STATS_WORD(file_hits), 1);
+		return CLOD_REGION_OK;
+	}
+
+	if (cache->open >= r->opts.max_open_files) cache_trim(r);
+
+	mutex_lock(&shard->mtx);
+	while ((e = clod_table_get(shard->index, pos, key_size)) && !e->rf) {
+		condvar_wait(&shard->opened, &shard->mtx);
+	}
+	if (e) {
+		entry_pin(e, rf_ptr);
+		mutex_unlock(&shard->mtx);
+		stats_add(r->stats, STATS_WORD(file_hits), 1);
+		return CLOD_REGION_OK;
+	}
+
+	e = entry_reserve(shard, pos, key_size);
+	mutex_unlock(&shard->mtx);
+	if (!e) return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for file cache.");
+	cache->open++;
+	stats_add(r->stats, STATS_WORD(file_misses), 1);
+
+	struct region_file *rf = nullptr;
 	auto const res = region_file_open(r, &rf, pos, create);
-	if (res != CLOD_REGION_OK) return res;
-
-	if (empty == INDEX_NIL) {
-		void *new = malloc((r->cache_len + 1) * fc_size);
-		if (!new) {
-			region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for file cache.");
-			region_file_close(rf);
-			return CLOD_REGION_INVALID_USAGE;
-		}
+	if (res == CLOD_REGION_OK) stats_add(r->stats, STATS_WORD(file_opens), 1);
 
-		memcpy(new, r->cache, r->cache_len * fc_size);
-		free(r->cache);
-		r->cache = new;
-		empty = r->cache_len++;
+	mutex_lock(&shard->mtx);
+	rbmutex_wrlock(&shard->index_mtx);
+	if (res == CLOD_REGION_OK) {
+		rf->pins = 1;
+		e->rf = rf;
+		*rf_ptr = rf;
+	} else {
+		entry_remove(shard, e, r->opts.dims);
 	}
+	rbmutex_wrunlock(&shard->index_mtx);
+	condvar_broadcast(&shard->opened);
+	mutex_unlock(&shard->mtx);
 
-	auto const fc = index(empty);
-	fc->rf = rf;
-	fc->last_access = now;
-	memcpy(fc->pos, pos, sizeof(fc->pos[0]) * r->opts.dims);
-	*rf_ptr = rf;
+	if (res != CLOD_REGION_OK) {
+		free(e);
+		cache->open--;
+	}
+	return res;
+}
 
+enum clod_region_result region_file_pin_open(struct clod_region *r, struct region_file ***rfs_ptr, size_t *count) {
+	struct region_file **rfs = nullptr;
+	size_t len = 0, cap = 0;
+	for (size_t s = 0; s < CACHE_SHARDS; s++) {
+		auto const shard = &r->cache->shards[s];
+		rbmutex_rdlock(&shard->index_mtx);
+		for (size_t i = 0; i < shard->len; i++) {
+			auto const rf = shard->clock[i]->rf;
+			if (!rf) continue;
+			if (len == cap) {
+				cap = cap ? cap * 2 : 64;
+				struct region_file **grown = realloc(rfs, cap * sizeof(rfs[0]));
+				if (!grown) {
+					rbmutex_rdunlock(&shard->index_mtx);
+					for (size_t k = 0; k < len; k++) rfs[k]->pins--;
+					free(rfs);
+					return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for open files.");
+				}
+				rfs = grown;
+			}
+			// Unlike entry_pin, the referenced bit is left alone.
+			rf->pins++;
+			rfs[len++] = rf;
+		}
+		rbmutex_rdunlock(&shard->index_mtx);
+	}
+	*rfs_ptr = rfs;
+	*count = len;
 	return CLOD_REGION_OK;
 }
+
 enum clod_region_result file_cache_destroy(struct clod_region *r) {
+	auto const cache = r->cache;
+	if (!cache) return CLOD_REGION_OK;
+
 	enum clod_region_result res = CLOD_REGION_OK;
-	for (size_t i = 0; i < r->cache_len; i++) {
-		auto const fc = index(i);
-		if (fc->rf) {
-			auto const close_res = region_file_close(fc->rf);
+	for (size_t s = 0; s < CACHE_SHARDS; s++) {
+		auto const shard = &cache->shards[s];
+		for (size_t i = 0; i < shard->len; i++) {
+			auto const close_res = region_file_close(shard->clock[i]->rf);
 			if (res == CLOD_REGION_OK) res = close_res;
+			free(shard->clock[i]);
 		}
+		clod_table_destroy(shard->index);
+		free(shard->clock);
+		rbmutex_destroy(&shard->index_mtx);
+		condvar_destroy(&shard->opened);
+		mutex_destroy(&shard->mtx);
 	}
-	free(r->cache);
+	free(cache);
 	r->cache = nullptr;
-	r->cache_len = 0;
 	return res;
 }
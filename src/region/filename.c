@@ -31,7 +31,7 @@ void str_copy(
  */
 size_t filename_make(
 	char filename[REGION_FILENAME_MAX + 1],
-	const char prefix[PREFIX_MAX],
+	const char *prefix,
 	const char *extension,
 	const int64_t *pos, const uint8_t dims
 ) {
@@ -58,7 +58,7 @@ size_t filename_make(
  * Returns 0 on failure, or the size of the parsed filename.
  */
 bool filename_parse_pos(const char filename[REGION_FILENAME_MAX + 1],
-                      const char prefix[PREFIX_MAX],
+                      const char *prefix,
                       const char *extension,
                       int64_t *pos, const uint8_t dims
 ) {
@@ -74,8 +74,8 @@ bool filename_parse_pos(const char filename[REGION_FILENAME_MAX + 1],
 	for (uint8_t i = 0; i < dims; i++) {
 		char *end;
 		pos[i] = strtoll(&filename[offset], &end, 10);
-		if (end == filename + offset) return false;
-		offset += (size_t)(end - filename) + 1;
+		if (end == filename + offset || *end != '.') return false;
+		offset = (size_t)(end - filename) + 1;
 	}
 
 	size_t extension_offset = 0;
@@ -15,7 +15,7 @@ static_assert(REGION_FILENAME_MAX == 255);
  */
 size_t filename_make(
 	char filename[REGION_FILENAME_MAX + 1],
-	const char prefix[PREFIX_MAX],
+	const char *prefix,
 	const char *extension,
 	const int64_t *pos, uint8_t dims
 );
@@ -26,7 +26,7 @@ size_t filename_make(
  */
 bool filename_parse_pos(
 	const char filename[REGION_FILENAME_MAX + 1],
-	const char prefix[PREFIX_MAX],
+	const char *prefix,
 	const char *extension,
 	int64_t *pos, uint8_t dims
 );
@@ -12,6 +12,14 @@ typedef uintptr_t file;
 
 enum clod_region_result dir_open(dir *d, const char *path, const struct clod_region_opts *opts);
 enum clod_region_result dir_rename(dir d, const char *old_name, const char *new_name);
+enum clod_region_result dir_unlink(dir d, const char *name);
+bool dir_exists(dir d, const char *name);
+// Wait until renames and deletions in the directory are durable.
+enum clod_region_result dir_sync(dir d);
+// Replace a file with one holding data. The data is written under a temporary name that is renamed over the file,
+// so a crash leaves either the old file or the new one, and the old file stays intact for anyone who has it open.
+// With sync set, the new file is durable once this returns.
+enum clod_region_result dir_replace(dir d, const char *name, const void *data, size_t size, bool sync, const struct clod_region_opts *opts);
 enum clod_region_result dir_close(dir d);
 
 enum clod_region_result dir_iter_open(dir_iter *iter, dir d);
@@ -20,9 +28,70 @@ enum clod_region_result dir_iter_next(dir_iter iter, const char **name);
 
 enum clod_region_result file_open(file *f, dir d, const char *name, bool create, const struct clod_region_opts *opts);
 enum clod_region_result file_get(file f, void **data, size_t *size);
+// Resize a file. Writeable files are mapped inside a large reservation of address space,
+// so their mapping grows in place and pointers into it stay valid unless the file outgrows it.
 enum clod_region_result file_truncate(file f, size_t new_size);
+// Wait until changes to the file are durable.
+enum clod_region_result file_sync(file f);
+// Start reading part of the file into memory in the background.
+void file_prefetch(file f, size_t offset, size_t size);
+// Keep the first size bytes of the file in memory, as far as the system allows, including after it's resized.
+void file_lock(file f, size_t size);
 enum clod_region_result file_close(file f);
 
+// Map any part of the file that another process has added since it was mapped.
+// Unless move is set, the mapping is only changed if it can grow in place,
+// and CLOD_REGION_SHORT_BUFFER is returned if it would have to move or shrink.
+enum clod_region_result file_refresh(file f, bool move);
+
+// State of a region shared between processes, kept in a file in its directory that each of them maps.
+typedef uintptr_t shared;
+// Shared state of region files: a lock held by whichever process is writing to one, and a count of the writes,
+// which is odd while a write is under way, as a seqlock's is.
+// Files are spread over a fixed number of these, so unrelated files can share one.
+struct shared_file;
+
+// Open the shared state of a region, creating it if this is the first process to use it.
+// Returns CLOD_REGION_INVALID_USAGE if the platform can't share a region between processes.
+enum clod_region_result shared_open(shared *s, dir d, const char *name, const struct clod_region_opts *opts);
+void shared_close(shared s);
+// Get the shared state of the region file at pos. It lives until the shared state is closed.
+struct shared_file *shared_file_get(shared s, const int64_t *pos, uint8_t dims);
+// Lock out writers in every process. Returns true if a process died part way through a write to the file at pos,
+// in which case the write must be repaired and counted with shared_file_changed.
+bool shared_file_lock(struct shared_file *sf, const int64_t *pos, uint8_t dims);
+void shared_file_unlock(struct shared_file *sf);
+// Check if another process that's still running is part way through a write.
+bool shared_file_busy(struct shared_file *sf);
+// Mark this process as writing to the file at pos. The lock must be held.
+void shared_file_begin(struct shared_file *sf, const int64_t *pos, uint8_t dims);
+// Count a write, or the repair of one, once it's finished. The lock must be held.
+void shared_file_changed(struct shared_file *sf);
+// Count of the writes made by every process, which is odd while one is under way.
+uint64_t shared_file_generation(const struct shared_file *sf);
+
+typedef uintptr_t ring;
+
+struct ring_read {
+	file f;
+	size_t offset;
+	size_t size;
+	// Set to the data read. Valid until the ring is used again.
+	const char *data;
+	// Set to the number of bytes read, which is less than size if the file ended first.
+	size_t read;
+	enum clod_region_result result;
+};
+
+// Open a ring for keeping many reads in flight. Returns CLOD_REGION_NOT_FOUND if the platform doesn't support it.
+enum clod_region_result ring_open(ring *r);
+// Do as many of the reads as fit in the ring at once, and return how many were done.
+// At least one read is done if count is not zero.
+size_t ring_read(ring r, struct ring_read *reads, size_t count);
+// Check if a failed ring_read left reads in flight, in which case the ring can only be closed.
+bool ring_broken(ring r);
+void ring_close(ring r);
+
 int num_procs();
 
 #define atomic _Atomic
@@ -34,19 +103,69 @@ int num_procs();
 	#define mutex_init(m) pthread_mutex_init(m, nullptr)
 	#define mutex_destroy(m) pthread_mutex_destroy(m)
 	#define mutex_lock(m) pthread_mutex_lock(m)
+	#define mutex_trylock(m) (pthread_mutex_trylock(m) == 0)
 	#define mutex_unlock(m) pthread_mutex_unlock(m)
 
 	#define rwmutex pthread_rwlock_t
 	#define rwmutex_init(rw) pthread_rwlock_init(rw, nullptr)
 	#define rwmutex_destroy(rw) pthread_rwlock_destroy(rw)
 	#define rwmutex_rdlock(rw) pthread_rwlock_rdlock(rw)
+	#define rwmutex_tryrdlock(rw) (pthread_rwlock_tryrdlock(rw) == 0)
 	#define rwmutex_rdunlock(rw) pthread_rwlock_unlock(rw)
 	#define rwmutex_wrlock(rw) pthread_rwlock_wrlock(rw)
+	#define rwmutex_trywrlock(rw) (pthread_rwlock_trywrlock(rw) == 0)
 	#define rwmutex_wrunlock(rw) pthread_rwlock_unlock(rw)
+
+	#define condvar pthread_cond_t
+	#define condvar_init(c) pthread_cond_init(c, nullptr)
+	#define condvar_destroy(c) pthread_cond_destroy(c)
+	#define condvar_wait(c, m) pthread_cond_wait(c, m)
+	#define condvar_broadcast(c) pthread_cond_broadcast(c)
+	// Wait until woken or the realtime deadline passes. True if woken.
+	#define condvar_timedwait(c, m, deadline) (pthread_cond_timedwait(c, m, deadline) == 0)
+
+	#define thread pthread_t
+	#define thread_create(t, fn, arg) (pthread_create(t, nullptr, fn, arg) == 0)
+	#define thread_join(t) pthread_join(t, nullptr)
 #else
 	#error "Mutex implementation for this platform has not been added"
 #endif
 
+// Number of reader counts in an rbmutex. Threads are spread across them.
+#define RBMUTEX_SLOTS 16
+
+/**
+ * Read-write mutex biased towards readers, in the style of a big-reader lock.
+ * Readers only change a count shared with a few other threads, each on its own cache line,
+ * so read locking scales with cores where an rwmutex's single count would bounce between them.
+ * Writers shut out new readers and wait for every count to drain, which is much slower.
+ * Read locks can be taken recursively, and must be released on the thread that took them.
+ */
+typedef struct {
+	struct {
+		atomic uint32_t readers;
+		char pad[64 - sizeof(uint32_t)];
+	} slots[RBMUTEX_SLOTS];
+	atomic bool writer;
+	// Held by the writer.
+	mutex writer_mtx;
+	// Broadcast when a reader leaves while a writer is waiting.
+	mutex drain_mtx;
+	condvar drained;
+} rbmutex;
+
+void rbmutex_init(rbmutex *m);
+void rbmutex_destroy(rbmutex *m);
+void rbmutex_rdlock(rbmutex *m);
+bool rbmutex_tryrdlock(rbmutex *m);
+void rbmutex_rdunlock(rbmutex *m);
+// Check if the calling thread holds a read lock on m.
+bool rbmutex_rdheld(const rbmutex *m);
+// The calling thread must not hold a read lock on m, as it would wait for itself.
+void rbmutex_wrlock(rbmutex *m);
+bool rbmutex_trywrlock(rbmutex *m);
+void rbmutex_wrunlock(rbmutex *m);
+
 #if defined(TIME_MONOTONIC)
 	#define monotonic_now(timespec) (timespec_get((timespec), TIME_MONOTONIC) == TIME_MONOTONIC)
 #elif HAVE_CLOCK_GETTIME
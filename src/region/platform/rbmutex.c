@@ -0,0 +1,138 @@
+/**
+ * Reader-biased read-write mutex built on the platform's mutex and atomics.
+ *
+ * A reader adds itself to its thread's count, then checks for a writer.
+ * A writer sets its flag, then waits for every count to be zero.
+ * With sequentially consistent atomics at least one of them sees the other, so they never both get in.
+ * A reader that sees a writer takes itself back out and waits for the writer's mutex.
+ *
+ * Each thread remembers the read locks it holds, so that taking one again doesn't
+ * wait behind a writer that is itself waiting for the first hold to be released.
+ * The same list catches a thread write locking a mutex it still holds the read lock of.
+ */
+#include "platform.h"
+#include <assert.h>
+
+// Read locks a thread can hold at once and still take recursively.
+#define HELD_MAX 16
+
+struct held {
+	const rbmutex *m;
+	uint32_t depth;
+};
+
+static atomic size_t next_slot;
+static thread_local size_t thread_slot = SIZE_MAX;
+static thread_local struct held held[HELD_MAX];
+static thread_local size_t held_len;
+
+static atomic uint32_t *readers_of(rbmutex *m) {
+	if (thread_slot == SIZE_MAX) thread_slot = next_slot++ % RBMUTEX_SLOTS;
+	return &m->slots[thread_slot].readers;
+}
+
+static bool drained(rbmutex *m) {
+	for (size_t i = 0; i < RBMUTEX_SLOTS; i++) {
+		if (m->slots[i].readers != 0) return false;
+	}
+	return true;
+}
+
+// Wake a writer that might be waiting for this reader to leave.
+static void drain_notify(rbmutex *m) {
+	mutex_lock(&m->drain_mtx);
+	condvar_broadcast(&m->drained);
+	mutex_unlock(&m->drain_mtx);
+}
+
+void rbmutex_init(rbmutex *m) {
+	for (size_t i = 0; i < RBMUTEX_SLOTS; i++) {
+		m->slots[i].readers = 0;
+	}
+	m->writer = false;
+	mutex_init(&m->writer_mtx);
+	mutex_init(&m->drain_mtx);
+	condvar_init(&m->drained);
+}
+
+void rbmutex_destroy(rbmutex *m) {
+	condvar_destroy(&m->drained);
+	mutex_destroy(&m->drain_mtx);
+	mutex_destroy(&m->writer_mtx);
+}
+
+void rbmutex_rdlock(rbmutex *m) {
+	while (!rbmutex_tryrdlock(m)) {
+		mutex_lock(&m->writer_mtx);
+		mutex_unlock(&m->writer_mtx);
+	}
+}
+
+bool rbmutex_tryrdlock(rbmutex *m) {
+	for (size_t i = 0; i < held_len; i++) {
+		if (held[i].m == m) {
+			held[i].depth++;
+			return true;
+		}
+	}
+
+	auto const readers = readers_of(m);
+	(*readers)++;
+	if (m->writer) {
+		(*readers)--;
+		drain_notify(m);
+		return false;
+	}
+
+	// Holds past the limit still work, but taking them again can wait behind a writer.
+	if (held_len < HELD_MAX) held[held_len++] = (struct held){ .m = m, .depth = 1 };
+	return true;
+}
+
+void rbmutex_rdunlock(rbmutex *m) {
+	for (size_t i = 0; i < held_len; i++) {
+		if (held[i].m == m) {
+			if (--held[i].depth > 0) return;
+			held[i] = held[--held_len];
+			break;
+		}
+	}
+
+	(*readers_of(m))--;
+	if (m->writer) drain_notify(m);
+}
+
+bool rbmutex_rdheld(const rbmutex *m) {
+	for (size_t i = 0; i < held_len; i++) {
+		if (held[i].m == m) return true;
+	}
+	return false;
+}
+
+void rbmutex_wrlock(rbmutex *m) {
+	// Readers aren't drained until this thread's own read lock is released, which would never happen.
+	assert(!rbmutex_rdheld(m) && "rbmutex write locked by a thread holding its read lock");
+	mutex_lock(&m->writer_mtx);
+	m->writer = true;
+
+	mutex_lock(&m->drain_mtx);
+	while (!drained(m)) {
+		condvar_wait(&m->drained, &m->drain_mtx);
+	}
+	mutex_unlock(&m->drain_mtx);
+}
+
+bool rbmutex_trywrlock(rbmutex *m) {
+	if (!mutex_trylock(&m->writer_mtx)) return false;
+	m->writer = true;
+	if (drained(m)) return true;
+
+	m->writer = false;
+	mutex_unlock(&m->writer_mtx);
+	return false;
+}
+
+void rbmutex_wrunlock(rbmutex *m) {
+	m->writer = false;
+	mutex_unlock(&m->writer_mtx);
+}
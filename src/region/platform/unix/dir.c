@@ -2,6 +2,7 @@
 #include "../../error.h"
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
@@ -27,6 +28,76 @@ enum clod_region_result dir_rename(const dir d, const char *old_name, const char
 	}
 	return CLOD_REGION_OK;
 }
+enum clod_region_result dir_unlink(const dir d, const char *name) {
+	if (unlinkat((int)(intptr_t)d, name, 0)) {
+		if (errno == ENOENT) return CLOD_REGION_NOT_FOUND;
+		return region_error(CLOD_REGION_INVALID_USAGE, "Deleting \"%s\": %s", name, strerror(errno));
+	}
+	return CLOD_REGION_OK;
+}
+bool dir_exists(const dir d, const char *name) {
+	struct stat st;
+	return fstatat((int)(intptr_t)d, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+enum clod_region_result dir_sync(const dir d) {
+	if (fsync((int)(intptr_t)d)) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Syncing directory: %s", strerror(errno));
+	}
+	return CLOD_REGION_OK;
+}
+enum clod_region_result dir_replace(
+	const dir d,
+	const char *name,
+	const void *data, const size_t size,
+	const bool sync,
+	const struct clod_region_opts *opts
+) {
+	char temp[FILENAME_MAX];
+	if (snprintf(temp, sizeof(temp), "%s.tmp", name) >= (int)sizeof(temp)) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Filename \"%s\" is too long.", name);
+	}
+
+	const mode_t o_mode = opts->unix_file_perms ? opts->unix_file_perms : 0664;
+	const int fd = openat((int)(intptr_t)d, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, o_mode);
+	if (fd < 0) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Opening \"%s\": %s", temp, strerror(errno));
+	}
+
+	enum clod_region_result res = CLOD_REGION_OK;
+#if HAVE_FALLOCATE
+	// Reserving the whole file first lets the filesystem place it in as few extents as it can.
+	if (size > 0 && fallocate(fd, 0, 0, (off_t)size) && errno != EOPNOTSUPP) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Allocating \"%s\": %s", temp, strerror(errno));
+	}
+#endif
+	for (size_t done = 0; res == CLOD_REGION_OK && done < size;) {
+		const ssize_t n = pwrite(fd, (const char *)data + done, size - done, (off_t)done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			res = region_error(CLOD_REGION_INVALID_USAGE, "Writing \"%s\": %s", temp, strerror(errno));
+			break;
+		}
+		done += (size_t)n;
+	}
+#if HAVE_FDATASYNC
+	if (res == CLOD_REGION_OK && sync && fdatasync(fd)) {
+#else
+	if (res == CLOD_REGION_OK && sync && fsync(fd)) {
+#endif
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Syncing \"%s\": %s", temp, strerror(errno));
+	}
+	if (close(fd) && res == CLOD_REGION_OK) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Closing \"%s\": %s", temp, strerror(errno));
+	}
+
+	if (res == CLOD_REGION_OK) res = dir_rename(d, temp, name);
+	if (res != CLOD_REGION_OK) {
+		(void)unlinkat((int)(intptr_t)d, temp, 0);
+		return res;
+	}
+	// The rename is only durable once the directory is synced too.
+	return sync ? dir_sync(d) : CLOD_REGION_OK;
+}
 enum clod_region_result dir_close(const dir d) {
 	if (close((int)(intptr_t)d)) {
 		return region_error(CLOD_REGION_INVALID_USAGE, "Closing directory: %s", strerror(errno));
@@ -9,7 +9,8 @@
 
 enum clod_region_result dir_iter_open(dir_iter *iter, const dir d) {
 	auto fd = (int)(intptr_t)d;
-	fd = fcntl(fd, F_DUPFD, 0);
+	// A duplicated descriptor would share its position with every other iterator, so the directory is opened again.
+	fd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 	if (fd < 0) {
 		return region_error(CLOD_REGION_INVALID_USAGE, "Opening directory iterator: %s", strerror(errno));
 	}
@@ -2,6 +2,7 @@
 
 #include "../platform.h"
 #include "../../error.h"
+#include "file.h"
 #include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -10,12 +11,95 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
-struct file {
-	void *map;
-	size_t size;
-	int fd;
-	bool writeable;
-};
+// Address space reserved for the mapping of a writeable file, so that it can grow in place.
+// Files that outgrow it are given a reservation twice their size, which moves their mapping.
+#define FILE_RESERVE ((size_t)1 << 30)
+// Most disk space allocated past the end of a growing file at once.
+#define FILE_PREALLOCATE_MAX ((size_t)64 << 20)
+
+#ifndef MAP_NORESERVE
+	#define MAP_NORESERVE 0
+#endif
+
+static size_t page_size() {
+	static atomic size_t size = 0;
+	if (size == 0) size = (size_t)sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+static size_t page_round(const size_t size) {
+	return (size + page_size() - 1) & ~(page_size() - 1);
+}
+
+static int map_prot(const struct file *f) {
+	return f->writeable ? PROT_READ | PROT_WRITE : PROT_READ;
+}
+
+// Reserve address space for reserve bytes and map the file at its start. Returns false with errno set on failure.
+static bool map_reserve(struct file *f, const size_t reserve, const int map_flags) {
+	void *base = mmap(nullptr, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) return false;
+	if (f->size > 0 && mmap(base, f->size, map_prot(f), map_flags | MAP_FIXED, f->fd, 0) == MAP_FAILED) {
+		const int err = errno;
+		munmap(base, reserve);
+		errno = err;
+		return false;
+	}
+	f->map = base;
+	f->reserved = reserve;
+	return true;
+}
+
+// Unmap the file, along with any address space reserved for it.
+static void map_release(struct file *f) {
+	if (f->map) munmap(f->map, f->reserved ? f->reserved : f->size);
+	f->map = nullptr;
+	f->reserved = 0;
+}
+
+// Map the part of the file that grew or give back the part that shrank, within its reservation.
+// Pages that were already mapped stay where they are. Returns false with errno set on failure.
+static bool map_resize(struct file *f, const size_t old_size) {
+	if (f->size > old_size) {
+		const size_t start = old_size & ~(page_size() - 1);
+		return mmap((char *)f->map + start, f->size - start, map_prot(f), MAP_SHARED | MAP_FIXED, f->fd, (off_t)start)
+			!= MAP_FAILED;
+	}
+
+	const size_t start = page_round(f->size);
+	const size_t end = page_round(old_size);
+	if (start == end) return true;
+	return mmap((char *)f->map + start, end - start, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+		!= MAP_FAILED;
+}
+
+// Allocate disk space past the end of a file that is growing to new_size, without changing its size.
+// Space is allocated geometrically, so appending allocates rarely and the file's extents stay long.
+static void preallocate(struct file *f, const size_t new_size) {
+#if HAVE_FALLOCATE
+	if (new_size <= f->allocated) return;
+	const size_t step = new_size < FILE_PREALLOCATE_MAX ? new_size : FILE_PREALLOCATE_MAX;
+	if (fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)(new_size + step)) == 0) {
+		f->allocated = new_size + step;
+	} else if (errno == EOPNOTSUPP) {
+		// The filesystem can't, so it isn't asked again.
+		f->allocated = SIZE_MAX;
+	}
+#else
+	(void)f;
+	(void)new_size;
+#endif
+}
+
+// Apply the region's mapping policy to a new mapping of the file. Every part of it is only a hint, so failures are ignored.
+static void map_advise(const struct file *f) {
+	if (!f->map) return;
+	if (f->advice != MADV_NORMAL) (void)madvise(f->map, f->size, f->advice);
+#ifdef MADV_HUGEPAGE
+	if (f->huge_pages) (void)madvise(f->map, f->size, MADV_HUGEPAGE);
+#endif
+	if (f->locked) (void)mlock(f->map, f->locked < f->size ? f->locked : f->size);
+}
 
 enum clod_region_result file_open(file *f, const dir d, const char *name, const bool create, const struct clod_region_opts *opts) {
 	int o_flags = 0;
@@ -54,30 +138,50 @@ enum clod_region_result file_open(file *f, const dir d, const char *name, const
 	const size_t size = (size_t)st.st_size;
 #endif
 
-	int prot = PROT_READ;
-	if (opts->mode == CLOD_REGION_MODE_RDWR) prot |= PROT_WRITE;
-	void *map = nullptr;
-	if (size > 0) {
-		map = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
-		if (map == MAP_FAILED) {
-			region_error(CLOD_REGION_INVALID_USAGE, "Failed to mmap \"%s\": %s", name, strerror(errno));
-			close(fd);
-			return CLOD_REGION_INVALID_USAGE;
-		}
-	}
-
 	struct file *file_struct = malloc(sizeof(struct file));
 	if (!file_struct) {
 		region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for file.");
-		if (size > 0) munmap(map, size);
 		close(fd);
 		return CLOD_REGION_INVALID_USAGE;
 	}
-
-	file_struct->map = map;
+	file_struct->map = nullptr;
 	file_struct->size = size;
 	file_struct->fd = fd;
 	file_struct->writeable = opts->mode == CLOD_REGION_MODE_RDWR;
+	file_struct->reserved = 0;
+	// Files shared with other processes aren't preallocated, since trimming the preallocation when the file is closed
+	// would cut off whatever another process had written past the end this one knows about.
+	file_struct->allocated = opts->shared ? SIZE_MAX : size;
+
+	int map_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (size <= opts->populate_max) map_flags |= MAP_POPULATE;
+#endif
+	// Only writeable files and files shared with writers in other processes grow,
+	// and only 64-bit systems have address space to spare.
+	bool mapped = false;
+	if ((file_struct->writeable || opts->shared) && sizeof(void *) >= 8) {
+		const size_t reserve = size * 2 > FILE_RESERVE ? page_round(size * 2) : FILE_RESERVE;
+		mapped = map_reserve(file_struct, reserve, map_flags);
+	}
+	if (!mapped && size > 0) {
+		void *map = mmap(nullptr, size, map_prot(file_struct), map_flags, fd, 0);
+		if (map == MAP_FAILED) {
+			region_error(CLOD_REGION_INVALID_USAGE, "Failed to mmap \"%s\": %s", name, strerror(errno));
+			free(file_struct);
+			close(fd);
+			return CLOD_REGION_INVALID_USAGE;
+		}
+		file_struct->map = map;
+	}
+
+	file_struct->advice =
+		opts->access == CLOD_REGION_ACCESS_RANDOM ? MADV_RANDOM :
+		opts->access == CLOD_REGION_ACCESS_SEQUENTIAL ? MADV_SEQUENTIAL :
+		MADV_NORMAL;
+	file_struct->huge_pages = opts->map_flags & CLOD_REGION_MAP_HUGE_PAGES;
+	file_struct->locked = 0;
+	map_advise(file_struct);
 	*f = (uintptr_t)file_struct;
 	return CLOD_REGION_OK;
 }
@@ -86,17 +190,30 @@ enum clod_region_result file_get(const file f, void **data, size_t *size) {
 	*size = ((struct file *)f)->size;
 	return CLOD_REGION_OK;
 }
-enum clod_region_result file_truncate(const file f, const size_t new_size) {
-	auto const file_struct = (struct file *)f;
-	if (file_struct->size == new_size) return CLOD_REGION_OK;
+// Change the mapping of a file that was old_size bytes to match its new size.
+static enum clod_region_result map_update(struct file *file_struct, const size_t old_size) {
+	const size_t new_size = file_struct->size;
+	if (file_struct->reserved) {
+		if (new_size <= file_struct->reserved) {
+			if (!map_resize(file_struct, old_size)) {
+				map_release(file_struct);
+				return region_error(CLOD_REGION_INVALID_USAGE, "Failed to map file: %s", strerror(errno));
+			}
+			map_advise(file_struct);
+			return CLOD_REGION_OK;
+		}
 
-	if (ftruncate(file_struct->fd, (off_t)new_size)) {
-		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to truncate file: %s", strerror(errno));
+		// The file outgrew its reservation, so it's mapped again in a larger one.
+		struct file old = *file_struct;
+		if (!map_reserve(file_struct, page_round(new_size * 2), MAP_SHARED)) {
+			map_release(file_struct);
+			return region_error(CLOD_REGION_INVALID_USAGE, "Failed to map file: %s", strerror(errno));
+		}
+		map_release(&old);
+		map_advise(file_struct);
+		return CLOD_REGION_OK;
 	}
 
-	const size_t old_size = file_struct->size;
-	file_struct->size = new_size;
-
 #if HAVE_MREMAP
 	if (file_struct->map != nullptr && new_size > 0) {
 		assert(old_size > 0);
@@ -105,6 +222,7 @@ enum clod_region_result file_truncate(const file f, const size_t new_size) {
 			file_struct->map = nullptr;
 			return region_error(CLOD_REGION_INVALID_USAGE, "Failed to remap file: %s", strerror(errno));
 		}
+		map_advise(file_struct);
 		return CLOD_REGION_OK;
 	}
 #endif
@@ -115,23 +233,86 @@ enum clod_region_result file_truncate(const file f, const size_t new_size) {
 		file_struct->map = nullptr;
 	}
 	if (new_size > 0) {
-		int mmap_flag = PROT_READ;
-		if (file_struct->writeable) mmap_flag |= PROT_WRITE;
-
-		file_struct->map = mmap(nullptr, new_size, mmap_flag, MAP_SHARED, file_struct->fd, 0);
+		file_struct->map = mmap(nullptr, new_size, map_prot(file_struct), MAP_SHARED, file_struct->fd, 0);
 		if (file_struct->map == MAP_FAILED) {
 			file_struct->map = nullptr;
 			return region_error(CLOD_REGION_INVALID_USAGE, "Failed to map file: %s", strerror(errno));
 		}
+		map_advise(file_struct);
+	}
+	return CLOD_REGION_OK;
+}
+enum clod_region_result file_truncate(const file f, const size_t new_size) {
+	auto const file_struct = (struct file *)f;
+	if (file_struct->size == new_size) return CLOD_REGION_OK;
+
+	if (new_size > file_struct->size) preallocate(file_struct, new_size);
+	if (ftruncate(file_struct->fd, (off_t)new_size)) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to truncate file: %s", strerror(errno));
+	}
+
+	const size_t old_size = file_struct->size;
+	file_struct->size = new_size;
+	return map_update(file_struct, old_size);
+}
+enum clod_region_result file_refresh(const file f, const bool move) {
+	auto const file_struct = (struct file *)f;
+	struct stat st;
+	if (fstat(file_struct->fd, &st)) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to stat file: %s", strerror(errno));
+	}
+	const size_t new_size = (size_t)st.st_size;
+	const size_t old_size = file_struct->size;
+	if (new_size == old_size) return CLOD_REGION_OK;
+	if (!move && !(file_struct->reserved && new_size > old_size && new_size <= file_struct->reserved)) {
+		return CLOD_REGION_SHORT_BUFFER;
+	}
+
+	file_struct->size = new_size;
+	return map_update(file_struct, old_size);
+}
+enum clod_region_result file_sync(const file f) {
+	auto const file_struct = (struct file *)f;
+	if (file_struct->map && msync(file_struct->map, file_struct->size, MS_SYNC)) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to sync file: %s", strerror(errno));
+	}
+#if HAVE_FDATASYNC
+	if (fdatasync(file_struct->fd)) {
+#else
+	if (fsync(file_struct->fd)) {
+#endif
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to sync file: %s", strerror(errno));
+	}
+	return CLOD_REGION_OK;
+}
+void file_prefetch(const file f, const size_t offset, const size_t size) {
+	auto const file_struct = (struct file *)f;
+	if (!file_struct->map || offset >= file_struct->size) return;
+
+	const size_t end = file_struct->size - offset < size ? file_struct->size : offset + size;
+	const size_t start = offset & ~(page_size() - 1);
+	(void)madvise((char *)file_struct->map + start, end - start, MADV_WILLNEED);
+}
+void file_lock(const file f, const size_t size) {
+	auto const file_struct = (struct file *)f;
+	if (file_struct->locked && file_struct->map) {
+		(void)munlock(file_struct->map, file_struct->locked < file_struct->size ? file_struct->locked : file_struct->size);
+	}
+	file_struct->locked = size;
+	if (size && file_struct->map) {
+		(void)mlock(file_struct->map, size < file_struct->size ? size : file_struct->size);
 	}
-	return true;
 }
 enum clod_region_result file_close(const file f) {
 	auto const file_struct = (struct file *)f;
 	enum clod_region_result res = CLOD_REGION_OK;
-	if (file_struct->map && munmap(file_struct->map, file_struct->size)) {
+	if (file_struct->map && munmap(file_struct->map, file_struct->reserved ? file_struct->reserved : file_struct->size)) {
 		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to unmap file: %s", strerror(errno));
 	}
+	// Space allocated past the end is given back. Truncating to the same size is what frees it.
+	if (file_struct->writeable && file_struct->allocated > file_struct->size && file_struct->allocated != SIZE_MAX) {
+		(void)ftruncate(file_struct->fd, (off_t)file_struct->size);
+	}
 	if (close(file_struct->fd)) {
 		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to close file: %s", strerror(errno));
 	}
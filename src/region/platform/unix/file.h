@@ -0,0 +1,23 @@
+#ifndef CLOD_REGION_UNIX_FILE_H
+#define CLOD_REGION_UNIX_FILE_H
+
+#include <stddef.h>
+
+struct file {
+	void *map;
+	// Atomic as a file shared between processes grows in place while it's read.
+	atomic size_t size;
+	int fd;
+	bool writeable;
+	// Address space reserved at map for the file to grow into, or 0 if only the file is mapped.
+	size_t reserved;
+	// Bytes of disk space allocated for the file, which is more than its size while it's growing.
+	size_t allocated;
+	// madvise advice applied to every mapping of the file.
+	int advice;
+	bool huge_pages;
+	// Bytes at the start of the file kept locked in memory.
+	size_t locked;
+};
+
+#endif
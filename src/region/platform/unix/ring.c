@@ -0,0 +1,344 @@
+/**
+ * Reads submitted through io_uring, so that many reads can be in flight from a single thread.
+ * Reads are done into one buffer registered with the kernel, which saves the kernel
+ * from having to map the destination pages for every read.
+ */
+#include "../platform.h"
+#include "../../error.h"
+
+#if HAVE_IO_URING
+
+#include "file.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Maximum number of reads in flight.
+#define RING_ENTRIES 64
+// Size of the registered buffer that reads are done into.
+#define RING_ARENA_SIZE (4 * 1024 * 1024)
+// Largest read submitted at once. Larger reads are resubmitted until they complete.
+#define RING_READ_MAX (1u << 30)
+// Marks the user data of requests cancelling the read in the rest of it.
+#define RING_CANCEL ((uint64_t)1 << 63)
+
+struct ring {
+	int fd;
+
+	void *sq_map;
+	size_t sq_map_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_map;
+	size_t cq_map_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	char *arena;
+	bool registered;
+	// Buffer for reads too large for the arena.
+	char *large;
+	size_t large_size;
+	// Bytes read so far for each read in flight.
+	size_t done[RING_ENTRIES];
+	// Whether each read is submitted and not yet complete.
+	bool flying[RING_ENTRIES];
+	// Set if reads were left in flight, which may still write to the buffers.
+	bool broken;
+};
+
+static void *ring_map(const int fd, const size_t size, const off_t offset) {
+	void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	return map == MAP_FAILED ? nullptr : map;
+}
+
+enum clod_region_result ring_open(ring *r) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	const int fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	// io_uring is commonly disabled or filtered, in which case callers fall back to other I/O.
+	if (fd < 0) return CLOD_REGION_NOT_FOUND;
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(fd);
+		return CLOD_REGION_NOT_FOUND;
+	}
+
+	struct ring *rs = calloc(1, sizeof(*rs));
+	if (!rs) {
+		close(fd);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for ring.");
+	}
+	rs->fd = fd;
+
+	rs->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	rs->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	const bool single_map = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_map) {
+		if (rs->cq_map_size > rs->sq_map_size) rs->sq_map_size = rs->cq_map_size;
+		rs->cq_map_size = 0;
+	}
+
+	rs->sq_map = ring_map(fd, rs->sq_map_size, IORING_OFF_SQ_RING);
+	rs->cq_map = single_map ? rs->sq_map : ring_map(fd, rs->cq_map_size, IORING_OFF_CQ_RING);
+	rs->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	rs->sqes = ring_map(fd, rs->sqes_size, IORING_OFF_SQES);
+	rs->arena = mmap(nullptr, RING_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rs->arena == MAP_FAILED) rs->arena = nullptr;
+	if (!rs->sq_map || !rs->cq_map || !rs->sqes || !rs->arena) {
+		ring_close((ring)rs);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to map ring: %s", strerror(errno));
+	}
+
+	rs->sq_tail = (unsigned *)((char *)rs->sq_map + p.sq_off.tail);
+	rs->sq_mask = (unsigned *)((char *)rs->sq_map + p.sq_off.ring_mask);
+	rs->sq_array = (unsigned *)((char *)rs->sq_map + p.sq_off.array);
+	rs->cq_head = (unsigned *)((char *)rs->cq_map + p.cq_off.head);
+	rs->cq_tail = (unsigned *)((char *)rs->cq_map + p.cq_off.tail);
+	rs->cq_mask = (unsigned *)((char *)rs->cq_map + p.cq_off.ring_mask);
+	rs->cqes = (struct io_uring_cqe *)((char *)rs->cq_map + p.cq_off.cqes);
+
+	// Registering can fail if locked memory is limited. Reads still work, just without the fixed buffer.
+	const struct iovec iov = { .iov_base = rs->arena, .iov_len = RING_ARENA_SIZE };
+	rs->registered = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+	*r = (ring)rs;
+	return CLOD_REGION_OK;
+}
+
+static void submit(struct ring *rs, const struct ring_read *rd, const size_t i, const bool fixed) {
+	const size_t done = rs->done[i];
+	const size_t len = rd->size - done < RING_READ_MAX ? rd->size - done : RING_READ_MAX;
+
+	const unsigned tail = *rs->sq_tail;
+	const unsigned slot = tail & *rs->sq_mask;
+	auto const sqe = &rs->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = ((struct file *)rd->f)->fd;
+	sqe->off = rd->offset + done;
+	sqe->addr = (uintptr_t)(rd->data + done);
+	sqe->len = (uint32_t)len;
+	sqe->buf_index = 0;
+	sqe->user_data = i;
+	rs->sq_array[slot] = slot;
+	rs->flying[i] = true;
+	__atomic_store_n(rs->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void submit_cancel(struct ring *rs, const size_t i) {
+	const unsigned tail = *rs->sq_tail;
+	const unsigned slot = tail & *rs->sq_mask;
+	auto const sqe = &rs->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = i;
+	sqe->user_data = RING_CANCEL | i;
+	rs->sq_array[slot] = slot;
+	__atomic_store_n(rs->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Take completions off the completion queue, resubmitting short reads. Returns the number taken.
+static unsigned reap(struct ring *rs, struct ring_read *reads, const bool fixed, size_t *pending, unsigned *to_submit) {
+	unsigned head = *rs->cq_head;
+	const unsigned tail = __atomic_load_n(rs->cq_tail, __ATOMIC_ACQUIRE);
+	const unsigned reaped = tail - head;
+	for (; head != tail; head++) {
+		auto const cqe = &rs->cqes[head & *rs->cq_mask];
+		// Cancellations only matter through the completion of the read they cancel.
+		if (cqe->user_data & RING_CANCEL) continue;
+		const size_t i = (size_t)cqe->user_data;
+		auto const rd = &reads[i];
+		rs->flying[i] = false;
+
+		if (cqe->res < 0) {
+			// Reads cancelled after a failure already have its result.
+			if (rd->result == CLOD_REGION_OK) {
+				rd->result = region_error(CLOD_REGION_INVALID_USAGE, "Failed to read file: %s", strerror(-cqe->res));
+			}
+			(*pending)--;
+			continue;
+		}
+
+		rs->done[i] += (size_t)cqe->res;
+		if (cqe->res == 0 || rs->done[i] == rd->size || rd->result != CLOD_REGION_OK) {
+			rd->read = rs->done[i];
+			(*pending)--;
+			continue;
+		}
+
+		// Short reads are continued from where they left off.
+		submit(rs, rd, i, fixed);
+		(*to_submit)++;
+	}
+	__atomic_store_n(rs->cq_head, head, __ATOMIC_RELEASE);
+	return reaped;
+}
+
+// Take back the reads queued but not yet submitted, which are the last ones before the tail, and complete them.
+static void unqueue(struct ring *rs, struct ring_read *reads, size_t *pending, unsigned *to_submit) {
+	const unsigned tail = *rs->sq_tail;
+	for (unsigned k = tail - *to_submit; k != tail; k++) {
+		const size_t i = (size_t)rs->sqes[rs->sq_array[k & *rs->sq_mask]].user_data;
+		reads[i].read = rs->done[i];
+		rs->flying[i] = false;
+	}
+	__atomic_store_n(rs->sq_tail, tail - *to_submit, __ATOMIC_RELEASE);
+	*pending -= *to_submit;
+	*to_submit = 0;
+}
+
+/**
+ * Cancel the reads in flight once every one has failed, and wait for them to complete,
+ * so none are left writing to the buffers. Returns false if they couldn't be waited for.
+ */
+static bool drain(struct ring *rs, struct ring_read *reads, const size_t n, const bool fixed, size_t *pending) {
+	unsigned to_submit = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (!rs->flying[i]) continue;
+		submit_cancel(rs, i);
+		to_submit++;
+	}
+
+	while (*pending > 0) {
+		const int submitted = (int)syscall(__NR_io_uring_enter, rs->fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (submitted >= 0) {
+			to_submit -= (unsigned)submitted;
+			// Failed reads aren't resubmitted, so nothing is added to submit.
+			reap(rs, reads, fixed, pending, &(unsigned){0});
+			continue;
+		}
+		const int err = errno;
+		if (err == EINTR) continue;
+		// A full completion queue clears once it's reaped. Anything else is given up on.
+		if ((err == EAGAIN || err == EBUSY) && reap(rs, reads, fixed, pending, &(unsigned){0}) > 0) continue;
+		return false;
+	}
+	return true;
+}
+
+size_t ring_read(const ring r, struct ring_read *reads, const size_t count) {
+	auto const rs = (struct ring *)r;
+	if (count == 0) return 0;
+	if (rs->broken) {
+		for (size_t i = 0; i < count; i++) {
+			reads[i].result = region_error(CLOD_REGION_INVALID_USAGE, "Ring was left with reads in flight.");
+		}
+		return count;
+	}
+
+	// Pack as many reads into the arena as fit.
+	size_t n = 0;
+	size_t used = 0;
+	while (n < count && n < RING_ENTRIES && reads[n].size <= RING_ARENA_SIZE - used) {
+		reads[n].data = rs->arena + used;
+		used += reads[n].size;
+		n++;
+	}
+
+	// A read too large for the arena is done on its own.
+	bool fixed = rs->registered;
+	if (n == 0) {
+		if (rs->large_size < reads[0].size) {
+			char *large = realloc(rs->large, reads[0].size);
+			if (!large) {
+				reads[0].result = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for read.");
+				return 1;
+			}
+			rs->large = large;
+			rs->large_size = reads[0].size;
+		}
+		reads[0].data = rs->large;
+		fixed = false;
+		n = 1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		rs->done[i] = 0;
+		reads[i].read = 0;
+		reads[i].result = CLOD_REGION_OK;
+		submit(rs, &reads[i], i, fixed);
+	}
+
+	size_t pending = n;
+	unsigned to_submit = (unsigned)n;
+	bool wait_only = false;
+	while (pending > 0) {
+		const int submitted = (int)syscall(__NR_io_uring_enter, rs->fd, wait_only ? 0 : to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (submitted >= 0) {
+			to_submit -= (unsigned)submitted;
+			wait_only = false;
+			reap(rs, reads, fixed, &pending, &to_submit);
+			continue;
+		}
+		const int err = errno;
+		if (err == EINTR) continue;
+
+		// The completion queue is full, or the kernel is short of memory. Both clear once completions are reaped,
+		// so reap them, or wait for some if none are ready, before submitting again.
+		if ((err == EAGAIN || err == EBUSY) && !wait_only) {
+			if (reap(rs, reads, fixed, &pending, &to_submit) == 0) wait_only = pending > to_submit;
+			if (wait_only || pending == 0) continue;
+		}
+
+		// Nothing more can be submitted, so fail the reads still queued, and wait for the ones submitted.
+		const enum clod_region_result res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to submit reads: %s", strerror(err));
+		for (size_t i = 0; i < n; i++) if (reads[i].result == CLOD_REGION_OK) reads[i].result = res;
+		// Waiting failed too, so the reads in flight are cancelled, and the ring is given up on if they can't be.
+		if (to_submit == 0) {
+			if (!drain(rs, reads, n, fixed, &pending)) rs->broken = true;
+			return n;
+		}
+		unqueue(rs, reads, &pending, &to_submit);
+		wait_only = false;
+	}
+	return n;
+}
+
+bool ring_broken(const ring r) {
+	return ((struct ring *)r)->broken;
+}
+
+void ring_close(const ring r) {
+	auto const rs = (struct ring *)r;
+	// Reads left in flight carry on after the ring is closed, so the buffers they write to are never reused.
+	if (rs->arena && !rs->broken) munmap(rs->arena, RING_ARENA_SIZE);
+	if (rs->sqes) munmap(rs->sqes, rs->sqes_size);
+	if (rs->cq_map && rs->cq_map != rs->sq_map) munmap(rs->cq_map, rs->cq_map_size);
+	if (rs->sq_map) munmap(rs->sq_map, rs->sq_map_size);
+	close(rs->fd);
+	if (!rs->broken) free(rs->large);
+	free(rs);
+}
+
+#else
+
+enum clod_region_result ring_open(ring *) {
+	return CLOD_REGION_NOT_FOUND;
+}
+
+size_t ring_read(ring, struct ring_read *reads, const size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		reads[i].result = region_error(CLOD_REGION_INVALID_USAGE, "Rings are not supported on this platform.");
+	}
+	return count;
+}
+
+bool ring_broken(ring) {
+	return false;
+}
+
+void ring_close(ring) {}
+
+#endif
@@ -0,0 +1,192 @@
+/**
+ * Processes sharing a region coordinate through a sidecar file in the region directory, which each of them maps.
+ * It holds a fixed table of slots, each with a robust process-shared mutex and a count of the writes made under it.
+ * Region files are spread over the slots by position, so unrelated files can share a slot,
+ * which costs them a little concurrency but keeps the table a fixed size however large the world is.
+ *
+ * Robust mutexes are released by the system when their holder dies, and the next process to lock one is told,
+ * so a write cut short by a crash is noticed and repaired rather than leaving the file locked forever.
+ */
+#include "../platform.h"
+#include "../../error.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Number of slots region files are spread over.
+#define SHARED_SLOTS 4096
+// Identifies an initialised sidecar file, and its layout.
+#define SHARED_MAGIC UINT64_C(0x31766873646f6c63)
+
+struct shared_file {
+	pthread_mutex_t mtx;
+	// Process writing to a file in the slot, or 0. Still set once the mutex is locked again if the writer died.
+	atomic int32_t writer;
+	atomic uint64_t generation;
+	// Position of the file being written.
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+};
+
+struct shared_state {
+	// Set once the slots are initialised.
+	atomic uint64_t magic;
+	uint8_t dims;
+	struct shared_file slots[SHARED_SLOTS];
+};
+
+#if HAVE_ROBUST_MUTEX
+
+static bool slot_init(struct shared_file *sf) {
+	pthread_mutexattr_t attr;
+	if (pthread_mutexattr_init(&attr)) return false;
+	bool ok =
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+		pthread_mutex_init(&sf->mtx, &attr) == 0;
+	pthread_mutexattr_destroy(&attr);
+	sf->writer = 0;
+	sf->generation = 0;
+	return ok;
+}
+
+enum clod_region_result shared_open(shared *s, const dir d, const char *name, const struct clod_region_opts *opts) {
+	const mode_t o_mode = opts->unix_file_perms ? opts->unix_file_perms : 0664;
+	// Read-only regions still take the locks, so the file is always opened for writing.
+	const int fd = openat((int)(intptr_t)d, name, O_RDWR | O_CREAT | O_CLOEXEC, o_mode);
+	if (fd < 0) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Opening \"%s\": %s", name, strerror(errno));
+	}
+
+	// Held while the file is set up, so only the first process initialises it.
+	if (flock(fd, LOCK_EX)) {
+		close(fd);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Locking \"%s\": %s", name, strerror(errno));
+	}
+
+	enum clod_region_result res = CLOD_REGION_OK;
+	struct stat st;
+	if (fstat(fd, &st)) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to stat \"%s\": %s", name, strerror(errno));
+	} else if ((size_t)st.st_size < sizeof(struct shared_state) && ftruncate(fd, sizeof(struct shared_state))) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to truncate \"%s\": %s", name, strerror(errno));
+	}
+
+	struct shared_state *state = nullptr;
+	if (res == CLOD_REGION_OK) {
+		state = mmap(nullptr, sizeof(*state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (state == MAP_FAILED) {
+			state = nullptr;
+			res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to mmap \"%s\": %s", name, strerror(errno));
+		}
+	}
+
+	// A process that died part way through initialising left the magic unset, so it's done again.
+	if (res == CLOD_REGION_OK && state->magic != SHARED_MAGIC) {
+		state->dims = opts->dims;
+		for (size_t i = 0; i < SHARED_SLOTS && res == CLOD_REGION_OK; i++) {
+			if (!slot_init(&state->slots[i])) {
+				res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to create process-shared mutex in \"%s\".", name);
+			}
+		}
+		if (res == CLOD_REGION_OK) state->magic = SHARED_MAGIC;
+	}
+	if (res == CLOD_REGION_OK && state->dims != opts->dims) {
+		res = region_error(CLOD_REGION_INVALID_USAGE,
+			"\"%s\" is shared by processes using %d dimensions, not %d.", name, state->dims, opts->dims);
+	}
+
+	(void)flock(fd, LOCK_UN);
+	close(fd);
+	if (res != CLOD_REGION_OK) {
+		if (state) munmap(state, sizeof(*state));
+		return res;
+	}
+	*s = (shared)state;
+	return CLOD_REGION_OK;
+}
+
+void shared_close(const shared s) {
+	munmap((struct shared_state *)s, sizeof(struct shared_state));
+}
+
+struct shared_file *shared_file_get(const shared s, const int64_t *pos, const uint8_t dims) {
+	uint64_t h = 0;
+	for (uint8_t i = 0; i < dims; i++) {
+		h = (h ^ (uint64_t)pos[i]) * 0x9E3779B97F4A7C15;
+	}
+	return &((struct shared_state *)s)->slots[(h >> 32) % SHARED_SLOTS];
+}
+
+bool shared_file_lock(struct shared_file *sf, const int64_t *pos, const uint8_t dims) {
+	// The previous holder died, but the state it protects is repaired by the caller, so the mutex is usable again.
+	if (pthread_mutex_lock(&sf->mtx) == EOWNERDEAD) pthread_mutex_consistent(&sf->mtx);
+	// Live writers clear their mark before unlocking, so a mark left behind is from one that died.
+	return sf->writer != 0 && memcmp(sf->pos, pos, sizeof(pos[0]) * dims) == 0;
+}
+
+void shared_file_unlock(struct shared_file *sf) {
+	pthread_mutex_unlock(&sf->mtx);
+}
+
+bool shared_file_busy(struct shared_file *sf) {
+	const int32_t writer = sf->writer;
+	if (writer == 0 || writer == (int32_t)getpid()) return false;
+
+	// Writers hold the mutex for the whole write, so a mark on a slot nobody has locked is from one that died.
+	// The mark is left for the next writer to find, which repairs the write.
+	const int err = pthread_mutex_trylock(&sf->mtx);
+	if (err == EBUSY) return true;
+	if (err == EOWNERDEAD) pthread_mutex_consistent(&sf->mtx);
+	if (err == 0 || err == EOWNERDEAD) pthread_mutex_unlock(&sf->mtx);
+	return false;
+}
+
+void shared_file_begin(struct shared_file *sf, const int64_t *pos, const uint8_t dims) {
+	memcpy(sf->pos, pos, sizeof(pos[0]) * dims);
+	sf->writer = (int32_t)getpid();
+	// Odd while a write is under way. A write that died left it odd already, so it's moved on to the next odd count.
+	sf->generation += sf->generation & 1 ? 2 : 1;
+	// Nothing the write changes can be seen before the count is.
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+#else
+
+enum clod_region_result shared_open(shared *, dir, const char *, const struct clod_region_opts *) {
+	return region_error(CLOD_REGION_INVALID_USAGE,
+		"Sharing a region between processes needs robust process-shared mutexes, which this platform doesn't have.");
+}
+
+void shared_close(shared) {}
+
+struct shared_file *shared_file_get(shared, const int64_t *, uint8_t) {
+	return nullptr;
+}
+
+bool shared_file_lock(struct shared_file *, const int64_t *, uint8_t) {
+	return false;
+}
+
+void shared_file_unlock(struct shared_file *) {}
+
+bool shared_file_busy(struct shared_file *) {
+	return false;
+}
+
+void shared_file_begin(struct shared_file *, const int64_t *, uint8_t) {}
+
+#endif
+
+uint64_t shared_file_generation(const struct shared_file *sf) {
+	return sf->generation;
+}
+
+void shared_file_changed(struct shared_file *sf) {
+	// Even once the write is done, including a repair of one that died, which left it odd.
+	sf->generation += sf->generation & 1 ? 1 : 2;
+	sf->writer = 0;
+}
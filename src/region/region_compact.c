@@ -0,0 +1,402 @@
+/**
+ * Compaction copies a region file's chunks one after another into a new file, then renames it over the old one.
+ *
+ * The writers of every stripe are held throughout, so the chunks can't change while they're copied,
+ * but only the file's read lock is held until the copy is done, so readers carry on.
+ * The new file is swapped in with the file's write lock held, so nobody is left using the old one.
+ * A crash before the rename leaves the old file as it was, and the temporary file is overwritten next time.
+ *
+ * The background compactor periodically looks at the free sectors of every open region file,
+ * and compacts those with more unused space than the threshold. Files that aren't open aren't opened to check them,
+ * as files only gain unused space when they're written. Writes that leave a file over the threshold wake it early.
+ */
+#include <clod/region.h>
+#include "region_impl.h"
+#include "region_file.h"
+#include "filename.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NS_IN_SEC 1000000000ULL
+// Time between passes of the background compactor over the directory.
+#define COMPACT_INTERVAL_NS (60 * NS_IN_SEC)
+// Every stripe of a region file.
+#define STRIPES_ALL UINT64_MAX
+
+struct compact_chunk {
+	uint32_t index;
+	// Chunks are stored in ascending order of key.
+	uint32_t key;
+	struct format_location location;
+};
+
+// Limits the rate chunks are copied at.
+struct throttle {
+	uint64_t budget;
+	uint64_t bytes;
+	struct timespec start;
+};
+
+static int compact_chunk_cmp(const void *a, const void *b) {
+	const struct compact_chunk *x = a, *y = b;
+	if (x->key != y->key) return x->key < y->key ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Position of a chunk along a Z-order curve through the region file.
+static uint32_t spatial_key(const size_t index, const uint8_t dims) {
+	// Split the index into coordinates the way vec_group packed them.
+	uint32_t coords[CLOD_REGION_DIMENSIONS_MAX];
+	uint8_t bits[CLOD_REGION_DIMENSIONS_MAX];
+	uint8_t used = 0;
+	for (uint8_t i = 0; i < dims; i++) {
+		bits[i] = (uint8_t)((HEADER_CHUNK_BITS - used + dims - i - 1) / (dims - i));
+		coords[i] = (uint32_t)(index >> used) & (((uint32_t)1 << bits[i]) - 1);
+		used += bits[i];
+	}
+
+	uint32_t key = 0;
+	uint8_t out = 0;
+	for (uint8_t b = 0; b < HEADER_CHUNK_BITS; b++) {
+		for (uint8_t i = 0; i < dims; i++) {
+			if (b < bits[i]) key |= ((coords[i] >> b) & 1) << out++;
+		}
+	}
+	return key;
+}
+
+static struct timespec deadline_in(const uint64_t ns) {
+	struct timespec deadline;
+	timespec_get(&deadline, TIME_UTC);
+	const uint64_t nsec = (uint64_t)deadline.tv_nsec + ns % NS_IN_SEC;
+	deadline.tv_sec += (time_t)(ns / NS_IN_SEC + nsec / NS_IN_SEC);
+	deadline.tv_nsec = (long)(nsec % NS_IN_SEC);
+	return deadline;
+}
+
+// Wait for ns nanoseconds. Returns false if the region is being closed.
+static bool compact_wait(struct clod_region *r, const uint64_t ns) {
+	const struct timespec deadline = deadline_in(ns);
+	mutex_lock(&r->compact_mtx);
+	while (!r->compact_stopping && condvar_timedwait(&r->compact_wake, &r->compact_mtx, &deadline));
+	const bool stopping = r->compact_stopping;
+	mutex_unlock(&r->compact_mtx);
+	return !stopping;
+}
+
+// Wait until the next pass, which is early if a write asked for one. Returns false if the region is being closed.
+static bool compact_idle(struct clod_region *r) {
+	const struct timespec deadline = deadline_in(COMPACT_INTERVAL_NS);
+	mutex_lock(&r->compact_mtx);
+	while (!r->compact_stopping && !r->compact_due && condvar_timedwait(&r->compact_wake, &r->compact_mtx, &deadline));
+	r->compact_due = false;
+	const bool stopping = r->compact_stopping;
+	mutex_unlock(&r->compact_mtx);
+	return !stopping;
+}
+
+// Check if a file of size bytes has more unused space than the threshold. Its sectors_mtx must be held.
+static bool compact_over(const struct region_file *rf, const size_t size, const uint8_t threshold) {
+	const size_t live = (size_t)rf->sectors.count * rf->fmt.sector_size;
+	return rf->fmt.version != 0 && live < size && (size - live) * 100 >= size * threshold;
+}
+
+// Count bytes copied, and wait until they're within the budget. Returns false if the region is being closed.
+static bool throttle(struct clod_region *r, struct throttle *t, const size_t bytes) {
+	t->bytes += bytes;
+	const uint64_t due = t->bytes / t->budget * NS_IN_SEC + t->bytes % t->budget * NS_IN_SEC / t->budget;
+
+	struct timespec now;
+	if (!monotonic_now(&now)) return !r->compact_stopping;
+	const uint64_t elapsed = (uint64_t)(now.tv_sec - t->start.tv_sec) * NS_IN_SEC + (uint64_t)now.tv_nsec - (uint64_t)t->start.tv_nsec;
+	if (due <= elapsed) return !r->compact_stopping;
+	return compact_wait(r, due - elapsed);
+}
+
+/**
+ * Copy the chunks of a region file whose read lock and every writer lock are held into a new file, and swap it in.
+ * Files with less than threshold percent unused space are left alone.
+ */
+static enum clod_region_result file_compact_locked(
+	struct clod_region *r,
+	struct region_file *rf,
+	const int64_t *region_pos,
+	const uint8_t threshold
+) {
+	if (rf->fmt.version == 0) return CLOD_REGION_OK;
+
+	void *map;
+	size_t size;
+	auto res = file_get(rf->f, &map, &size);
+	if (res != CLOD_REGION_OK) return res;
+
+	struct compact_chunk *chunks = malloc(HEADER_CHUNKS * sizeof(chunks[0]));
+	if (!chunks) return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for compaction.");
+
+	const uint32_t sector_size = rf->fmt.sector_size;
+	uint64_t live = rf->fmt.header_sectors;
+	size_t n = 0;
+	for (size_t i = 0; i < HEADER_CHUNKS; i++) {
+		struct format_location location;
+		res = format_chunk_locate(&rf->fmt, map, size, i, &location);
+		if (res == CLOD_REGION_NOT_FOUND) continue;
+		if (res != CLOD_REGION_OK) {
+			free(chunks);
+			return res;
+		}
+
+		chunks[n++] = (struct compact_chunk){
+			.index = (uint32_t)i,
+			.key = r->opts.compact_order == CLOD_REGION_ORDER_RECENT
+				? UINT32_MAX - format_mtime_get(&rf->fmt, map, i)
+				: spatial_key(i, r->opts.dims),
+			.location = location,
+		};
+		live += location.sectors;
+	}
+
+	const size_t compact_size = (size_t)live * sector_size;
+	if (threshold && (compact_size >= size || (size - compact_size) * 100 < size * threshold)) {
+		free(chunks);
+		return CLOD_REGION_OK;
+	}
+	qsort(chunks, n, sizeof(chunks[0]), compact_chunk_cmp);
+
+	file f;
+	res = region_file_temp_open(r, region_pos, &f);
+	if (res != CLOD_REGION_OK) {
+		free(chunks);
+		return res;
+	}
+
+	void *out;
+	size_t out_size;
+	res = stats_truncate(r->stats, f, compact_size);
+	if (res == CLOD_REGION_OK) res = file_get(f, &out, &out_size);
+
+	bool stopped = false;
+	if (res == CLOD_REGION_OK) {
+		struct throttle t = { .budget = r->opts.compact_budget };
+		if (!monotonic_now(&t.start)) res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to get the time.");
+
+		memcpy(out, map, (size_t)rf->fmt.header_sectors * sector_size);
+		uint32_t offset = rf->fmt.header_sectors;
+		for (size_t i = 0; i < n && res == CLOD_REGION_OK; i++) {
+			auto const c = &chunks[i];
+			// The last chunk in a file might not fill its last sector.
+			const size_t from = (size_t)c->location.offset * sector_size;
+			const size_t stored = (size_t)c->location.sectors * sector_size;
+			memcpy((char *)out + (size_t)offset * sector_size, (char *)map + from, size - from < stored ? size - from : stored);
+
+			format_location_set(&rf->fmt, out, c->index, (struct format_location){ .offset = offset, .sectors = c->location.sectors });
+			offset += c->location.sectors;
+			if (!throttle(r, &t, stored)) {
+				stopped = true;
+				break;
+			}
+		}
+	}
+	free(chunks);
+
+	return region_file_swap(r, rf, region_pos, f, &rf->fmt, res == CLOD_REGION_OK && !stopped, res);
+}
+
+enum clod_region_result region_file_temp_open(struct clod_region *r, const int64_t *region_pos, file *f) {
+	char temp_filename[REGION_FILENAME_MAX + 1];
+	char temp_ext[EXTENSION_MAX + 1];
+	snprintf(temp_ext, sizeof(temp_ext), "%s.tmp", r->opts.region_ext);
+	filename_make(temp_filename, r->opts.prefix, temp_ext, region_pos, r->opts.dims);
+
+	auto const res = file_open(f, r->d, temp_filename, true, &r->opts);
+	if (res != CLOD_REGION_OK) return res;
+
+	// A temporary file left by a crash is overwritten.
+	auto const trunc_res = stats_truncate(r->stats, *f, 0);
+	if (trunc_res != CLOD_REGION_OK) (void)file_close(*f);
+	return trunc_res;
+}
+
+enum clod_region_result region_file_swap(
+	struct clod_region *r,
+	struct region_file *rf,
+	const int64_t *region_pos,
+	file f,
+	const struct format *fmt,
+	const bool keep,
+	enum clod_region_result res
+) {
+	char filename[REGION_FILENAME_MAX + 1];
+	char temp_filename[REGION_FILENAME_MAX + 1];
+	char temp_ext[EXTENSION_MAX + 1];
+	snprintf(temp_ext, sizeof(temp_ext), "%s.tmp", r->opts.region_ext);
+	filename_make(filename, r->opts.prefix, r->opts.region_ext, region_pos, r->opts.dims);
+	filename_make(temp_filename, r->opts.prefix, temp_ext, region_pos, r->opts.dims);
+
+	void *out;
+	size_t out_size;
+	struct sectors sectors;
+	bool sectors_ready = false;
+	if (res == CLOD_REGION_OK && keep) res = file_get(f, &out, &out_size);
+	if (res == CLOD_REGION_OK && keep) {
+		format_commit(fmt, out);
+		res = file_sync(f);
+	}
+	if (res == CLOD_REGION_OK && keep) {
+		sectors_ready = sectors_init(&sectors, fmt, out);
+		if (!sectors_ready) res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for region file sectors.");
+	}
+
+	if (res == CLOD_REGION_OK && keep) {
+		// Readers must be done with the old file before it's closed.
+		res = region_file_upgrade(rf);
+	}
+	if (res == CLOD_REGION_OK && keep) {
+		res = dir_rename(r->d, temp_filename, filename);
+		if (res == CLOD_REGION_OK) {
+			const file old = rf->f;
+			rf->f = f;
+			f = old;
+			rf->fmt = *fmt;
+			region_file_keep_header(r, rf);
+			sectors_destroy(&rf->sectors);
+			rf->sectors = sectors;
+			sectors_ready = false;
+		}
+		region_file_downgrade(rf);
+	}
+
+	if (sectors_ready) sectors_destroy(&sectors);
+	auto const close_res = file_close(f);
+	if (res != CLOD_REGION_OK || !keep) {
+		(void)dir_unlink(r->d, temp_filename);
+		return res;
+	}
+	// Later writes sync the new file, which is only durable once the rename that put it in place is.
+	auto const sync_res = dir_sync(r->d);
+	return sync_res != CLOD_REGION_OK ? sync_res : close_res;
+}
+
+// Compact the region file at a position, if it exists.
+static enum clod_region_result region_compact(struct clod_region *r, const int64_t *region_pos, const uint8_t threshold) {
+	struct region_file *rf;
+	auto res = region_file_get(r, &rf, region_pos, false);
+	if (res != CLOD_REGION_OK) return res == CLOD_REGION_NOT_FOUND ? CLOD_REGION_OK : res;
+
+	// The file stays pinned until its read lock is held, so it can't be evicted meanwhile.
+	region_file_writers_lock(rf, STRIPES_ALL);
+	region_file_lock_pinned(rf);
+
+	res = file_compact_locked(r, rf, region_pos, threshold);
+
+	rbmutex_rdunlock(&rf->mtx);
+	region_file_writers_unlock(rf, STRIPES_ALL);
+	return res;
+}
+
+enum clod_region_result clod_region_compact(struct clod_region *region, const int64_t *pos) {
+	REGION_PUBLIC_ENTER(region);
+
+	if (region->opts.mode != CLOD_REGION_MODE_RDWR) {
+		REGION_PUBLIC_LEAVE(region);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Attempted to compact a read-only region.");
+	}
+	// Other processes would be left with the replaced file open.
+	if (region->opts.shared) {
+		REGION_PUBLIC_LEAVE(region);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Attempted to compact a region shared between processes.");
+	}
+
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	chunk_index(pos, region_pos, region->opts.dims);
+	auto const res = region_compact(region, region_pos, 0);
+
+	REGION_PUBLIC_LEAVE(region);
+	return res;
+}
+
+// Check if a pinned region file has more unused space than the threshold, from its free sectors, and unpin it.
+static bool compact_wanted(struct region_file *rf, const uint8_t threshold, int64_t *region_pos) {
+	region_file_lock_pinned(rf);
+	void *map;
+	size_t size;
+	bool wanted = false;
+	if (file_get(rf->f, &map, &size) == CLOD_REGION_OK) {
+		mutex_lock(&rf->sectors_mtx);
+		wanted = compact_over(rf, size, threshold);
+		mutex_unlock(&rf->sectors_mtx);
+	}
+	memcpy(region_pos, rf->pos, sizeof(rf->pos));
+	rbmutex_rdunlock(&rf->mtx);
+	return wanted;
+}
+
+// Compact the open region files that have enough unused space.
+static void compact_pass(struct clod_region *r) {
+	struct region_file **rfs;
+	size_t count;
+	if (region_file_pin_open(r, &rfs, &count) != CLOD_REGION_OK) return;
+
+	// Files are only kept pinned while they're checked, so that the files waiting to be compacted can be evicted.
+	int64_t (*positions)[CLOD_REGION_DIMENSIONS_MAX] = malloc((count ? count : 1) * sizeof(positions[0]));
+	size_t wanted = 0;
+	for (size_t i = 0; i < count; i++) {
+		int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+		if (compact_wanted(rfs[i], r->opts.compact_threshold, region_pos) && positions) {
+			memcpy(positions[wanted++], region_pos, sizeof(region_pos));
+		}
+	}
+	free(rfs);
+
+	for (size_t i = 0; i < wanted && !r->compact_stopping; i++) {
+		// Errors have been reported, and the file is tried again next pass.
+		(void)region_compact(r, positions[i], r->opts.compact_threshold);
+	}
+	free(positions);
+}
+
+static void *compact_worker(void *arg) {
+	struct clod_region *r = arg;
+	do {
+		compact_pass(r);
+	} while (compact_idle(r));
+	return nullptr;
+}
+
+void compact_notify(struct clod_region *r, const struct region_file *rf) {
+	if (!r->compact_running || r->compact_due) return;
+	void *map;
+	size_t size;
+	if (file_get(rf->f, &map, &size) != CLOD_REGION_OK || !compact_over(rf, size, r->opts.compact_threshold)) return;
+
+	mutex_lock(&r->compact_mtx);
+	r->compact_due = true;
+	condvar_broadcast(&r->compact_wake);
+	mutex_unlock(&r->compact_mtx);
+}
+
+enum clod_region_result compact_start(struct clod_region *r) {
+	r->compact_stopping = false;
+	r->compact_due = false;
+	r->compact_running = false;
+	if (r->opts.mode != CLOD_REGION_MODE_RDWR || r->opts.compact_threshold == 0 || r->opts.shared) return CLOD_REGION_OK;
+
+	if (!thread_create(&r->compact_thread, compact_worker, r)) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to start background compaction thread.");
+	}
+	r->compact_running = true;
+	return CLOD_REGION_OK;
+}
+
+void compact_stop(struct clod_region *r) {
+	if (!r->compact_running) return;
+
+	mutex_lock(&r->compact_mtx);
+	r->compact_stopping = true;
+	condvar_broadcast(&r->compact_wake);
+	mutex_unlock(&r->compact_mtx);
+
+	thread_join(r->compact_thread);
+	r->compact_running = false;
+}
@@ -0,0 +1,434 @@
+/**
+ * Conversion copies every region file of one region into the matching region file of another, on a pool of threads.
+ *
+ * A thread claims a whole source file and reads its chunks in the order they are stored.
+ * Each chunk is checked against its checksum and decompressed, so corrupted chunks are caught before they're copied,
+ * then gathered in the thread's buffer: as it's stored if the destination uses the same compression,
+ * or compressed again if it doesn't. The buffer is written to the destination file with one sync whenever it fills,
+ * and when the source file is done, so memory use is bounded by the buffer size times the number of threads.
+ *
+ * Once a file is durable in the destination, its position is appended to a progress file in the destination directory.
+ * A conversion that is cut short skips the files listed there when it's run again,
+ * and the progress file is removed once every file has been converted.
+ */
+#include <clod/region.h>
+#include <clod/hash.h>
+#include "region_impl.h"
+#include "region_file.h"
+#include "filename.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes of converted chunk data a thread gathers before writing, by default.
+#define CONVERT_BATCH_DEFAULT (32 * 1024 * 1024)
+// Size of a thread's decompression buffer to begin with. Grown when a chunk doesn't fit.
+#define CONVERT_BUFFER_MIN (256 * 1024)
+// Extension of the progress file, which is named after the destination's prefix.
+#define PROGRESS_EXT "convert"
+// Written after the position in each record of the progress file, so a record cut short by a crash isn't counted.
+#define PROGRESS_MAGIC UINT64_C(0x656e6f64766e6f63)
+
+// A region file listed in the progress file. Unused dimensions are zero.
+struct converted_file {
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+};
+
+struct convert {
+	struct clod_region *src;
+	struct clod_region *dst;
+	const struct clod_region_convert_opts *opts;
+	size_t batch_size;
+
+	struct region_files files;
+
+	// Held to append to the progress file, and to stop the conversion.
+	mutex mtx;
+	file progress;
+	size_t progress_size;
+	// Files converted before, sorted.
+	struct converted_file *done;
+	size_t done_len;
+
+	atomic bool stopped;
+	enum clod_region_result result;
+};
+
+// A chunk gathered in a thread's buffer.
+struct convert_chunk {
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+	size_t offset;
+	size_t size;
+	size_t uncompressed_size;
+	uint32_t mtime;
+};
+
+struct convert_worker {
+	struct convert *convert;
+	thread t;
+	struct clod_decompressor *dctx;
+	struct clod_compressor *cctx;
+	// Decompressed chunk.
+	uint8_t *buff;
+	size_t cap;
+	// Converted chunks waiting to be written.
+	uint8_t *batch;
+	size_t batch_len;
+	size_t batch_cap;
+	struct convert_chunk chunks[HEADER_CHUNKS];
+	struct chunk_copy copies[HEADER_CHUNKS];
+	size_t chunks_len;
+};
+
+// Stop the conversion with a result, unless it was already stopped.
+static void convert_stop(struct convert *c, const enum clod_region_result res) {
+	mutex_lock(&c->mtx);
+	if (!c->stopped) {
+		c->stopped = true;
+		c->result = res;
+	}
+	mutex_unlock(&c->mtx);
+}
+
+// Pass a chunk that couldn't be converted to the error callback, or stop the conversion if there isn't one.
+static void convert_error(struct convert *c, const int64_t *pos, const enum clod_region_result res) {
+	if (c->opts->error) c->opts->error(c->opts->user, pos, res);
+	else convert_stop(c, res);
+}
+
+static int converted_cmp(const void *a, const void *b) {
+	return memcmp(a, b, sizeof(struct converted_file));
+}
+
+static size_t progress_record_size(const struct convert *c) {
+	return sizeof(int64_t) * c->dst->opts.dims + sizeof(uint64_t);
+}
+
+// Open the progress file, and list the files it records as converted.
+static enum clod_region_result progress_open(struct convert *c) {
+	char name[REGION_FILENAME_MAX + 1];
+	snprintf(name, sizeof(name), "%s.%s", c->dst->opts.prefix, PROGRESS_EXT);
+	auto res = file_open(&c->progress, c->dst->d, name, true, &c->dst->opts);
+	if (res != CLOD_REGION_OK) return res;
+
+	void *map;
+	res = file_get(c->progress, &map, &c->progress_size);
+	const size_t record = progress_record_size(c);
+	const size_t records = c->progress_size / record;
+	if (res == CLOD_REGION_OK && !(c->done = calloc(records ? records : 1, sizeof(c->done[0])))) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for conversion progress.");
+	}
+	if (res != CLOD_REGION_OK) {
+		(void)file_close(c->progress);
+		return res;
+	}
+
+	// A record cut short by a crash is overwritten by the next one.
+	c->progress_size = records * record;
+
+	for (size_t i = 0; i < records; i++) {
+		const char *r = (const char *)map + i * record;
+		uint64_t magic;
+		memcpy(&magic, r + record - sizeof(magic), sizeof(magic));
+		if (magic != PROGRESS_MAGIC) continue;
+		memcpy(c->done[c->done_len++].pos, r, record - sizeof(magic));
+	}
+	qsort(c->done, c->done_len, sizeof(c->done[0]), converted_cmp);
+	return CLOD_REGION_OK;
+}
+
+// Append a converted file to the progress file, once its chunks are durable.
+static enum clod_region_result progress_record(struct convert *c, const int64_t *region_pos) {
+	const size_t record = progress_record_size(c);
+	const uint64_t magic = PROGRESS_MAGIC;
+
+	mutex_lock(&c->mtx);
+	auto res = file_truncate(c->progress, c->progress_size + record);
+	void *map;
+	size_t size;
+	if (res == CLOD_REGION_OK) res = file_get(c->progress, &map, &size);
+	if (res == CLOD_REGION_OK) {
+		char *r = (char *)map + c->progress_size;
+		memcpy(r, region_pos, record - sizeof(magic));
+		memcpy(r + record - sizeof(magic), &magic, sizeof(magic));
+		res = file_sync(c->progress);
+	}
+	if (res == CLOD_REGION_OK) c->progress_size += record;
+	mutex_unlock(&c->mtx);
+	return res;
+}
+
+// Find the next source file that hasn't been converted. Returns false once there are none left.
+static bool convert_next(struct convert *c, int64_t *region_pos) {
+	struct converted_file key = {0};
+	while (region_files_next(&c->files, key.pos)) {
+		if (bsearch(&key, c->done, c->done_len, sizeof(c->done[0]), converted_cmp)) continue;
+		memcpy(region_pos, key.pos, sizeof(key.pos[0]) * c->src->opts.dims);
+		return true;
+	}
+	return false;
+}
+
+// List the chunks of a source file in the order they are stored, and start reading the file in.
+static size_t file_chunks(struct clod_region *src, const int64_t *region_pos, uint16_t *indices) {
+	struct region_file *rf;
+	if (region_file_rdlock(src, &rf, region_pos) != CLOD_REGION_OK) return 0;
+
+	void *data;
+	size_t size;
+	size_t n = 0;
+	if (file_get(rf->f, &data, &size) == CLOD_REGION_OK && rf->fmt.version != 0) {
+		file_prefetch(rf->f, 0, SIZE_MAX);
+		region_file_stripes_rdlock(rf, UINT64_MAX);
+		n = region_file_chunks(rf, data, indices);
+		region_file_stripes_rdunlock(rf, UINT64_MAX);
+	}
+	rbmutex_rdunlock(&rf->mtx);
+	return n;
+}
+
+// Grow a worker's batch to hold at least n more bytes.
+static enum clod_region_result batch_reserve(struct convert_worker *w, const size_t n) {
+	if (w->batch_len + n <= w->batch_cap) return CLOD_REGION_OK;
+	size_t cap = w->batch_cap ? w->batch_cap : CONVERT_BUFFER_MIN;
+	while (cap < w->batch_len + n) cap *= 2;
+	uint8_t *batch = realloc(w->batch, cap);
+	if (!batch) return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for converted chunks.");
+	w->batch = batch;
+	w->batch_cap = cap;
+	return CLOD_REGION_OK;
+}
+
+// Make room for compressed data at the end of a worker's batch.
+static enum clod_region_result batch_reserve_compressed(void *user, const size_t capacity, uint8_t **dst) {
+	struct convert_worker *w = user;
+	auto const res = batch_reserve(w, capacity);
+	if (res == CLOD_REGION_OK) *dst = w->batch + w->batch_len;
+	return res;
+}
+
+// Check a chunk against its checksum and decompress it into the worker's buffer.
+static enum clod_region_result chunk_check(struct convert_worker *w, const struct clod_region_view *view, size_t *size) {
+	if (view->checksum && clod_crc32(view->data, view->size) != view->checksum) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk data doesn't match its checksum.");
+	}
+	if (view->compression == CLOD_UNCOMPRESSED) {
+		*size = view->size;
+		return CLOD_REGION_OK;
+	}
+
+	return codec_decompress(w->dctx, view->data, view->size, view->compression, view->uncompressed_size, &w->buff, &w->cap, size);
+}
+
+// Add a checked chunk to the worker's batch, compressed with the destination's compression.
+static enum clod_region_result chunk_gather(
+	struct convert_worker *w,
+	const int64_t *pos,
+	const struct clod_region_view *view,
+	const size_t uncompressed_size,
+	const uint32_t mtime
+) {
+	auto const dst = w->convert->dst;
+	const enum clod_compression_method compression = dst->opts.compression;
+	const uint8_t *plain = view->compression == CLOD_UNCOMPRESSED ? view->data : w->buff;
+
+	enum clod_region_result res;
+	size_t size;
+	if (view->compression == compression || compression == CLOD_UNCOMPRESSED) {
+		// Chunks already stored the way the destination stores them are copied as they are.
+		const uint8_t *data = view->compression == compression ? view->data : plain;
+		size = view->compression == compression ? view->size : uncompressed_size;
+		res = batch_reserve(w, size);
+		if (res == CLOD_REGION_OK) memcpy(w->batch + w->batch_len, data, size);
+	} else {
+		res = codec_compress(w->cctx, plain, uncompressed_size, compression, CLOD_COMPRESSION_NORMAL,
+			batch_reserve_compressed, w, &size);
+	}
+	if (res != CLOD_REGION_OK) return res;
+
+	auto const chunk = &w->chunks[w->chunks_len++];
+	memcpy(chunk->pos, pos, sizeof(pos[0]) * dst->opts.dims);
+	chunk->offset = w->batch_len;
+	chunk->size = size;
+	chunk->uncompressed_size = uncompressed_size;
+	chunk->mtime = mtime;
+	w->batch_len += size;
+	return CLOD_REGION_OK;
+}
+
+// Read, check and gather a chunk of the source.
+static enum clod_region_result chunk_convert(struct convert_worker *w, const int64_t *pos) {
+	auto const src = w->convert->src;
+	time_t mtime;
+	auto res = clod_region_mtime(src, pos, &mtime);
+	if (res != CLOD_REGION_OK) return res;
+
+	bool retry;
+	do {
+		struct clod_region_view view;
+		uint64_t seen;
+		res = region_read_view(src, pos, &view, &seen);
+		if (res != CLOD_REGION_OK) return res;
+
+		const size_t chunks_len = w->chunks_len;
+		const size_t batch_len = w->batch_len;
+		size_t size;
+		const size_t mark = error_hold();
+		res = chunk_check(w, &view, &size);
+		if (res == CLOD_REGION_OK) {
+			res = chunk_gather(w, pos, &view, size, mtime > 0 && mtime <= UINT32_MAX ? (uint32_t)mtime : 0);
+		}
+		// A chunk that another process may have overwritten while it was read is taken back out of the batch and read again.
+		retry = region_file_read_retry(view_region_file(&view), seen);
+		error_release(mark, !retry);
+		if (retry) {
+			w->chunks_len = chunks_len;
+			w->batch_len = batch_len;
+		}
+		clod_region_view_release(src, &view);
+	} while (retry);
+	return res;
+}
+
+// Write the worker's batch to the destination file.
+static void batch_flush(struct convert_worker *w, const int64_t *region_pos) {
+	auto const c = w->convert;
+	if (w->chunks_len == 0) return;
+
+	for (size_t i = 0; i < w->chunks_len; i++) {
+		auto const chunk = &w->chunks[i];
+		w->copies[i] = (struct chunk_copy){
+			.pos = chunk->pos,
+			.data = w->batch + chunk->offset,
+			.size = chunk->size,
+			.uncompressed_size = chunk->uncompressed_size,
+			.mtime = chunk->mtime,
+		};
+	}
+	(void)region_write_copies(c->dst, region_pos, w->copies, w->chunks_len);
+	for (size_t i = 0; i < w->chunks_len; i++) {
+		if (w->copies[i].result != CLOD_REGION_OK) convert_error(c, w->chunks[i].pos, w->copies[i].result);
+	}
+	w->chunks_len = 0;
+	w->batch_len = 0;
+}
+
+static void file_convert(struct convert_worker *w, const int64_t *region_pos) {
+	auto const c = w->convert;
+	uint16_t indices[HEADER_CHUNKS];
+	const size_t n = file_chunks(c->src, region_pos, indices);
+
+	for (size_t i = 0; i < n && !c->stopped; i++) {
+		int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+		chunk_pos(region_pos, indices[i], pos, c->src->opts.dims);
+		auto const res = chunk_convert(w, pos);
+		// Chunks deleted since the file was listed are left out.
+		if (res != CLOD_REGION_OK && res != CLOD_REGION_NOT_FOUND) convert_error(c, pos, res);
+		if (w->batch_len >= c->batch_size) batch_flush(w, region_pos);
+	}
+	batch_flush(w, region_pos);
+	if (c->stopped) return;
+
+	auto const res = progress_record(c, region_pos);
+	if (res != CLOD_REGION_OK) convert_stop(c, res);
+	else if (c->opts->converted && !c->opts->converted(c->opts->user, region_pos)) convert_stop(c, CLOD_REGION_OK);
+}
+
+static void *convert_worker(void *arg) {
+	struct convert_worker *w = arg;
+	auto const c = w->convert;
+
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	while (!c->stopped && convert_next(c, region_pos)) file_convert(w, region_pos);
+	return nullptr;
+}
+
+enum clod_region_result clod_region_convert(
+	struct clod_region *src,
+	struct clod_region *dst,
+	const struct clod_region_convert_opts *opts
+) {
+	if (src == dst) return region_error(CLOD_REGION_INVALID_USAGE, "Attempted to convert a region into itself.");
+	if (src->opts.dims != dst->opts.dims) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Attempted to convert a region into one with different dimensions.");
+	}
+	if (dst->opts.mode != CLOD_REGION_MODE_RDWR) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Attempted to convert into a read-only region.");
+	}
+	REGION_PUBLIC_ENTER(src);
+	REGION_PUBLIC_ENTER(dst);
+
+	const struct clod_region_convert_opts defaults = {0};
+	if (!opts) opts = &defaults;
+	const size_t procs = num_procs() > 0 ? (size_t)num_procs() : 1;
+	const size_t threads = opts->threads ? opts->threads : procs;
+
+	struct convert c = {
+		.src = src,
+		.dst = dst,
+		.opts = opts,
+		.batch_size = opts->batch_size ? opts->batch_size : CONVERT_BATCH_DEFAULT,
+		.result = CLOD_REGION_OK,
+	};
+	mutex_init(&c.mtx);
+
+	bool files_opened = false;
+	auto res = progress_open(&c);
+	const bool progress_opened = res == CLOD_REGION_OK;
+	if (res == CLOD_REGION_OK) {
+		res = region_files_open(&c.files, src);
+		files_opened = res == CLOD_REGION_OK;
+	}
+
+	struct convert_worker *ws = res == CLOD_REGION_OK ? calloc(threads, sizeof(ws[0])) : nullptr;
+	if (res == CLOD_REGION_OK) {
+		bool ok = ws != nullptr;
+		for (size_t i = 0; ok && i < threads; i++) {
+			ws[i].convert = &c;
+			ws[i].dctx = clod_decompressor_init();
+			ws[i].cctx = clod_compressor_init();
+			ws[i].buff = malloc(CONVERT_BUFFER_MIN);
+			ws[i].cap = CONVERT_BUFFER_MIN;
+			ok = ws[i].dctx && ws[i].cctx && ws[i].buff;
+		}
+		if (!ok) res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for conversion.");
+	}
+
+	if (res == CLOD_REGION_OK) {
+		size_t started = 0;
+		for (; started < threads; started++) {
+			if (!thread_create(&ws[started].t, convert_worker, &ws[started])) {
+				convert_stop(&c, region_error(CLOD_REGION_INVALID_USAGE, "Failed to start conversion thread."));
+				break;
+			}
+		}
+		for (size_t i = 0; i < started; i++) thread_join(ws[i].t);
+		res = c.result;
+	}
+
+	for (size_t i = 0; ws && i < threads; i++) {
+		if (ws[i].dctx) clod_decompressor_free(ws[i].dctx);
+		if (ws[i].cctx) clod_compressor_free(ws[i].cctx);
+		free(ws[i].buff);
+		free(ws[i].batch);
+	}
+	free(ws);
+	if (files_opened) region_files_close(&c.files);
+
+	// Progress is only forgotten once every file has been converted.
+	if (progress_opened) {
+		(void)file_close(c.progress);
+		if (res == CLOD_REGION_OK && !c.stopped) {
+			char name[REGION_FILENAME_MAX + 1];
+			snprintf(name, sizeof(name), "%s.%s", dst->opts.prefix, PROGRESS_EXT);
+			res = dir_unlink(dst->d, name);
+		}
+	}
+	free(c.done);
+	mutex_destroy(&c.mtx);
+
+	REGION_PUBLIC_LEAVE(dst);
+	REGION_PUBLIC_LEAVE(src);
+	return res;
+}
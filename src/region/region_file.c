@@ -1,19 +1,108 @@
 #include "region_impl.h"
 #include "region_file.h"
 #include "filename.h"
+#include "region_format/journal.h"
 #include "error.h"
 #include <stdlib.h>
+#include <string.h>
 
-enum clod_region_result region_file_open(const struct clod_region *r, struct region_file **rf_ptr, const int64_t *pos, const bool create) {
-	char filename[REGION_FILENAME_MAX + 1];
-	filename_make(filename, r->opts.prefix, r->opts.region_ext, pos, r->opts.dims);
+// Chunk files of a region file being recovered.
+struct recovery {
+	const struct clod_region *r;
+	const int64_t *region_pos;
+	// Chunks whose staged chunk file is left over from an undone change.
+	uint64_t undone[HEADER_CHUNKS / 64];
+};
+
+// A staged chunk file is renamed into place while the header is updated, so if it's still there, the change is undone
+// and the chunk file it replaced is put back. Otherwise the change is kept, and the replaced chunk file isn't needed.
+static bool recovery_placed(void *user, const uint32_t index, const bool old_external) {
+	struct recovery *rec = user;
+	auto const r = rec->r;
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+	chunk_pos(rec->region_pos, index, pos, r->opts.dims);
+
+	char filename[REGION_FILENAME_MAX + 1], staged[REGION_FILENAME_MAX + 1], kept[REGION_FILENAME_MAX + 1];
+	external_filename(r, filename, pos, "");
+	external_filename(r, staged, pos, EXTERNAL_STAGED);
+	external_filename(r, kept, pos, EXTERNAL_KEPT);
+	if (!dir_exists(r->d, staged)) {
+		(void)dir_unlink(r->d, kept);
+		return true;
+	}
 
+	if (old_external && dir_exists(r->d, kept)) (void)dir_rename(r->d, kept, filename);
+	rec->undone[index / 64] |= (uint64_t)1 << (index % 64);
+	return false;
+}
+
+enum clod_region_result region_file_recover(
+	const struct clod_region *r,
+	const file f,
+	const struct format *fmt,
+	const int64_t *region_pos
+) {
+	void *data;
+	size_t size;
+	(void)file_get(f, &data, &size);
+	struct recovery rec = { .r = r, .region_pos = region_pos, .undone = {0} };
+	if (!journal_recover(fmt, data, size, recovery_placed, &rec)) return CLOD_REGION_OK;
+
+	bool undone = false;
+	for (size_t i = 0; i < HEADER_CHUNKS / 64; i++) undone |= rec.undone[i] != 0;
+	auto res = undone ? dir_sync(r->d) : CLOD_REGION_OK;
+	if (res == CLOD_REGION_OK) res = file_sync(f);
+	if (res != CLOD_REGION_OK) return res;
+	journal_end(fmt, data);
+	if (!undone) return CLOD_REGION_OK;
+
+	// Staged chunk files decide what's undone for as long as the journal might be recovered again.
+	res = file_sync(f);
+	if (res != CLOD_REGION_OK) return res;
+	for (size_t i = 0; i < HEADER_CHUNKS; i++) {
+		if (!(rec.undone[i / 64] & (uint64_t)1 << (i % 64))) continue;
+		int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+		chunk_pos(region_pos, i, pos, r->opts.dims);
+		char staged[REGION_FILENAME_MAX + 1];
+		external_filename(r, staged, pos, EXTERNAL_STAGED);
+		(void)dir_unlink(r->d, staged);
+	}
+	return CLOD_REGION_OK;
+}
+
+int region_file_version(const struct clod_region_opts *opts) {
+	const struct format vanilla = { .version = HEADER_VERSION_COMPOUND };
+	return is_vanilla_compatible(opts) &&
+		opts->sector_size == HEADER_VANILLA_SECTOR_SIZE &&
+		format_compression_encode(&vanilla, opts->compression) != 0
+			? HEADER_VERSION_COMPOUND
+			: HEADER_VERSION_LIBCLOD;
+}
+
+// Open a region file and read its header, leaving its locks to be initialised.
+static enum clod_region_result region_file_load(
+	const struct clod_region *r,
+	struct region_file **rf_ptr,
+	const char *filename,
+	const int64_t *pos,
+	const bool create
+) {
 	file f;
 	auto const res = file_open(&f, r->d, filename, create, &r->opts);
 	if (res != CLOD_REGION_OK) {
 		return res;
 	}
 
+	void *data;
+	size_t size;
+	struct format fmt;
+	auto const get_res = file_get(f, &data, &size);
+	auto const fmt_res = get_res == CLOD_REGION_OK ? format_read(&fmt, data, size) : get_res;
+	if (fmt_res != CLOD_REGION_OK) {
+		file_close(f);
+		return fmt_res;
+	}
+
 	struct region_file *rf = malloc(sizeof(*rf));
 	if (!rf) {
 		region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for region file.");
@@ -21,16 +110,244 @@ enum clod_region_result region_file_open(const struct clod_region *r, struct reg
 		return CLOD_REGION_INVALID_USAGE;
 	}
 
-	rwmutex_init(&rf->mtx);
+	if (r->opts.mode == CLOD_REGION_MODE_RDWR) {
+		auto const recover_res = region_file_recover(r, f, &fmt, pos);
+		if (recover_res != CLOD_REGION_OK) {
+			free(rf);
+			file_close(f);
+			return recover_res;
+		}
+
+		if (!sectors_init(&rf->sectors, &fmt, data)) {
+			region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for region file sectors.");
+			free(rf);
+			file_close(f);
+			return CLOD_REGION_INVALID_USAGE;
+		}
+	} else {
+		memset(&rf->sectors, 0, sizeof(rf->sectors));
+	}
+
 	rf->f = f;
+	rf->fmt = fmt;
+	rf->seen = 0;
+	rf->synced = 0;
+	*rf_ptr = rf;
+	return CLOD_REGION_OK;
+}
+
+enum clod_region_result region_file_open(const struct clod_region *r, struct region_file **rf_ptr, const int64_t *pos, const bool create) {
+	char filename[REGION_FILENAME_MAX + 1];
+	filename_make(filename, r->opts.prefix, r->opts.region_ext, pos, r->opts.dims);
+
+	// Other processes are kept from writing while the header is read, and while a write one of them left is repaired.
+	struct shared_file *sf = r->shared ? shared_file_get(r->shared, pos, r->opts.dims) : nullptr;
+	const bool died = sf && shared_file_lock(sf, pos, r->opts.dims);
+	struct region_file *rf = nullptr;
+	auto const res = region_file_load(r, &rf, filename, pos, create);
+	if (sf && res == CLOD_REGION_OK) {
+		// Repairs are made by whoever opens the file, not only by writers that already had it open.
+		if (died && r->opts.mode == CLOD_REGION_MODE_RDWR) shared_file_changed(sf);
+		rf->seen = rf->synced = shared_file_generation(sf);
+	}
+	if (sf) shared_file_unlock(sf);
+	if (res != CLOD_REGION_OK) return res;
+
+	rbmutex_init(&rf->mtx);
+	for (size_t i = 0; i < REGION_FILE_STRIPES; i++) {
+		rwmutex_init(&rf->stripes[i]);
+		mutex_init(&rf->writers[i]);
+	}
+	mutex_init(&rf->sectors_mtx);
+	mutex_init(&rf->header_mtx);
+	rf->pins = 0;
+	for (size_t i = 0; i < HEADER_CHUNKS / 64; i++) rf->verified[i] = 0;
+	memcpy(rf->pos, pos, sizeof(pos[0]) * r->opts.dims);
+	rf->shared = sf;
+	mutex_init(&rf->refresh_mtx);
+	rf->stats = r->stats;
+	region_file_keep_header(r, rf);
 	*rf_ptr = rf;
 
 	return CLOD_REGION_OK;
 }
 
+void region_file_keep_header(const struct clod_region *r, struct region_file *rf) {
+	if (!(r->opts.map_flags & CLOD_REGION_MAP_LOCK_HEADERS) || rf->fmt.version == 0) return;
+	file_lock(rf->f, (size_t)rf->fmt.header_sectors * rf->fmt.sector_size);
+}
+
 enum clod_region_result region_file_close(struct region_file *f) {
-	rwmutex_destroy(&f->mtx);
+	rbmutex_destroy(&f->mtx);
+	for (size_t i = 0; i < REGION_FILE_STRIPES; i++) {
+		rwmutex_destroy(&f->stripes[i]);
+		mutex_destroy(&f->writers[i]);
+	}
+	mutex_destroy(&f->sectors_mtx);
+	mutex_destroy(&f->header_mtx);
+	mutex_destroy(&f->refresh_mtx);
+	sectors_destroy(&f->sectors);
 	auto const res = file_close(f->f);
 	free(f);
 	return res;
 }
+
+enum clod_region_result region_file_rdlock(struct clod_region *r, struct region_file **rf_ptr, const int64_t *pos) {
+	auto res = region_file_get(r, rf_ptr, pos, false);
+	if (res != CLOD_REGION_OK) return res;
+
+	auto const rf = *rf_ptr;
+	if (!rf->shared) {
+		region_file_lock_pinned(rf);
+		return CLOD_REGION_OK;
+	}
+
+	// A write another process is part way through is waited out, so what's read isn't half written.
+	if (shared_file_busy(rf->shared)) {
+		(void)shared_file_lock(rf->shared, rf->pos, r->opts.dims);
+		shared_file_unlock(rf->shared);
+	}
+	region_file_lock_pinned(rf);
+	res = region_file_refresh(r, rf);
+	if (res != CLOD_REGION_OK) rbmutex_rdunlock(&rf->mtx);
+	return res;
+}
+
+void region_file_lock_pinned(struct region_file *rf) {
+	// Waiting for the lock doesn't hold up anyone else, and once it's held the file can't be evicted.
+	if (!rbmutex_tryrdlock(&rf->mtx)) {
+		const uint64_t start = stats_clock();
+		rbmutex_rdlock(&rf->mtx);
+		stats_wait(rf->stats, STATS_WORD(file_lock_waits), STATS_WORD(file_lock_wait_ns), start);
+	}
+	rf->pins--;
+}
+
+enum clod_region_result region_file_upgrade(struct region_file *rf) {
+	// Pinned so it can't be evicted while unlocked.
+	rf->pins++;
+	rbmutex_rdunlock(&rf->mtx);
+	// A thread still holding the read lock, through a view, would wait for itself forever.
+	if (rbmutex_rdheld(&rf->mtx)) {
+		rbmutex_rdlock(&rf->mtx);
+		rf->pins--;
+		return region_error(CLOD_REGION_INVALID_USAGE, "Region file can't be changed while this thread holds a view of it.");
+	}
+	if (!rbmutex_trywrlock(&rf->mtx)) {
+		const uint64_t start = stats_clock();
+		rbmutex_wrlock(&rf->mtx);
+		stats_wait(rf->stats, STATS_WORD(file_lock_waits), STATS_WORD(file_lock_wait_ns), start);
+	}
+	rf->pins--;
+	return CLOD_REGION_OK;
+}
+
+void region_file_downgrade(struct region_file *rf) {
+	rf->pins++;
+	rbmutex_wrunlock(&rf->mtx);
+	region_file_lock_pinned(rf);
+}
+
+void region_file_stripes_rdlock(struct region_file *rf, const uint64_t stripes) {
+	for (size_t i = 0; i < REGION_FILE_STRIPES; i++) {
+		if (!(stripes & (uint64_t)1 << i) || rwmutex_tryrdlock(&rf->stripes[i])) continue;
+
+		const uint64_t start = stats_clock();
+		rwmutex_rdlock(&rf->stripes[i]);
+		stats_wait(rf->stats, STATS_WORD(stripe_lock_waits), STATS_WORD(stripe_lock_wait_ns), start);
+	}
+}
+
+void region_file_stripes_rdunlock(struct region_file *rf, const uint64_t stripes) {
+	for (size_t i = 0; i < REGION_FILE_STRIPES; i++) {
+		if (stripes & (uint64_t)1 << i) rwmutex_rdunlock(&rf->stripes[i]);
+	}
+}
+
+void region_file_stripes_wrlock(struct region_file *rf, const uint64_t stripes) {
+	for (size_t i = 0; i < REGION_FILE_STRIPES; i++) {
+		if (!(stripes & (uint64_t)1 << i) || rwmutex_trywrlock(&rf->stripes[i])) continue;
+
+		const uint64_t start = stats_clock();
+		rwmutex_wrlock(&rf->stripes[i]);
+		stats_wait(rf->stats, STATS_WORD(stripe_lock_waits), STATS_WORD(stripe_lock_wait_ns), start);
+	}
+}
+
+void region_file_stripes_wrunlock(struct region_file *rf, const uint64_t stripes) {
+	for (size_t i = 0; i < REGION_FILE_STRIPES; i++) {
+		if (stripes & (uint64_t)1 << i) rwmutex_wrunlock(&rf->stripes[i]);
+	}
+}
+
+void region_file_writers_lock(struct region_file *rf, const uint64_t stripes) {
+	for (size_t i = 0; i < REGION_FILE_STRIPES; i++) {
+		if (stripes & (uint64_t)1 << i) mutex_lock(&rf->writers[i]);
+	}
+}
+
+void region_file_writers_unlock(struct region_file *rf, const uint64_t stripes) {
+	for (size_t i = 0; i < REGION_FILE_STRIPES; i++) {
+		if (stripes & (uint64_t)1 << i) mutex_unlock(&rf->writers[i]);
+	}
+}
+
+struct located {
+	uint32_t offset;
+	uint16_t index;
+};
+
+static int located_cmp(const void *a, const void *b) {
+	const struct located *x = a, *y = b;
+	if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+size_t region_file_chunks(const struct region_file *rf, const void *map, uint16_t *indices) {
+	struct located located[HEADER_CHUNKS];
+	size_t n = 0;
+	for (size_t i = 0; i < HEADER_CHUNKS; i++) {
+		auto const location = format_location_get(&rf->fmt, map, i);
+		// Any location but none at all is listed, so reading the chunk reports what's wrong with it.
+		if (location.offset == 0 && location.sectors == 0) continue;
+		located[n++] = (struct located){ .offset = location.offset, .index = (uint16_t)i };
+	}
+
+	qsort(located, n, sizeof(located[0]), located_cmp);
+	for (size_t i = 0; i < n; i++) indices[i] = located[i].index;
+	return n;
+}
+
+enum clod_region_result region_files_open(struct region_files *files, const struct clod_region *r) {
+	auto const res = dir_iter_open(&files->iter, r->d);
+	if (res != CLOD_REGION_OK) return res;
+	files->opts = &r->opts;
+	files->done = false;
+	mutex_init(&files->mtx);
+	return CLOD_REGION_OK;
+}
+
+bool region_files_next(struct region_files *files, int64_t *region_pos) {
+	auto const opts = files->opts;
+	bool found = false;
+
+	mutex_lock(&files->mtx);
+	while (!found && !files->done) {
+		const char *name;
+		if (dir_iter_next(files->iter, &name) != CLOD_REGION_OK || !name) {
+			files->done = true;
+			break;
+		}
+
+		char filename[REGION_FILENAME_MAX + 1] = {0};
+		strncpy(filename, name, REGION_FILENAME_MAX);
+		found = filename_parse_pos(filename, opts->prefix, opts->region_ext, region_pos, opts->dims);
+	}
+	mutex_unlock(&files->mtx);
+	return found;
+}
+
+void region_files_close(struct region_files *files) {
+	mutex_destroy(&files->mtx);
+	(void)dir_iter_close(files->iter);
+}
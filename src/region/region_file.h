@@ -3,17 +3,169 @@
 
 #include <clod/region.h>
 #include "platform/platform.h"
+#include "region_format/format.h"
+#include "region_format/region_header.h"
+#include "sectors.h"
 
+// Chunks are split into this many stripes by index, each with its own locks.
+#define REGION_FILE_STRIPES 64
+
+/**
+ * Locks are taken in the order writers, the shared lock, mtx, stripes, then sectors_mtx or header_mtx.
+ * Stripes are taken in ascending order. refresh_mtx is only taken with mtx read locked, and nothing after it.
+ */
 struct region_file {
-	rwmutex mtx;
+	// Read locked to use the file, write locked to change its structure: creating the header or growing the file.
+	rbmutex mtx;
+	// Read locked to use chunks' locations and data, write locked to move a chunk.
+	rwmutex stripes[REGION_FILE_STRIPES];
+	// Held by the writer of chunks from before their new data is placed until their old data is released.
+	mutex writers[REGION_FILE_STRIPES];
+	// Held to allocate or free sectors.
+	mutex sectors_mtx;
+	// Held to change the header.
+	mutex header_mtx;
+	// Statistics of the region the file belongs to.
+	struct region_stats *stats;
+	// Files can't be evicted while pinned. Keeps the file open between finding it and locking it.
+	atomic int32_t pins;
 	file f;
+	struct format fmt;
+	// Only maintained when the region is writeable.
+	struct sectors sectors;
+	// Bit set of chunks checked against their checksum since the file was opened, for CLOD_REGION_VERIFY_FIRST.
+	atomic uint64_t verified[HEADER_CHUNKS / 64];
+
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+	// Shared state of the file when the region is shared between processes, or null.
+	struct shared_file *shared;
+	// Generation of the shared state that the mapping and header were last brought up to date with.
+	atomic uint64_t seen;
+	// Generation of the shared state that the free sectors were last rebuilt at. Only used with the shared lock held.
+	uint64_t synced;
+	// Held while growing the mapping to catch up with other processes, which only needs the read lock.
+	mutex refresh_mtx;
 };
 
+// Mask of the stripe a chunk belongs to.
+static inline uint64_t region_file_stripe(const size_t index) {
+	return (uint64_t)1 << (index % REGION_FILE_STRIPES);
+}
+
 // Close the region file. Only called by the file cache.
 enum clod_region_result region_file_close(struct region_file *f);
 // Open the region file. Only called by the file cache.
 enum clod_region_result region_file_open(const struct clod_region *r, struct region_file **rf_ptr, const int64_t *pos, bool create);
-// Get the region file for a given position. Should not be closed - the file cache handles file lifetime.
+// Header version a new region file is created with, which is vanilla compatible whenever opts allow it.
+int region_file_version(const struct clod_region_opts *opts);
+// Keep the header of the file in memory if opts.map_flags asks for it. Called again whenever the header is created or moved.
+void region_file_keep_header(const struct clod_region *r, struct region_file *rf);
+// Get and pin the region file for a given position. Should not be closed - the file cache handles file lifetime.
 enum clod_region_result region_file_get(struct clod_region *r, struct region_file **rf_ptr, const int64_t *pos, bool create);
+// Pin every open region file without counting it as used, so eviction carries on as if it weren't looked at.
+// The files are returned in an array the caller frees, once it has unpinned each one with region_file_lock_pinned.
+enum clod_region_result region_file_pin_open(struct clod_region *r, struct region_file ***rfs_ptr, size_t *count);
+// Get the region file for a given position and take its read lock. Released with rbmutex_rdunlock.
+enum clod_region_result region_file_rdlock(struct clod_region *r, struct region_file **rf_ptr, const int64_t *pos);
+// Take the read lock of a pinned file, then unpin it.
+void region_file_lock_pinned(struct region_file *rf);
+// Swap the held read lock of a file for its write lock. Anything read under the read lock must be checked again.
+// Fails, keeping the read lock, if the thread holds the read lock more than once, as it does while it holds a view.
+enum clod_region_result region_file_upgrade(struct region_file *rf);
+// Swap the held write lock of a file for its read lock.
+void region_file_downgrade(struct region_file *rf);
+
+// Read or write lock the stripes in a mask. Time spent waiting is counted in the region's statistics.
+void region_file_stripes_rdlock(struct region_file *rf, uint64_t stripes);
+void region_file_stripes_rdunlock(struct region_file *rf, uint64_t stripes);
+void region_file_stripes_wrlock(struct region_file *rf, uint64_t stripes);
+void region_file_stripes_wrunlock(struct region_file *rf, uint64_t stripes);
+// Take the writer locks of the stripes in a mask.
+void region_file_writers_lock(struct region_file *rf, uint64_t stripes);
+void region_file_writers_unlock(struct region_file *rf, uint64_t stripes);
+
+// List the chunks of a file in the order they are stored, given its mapping, and return how many there are.
+// The read lock must be held, and the chunks kept from moving by their stripes' read locks or writer locks.
+size_t region_file_chunks(const struct region_file *rf, const void *map, uint16_t *indices);
+
+// The region files in a directory, handed out one at a time to any number of threads.
+struct region_files {
+	const struct clod_region_opts *opts;
+	// Held to read the directory.
+	mutex mtx;
+	dir_iter iter;
+	bool done;
+};
+
+enum clod_region_result region_files_open(struct region_files *files, const struct clod_region *r);
+// Find the next region file in the directory. Returns false once there are none left.
+bool region_files_next(struct region_files *files, int64_t *region_pos);
+void region_files_close(struct region_files *files);
+
+// Bring the mapping and header of a file shared between processes up to date with writes made by the others.
+// The read lock must be held.
+enum clod_region_result region_file_refresh(const struct clod_region *r, struct region_file *rf);
+// Bring a file shared between processes up to date to write to, once its shared lock and read lock are held.
+// If died is set, a write that another process left unfinished is repaired first.
+enum clod_region_result region_file_shared_begin(const struct clod_region *r, struct region_file *rf, bool died);
+// Count a finished write to a file shared between processes. Its shared lock is still held.
+void region_file_shared_end(struct region_file *rf);
+// Finish or undo a write to the file at region_pos that was cut short, before anything relies on its header,
+// and put back the chunk files of the chunks it changed.
+enum clod_region_result region_file_recover(const struct clod_region *r, file f, const struct format *fmt, const int64_t *region_pos);
+
+// Open an empty temporary file to rewrite the region file at region_pos into.
+enum clod_region_result region_file_temp_open(struct clod_region *r, const int64_t *region_pos, file *f);
+// Finish rewriting a region file whose read lock and every writer lock are held, closing the temporary file f.
+// If keep is set and res is CLOD_REGION_OK, f is given the header fmt, synced and renamed over the region file.
+// Otherwise it's removed, and res is returned.
+enum clod_region_result region_file_swap(
+	struct clod_region *r,
+	struct region_file *rf,
+	const int64_t *region_pos,
+	file f,
+	const struct format *fmt,
+	bool keep,
+	enum clod_region_result res
+);
+
+// Wake the background compactor if a written file whose sectors_mtx is held has more unused space than the threshold.
+void compact_notify(struct clod_region *r, const struct region_file *rf);
+
+/**
+ * Readers of a shared file take no lock other processes see, so reads are checked like a seqlock's instead.
+ * A read starts from the generation its file's read lock was taken at, once the file was brought up to date,
+ * and is tried again if the generation changed by the time it's done, or was odd throughout with a writer still at work.
+ * Errors reported meanwhile are held with error_hold, and dropped if the read is tried again.
+ */
+static inline uint64_t region_file_read_begin(const struct region_file *rf) {
+	return rf->seen;
+}
+
+// Check if another process wrote to a shared file while a read of it was under way, in which case it's tried again,
+// whether or not it succeeded, as the chunk's sectors may have been given to another chunk meanwhile.
+static inline bool region_file_read_retry(const struct region_file *rf, const uint64_t seen) {
+	if (!rf->shared) return false;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	const uint64_t generation = shared_file_generation(rf->shared);
+	// A generation left odd by a writer that died stays that way until the write is repaired, and can be read as it is.
+	return generation != seen || ((generation & 1) && shared_file_busy(rf->shared));
+}
+
+// Get a view as clod_region_read_view does, setting seen to where reads of it begin from.
+// Data copied out of the view is only trusted once region_file_read_retry says the read needn't be tried again.
+enum clod_region_result region_read_view(struct clod_region *region, const int64_t *pos, struct clod_region_view *view, uint64_t *seen);
+
+// Get the region file a view was made from.
+struct region_file *view_region_file(const struct clod_region_view *view);
+
+// Copy chunk data and return its CRC-32. Each block is hashed straight after it's copied, while it's still in cache.
+uint32_t verify_copy(void *dst, const void *src, size_t size);
+// Check if a read of a chunk should be checked against its checksum, following opts.verify.
+bool verify_wanted(const struct clod_region *r, struct region_file *rf, size_t index, uint32_t checksum);
+// Compare a chunk's CRC-32 with its checksum, noting intact chunks so CLOD_REGION_VERIFY_FIRST doesn't check them again.
+enum clod_region_result verify_check(struct region_file *rf, size_t index, uint32_t checksum, uint32_t crc);
+// Forget that a chunk was checked, once it's rewritten.
+void verify_forget(struct region_file *rf, size_t index);
 
 #endif
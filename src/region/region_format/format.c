@@ -1,69 +1,421 @@
+#include "format.h"
 #include "region_header.h"
+#include "../error.h"
+#include <clod/hash.h>
 #include <clod/nbt.h>
-#include <clod/vmath.h>
+#include <inttypes.h>
 #include <string.h>
 #include <assert.h>
 
-static int header_version(const char *file, const char *file_end) {
-	assert(file_end > file);
+static int header_version(const char *file, const size_t file_size) {
+	if (file_size == 0) {
+		return 0;
+	}
 
-	if (file_end - file >= HEADER_LIBCLOD_SIZE_MIN) {
+	if (file_size >= HEADER_LIBCLOD_SIZE_MIN) {
 		if (strncmp(file, HEADER_MAGIC, strlen(HEADER_MAGIC)) == 0) {
 			return HEADER_VERSION_LIBCLOD;
 		}
 	}
 
-	if (file_end - file >= HEADER_VANILLA_SIZE + HEADER_LIBCLOD_SIZE_MIN) {
+	if (file_size >= HEADER_VANILLA_SIZE + HEADER_LIBCLOD_SIZE_MIN) {
 		if (strncmp(file + HEADER_VANILLA_SIZE, HEADER_MAGIC, strlen(HEADER_MAGIC)) == 0) {
 			return HEADER_VERSION_COMPOUND;
 		}
 	}
 
-	if (file_end - file >= HEADER_VANILLA_SIZE) {
+	if (file_size >= HEADER_VANILLA_SIZE) {
 		return HEADER_VERSION_VANILLA;
 	}
 
 	return -1;
 }
 
-static struct {
-	uint32_t nbt_checksum;
-	uint32_t nbt_size;
-	uint32_t generation;
-} read_libclod_header(char *libclod_header, const char *file_end) {
-	assert(file_end - libclod_header >= HEADER_LIBCLOD_SIZE_MIN);
-	assert(strncmp(libclod_header, HEADER_MAGIC, strlen(HEADER_MAGIC)) == 0);
+static enum clod_compression_method compression_decode(const int version, const uint8_t type) {
+	if (version == HEADER_VERSION_LIBCLOD) {
+		switch (type) {
+			case CLOD_UNCOMPRESSED:
+			case CLOD_GZIP:
+			case CLOD_ZLIB:
+			case CLOD_DEFLATE:
+			case CLOD_LZ4F:
+			case CLOD_XZ:
+			case CLOD_ZSTD:
+			case CLOD_BZIP2:
+			case CLOD_MINECRAFT_LZ4:
+				return (enum clod_compression_method)type;
+			default:
+				return 0;
+		}
+	}
+
+	switch (type) {
+		case CHUNK_VANILLA_GZIP: return CLOD_GZIP;
+		case CHUNK_VANILLA_ZLIB: return CLOD_ZLIB;
+		case CHUNK_VANILLA_UNCOMPRESSED: return CLOD_UNCOMPRESSED;
+		case CHUNK_VANILLA_LZ4: return CLOD_MINECRAFT_LZ4;
+		default: return 0;
+	}
+}
+
+// Find an array in a compound payload with one element for each chunk.
+// Returns the offset of the array data in the file, or 0 if it doesn't exist.
+static size_t nbt_chunk_array(const char *file, const char *compound, const char *end, const char *name, const char type) {
+	const char *tag = clod_nbt_compound_get(compound, end, CLOD_SSTR_C(name));
+	if (!tag || tag[0] != type) return 0;
+
+	const char *payload = clod_nbt_tag_payload(tag, end);
+	if (!payload || clod_nbt_payload_size(payload, end, type) == 0) return 0;
+	if (bei32_dec(payload) != HEADER_CHUNKS) return 0;
+
+	return (size_t)(payload + 4 - file);
+}
+
+static bool read_libclod(struct format *fmt, const char *file, const size_t file_size, const size_t base) {
+	const char *header = file + base;
+	const size_t nbt_size = beu32_dec(header + HEADER_LIBCLOD_NBT_SIZE);
+	if (nbt_size == 0 || file_size - base - HEADER_LIBCLOD_NBT < nbt_size) return false;
 
+	const char *nbt = header + HEADER_LIBCLOD_NBT;
+	const char *end = nbt + nbt_size;
+	// The checksum is stale while a write is applied, and is fixed by journal_recover.
+	const bool updating = beu32_dec(header + HEADER_LIBCLOD_GENERATION) & 1;
+	if (!updating && clod_crc32(nbt, nbt_size) != beu32_dec(header + HEADER_LIBCLOD_CHECKSUM)) return false;
+
+	if (nbt[0] != CLOD_NBT_COMPOUND) return false;
+	const char *root = clod_nbt_tag_payload(nbt, end);
+	if (!root || clod_nbt_payload_size(root, end, CLOD_NBT_COMPOUND) == 0) return false;
+
+	const char *chunks = clod_nbt_compound_get(root, end, CLOD_SSTR_C("Chunks"));
+	if (!chunks || chunks[0] != CLOD_NBT_COMPOUND) return false;
+	chunks = clod_nbt_tag_payload(chunks, end);
+	if (!chunks) return false;
+
+	fmt->libclod = base;
+	// Headers written before the uncompressed size and checksum were recorded don't have them.
+	fmt->uncompressed_size = nbt_chunk_array(file, chunks, end, "UncompressedSize", CLOD_NBT_INT32_ARRAY);
+	fmt->checksum = nbt_chunk_array(file, chunks, end, "Checksum", CLOD_NBT_INT32_ARRAY);
+
+	if (base != 0) {
+		// Compound headers keep locations and timestamps in the vanilla header.
+		return true;
+	}
+
+	const char *sector_size = clod_nbt_compound_get(root, end, CLOD_SSTR_C("SectorSize"));
+	if (!sector_size || sector_size[0] != CLOD_NBT_INT32) return false;
+	sector_size = clod_nbt_tag_payload(sector_size, end);
+	if (!sector_size || end - sector_size < 4) return false;
+	fmt->sector_size = beu32_dec(sector_size);
+	if (fmt->sector_size == 0) return false;
+
+	fmt->file_offset = nbt_chunk_array(file, chunks, end, "FileOffset", CLOD_NBT_INT32_ARRAY);
+	fmt->file_sectors = nbt_chunk_array(file, chunks, end, "FileSectors", CLOD_NBT_INT8_ARRAY);
+	fmt->modification_time = nbt_chunk_array(file, chunks, end, "ModificationTime", CLOD_NBT_INT32_ARRAY);
+	return fmt->file_offset && fmt->file_sectors && fmt->modification_time;
 }
 
-struct format_chunk_get {
-	size_t chunk_offset;
-	size_t chunk_size;
-} format_chunk_get(char *file, const char *const file_end, int64_t *pos, uint8_t dims) {
-	size_t chunk_index = vec_group(pos, dims, 10);
+enum clod_region_result format_read(struct format *fmt, const char *file, const size_t file_size) {
+	memset(fmt, 0, sizeof(*fmt));
+	fmt->version = header_version(file, file_size);
+
+	switch (fmt->version) {
+		case 0:
+			return CLOD_REGION_OK;
+		case HEADER_VERSION_VANILLA:
+			fmt->sector_size = HEADER_VANILLA_SECTOR_SIZE;
+			fmt->header_sectors = HEADER_VANILLA_SIZE / HEADER_VANILLA_SECTOR_SIZE;
+			fmt->offset_max = BEU24_MAX;
+			return CLOD_REGION_OK;
+		case HEADER_VERSION_COMPOUND:
+			fmt->sector_size = HEADER_VANILLA_SECTOR_SIZE;
+			fmt->offset_max = BEU24_MAX;
+			if (!read_libclod(fmt, file, file_size, HEADER_VANILLA_SIZE)) {
+				// The libclod header was overwritten by something that doesn't understand it.
+				fmt->version = HEADER_VERSION_VANILLA;
+				fmt->libclod = 0;
+				fmt->uncompressed_size = 0;
+				fmt->checksum = 0;
+				fmt->header_sectors = HEADER_VANILLA_SIZE / HEADER_VANILLA_SECTOR_SIZE;
+				return CLOD_REGION_OK;
+			}
+			break;
+		case HEADER_VERSION_LIBCLOD:
+			fmt->offset_max = BEI32_MAX;
+			if (!read_libclod(fmt, file, file_size, 0)) {
+				return region_error(CLOD_REGION_MALFORMED, "Region file has a corrupted libclod header.");
+			}
+			break;
+		default:
+			return region_error(CLOD_REGION_MALFORMED, "Region file is too small to hold a header.");
+	}
+
+	size_t header_end = fmt->libclod + HEADER_LIBCLOD_NBT + beu32_dec(file + fmt->libclod + HEADER_LIBCLOD_NBT_SIZE);
+	if (header_end < fmt->libclod + HEADER_LIBCLOD_SIZE) header_end = fmt->libclod + HEADER_LIBCLOD_SIZE;
+	fmt->header_sectors = (uint32_t)((header_end + fmt->sector_size - 1) / fmt->sector_size);
+	return CLOD_REGION_OK;
+}
 
-	switch (header_version(file, file_end)) {
-		case HEADER_VERSION_VANILLA: {
-			return (struct format_chunk_get){
-				.chunk_offset = (size_t)beu24_dec(file + chunk_index * 4) * HEADER_VANILLA_SECTOR_SIZE,
-				.chunk_size = (size_t)beu8_dec(file + chunk_index * 4 + 3) * HEADER_VANILLA_SECTOR_SIZE
+struct format_location format_location_get(const struct format *fmt, const char *file, const size_t index) {
+	assert(index < HEADER_CHUNKS);
+
+	switch (fmt->version) {
+		case HEADER_VERSION_VANILLA:
+		case HEADER_VERSION_COMPOUND: {
+			const char *location = file + HEADER_VANILLA_LOCATIONS + index * 4;
+			return (struct format_location){
+				.offset = beu24_dec(location),
+				.sectors = beu8_dec(location + 3)
 			};
 		}
-		case HEADER_VERSION_COMPOUND: {
-			return (struct format_chunk_get){
-				.chunk_offset = (size_t)beu24_dec(file + chunk_index * 4) * HEADER_VANILLA_SECTOR_SIZE,
-				.chunk_size = (size_t)beu8_dec(file + chunk_index * 4 + 3) * HEADER_VANILLA_SECTOR_SIZE
+		case HEADER_VERSION_LIBCLOD: {
+			return (struct format_location){
+				.offset = beu32_dec(file + fmt->file_offset + index * 4),
+				.sectors = beu8_dec(file + fmt->file_sectors + index)
 			};
 		}
+		default:
+			return (struct format_location){ .offset = 0, .sectors = 0 };
+	}
+}
+
+void format_location_set(const struct format *fmt, char *file, const size_t index, const struct format_location location) {
+	assert(index < HEADER_CHUNKS);
+	assert(location.offset <= fmt->offset_max);
+	assert(location.sectors <= CHUNK_SECTORS_MAX);
+
+	switch (fmt->version) {
+		case HEADER_VERSION_VANILLA:
+		case HEADER_VERSION_COMPOUND: {
+			char *entry = file + HEADER_VANILLA_LOCATIONS + index * 4;
+			beu24_enc(entry, location.offset);
+			beu8_enc(entry + 3, (uint8_t)location.sectors);
+			return;
+		}
 		case HEADER_VERSION_LIBCLOD: {
-			char *nbt = get_nbt_root();
+			beu32_enc(file + fmt->file_offset + index * 4, location.offset);
+			beu8_enc(file + fmt->file_sectors + index, (uint8_t)location.sectors);
+			return;
 		}
+		default:
+			assert(false);
 	}
+}
 
+uint32_t format_mtime_get(const struct format *fmt, const char *file, const size_t index) {
+	assert(index < HEADER_CHUNKS);
 
+	switch (fmt->version) {
+		case HEADER_VERSION_VANILLA:
+		case HEADER_VERSION_COMPOUND:
+			return beu32_dec(file + HEADER_VANILLA_TIMESTAMPS + index * 4);
+		case HEADER_VERSION_LIBCLOD:
+			return beu32_dec(file + fmt->modification_time + index * 4);
+		default:
+			return 0;
+	}
+}
+
+void format_mtime_set(const struct format *fmt, char *file, const size_t index, const uint32_t mtime) {
+	assert(index < HEADER_CHUNKS);
+
+	switch (fmt->version) {
+		case HEADER_VERSION_VANILLA:
+		case HEADER_VERSION_COMPOUND:
+			beu32_enc(file + HEADER_VANILLA_TIMESTAMPS + index * 4, mtime);
+			return;
+		case HEADER_VERSION_LIBCLOD:
+			beu32_enc(file + fmt->modification_time + index * 4, mtime);
+			return;
+		default:
+			assert(false);
+	}
 }
 
-bool format_chunk_set(struct format *fmt, int64_t *pos) {
-	return false;
+uint32_t format_uncompressed_get(const struct format *fmt, const char *file, const size_t index) {
+	assert(index < HEADER_CHUNKS);
+	if (!fmt->uncompressed_size) return 0;
+	return beu32_dec(file + fmt->uncompressed_size + index * 4);
 }
 
+void format_uncompressed_set(const struct format *fmt, char *file, const size_t index, const size_t size) {
+	assert(index < HEADER_CHUNKS);
+	if (!fmt->uncompressed_size) return;
+	beu32_enc(file + fmt->uncompressed_size + index * 4, size <= UINT32_MAX ? (uint32_t)size : 0);
+}
+
+uint32_t format_checksum_get(const struct format *fmt, const char *file, const size_t index) {
+	assert(index < HEADER_CHUNKS);
+	if (!fmt->checksum) return 0;
+	return beu32_dec(file + fmt->checksum + index * 4);
+}
+
+void format_checksum_set(const struct format *fmt, char *file, const size_t index, const uint32_t checksum) {
+	assert(index < HEADER_CHUNKS);
+	if (!fmt->checksum) return;
+	beu32_enc(file + fmt->checksum + index * 4, checksum);
+}
+
+enum clod_region_result format_chunk_locate(
+	const struct format *fmt,
+	const char *file, const size_t file_size,
+	const size_t index,
+	struct format_location *location
+) {
+	*location = format_location_get(fmt, file, index);
+	if (location->offset == 0 && location->sectors == 0) {
+		return CLOD_REGION_NOT_FOUND;
+	}
+
+	if (location->offset < fmt->header_sectors || location->sectors == 0) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk %zu has invalid location %"PRIu32"+%"PRIu32".",
+			index, location->offset, location->sectors);
+	}
+
+	const size_t offset = (size_t)location->offset * fmt->sector_size;
+	if (offset > file_size || file_size - offset < CHUNK_HEADER_SIZE) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk %zu is located past the end of the file.", index);
+	}
+	return CLOD_REGION_OK;
+}
+
+enum clod_region_result format_chunk_parse(
+	const struct format *fmt,
+	const size_t index,
+	const struct format_location location,
+	const char *data, const size_t size,
+	struct format_chunk *chunk
+) {
+	if (size < CHUNK_HEADER_SIZE) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk %zu is located past the end of the file.", index);
+	}
+
+	const size_t length = beu32_dec(data);
+	if (length == 0 || length > size - 4) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk %zu has invalid size %zu.", index, length);
+	}
+
+	const uint8_t type = beu8_dec(data + 4);
+	chunk->location = location;
+	chunk->external = (type & CHUNK_EXTERNAL) != 0;
+	chunk->compression = compression_decode(fmt->version, (uint8_t)(type & ~CHUNK_EXTERNAL));
+	if (chunk->compression == 0) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk %zu has unknown compression type %d.", index, type);
+	}
+
+	chunk->data = chunk->external ? nullptr : data + CHUNK_HEADER_SIZE;
+	chunk->size = chunk->external ? 0 : length - 1;
+	chunk->uncompressed_size = 0;
+	chunk->checksum = 0;
+	return CLOD_REGION_OK;
+}
+
+enum clod_region_result format_chunk_get(
+	const struct format *fmt,
+	const char *file, const size_t file_size,
+	const size_t index,
+	struct format_chunk *chunk
+) {
+	struct format_location location;
+	auto res = format_chunk_locate(fmt, file, file_size, index, &location);
+	if (res != CLOD_REGION_OK) return res;
+
+	const size_t offset = (size_t)location.offset * fmt->sector_size;
+	const size_t stored = (size_t)location.sectors * fmt->sector_size;
+	const size_t size = file_size - offset < stored ? file_size - offset : stored;
+	res = format_chunk_parse(fmt, index, location, file + offset, size, chunk);
+	if (res != CLOD_REGION_OK) return res;
+	chunk->uncompressed_size = format_uncompressed_get(fmt, file, index);
+	chunk->checksum = format_checksum_get(fmt, file, index);
+	return CLOD_REGION_OK;
+}
+
+uint8_t format_compression_encode(const struct format *fmt, const enum clod_compression_method compression) {
+	if (fmt->version == HEADER_VERSION_LIBCLOD) {
+		return compression_decode(fmt->version, (uint8_t)compression) == compression ? (uint8_t)compression : 0;
+	}
+
+	switch (compression) {
+		case CLOD_GZIP: return CHUNK_VANILLA_GZIP;
+		case CLOD_ZLIB: return CHUNK_VANILLA_ZLIB;
+		case CLOD_UNCOMPRESSED: return CHUNK_VANILLA_UNCOMPRESSED;
+		case CLOD_MINECRAFT_LZ4: return CHUNK_VANILLA_LZ4;
+		default: return 0;
+	}
+}
+
+static char *nbt_put_tag(char *p, const char type, const char *name) {
+	const size_t len = strlen(name);
+	p[0] = type;
+	beu16_enc(p + 1, (uint16_t)len);
+	memcpy(p + 3, name, len);
+	return p + 3 + len;
+}
+
+static char *nbt_put_string(char *p, const char *name, const char *value) {
+	const size_t len = strlen(value);
+	p = nbt_put_tag(p, CLOD_NBT_STRING, name);
+	beu16_enc(p, (uint16_t)len);
+	memcpy(p + 2, value, len);
+	return p + 2 + len;
+}
+
+static char *nbt_put_chunk_array(char *p, const char *name, const char type, const size_t element_size) {
+	p = nbt_put_tag(p, type, name);
+	bei32_enc(p, HEADER_CHUNKS);
+	memset(p + 4, 0, HEADER_CHUNKS * element_size);
+	return p + 4 + HEADER_CHUNKS * element_size;
+}
+
+size_t format_create_size(const int version, const uint32_t sector_size) {
+	const size_t size = version == HEADER_VERSION_COMPOUND
+		? HEADER_VANILLA_SIZE + HEADER_LIBCLOD_SIZE
+		: HEADER_LIBCLOD_SIZE;
+	return (size + sector_size - 1) / sector_size * sector_size;
+}
+
+void format_create(struct format *fmt, char *file, const size_t file_size, const int version, const struct clod_region_opts *opts) {
+	assert(version == HEADER_VERSION_LIBCLOD || version == HEADER_VERSION_COMPOUND);
+	assert(file_size >= format_create_size(version, opts->sector_size));
+
+	const bool compound = version == HEADER_VERSION_COMPOUND;
+	char *header = file + (compound ? HEADER_VANILLA_SIZE : 0);
+	memset(file, 0, format_create_size(version, opts->sector_size));
+	memcpy(header, HEADER_MAGIC, strlen(HEADER_MAGIC));
+
+	char *nbt = header + HEADER_LIBCLOD_NBT;
+	char *p = nbt_put_tag(nbt, CLOD_NBT_COMPOUND, "");
+	p = nbt_put_string(p, "ChunkFilePrefix", CHUNK_FILE_PREFIX);
+	// Chunk files are written with the region's chunk extension, which vanilla compatible regions can set too.
+	p = nbt_put_string(p, "ChunkFileExtension", opts->chunk_ext);
+	p = nbt_put_tag(p, CLOD_NBT_INT8, "Dimensions");
+	beu8_enc(p++, (uint8_t)(compound ? 2 : opts->dims));
+	p = nbt_put_tag(p, CLOD_NBT_INT32, "SectorSize");
+	beu32_enc(p, compound ? HEADER_VANILLA_SECTOR_SIZE : opts->sector_size);
+	p += 4;
+
+	p = nbt_put_tag(p, CLOD_NBT_COMPOUND, "Chunks");
+	if (!compound) {
+		p = nbt_put_chunk_array(p, "ModificationTime", CLOD_NBT_INT32_ARRAY, 4);
+		p = nbt_put_chunk_array(p, "FileOffset", CLOD_NBT_INT32_ARRAY, 4);
+		p = nbt_put_chunk_array(p, "FileSectors", CLOD_NBT_INT8_ARRAY, 1);
+	}
+	p = nbt_put_chunk_array(p, "UncompressedSize", CLOD_NBT_INT32_ARRAY, 4);
+	p = nbt_put_chunk_array(p, "Checksum", CLOD_NBT_INT32_ARRAY, 4);
+	*p++ = CLOD_NBT_ZERO;
+	*p++ = CLOD_NBT_ZERO;
+
+	assert(p - header <= HEADER_LIBCLOD_SIZE);
+	beu32_enc(header + HEADER_LIBCLOD_NBT_SIZE, (uint32_t)(p - nbt));
+	beu32_enc(header + HEADER_LIBCLOD_CHECKSUM, clod_crc32(nbt, (size_t)(p - nbt)));
+
+	[[maybe_unused]] auto const res = format_read(fmt, file, file_size);
+	assert(res == CLOD_REGION_OK && fmt->version == version);
+}
+
+void format_commit(const struct format *fmt, char *file) {
+	if (fmt->version != HEADER_VERSION_LIBCLOD && fmt->version != HEADER_VERSION_COMPOUND) return;
+
+	char *header = file + fmt->libclod;
+	const size_t nbt_size = beu32_dec(header + HEADER_LIBCLOD_NBT_SIZE);
+	beu32_enc(header + HEADER_LIBCLOD_CHECKSUM, clod_crc32(header + HEADER_LIBCLOD_NBT, nbt_size));
+}
@@ -1,4 +1,161 @@
 #ifndef CLOD_REGION_FORMAT_H
 #define CLOD_REGION_FORMAT_H
 
+#include <clod/compression.h>
+#include <clod/region.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Layout of a region file's header.
+ * Only offsets are stored as the file's mapping can move.
+ */
+struct format {
+	// HEADER_VERSION_*, or 0 if the file is empty.
+	int version;
+	// Size of sectors in bytes.
+	uint32_t sector_size;
+	// Number of sectors at the start of the file reserved for the header.
+	uint32_t header_sectors;
+	// Largest sector offset the header can store.
+	uint32_t offset_max;
+
+	// Offset of the libclod header, if there is one.
+	size_t libclod;
+	// Offsets of the FileOffset, FileSectors and ModificationTime array data in a libclod header.
+	size_t file_offset;
+	size_t file_sectors;
+	size_t modification_time;
+	// Offsets of the UncompressedSize and Checksum array data, or 0 if the header doesn't have them.
+	size_t uncompressed_size;
+	size_t checksum;
+};
+
+struct format_location {
+	// Offset of the chunk in sectors.
+	uint32_t offset;
+	// Size of the chunk in sectors.
+	uint32_t sectors;
+};
+
+struct format_chunk {
+	// Location of the chunk data.
+	struct format_location location;
+	// Stored chunk data. Null if the chunk is external.
+	const char *data;
+	// Size of the stored chunk data.
+	size_t size;
+	// Compression used for the chunk data.
+	enum clod_compression_method compression;
+	// Size of the chunk data once decompressed, or 0 if it isn't known.
+	size_t uncompressed_size;
+	// CRC-32 of the stored chunk data, or 0 if it doesn't have one.
+	uint32_t checksum;
+	// If the chunk data is stored in a dedicated file.
+	bool external;
+};
+
+/**
+ * Read the header of a region file.
+ */
+enum clod_region_result format_read(struct format *fmt, const char *file, size_t file_size);
+
+/**
+ * Get the location of a chunk.
+ * A location with zero sectors means the chunk doesn't exist.
+ */
+struct format_location format_location_get(const struct format *fmt, const char *file, size_t index);
+
+/**
+ * Set the location of a chunk.
+ */
+void format_location_set(const struct format *fmt, char *file, size_t index, struct format_location location);
+
+/**
+ * Get the last modification time of a chunk in unix epoch seconds.
+ */
+uint32_t format_mtime_get(const struct format *fmt, const char *file, size_t index);
+
+/**
+ * Set the last modification time of a chunk in unix epoch seconds.
+ */
+void format_mtime_set(const struct format *fmt, char *file, size_t index, uint32_t mtime);
+
+/**
+ * Get the size of a chunk's data once decompressed, or 0 if it isn't known.
+ * Vanilla headers, and libclod headers written before the size was recorded, don't know it.
+ */
+uint32_t format_uncompressed_get(const struct format *fmt, const char *file, size_t index);
+
+/**
+ * Set the size of a chunk's data once decompressed.
+ * Does nothing if the header can't store it. Sizes that don't fit are stored as 0, meaning unknown.
+ */
+void format_uncompressed_set(const struct format *fmt, char *file, size_t index, size_t size);
+
+/**
+ * Get the CRC-32 of a chunk's stored data, or 0 if it doesn't have one.
+ */
+uint32_t format_checksum_get(const struct format *fmt, const char *file, size_t index);
+
+/**
+ * Set the CRC-32 of a chunk's stored data. Does nothing if the header can't store it.
+ */
+void format_checksum_set(const struct format *fmt, char *file, size_t index, uint32_t checksum);
+
+/**
+ * Get the location of a chunk, checking that it lies within the file.
+ */
+enum clod_region_result format_chunk_locate(
+	const struct format *fmt,
+	const char *file, size_t file_size,
+	size_t index,
+	struct format_location *location
+);
+
+/**
+ * Parse stored chunk data read from the chunk's location.
+ * \p data points to the first sector of the chunk, and \p size is the number of bytes read from there.
+ * The uncompressed size and checksum aren't stored with the data, so they're left as 0.
+ */
+enum clod_region_result format_chunk_parse(
+	const struct format *fmt,
+	size_t index,
+	struct format_location location,
+	const char *data, size_t size,
+	struct format_chunk *chunk
+);
+
+/**
+ * Get the stored data of a chunk.
+ */
+enum clod_region_result format_chunk_get(
+	const struct format *fmt,
+	const char *file, size_t file_size,
+	size_t index,
+	struct format_chunk *chunk
+);
+
+/**
+ * Get the compression type byte stored with chunk data.
+ * Returns 0 if the header version can't store the compression method.
+ */
+uint8_t format_compression_encode(const struct format *fmt, enum clod_compression_method compression);
+
+/**
+ * Get the size of the header created by format_create.
+ */
+size_t format_create_size(int version, uint32_t sector_size);
+
+/**
+ * Write a new header to an empty file.
+ * \p file_size must be at least format_create_size.
+ */
+void format_create(struct format *fmt, char *file, size_t file_size, int version, const struct clod_region_opts *opts);
+
+/**
+ * Update the header checksum after the header was modified.
+ */
+void format_commit(const struct format *fmt, char *file);
+
 #endif
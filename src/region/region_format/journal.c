@@ -0,0 +1,150 @@
+#include "journal.h"
+#include "region_header.h"
+#include <clod/hash.h>
+
+bool journal_supported(const struct format *fmt) {
+	return fmt->version == HEADER_VERSION_LIBCLOD || fmt->version == HEADER_VERSION_COMPOUND;
+}
+
+size_t journal_size(const size_t count) {
+	return JOURNAL_ENTRIES + count * JOURNAL_ENTRY_SIZE;
+}
+
+void journal_begin(
+	const struct format *fmt,
+	char *file,
+	const uint32_t offset,
+	const struct journal_entry *entries,
+	const size_t count
+) {
+	char *header = file + fmt->libclod;
+	char *journal = file + (size_t)offset * fmt->sector_size;
+	const uint32_t generation = (beu32_dec(header + HEADER_LIBCLOD_GENERATION) + 1) | 1;
+
+	beu32_enc(journal + JOURNAL_GENERATION, generation);
+	beu32_enc(journal + JOURNAL_COUNT, (uint32_t)count);
+	for (size_t i = 0; i < count; i++) {
+		auto const e = &entries[i];
+		char *entry = journal + JOURNAL_ENTRIES + i * JOURNAL_ENTRY_SIZE;
+		beu32_enc(entry, e->index);
+		beu32_enc(entry + 4, e->old_location.offset);
+		beu32_enc(entry + 8, e->old_location.sectors);
+		beu32_enc(entry + 12, e->old_mtime);
+		beu32_enc(entry + 16, e->old_uncompressed_size);
+		beu32_enc(entry + 20, e->old_checksum);
+		beu32_enc(entry + 24, e->new_location.offset);
+		beu32_enc(entry + 28, e->new_location.sectors);
+		beu32_enc(entry + 32, e->new_mtime);
+		beu32_enc(entry + 36, e->new_uncompressed_size);
+		beu32_enc(entry + 40, e->new_checksum);
+	}
+
+	const size_t size = journal_size(count);
+	beu32_enc(journal + JOURNAL_CHECKSUM, clod_crc32(journal + JOURNAL_GENERATION, size - JOURNAL_GENERATION));
+
+	beu32_enc(header + HEADER_LIBCLOD_JOURNAL_OFFSET, offset);
+	beu32_enc(header + HEADER_LIBCLOD_JOURNAL_SIZE, (uint32_t)size);
+	beu32_enc(header + HEADER_LIBCLOD_GENERATION, generation);
+}
+
+void journal_end(const struct format *fmt, char *file) {
+	char *header = file + fmt->libclod;
+	beu32_enc(header + HEADER_LIBCLOD_GENERATION, beu32_dec(header + HEADER_LIBCLOD_GENERATION) + 1);
+	beu32_enc(header + HEADER_LIBCLOD_JOURNAL_OFFSET, 0);
+	beu32_enc(header + HEADER_LIBCLOD_JOURNAL_SIZE, 0);
+}
+
+// Parse the chunk a location points to, if the location is within the file.
+static bool chunk_at(
+	const struct format *fmt,
+	const char *file, const size_t file_size,
+	const uint32_t index,
+	const struct format_location location,
+	struct format_chunk *chunk
+) {
+	if (location.offset < fmt->header_sectors || location.offset > fmt->offset_max) return false;
+	if (location.sectors == 0 || location.sectors > CHUNK_SECTORS_MAX) return false;
+
+	const size_t offset = (size_t)location.offset * fmt->sector_size;
+	const size_t stored = (size_t)location.sectors * fmt->sector_size;
+	if (offset > file_size || file_size - offset < stored) return false;
+	return format_chunk_parse(fmt, index, location, file + offset, stored, chunk) == CLOD_REGION_OK;
+}
+
+// Check that the chunk data a change points to was written in full, against its checksum if it has one.
+static bool entry_intact(
+	const struct format *fmt,
+	const char *file, const size_t file_size,
+	const struct journal_entry *e,
+	const journal_placed placed, void *user
+) {
+	if (e->new_location.sectors == 0) return e->new_location.offset == 0;
+
+	struct format_chunk chunk;
+	if (!chunk_at(fmt, file, file_size, e->index, e->new_location, &chunk)) return false;
+	if (chunk.external) {
+		// Chunk files are put in place while the header is updated, so only the caller can tell if this one was.
+		struct format_chunk old;
+		const bool old_external = chunk_at(fmt, file, file_size, e->index, e->old_location, &old) && old.external;
+		return placed(user, e->index, old_external);
+	}
+	// The chunk header can reach the disk without the rest of the data, which only the checksum catches.
+	return e->new_checksum == 0 || clod_crc32(chunk.data, chunk.size) == e->new_checksum;
+}
+
+bool journal_recover(
+	const struct format *fmt,
+	char *file, const size_t file_size,
+	const journal_placed placed, void *user
+) {
+	if (!journal_supported(fmt)) return false;
+
+	const char *header = file + fmt->libclod;
+	const uint32_t generation = beu32_dec(header + HEADER_LIBCLOD_GENERATION);
+	if ((generation & 1) == 0) return false;
+
+	// A journal that wasn't written in full means the header wasn't changed yet.
+	const size_t offset = (size_t)beu32_dec(header + HEADER_LIBCLOD_JOURNAL_OFFSET) * fmt->sector_size;
+	const size_t size = beu32_dec(header + HEADER_LIBCLOD_JOURNAL_SIZE);
+	const char *journal = file + offset;
+	const bool valid =
+		offset >= (size_t)fmt->header_sectors * fmt->sector_size &&
+		offset <= file_size && file_size - offset >= size && size >= JOURNAL_ENTRIES &&
+		beu32_dec(journal + JOURNAL_GENERATION) == generation &&
+		beu32_dec(journal + JOURNAL_COUNT) <= HEADER_CHUNKS &&
+		journal_size(beu32_dec(journal + JOURNAL_COUNT)) == size &&
+		clod_crc32(journal + JOURNAL_GENERATION, size - JOURNAL_GENERATION) == beu32_dec(journal + JOURNAL_CHECKSUM);
+
+	const size_t count = valid ? beu32_dec(journal + JOURNAL_COUNT) : 0;
+	for (size_t i = 0; i < count; i++) {
+		const char *entry = journal + JOURNAL_ENTRIES + i * JOURNAL_ENTRY_SIZE;
+		const struct journal_entry e = {
+			.index = beu32_dec(entry),
+			.old_location = { .offset = beu32_dec(entry + 4), .sectors = beu32_dec(entry + 8) },
+			.old_mtime = beu32_dec(entry + 12),
+			.old_uncompressed_size = beu32_dec(entry + 16),
+			.old_checksum = beu32_dec(entry + 20),
+			.new_location = { .offset = beu32_dec(entry + 24), .sectors = beu32_dec(entry + 28) },
+			.new_mtime = beu32_dec(entry + 32),
+			.new_uncompressed_size = beu32_dec(entry + 36),
+			.new_checksum = beu32_dec(entry + 40),
+		};
+		if (e.index >= HEADER_CHUNKS) continue;
+
+		// The old chunk's sectors aren't released until the update ends, so it's still intact.
+		if (entry_intact(fmt, file, file_size, &e, placed, user)) {
+			format_location_set(fmt, file, e.index, e.new_location);
+			format_mtime_set(fmt, file, e.index, e.new_mtime);
+			format_uncompressed_set(fmt, file, e.index, e.new_uncompressed_size);
+			format_checksum_set(fmt, file, e.index, e.new_checksum);
+		} else if (e.old_location.offset <= fmt->offset_max && e.old_location.sectors <= CHUNK_SECTORS_MAX) {
+			format_location_set(fmt, file, e.index, e.old_location);
+			format_mtime_set(fmt, file, e.index, e.old_mtime);
+			format_uncompressed_set(fmt, file, e.index, e.old_uncompressed_size);
+			format_checksum_set(fmt, file, e.index, e.old_checksum);
+		}
+	}
+
+	format_commit(fmt, file);
+	return true;
+}
@@ -0,0 +1,62 @@
+#ifndef CLOD_REGION_JOURNAL_H
+#define CLOD_REGION_JOURNAL_H
+
+#include "format.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Header changes are written to a journal in free sectors before they are applied,
+ * and the header's generation is odd while they are applied.
+ * A file found with an odd generation was left part way through an update,
+ * and journal_recover finishes or undoes each change in the journal.
+ *
+ * Only headers with a libclod header have a generation, so vanilla files aren't journaled.
+ */
+struct journal_entry {
+	uint32_t index;
+	struct format_location old_location;
+	uint32_t old_mtime;
+	uint32_t old_uncompressed_size;
+	uint32_t old_checksum;
+	struct format_location new_location;
+	uint32_t new_mtime;
+	uint32_t new_uncompressed_size;
+	uint32_t new_checksum;
+};
+
+/**
+ * Check if the header can be journaled.
+ */
+bool journal_supported(const struct format *fmt);
+
+/**
+ * Get the size in bytes of a journal holding \p count entries.
+ */
+size_t journal_size(size_t count);
+
+/**
+ * Write a journal at sector \p offset, and mark the header as being updated.
+ */
+void journal_begin(const struct format *fmt, char *file, uint32_t offset, const struct journal_entry *entries, size_t count);
+
+/**
+ * Mark the header as consistent once the journaled changes are applied and committed.
+ */
+void journal_end(const struct format *fmt, char *file);
+
+/**
+ * Decide whether the chunk file of a change that made the chunk at \p index external was put in place,
+ * and leave the chunk files matching the decision. \p old_external is set if the chunk it replaced was external too.
+ */
+typedef bool (*journal_placed)(void *user, uint32_t index, bool old_external);
+
+/**
+ * Repair a header left part way through an update.
+ * Changes whose new chunk data is intact are applied, and others are undone.
+ * Changes to external chunks are applied if \p placed says their chunk file was put in place.
+ * Returns true if the header was being updated, in which case the repair must be made durable before journal_end.
+ */
+bool journal_recover(const struct format *fmt, char *file, size_t file_size, journal_placed placed, void *user);
+
+#endif
@@ -8,15 +8,6 @@
 #define HEADER_VERSION_LIBCLOD 2
 #define HEADER_VERSION_COMPOUND 3
 
-struct format {
-	char *file_data;
-	size_t file_size;
-
-	int version;
-};
-
-#define FORMAT_NULL ((struct format){ .file_data = nullptr })
-
 #define HEADER_MAGIC_SIZE 128
 #define HEADER_MAGIC \
 	"\n\n"\
@@ -26,9 +17,46 @@ struct format {
 
 static_assert(sizeof(HEADER_MAGIC) <= HEADER_MAGIC_SIZE);
 
-#define HEADER_VANILLA_SIZE 8192
-#define HEADER_LIBCLOD_SIZE_MIN (HEADER_MAGIC_SIZE + 128)
+// Every region file stores 2^10 chunks, regardless of the number of dimensions.
+#define HEADER_CHUNK_BITS 10
+#define HEADER_CHUNKS (1 << HEADER_CHUNK_BITS)
 
+#define HEADER_VANILLA_SIZE 8192
+#define HEADER_VANILLA_LOCATIONS 0
+#define HEADER_VANILLA_TIMESTAMPS 4096
 #define HEADER_VANILLA_SECTOR_SIZE 4096
 
+#define HEADER_LIBCLOD_SIZE_MIN (HEADER_MAGIC_SIZE + 128)
+#define HEADER_LIBCLOD_CHECKSUM 128
+#define HEADER_LIBCLOD_NBT_SIZE 132
+#define HEADER_LIBCLOD_GENERATION 136
+#define HEADER_LIBCLOD_JOURNAL_OFFSET 140
+#define HEADER_LIBCLOD_JOURNAL_SIZE 144
+#define HEADER_LIBCLOD_NBT HEADER_LIBCLOD_SIZE_MIN
+// Space reserved for the libclod header, leaving room for the NBT data to grow.
+#define HEADER_LIBCLOD_SIZE 32768
+
+// A journal is its checksum, generation and number of entries, followed by the entries.
+#define JOURNAL_CHECKSUM 0
+#define JOURNAL_GENERATION 4
+#define JOURNAL_COUNT 8
+#define JOURNAL_ENTRIES 12
+// Index, old offset, sectors, modification time, uncompressed size and checksum, then the new ones.
+#define JOURNAL_ENTRY_SIZE 44
+
+// Chunk data is prefixed with its size in bytes (including the compression byte) and compression type.
+#define CHUNK_HEADER_SIZE 5
+// Set in the compression byte when chunk data is stored in a dedicated file.
+#define CHUNK_EXTERNAL 0x80
+// Prefix of the dedicated files used for chunks too large to fit in the region file.
+#define CHUNK_FILE_PREFIX "c"
+// The largest number of sectors a chunk can occupy.
+#define CHUNK_SECTORS_MAX 255
+
+// Compression types used by vanilla.
+#define CHUNK_VANILLA_GZIP 1
+#define CHUNK_VANILLA_ZLIB 2
+#define CHUNK_VANILLA_UNCOMPRESSED 3
+#define CHUNK_VANILLA_LZ4 4
+
 #endif
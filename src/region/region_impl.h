@@ -2,26 +2,178 @@
 #define CLOD_REGION_IMPL_H
 
 #include <clod/region.h>
+#include <clod/vmath.h>
 #include "platform/platform.h"
+#include "region_format/region_header.h"
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
 
+// Maximum number of idle compressors and decompressors kept around for reuse.
+#define CODEC_POOL_MAX 64
+// Largest decompressed chunk, past which the chunk is assumed to be malformed.
+#define DECOMPRESS_MAX ((size_t)1 << 30)
+// Maximum number of idle rings kept around for reuse.
+#define RING_POOL_MAX 16
+// Maximum number of chunk files of external chunks kept open.
+#define EXTERNAL_CACHE_MAX 32
+
+// An open chunk file of an external chunk.
+struct external_file {
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+	file f;
+	// Views of the chunk using the file.
+	uint32_t users;
+	// Set once the file has left the cache, so the last user closes it.
+	bool evicted;
+};
+
 struct clod_region {
 	struct clod_region_opts opts;
 
 	atomic int32_t inside;
-	mutex mtx;
 	dir d;
+	// State shared with other processes using the region, if opts.shared is set.
+	shared shared;
 
-	size_t cache_len;
 	struct file_cache *cache;
+	struct region_stats *stats;
+
+	mutex codec_mtx;
+	size_t compressors_len;
+	struct clod_compressor *compressors[CODEC_POOL_MAX];
+	size_t decompressors_len;
+	struct clod_decompressor *decompressors[CODEC_POOL_MAX];
+
+	mutex ring_mtx;
+	size_t rings_len;
+	ring rings[RING_POOL_MAX];
+
+	// Chunk files kept open, least recently used first.
+	mutex external_mtx;
+	size_t externals_len;
+	struct external_file *externals[EXTERNAL_CACHE_MAX];
+
+	// Background compaction. compact_stopping is set with compact_mtx held, so waiters see it.
+	mutex compact_mtx;
+	condvar compact_wake;
+	atomic bool compact_stopping;
+	// Set by writes that leave a file with more unused space than the threshold, so the next pass starts early.
+	atomic bool compact_due;
+	bool compact_running;
+	thread compact_thread;
+
+	// Index of the chunks in every region file, if the region keeps or reads one.
+	struct region_index *index;
 };
 
+// Index of a counter in struct clod_region_stats, each field of which is one or more uint64_t.
+#define STATS_WORD(field) (offsetof(struct clod_region_stats, field) / sizeof(uint64_t))
+
+enum clod_region_result stats_create(struct clod_region *r);
+void stats_destroy(struct clod_region *r);
+// Add to the counter at a STATS_WORD index.
+void stats_add(struct region_stats *s, size_t word, uint64_t n);
+// Current monotonic time in nanoseconds, for timing with stats_latency and stats_wait.
+uint64_t stats_clock();
+// Count a call that started at start in the latency histogram at a STATS_WORD index.
+void stats_latency(struct region_stats *s, size_t histogram, uint64_t start);
+// Count a wait for a lock that started at start.
+void stats_wait(struct region_stats *s, size_t waits, size_t wait_ns, uint64_t start);
+// Resize a file, counting the resize and whether its mapping moved.
+enum clod_region_result stats_truncate(struct region_stats *s, file f, size_t new_size);
+
+enum clod_region_result file_cache_create(struct clod_region *r);
 enum clod_region_result file_cache_destroy(struct clod_region *r);
 
+// Take a compressor from the pool, or create a new one. Returns nullptr on allocation failure.
+struct clod_compressor *codec_compressor_get(struct clod_region *r);
+// Return a compressor to the pool.
+void codec_compressor_put(struct clod_region *r, struct clod_compressor *ctx);
+// Take a decompressor from the pool, or create a new one. Returns nullptr on allocation failure.
+struct clod_decompressor *codec_decompressor_get(struct clod_region *r);
+// Return a decompressor to the pool.
+void codec_decompressor_put(struct clod_region *r, struct clod_decompressor *ctx);
+void codec_destroy(struct clod_region *r);
+// Decompress chunk data into a buffer allocated with malloc, growing it until the chunk fits.
+// known is the size of the chunk once decompressed, or 0 if it isn't known.
+enum clod_region_result codec_decompress(
+	struct clod_decompressor *ctx,
+	const void *data, size_t data_size,
+	enum clod_compression_method compression,
+	size_t known,
+	uint8_t **buff, size_t *cap, size_t *size
+);
+// Make room for capacity bytes of compressed data, setting dst to where they start.
+typedef enum clod_region_result (*codec_reserve)(void *user, size_t capacity, uint8_t **dst);
+// Compress chunk data into room made by reserve, which is asked for more until the compressed data fits.
+enum clod_region_result codec_compress(
+	struct clod_compressor *ctx,
+	const void *data, size_t data_size,
+	enum clod_compression_method compression,
+	enum clod_compression_level level,
+	codec_reserve reserve, void *user,
+	size_t *size
+);
+
+// Take a ring from the pool, or open a new one. Returns 0 if rings aren't available.
+ring ring_pool_get(struct clod_region *r);
+// Return a ring to the pool, or close it if it's broken.
+void ring_pool_put(struct clod_region *r, ring ring);
+void ring_pool_destroy(struct clod_region *r);
+
+// Get the open chunk file of the external chunk at pos, opening it if it isn't cached. Released with external_put.
+enum clod_region_result external_get(struct clod_region *r, const int64_t *pos, struct external_file **ext);
+// Stop using a chunk file.
+void external_put(struct clod_region *r, struct external_file *ext);
+// Drop the cached chunk file of the chunk at pos once it's replaced or deleted. The chunk's stripe must be write locked.
+void external_forget(struct clod_region *r, const int64_t *pos);
+// Name the chunk file of the external chunk at pos, with suffix added to its extension.
+// Writes stage a new chunk file under EXTERNAL_STAGED, and keep the one it replaces under EXTERNAL_KEPT
+// until the header no longer refers to it.
+void external_filename(const struct clod_region *r, char *filename, const int64_t *pos, const char *suffix);
+#define EXTERNAL_STAGED ".new"
+#define EXTERNAL_KEPT ".old"
+void external_cache_destroy(struct clod_region *r);
+
+// A chunk copied from another region, already compressed with this region's compression.
+struct chunk_copy {
+	const int64_t *pos;
+	const uint8_t *data;
+	size_t size;
+	size_t uncompressed_size;
+	// Modification time to keep, or 0 for the time of the write.
+	uint32_t mtime;
+	enum clod_region_result result;
+};
+
+// Store copied chunks in the region file at region_pos, which every chunk must be in, and sync it.
+// The result of each chunk is set in its chunk_copy.
+enum clod_region_result region_write_copies(struct clod_region *region, const int64_t *region_pos, struct chunk_copy *copies, size_t count);
+
+// Start the background compactor if the region is configured for one.
+enum clod_region_result compact_start(struct clod_region *r);
+// Stop the background compactor, waiting for the file it's compacting to be finished or abandoned.
+void compact_stop(struct clod_region *r);
+
+struct journal_entry;
+struct region_file;
+
+// Open the chunk index if opts.index is set, rebuilding it if it's out of date, or mark it dirty if the region
+// is writeable but doesn't keep it.
+enum clod_region_result region_index_open(struct clod_region *r);
+// Sync the chunk index and mark it clean if this process kept it, then close it.
+enum clod_region_result region_index_close(struct clod_region *r);
+// Record header changes just made to the region file at region_pos.
+void region_index_update(struct clod_region *r, const int64_t *region_pos, const struct journal_entry *entries, size_t count);
+// Record every chunk of a region file from its header, once it's been rewritten. Every writer lock must be held.
+void region_index_reload(struct clod_region *r, struct region_file *rf);
+// Look a chunk up in the chunk index. Returns false if the index can't be used, and region files must be read instead.
+bool region_index_mtime(struct clod_region *r, const int64_t *pos, bool *found, uint32_t *mtime);
+
 #define REGION_PUBLIC_ENTER(region) do {\
 	assert((region) != nullptr);\
 	const int32_t inside = ++(region)->inside;\
@@ -33,7 +185,7 @@ enum clod_region_result file_cache_destroy(struct clod_region *r);
 	assert(inside > 0);\
 } while(0)
 
-static bool is_vanilla_compatible(struct clod_region_opts *opts) {
+static bool is_vanilla_compatible(const struct clod_region_opts *opts) {
 	return
 		opts->dims == 2 &&
 		memcmp(opts->prefix, "region", strlen("region")) == 0 &&
@@ -43,4 +195,21 @@ static bool is_vanilla_compatible(struct clod_region_opts *opts) {
 		);
 }
 
+// Write the position of the region file containing the chunk at pos to region_pos,
+// and return the index of the chunk in that region file.
+static inline size_t chunk_index(const int64_t *pos, int64_t *region_pos, const uint8_t dims) {
+	memcpy(region_pos, pos, sizeof(pos[0]) * dims);
+	return (size_t)vec_group(region_pos, dims, HEADER_CHUNK_BITS);
+}
+
+// Write the position of the chunk at index in the region file at region_pos to pos. The inverse of chunk_index.
+static inline void chunk_pos(const int64_t *region_pos, const size_t index, int64_t *pos, const uint8_t dims) {
+	uint8_t used = 0;
+	for (uint8_t i = 0; i < dims; i++) {
+		const uint8_t bits = (uint8_t)((HEADER_CHUNK_BITS - used + dims - i - 1) / (dims - i));
+		pos[i] = region_pos[i] * ((int64_t)1 << bits) + (int64_t)((index >> used) & mask64(bits));
+		used += bits;
+	}
+}
+
 #endif
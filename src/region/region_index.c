@@ -0,0 +1,678 @@
+/**
+ * The chunk index records which chunks exist in each region file, with their modification time and size,
+ * so finding and listing chunks doesn't open any region file.
+ *
+ * It's a single file beside the region files, named after the prefix, that's mapped as a whole.
+ * After a small header come entries, one for each region file, holding a bit set of its chunks with their
+ * times and sizes, and an open addressing table of the entries' offsets, keyed by region file position.
+ * Entries are appended and never move, and the table is appended again at twice the size once it fills up.
+ *
+ * The process keeping the index marks it dirty when it opens the region, and clean once it has synced it on closing.
+ * An index found dirty was left out of date by a crash, or is being kept by another process,
+ * so writeable regions rebuild it from the region files, and read-only ones answer from the region files instead.
+ * Writeable regions that don't keep the index mark it dirty, as their writes would leave it out of date.
+ *
+ * Entries are updated after the header of their region file, while the file's locks are still held.
+ * Like a region file, the index has a lock read locked to use the mapping and write locked to add an entry,
+ * which can move the mapping, and stripes to read and change entries.
+ */
+#include <clod/region.h>
+#include "region_impl.h"
+#include "region_file.h"
+#include "region_format/journal.h"
+#include "filename.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Identifies an index file written on a machine with the same byte order.
+#define INDEX_MAGIC 0x7865646e69646f6cULL
+#define INDEX_VERSION 1
+// Extension of the index file, which is named after the region's prefix.
+#define INDEX_EXT ".index"
+// Number of slots in the table of a new index.
+#define INDEX_SLOTS_MIN 256
+// Entries are split into this many stripes, each with its own lock.
+#define INDEX_STRIPES 64
+// Every stripe of a region file.
+#define STRIPES_ALL UINT64_MAX
+
+struct index_header {
+	uint64_t magic;
+	uint32_t version;
+	uint8_t dims;
+	// Set while a process keeps the index up to date, and cleared once it has synced the index.
+	uint8_t dirty;
+	uint16_t reserved;
+	// Number of entries.
+	uint32_t files;
+	// Number of slots in the table, a power of two.
+	uint32_t slots;
+	// Offset of the table. Each slot holds the offset of an entry, or 0.
+	uint64_t table;
+	// End of the last entry or table. The file past it is unused.
+	uint64_t end;
+};
+
+// Chunks of a region file.
+struct index_entry {
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+	uint64_t exists[HEADER_CHUNKS / 64];
+	uint32_t mtime[HEADER_CHUNKS];
+	// Size of each chunk once decompressed, or 0 if it isn't known.
+	uint32_t size[HEADER_CHUNKS];
+};
+
+static_assert(sizeof(struct index_header) % sizeof(uint64_t) == 0);
+static_assert(sizeof(struct index_entry) % sizeof(uint64_t) == 0);
+
+struct region_index {
+	file f;
+	// Set if this process keeps the index up to date. Otherwise it's only used while it's clean.
+	bool owned;
+	// Set once an entry couldn't be added, after which the index isn't used, and is rebuilt next time.
+	atomic bool broken;
+	// Read locked to use the mapping, write locked to add an entry.
+	rbmutex mtx;
+	// Read locked to read an entry, write locked to change one.
+	rwmutex stripes[INDEX_STRIPES];
+};
+
+// A chunk found while listing.
+struct listed {
+	uint16_t index;
+	uint32_t mtime;
+	uint32_t size;
+};
+
+static uint64_t pos_hash(const int64_t *pos, const uint8_t dims) {
+	uint64_t h = 0;
+	for (uint8_t i = 0; i < dims; i++) {
+		h = (h ^ (uint64_t)pos[i]) * 0x9E3779B97F4A7C15;
+	}
+	return h >> 32;
+}
+
+static bool header_valid(const void *map, const size_t size, const uint8_t dims) {
+	if (!map || size < sizeof(struct index_header)) return false;
+	const struct index_header *h = map;
+	return
+		h->magic == INDEX_MAGIC &&
+		h->version == INDEX_VERSION &&
+		h->dims == dims &&
+		h->slots >= INDEX_SLOTS_MIN && (h->slots & (h->slots - 1)) == 0 &&
+		h->end <= size &&
+		h->table >= sizeof(*h) && h->table % sizeof(uint64_t) == 0 && h->table <= h->end &&
+		(h->end - h->table) / sizeof(uint64_t) >= h->slots;
+}
+
+static struct index_entry *entry_at(void *map, const uint64_t offset) {
+	return (struct index_entry *)((char *)map + offset);
+}
+
+static rwmutex *entry_stripe(struct region_index *ix, const uint64_t offset) {
+	return &ix->stripes[offset / sizeof(struct index_entry) % INDEX_STRIPES];
+}
+
+// Find the entry of the region file at pos. Returns its offset, or 0 if it has none. The read lock must be held.
+static uint64_t entry_find(void *map, const size_t size, const int64_t *pos, const uint8_t dims) {
+	const struct index_header *h = map;
+	const uint64_t *table = (const uint64_t *)((char *)map + h->table);
+	const size_t mask = h->slots - 1;
+	size_t slot = pos_hash(pos, dims) & mask;
+	for (size_t i = 0; i < h->slots; i++, slot = (slot + 1) & mask) {
+		const uint64_t offset = table[slot];
+		if (offset == 0) return 0;
+		if (offset % sizeof(uint64_t) != 0 || offset > size || size - offset < sizeof(struct index_entry)) return 0;
+		if (memcmp(entry_at(map, offset)->pos, pos, sizeof(pos[0]) * dims) == 0) return offset;
+	}
+	return 0;
+}
+
+static void table_insert(void *map, uint64_t *table, const uint32_t slots, const uint64_t offset, const uint8_t dims) {
+	size_t slot = pos_hash(entry_at(map, offset)->pos, dims) & (slots - 1);
+	while (table[slot]) slot = (slot + 1) & (slots - 1);
+	table[slot] = offset;
+}
+
+// Add an empty entry for the region file at pos. The write lock must be held.
+static enum clod_region_result entry_add(struct region_index *ix, const int64_t *pos, const uint8_t dims, uint64_t *offset) {
+	void *map;
+	size_t size;
+	(void)file_get(ix->f, &map, &size);
+	const struct index_header *old = map;
+
+	// The table is kept at most three quarters full, so probes stay short.
+	const bool grow = ((size_t)old->files + 1) * 4 > (size_t)old->slots * 3;
+	const uint32_t slots = grow ? old->slots * 2 : old->slots;
+	const size_t need = old->end + sizeof(struct index_entry) + (grow ? slots * sizeof(uint64_t) : 0);
+	if (need > size) {
+		// The file grows geometrically, and is cut down to size when the index is closed.
+		auto const res = file_truncate(ix->f, need > size * 2 ? need : size * 2);
+		if (res != CLOD_REGION_OK) return res;
+		(void)file_get(ix->f, &map, &size);
+	}
+
+	struct index_header *h = map;
+	if (grow) {
+		auto const table = (uint64_t *)((char *)map + h->end);
+		memset(table, 0, slots * sizeof(uint64_t));
+		const uint64_t *old_table = (const uint64_t *)((char *)map + h->table);
+		for (size_t i = 0; i < h->slots; i++) {
+			if (old_table[i]) table_insert(map, table, slots, old_table[i], dims);
+		}
+		h->table = h->end;
+		h->slots = slots;
+		h->end += slots * sizeof(uint64_t);
+	}
+
+	*offset = h->end;
+	auto const e = entry_at(map, *offset);
+	memset(e, 0, sizeof(*e));
+	memcpy(e->pos, pos, sizeof(pos[0]) * dims);
+	table_insert(map, (uint64_t *)((char *)map + h->table), h->slots, *offset, dims);
+	h->end += sizeof(*e);
+	h->files++;
+	return CLOD_REGION_OK;
+}
+
+/**
+ * Find the entry of the region file at pos, adding one if create is set. Returns its offset, or 0 if it has none.
+ * Returns with the read lock held either way.
+ */
+static uint64_t entry_get(struct region_index *ix, const int64_t *pos, const uint8_t dims, const bool create) {
+	void *map;
+	size_t size;
+	rbmutex_rdlock(&ix->mtx);
+	(void)file_get(ix->f, &map, &size);
+	uint64_t offset = entry_find(map, size, pos, dims);
+	if (offset || !create) return offset;
+
+	rbmutex_rdunlock(&ix->mtx);
+	rbmutex_wrlock(&ix->mtx);
+	(void)file_get(ix->f, &map, &size);
+	offset = entry_find(map, size, pos, dims);
+	if (!offset && entry_add(ix, pos, dims, &offset) != CLOD_REGION_OK) {
+		// The region file would be missing from the index, so it's no longer used.
+		ix->broken = true;
+		offset = 0;
+	}
+	rbmutex_wrunlock(&ix->mtx);
+	// Entries never move, so the offset is still good once the read lock is taken again.
+	rbmutex_rdlock(&ix->mtx);
+	return offset;
+}
+
+static void entry_set(struct index_entry *e, const size_t index, const bool exists, const uint32_t mtime, const uint32_t size) {
+	const uint64_t bit = (uint64_t)1 << (index % 64);
+	if (exists) e->exists[index / 64] |= bit;
+	else e->exists[index / 64] &= ~bit;
+	e->mtime[index] = exists ? mtime : 0;
+	e->size[index] = exists ? size : 0;
+}
+
+// Record every chunk of a region file from its header, which mustn't change meanwhile.
+static void entry_reload(struct region_index *ix, const uint8_t dims, const int64_t *pos, const struct format *fmt, const char *header) {
+	bool any = false;
+	for (size_t i = 0; fmt->version != 0 && i < HEADER_CHUNKS && !any; i++) {
+		any = format_location_get(fmt, header, i).sectors != 0;
+	}
+
+	const uint64_t offset = entry_get(ix, pos, dims, any);
+	if (offset) {
+		void *map;
+		size_t size;
+		(void)file_get(ix->f, &map, &size);
+		auto const e = entry_at(map, offset);
+		auto const stripe = entry_stripe(ix, offset);
+		rwmutex_wrlock(stripe);
+		for (size_t i = 0; i < HEADER_CHUNKS; i++) {
+			const bool exists = fmt->version != 0 && format_location_get(fmt, header, i).sectors != 0;
+			entry_set(e, i, exists,
+				exists ? format_mtime_get(fmt, header, i) : 0,
+				exists ? format_uncompressed_get(fmt, header, i) : 0);
+		}
+		rwmutex_wrunlock(stripe);
+	}
+	rbmutex_rdunlock(&ix->mtx);
+}
+
+static struct region_index *index_new(const file f, const bool owned) {
+	struct region_index *ix = calloc(1, sizeof(*ix));
+	if (!ix) return nullptr;
+	ix->f = f;
+	ix->owned = owned;
+	ix->broken = false;
+	rbmutex_init(&ix->mtx);
+	for (size_t i = 0; i < INDEX_STRIPES; i++) rwmutex_init(&ix->stripes[i]);
+	return ix;
+}
+
+static enum clod_region_result index_free(struct region_index *ix) {
+	auto const res = file_close(ix->f);
+	for (size_t i = 0; i < INDEX_STRIPES; i++) rwmutex_destroy(&ix->stripes[i]);
+	rbmutex_destroy(&ix->mtx);
+	free(ix);
+	return res;
+}
+
+// Mark the index dirty, as writes that don't keep it up to date would leave it out of date.
+static enum clod_region_result index_invalidate(struct clod_region *r, const char *name) {
+	file f;
+	auto res = file_open(&f, r->d, name, false, &r->opts);
+	if (res == CLOD_REGION_NOT_FOUND) return CLOD_REGION_OK;
+	if (res != CLOD_REGION_OK) return res;
+
+	void *map;
+	size_t size;
+	(void)file_get(f, &map, &size);
+	if (size >= sizeof(struct index_header) && !((struct index_header *)map)->dirty) {
+		((struct index_header *)map)->dirty = 1;
+		res = file_sync(f);
+	}
+	auto const close_res = file_close(f);
+	return res != CLOD_REGION_OK ? res : close_res;
+}
+
+// Build the index from the region files in a temporary file, and rename it over the old one.
+static enum clod_region_result index_rebuild(struct clod_region *r, const char *name) {
+	char temp[CLOD_REGION_PREFIX_MAX + sizeof(INDEX_EXT ".tmp")];
+	snprintf(temp, sizeof(temp), "%s.tmp", name);
+	const uint8_t dims = r->opts.dims;
+
+	file f;
+	auto res = file_open(&f, r->d, temp, true, &r->opts);
+	if (res != CLOD_REGION_OK) return res;
+	const size_t table = sizeof(struct index_header);
+	const size_t end = table + INDEX_SLOTS_MIN * sizeof(uint64_t);
+	// Whatever an earlier rebuild left behind is thrown away.
+	res = file_truncate(f, 0);
+	if (res == CLOD_REGION_OK) res = file_truncate(f, end);
+	struct region_index *ix = nullptr;
+	if (res == CLOD_REGION_OK && !(ix = index_new(f, true))) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for chunk index.");
+	}
+	if (res != CLOD_REGION_OK) {
+		(void)file_close(f);
+		(void)dir_unlink(r->d, temp);
+		return res;
+	}
+
+	void *map;
+	size_t size;
+	(void)file_get(f, &map, &size);
+	*(struct index_header *)map = (struct index_header){
+		.magic = INDEX_MAGIC,
+		.version = INDEX_VERSION,
+		.dims = dims,
+		.dirty = 1,
+		.slots = INDEX_SLOTS_MIN,
+		.table = table,
+		.end = end,
+	};
+
+	dir_iter iter;
+	res = dir_iter_open(&iter, r->d);
+	const bool opened = res == CLOD_REGION_OK;
+	while (res == CLOD_REGION_OK && !ix->broken) {
+		const char *entry_name;
+		res = dir_iter_next(iter, &entry_name);
+		if (res != CLOD_REGION_OK || !entry_name) break;
+
+		char filename[REGION_FILENAME_MAX + 1] = {0};
+		strncpy(filename, entry_name, REGION_FILENAME_MAX);
+		int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+		if (!filename_parse_pos(filename, r->opts.prefix, r->opts.region_ext, pos, dims)) continue;
+
+		// Files that can't be opened are left out, and reading their chunks says why.
+		struct region_file *rf;
+		if (region_file_get(r, &rf, pos, false) != CLOD_REGION_OK) continue;
+		region_file_writers_lock(rf, STRIPES_ALL);
+		region_file_lock_pinned(rf);
+		void *file_map;
+		size_t file_size;
+		(void)file_get(rf->f, &file_map, &file_size);
+		entry_reload(ix, dims, pos, &rf->fmt, file_map);
+		rbmutex_rdunlock(&rf->mtx);
+		region_file_writers_unlock(rf, STRIPES_ALL);
+	}
+	if (opened) (void)dir_iter_close(iter);
+	if (res == CLOD_REGION_OK && ix->broken) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to grow chunk index.");
+	}
+
+	// The index is complete and durable before it's renamed, so a crash can't leave part of one in its place.
+	if (res == CLOD_REGION_OK) {
+		(void)file_get(f, &map, &size);
+		res = file_truncate(f, ((struct index_header *)map)->end);
+	}
+	if (res == CLOD_REGION_OK) res = file_sync(f);
+	auto const close_res = index_free(ix);
+	if (res == CLOD_REGION_OK) res = close_res;
+	if (res == CLOD_REGION_OK) res = dir_rename(r->d, temp, name);
+	if (res != CLOD_REGION_OK) (void)dir_unlink(r->d, temp);
+	return res;
+}
+
+enum clod_region_result region_index_open(struct clod_region *r) {
+	char name[CLOD_REGION_PREFIX_MAX + sizeof(INDEX_EXT)];
+	snprintf(name, sizeof(name), "%s" INDEX_EXT, r->opts.prefix);
+	const bool writeable = r->opts.mode == CLOD_REGION_MODE_RDWR;
+	// Processes sharing a region would each have to lock the index, so none of them keep it.
+	const bool keep = writeable && r->opts.index && !r->opts.shared;
+	if (writeable && !keep) return index_invalidate(r, name);
+	if (!r->opts.index) return CLOD_REGION_OK;
+
+	file f;
+	auto res = file_open(&f, r->d, name, keep, &r->opts);
+	// Read-only regions without an index read region files instead.
+	if (!keep && res == CLOD_REGION_NOT_FOUND) return CLOD_REGION_OK;
+	if (res != CLOD_REGION_OK) return res;
+
+	void *map;
+	size_t size;
+	(void)file_get(f, &map, &size);
+	bool valid = header_valid(map, size, r->opts.dims);
+	if (keep && (!valid || ((struct index_header *)map)->dirty)) {
+		(void)file_close(f);
+		res = index_rebuild(r, name);
+		if (res == CLOD_REGION_OK) res = file_open(&f, r->d, name, false, &r->opts);
+		if (res != CLOD_REGION_OK) return res;
+		(void)file_get(f, &map, &size);
+		valid = header_valid(map, size, r->opts.dims);
+	} else if (keep) {
+		// Marked dirty before anything is written, so a crash leaves it to be rebuilt.
+		((struct index_header *)map)->dirty = 1;
+		res = file_sync(f);
+	}
+	if (res == CLOD_REGION_OK && !valid) {
+		res = keep ? region_error(CLOD_REGION_MALFORMED, "Rebuilt chunk index is malformed.") : CLOD_REGION_NOT_FOUND;
+	}
+
+	struct region_index *ix = nullptr;
+	if (res == CLOD_REGION_OK && !(ix = index_new(f, keep))) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for chunk index.");
+	}
+	if (res != CLOD_REGION_OK) {
+		(void)file_close(f);
+		// An index that isn't recognised is only a reason to read region files.
+		return res == CLOD_REGION_NOT_FOUND ? CLOD_REGION_OK : res;
+	}
+	r->index = ix;
+	return CLOD_REGION_OK;
+}
+
+enum clod_region_result region_index_close(struct clod_region *r) {
+	auto const ix = r->index;
+	if (!ix) return CLOD_REGION_OK;
+	r->index = nullptr;
+
+	enum clod_region_result res = CLOD_REGION_OK;
+	if (ix->owned && !ix->broken) {
+		// The index is synced before it's marked clean, so it's never clean without being complete.
+		void *map;
+		size_t size;
+		(void)file_get(ix->f, &map, &size);
+		res = file_truncate(ix->f, ((struct index_header *)map)->end);
+		if (res == CLOD_REGION_OK) res = file_sync(ix->f);
+		if (res == CLOD_REGION_OK) {
+			(void)file_get(ix->f, &map, &size);
+			((struct index_header *)map)->dirty = 0;
+			res = file_sync(ix->f);
+		}
+	}
+	auto const close_res = index_free(ix);
+	return res != CLOD_REGION_OK ? res : close_res;
+}
+
+void region_index_update(
+	struct clod_region *r,
+	const int64_t *region_pos,
+	const struct journal_entry *entries,
+	const size_t count
+) {
+	auto const ix = r->index;
+	if (!ix || !ix->owned || ix->broken) return;
+
+	bool any = false;
+	for (size_t i = 0; i < count && !any; i++) any = entries[i].new_location.sectors != 0;
+
+	// Deleting chunks from a file the index has no entry for changes nothing.
+	const uint64_t offset = entry_get(ix, region_pos, r->opts.dims, any);
+	if (offset) {
+		void *map;
+		size_t size;
+		(void)file_get(ix->f, &map, &size);
+		auto const e = entry_at(map, offset);
+		auto const stripe = entry_stripe(ix, offset);
+		rwmutex_wrlock(stripe);
+		for (size_t i = 0; i < count; i++) {
+			entry_set(e, entries[i].index, entries[i].new_location.sectors != 0,
+				entries[i].new_mtime, entries[i].new_uncompressed_size);
+		}
+		rwmutex_wrunlock(stripe);
+	}
+	rbmutex_rdunlock(&ix->mtx);
+}
+
+void region_index_reload(struct clod_region *r, struct region_file *rf) {
+	auto const ix = r->index;
+	if (!ix || !ix->owned || ix->broken) return;
+
+	void *map;
+	size_t size;
+	(void)file_get(rf->f, &map, &size);
+	entry_reload(ix, r->opts.dims, rf->pos, &rf->fmt, map);
+}
+
+// Check if the index can be used. The read lock must be held.
+static bool index_usable(struct region_index *ix) {
+	if (ix->broken) return false;
+	if (ix->owned) return true;
+	void *map;
+	size_t size;
+	(void)file_get(ix->f, &map, &size);
+	return !((struct index_header *)map)->dirty;
+}
+
+bool region_index_mtime(struct clod_region *r, const int64_t *pos, bool *found, uint32_t *mtime) {
+	auto const ix = r->index;
+	if (!ix) return false;
+
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	const size_t index = chunk_index(pos, region_pos, r->opts.dims);
+
+	rbmutex_rdlock(&ix->mtx);
+	const bool usable = index_usable(ix);
+	if (usable) {
+		void *map;
+		size_t size;
+		(void)file_get(ix->f, &map, &size);
+		const uint64_t offset = entry_find(map, size, region_pos, r->opts.dims);
+		*found = false;
+		if (offset) {
+			auto const e = entry_at(map, offset);
+			auto const stripe = entry_stripe(ix, offset);
+			rwmutex_rdlock(stripe);
+			*found = (e->exists[index / 64] >> (index % 64)) & 1;
+			*mtime = e->mtime[index];
+			rwmutex_rdunlock(stripe);
+		}
+	}
+	rbmutex_rdunlock(&ix->mtx);
+	return usable;
+}
+
+// Check if any chunk of the region file at region_pos is inside the box from min to max.
+static bool region_overlaps(const int64_t *region_pos, const int64_t *min, const int64_t *max, const uint8_t dims) {
+	int64_t first[CLOD_REGION_DIMENSIONS_MAX], last[CLOD_REGION_DIMENSIONS_MAX];
+	chunk_pos(region_pos, 0, first, dims);
+	chunk_pos(region_pos, HEADER_CHUNKS - 1, last, dims);
+	for (uint8_t i = 0; i < dims; i++) {
+		if (last[i] < min[i] || first[i] > max[i]) return false;
+	}
+	return true;
+}
+
+static bool chunk_inside(const int64_t *pos, const int64_t *min, const int64_t *max, const uint8_t dims) {
+	for (uint8_t i = 0; i < dims; i++) {
+		if (pos[i] < min[i] || pos[i] > max[i]) return false;
+	}
+	return true;
+}
+
+// Hand the chunks found in a region file to the caller. Returns false if it asked to stop.
+static bool list_found(
+	struct clod_region *r,
+	const int64_t *region_pos,
+	const struct listed *listed, const size_t n,
+	bool (*found)(void *user, const int64_t *pos, time_t mtime, size_t size),
+	void *user
+) {
+	for (size_t i = 0; i < n; i++) {
+		int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+		chunk_pos(region_pos, listed[i].index, pos, r->opts.dims);
+		if (!found(user, pos, (time_t)listed[i].mtime, listed[i].size)) return false;
+	}
+	return true;
+}
+
+/**
+ * List chunks from the index. Region files added while listing aren't listed.
+ * Returns false if the index can't be used, before anything is listed.
+ */
+static bool index_list(
+	struct clod_region *r,
+	const int64_t *min, const int64_t *max,
+	bool (*found)(void *user, const int64_t *pos, time_t mtime, size_t size),
+	void *user,
+	enum clod_region_result *res
+) {
+	auto const ix = r->index;
+	const uint8_t dims = r->opts.dims;
+	if (!ix) return false;
+
+	// The entries are noted first, so the caller is never called with the index locked.
+	rbmutex_rdlock(&ix->mtx);
+	const bool usable = index_usable(ix);
+	uint64_t *offsets = nullptr;
+	size_t n = 0;
+	if (usable) {
+		void *map;
+		size_t size;
+		(void)file_get(ix->f, &map, &size);
+		const struct index_header *h = map;
+		const uint64_t *table = (const uint64_t *)((char *)map + h->table);
+		offsets = malloc(h->slots * sizeof(offsets[0]));
+		for (size_t i = 0; offsets && i < h->slots; i++) {
+			const uint64_t offset = table[i];
+			if (offset == 0 || offset % sizeof(uint64_t) != 0 || offset > size || size - offset < sizeof(struct index_entry)) continue;
+			if (region_overlaps(entry_at(map, offset)->pos, min, max, dims)) offsets[n++] = offset;
+		}
+	}
+	rbmutex_rdunlock(&ix->mtx);
+	if (!usable) return false;
+	if (!offsets) {
+		*res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for listing chunks.");
+		return true;
+	}
+
+	*res = CLOD_REGION_OK;
+	for (size_t i = 0; i < n; i++) {
+		struct listed listed[HEADER_CHUNKS];
+		size_t len = 0;
+		int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+
+		rbmutex_rdlock(&ix->mtx);
+		void *map;
+		size_t size;
+		(void)file_get(ix->f, &map, &size);
+		auto const e = entry_at(map, offsets[i]);
+		memcpy(region_pos, e->pos, sizeof(region_pos[0]) * dims);
+		auto const stripe = entry_stripe(ix, offsets[i]);
+		rwmutex_rdlock(stripe);
+		for (size_t word = 0; word < HEADER_CHUNKS / 64; word++) {
+			for (uint64_t bits = e->exists[word]; bits; bits &= bits - 1) {
+				const size_t index = word * 64 + (size_t)__builtin_ctzll(bits);
+				int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+				chunk_pos(region_pos, index, pos, dims);
+				if (!chunk_inside(pos, min, max, dims)) continue;
+				listed[len++] = (struct listed){ .index = (uint16_t)index, .mtime = e->mtime[index], .size = e->size[index] };
+			}
+		}
+		rwmutex_rdunlock(stripe);
+		rbmutex_rdunlock(&ix->mtx);
+
+		if (!list_found(r, region_pos, listed, len, found, user)) break;
+	}
+	free(offsets);
+	return true;
+}
+
+// List chunks by reading the header of every region file in the box.
+static enum clod_region_result files_list(
+	struct clod_region *r,
+	const int64_t *min, const int64_t *max,
+	bool (*found)(void *user, const int64_t *pos, time_t mtime, size_t size),
+	void *user
+) {
+	const uint8_t dims = r->opts.dims;
+	dir_iter iter;
+	auto res = dir_iter_open(&iter, r->d);
+	if (res != CLOD_REGION_OK) return res;
+
+	for (;;) {
+		const char *name;
+		res = dir_iter_next(iter, &name);
+		if (res != CLOD_REGION_OK || !name) break;
+
+		char filename[REGION_FILENAME_MAX + 1] = {0};
+		strncpy(filename, name, REGION_FILENAME_MAX);
+		int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+		if (!filename_parse_pos(filename, r->opts.prefix, r->opts.region_ext, region_pos, dims)) continue;
+		if (!region_overlaps(region_pos, min, max, dims)) continue;
+
+		struct region_file *rf;
+		res = region_file_rdlock(r, &rf, region_pos);
+		if (res == CLOD_REGION_NOT_FOUND) continue;
+		if (res != CLOD_REGION_OK) break;
+
+		struct listed listed[HEADER_CHUNKS];
+		size_t len = 0;
+		void *map;
+		size_t size;
+		(void)file_get(rf->f, &map, &size);
+		region_file_stripes_rdlock(rf, STRIPES_ALL);
+		for (size_t i = 0; rf->fmt.version != 0 && i < HEADER_CHUNKS; i++) {
+			if (format_location_get(&rf->fmt, map, i).sectors == 0) continue;
+			int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+			chunk_pos(region_pos, i, pos, dims);
+			if (!chunk_inside(pos, min, max, dims)) continue;
+			listed[len++] = (struct listed){
+				.index = (uint16_t)i,
+				.mtime = format_mtime_get(&rf->fmt, map, i),
+				.size = format_uncompressed_get(&rf->fmt, map, i),
+			};
+		}
+		region_file_stripes_rdunlock(rf, STRIPES_ALL);
+		rbmutex_rdunlock(&rf->mtx);
+
+		if (!list_found(r, region_pos, listed, len, found, user)) break;
+	}
+	(void)dir_iter_close(iter);
+	return res;
+}
+
+enum clod_region_result clod_region_list(
+	struct clod_region *region,
+	const int64_t *min, const int64_t *max,
+	bool (*found)(void *user, const int64_t *pos, time_t mtime, size_t size),
+	void *user
+) {
+	REGION_PUBLIC_ENTER(region);
+	enum clod_region_result res;
+	if (!index_list(region, min, max, found, user, &res)) res = files_list(region, min, max, found, user);
+	REGION_PUBLIC_LEAVE(region);
+	return res;
+}
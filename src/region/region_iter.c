@@ -0,0 +1,118 @@
+/**
+ * The iterator hands out the chunks of one region file at a time, so each thread works through whole files
+ * and reads chunks in the order they are stored.
+ *
+ * Threads are spread over a fixed number of claims, each holding the chunks left in the file it was given.
+ * A thread takes chunks from the front of its own claim, and claims the next region file in the directory
+ * once it's empty. When the directory runs out, threads take chunks from the back of other claims,
+ * so the work left behind by slow or finished threads still gets done.
+ *
+ * The chunks of a file are listed when it's claimed, so chunks written after that aren't returned.
+ */
+#include <clod/region.h>
+#include "region_impl.h"
+#include "region_file.h"
+#include "error.h"
+#include <stdlib.h>
+
+// Number of claims threads are spread over.
+#define ITER_CLAIMS 64
+
+struct iter_claim {
+	mutex mtx;
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	// Indices of the chunks left in the region file, in the order they are stored.
+	uint16_t indices[HEADER_CHUNKS];
+	size_t next;
+	size_t len;
+};
+
+struct clod_region_iter {
+	struct clod_region *region;
+	struct region_files files;
+	struct iter_claim claims[ITER_CLAIMS];
+};
+
+static atomic size_t next_claim;
+static thread_local size_t thread_claim = SIZE_MAX;
+
+// Fill a claim with the chunks of a region file. The claim's mutex must be held.
+static void claim_fill(struct clod_region *region, struct iter_claim *claim) {
+	claim->next = 0;
+	claim->len = 0;
+
+	struct region_file *rf;
+	if (region_file_rdlock(region, &rf, claim->region_pos) != CLOD_REGION_OK) return;
+
+	void *data;
+	size_t size;
+	if (file_get(rf->f, &data, &size) == CLOD_REGION_OK && rf->fmt.version != 0) {
+		region_file_stripes_rdlock(rf, UINT64_MAX);
+		claim->len = region_file_chunks(rf, data, claim->indices);
+		region_file_stripes_rdunlock(rf, UINT64_MAX);
+	}
+	rbmutex_rdunlock(&rf->mtx);
+}
+
+// Take a chunk from the back of another thread's claim.
+static bool steal(struct clod_region_iter *iter, const size_t own, int64_t *pos) {
+	for (size_t i = 1; i < ITER_CLAIMS; i++) {
+		auto const claim = &iter->claims[(own + i) % ITER_CLAIMS];
+		mutex_lock(&claim->mtx);
+		const bool found = claim->next < claim->len;
+		if (found) chunk_pos(claim->region_pos, claim->indices[--claim->len], pos, iter->region->opts.dims);
+		mutex_unlock(&claim->mtx);
+		if (found) return true;
+	}
+	return false;
+}
+
+struct clod_region_iter *clod_region_iter_start(struct clod_region *region) {
+	REGION_PUBLIC_ENTER(region);
+
+	struct clod_region_iter *iter = malloc(sizeof(*iter));
+	if (!iter) {
+		region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for region iterator.");
+		REGION_PUBLIC_LEAVE(region);
+		return nullptr;
+	}
+	if (region_files_open(&iter->files, region) != CLOD_REGION_OK) {
+		free(iter);
+		REGION_PUBLIC_LEAVE(region);
+		return nullptr;
+	}
+
+	iter->region = region;
+	for (size_t i = 0; i < ITER_CLAIMS; i++) {
+		mutex_init(&iter->claims[i].mtx);
+		iter->claims[i].next = 0;
+		iter->claims[i].len = 0;
+	}
+	// The region stays entered until the iterator ends, so it can't be closed in the meantime.
+	return iter;
+}
+
+bool clod_region_iter_next(struct clod_region_iter *iter, int64_t *pos) {
+	if (thread_claim == SIZE_MAX) thread_claim = next_claim++ % ITER_CLAIMS;
+	auto const claim = &iter->claims[thread_claim];
+	const uint8_t dims = iter->region->opts.dims;
+
+	mutex_lock(&claim->mtx);
+	while (claim->next == claim->len) {
+		if (!region_files_next(&iter->files, claim->region_pos)) break;
+		claim_fill(iter->region, claim);
+	}
+	const bool found = claim->next < claim->len;
+	if (found) chunk_pos(claim->region_pos, claim->indices[claim->next++], pos, dims);
+	mutex_unlock(&claim->mtx);
+
+	return found || steal(iter, thread_claim, pos);
+}
+
+void clod_region_iter_end(struct clod_region_iter *iter) {
+	auto const region = iter->region;
+	region_files_close(&iter->files);
+	for (size_t i = 0; i < ITER_CLAIMS; i++) mutex_destroy(&iter->claims[i].mtx);
+	free(iter);
+	REGION_PUBLIC_LEAVE(region);
+}
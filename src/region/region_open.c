@@ -1,15 +1,28 @@
 #include <clod/region.h>
 #include "region_impl.h"
 #include "error.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-enum clod_region_result read_opts(struct clod_region_opts *dst, const struct clod_region_opts *src) {
-	if (src->version != CLOD_REGION_VERSION) {
+// Size of the options of each version, which are all prefixes of the current options.
+static const size_t opts_size[CLOD_REGION_VERSION + 1] = {
+	[1] = offsetof(struct clod_region_opts, io_engine),
+	[2] = sizeof(struct clod_region_opts),
+};
+
+enum clod_region_result read_opts(struct clod_region_opts *dst, const struct clod_region_opts *opts) {
+	if (opts->version == 0 || opts->version > CLOD_REGION_VERSION) {
 		return region_error(CLOD_REGION_INVALID_USAGE,
 			"Invalid opts.version %d. Current version is %d. Make sure to set opts.version correctly or update the library.",
-			src->version, CLOD_REGION_VERSION);
+			opts->version, CLOD_REGION_VERSION);
 	}
+	// Options of an older version lack the later fields, which are left to their defaults.
+	struct clod_region_opts current = {0};
+	memcpy(&current, opts, opts_size[opts->version]);
+	const struct clod_region_opts *src = &current;
 	dst->version = CLOD_REGION_VERSION;
 
 	if (src->dims) {
@@ -34,6 +47,86 @@ enum clod_region_result read_opts(struct clod_region_opts *dst, const struct clo
 		dst->mode = CLOD_REGION_MODE_RDWR;
 	}
 
+	if (src->io_engine) {
+		if (src->io_engine != CLOD_REGION_IO_MMAP && src->io_engine != CLOD_REGION_IO_URING) {
+			return region_error(CLOD_REGION_INVALID_USAGE,
+				"Invalid opts.io_engine %d. Must be CLOD_REGION_IO_MMAP or CLOD_REGION_IO_URING.",
+				src->io_engine);
+		}
+		dst->io_engine = src->io_engine;
+	} else {
+		dst->io_engine = CLOD_REGION_IO_MMAP;
+	}
+
+	if (src->access > CLOD_REGION_ACCESS_SEQUENTIAL) {
+		return region_error(CLOD_REGION_INVALID_USAGE,
+			"Invalid opts.access %d. Must be one of the CLOD_REGION_ACCESS_* patterns.",
+			src->access);
+	}
+	dst->access = src->access ? src->access : CLOD_REGION_ACCESS_NORMAL;
+
+	if (src->map_flags & ~(CLOD_REGION_MAP_HUGE_PAGES | CLOD_REGION_MAP_LOCK_HEADERS)) {
+		return region_error(CLOD_REGION_INVALID_USAGE,
+			"Invalid opts.map_flags %d. Must be a combination of the CLOD_REGION_MAP_* flags.",
+			src->map_flags);
+	}
+	dst->map_flags = src->map_flags;
+	dst->populate_max = src->populate_max;
+
+	dst->max_open_files = src->max_open_files ? src->max_open_files : 256;
+
+	if (src->compact_order) {
+		if (src->compact_order != CLOD_REGION_ORDER_SPATIAL && src->compact_order != CLOD_REGION_ORDER_RECENT) {
+			return region_error(CLOD_REGION_INVALID_USAGE,
+				"Invalid opts.compact_order %d. Must be CLOD_REGION_ORDER_SPATIAL or CLOD_REGION_ORDER_RECENT.",
+				src->compact_order);
+		}
+		dst->compact_order = src->compact_order;
+	} else {
+		dst->compact_order = CLOD_REGION_ORDER_SPATIAL;
+	}
+
+	if (src->compact_threshold > 100) {
+		return region_error(CLOD_REGION_INVALID_USAGE,
+			"Invalid opts.compact_threshold %d. Must be <= 100.",
+			src->compact_threshold);
+	}
+	dst->compact_threshold = src->compact_threshold;
+	dst->compact_budget = src->compact_budget ? src->compact_budget : 16 * 1024 * 1024;
+
+	if (src->verify > CLOD_REGION_VERIFY_SCRUB) {
+		return region_error(CLOD_REGION_INVALID_USAGE,
+			"Invalid opts.verify %d. Must be one of the CLOD_REGION_VERIFY_* policies.",
+			src->verify);
+	}
+	dst->verify = src->verify ? src->verify : CLOD_REGION_VERIFY_FIRST;
+	dst->verify_sample = src->verify_sample ? src->verify_sample : 64;
+
+	if (src->shared > 1) {
+		return region_error(CLOD_REGION_INVALID_USAGE,
+			"Invalid opts.shared %d. Must be 0 or 1.",
+			src->shared);
+	}
+	dst->shared = src->shared;
+
+	if (src->index > 1) {
+		return region_error(CLOD_REGION_INVALID_USAGE,
+			"Invalid opts.index %d. Must be 0 or 1.",
+			src->index);
+	}
+	dst->index = src->index;
+
+	if (src->sector_size) {
+		if (src->sector_size < 512 || (src->sector_size & (src->sector_size - 1)) != 0) {
+			return region_error(CLOD_REGION_INVALID_USAGE,
+				"Invalid opts.sector_size %"PRIu32". Must be a power of 2 and at least 512.",
+				src->sector_size);
+		}
+		dst->sector_size = src->sector_size;
+	} else {
+		dst->sector_size = HEADER_VANILLA_SECTOR_SIZE;
+	}
+
 	if (src->unix_fd) {
 		if (src->unix_fd < 0) {
 			return region_error(CLOD_REGION_INVALID_USAGE,
@@ -63,7 +156,7 @@ enum clod_region_result read_opts(struct clod_region_opts *dst, const struct clo
 		strncpy(dst->region_ext, src->region_ext, CLOD_REGION_EXTENSION_MAX);
 		dst->region_ext[CLOD_REGION_EXTENSION_MAX] = '\0';
 	} else {
-		strncpy(dst->region_ext, "mcr", CLOD_REGION_EXTENSION_MAX + 1);
+		strncpy(dst->region_ext, "mca", CLOD_REGION_EXTENSION_MAX + 1);
 	}
 
 	if (src->chunk_ext[0]) {
@@ -85,6 +178,7 @@ enum clod_region_result read_opts(struct clod_region_opts *dst, const struct clo
 			return region_error(CLOD_REGION_INVALID_USAGE,
 				"libdeflate has been disabled, but it is required to compress/decompress minecraft-compatible region files.");
 		}
+		dst->compression = CLOD_ZLIB;
 	} else {
 		if (clod_compression_support(CLOD_LZ4F)) {
 			dst->compression = CLOD_LZ4F;
@@ -93,28 +187,63 @@ enum clod_region_result read_opts(struct clod_region_opts *dst, const struct clo
 		}
 	}
 
-	return true;
+	return CLOD_REGION_OK;
 }
 struct clod_region *clod_region_open(const char *path, const struct clod_region_opts *opts) {
 	struct clod_region *r = malloc(sizeof(struct clod_region));
 	if (!r) return nullptr;
 
 	memset(r, 0, sizeof(struct clod_region));
-	if (!read_opts(&r->opts, opts)) {
+	if (read_opts(&r->opts, opts) != CLOD_REGION_OK) {
 		free(r);
 		return nullptr;
 	}
 
-	mutex_init(&r->mtx);
-	auto const res = dir_open(&r->d, path, &r->opts);
+	mutex_init(&r->codec_mtx);
+	mutex_init(&r->ring_mtx);
+	mutex_init(&r->external_mtx);
+	auto res = stats_create(r);
+	if (res == CLOD_REGION_OK) {
+		res = dir_open(&r->d, path, &r->opts);
+		if (res != CLOD_REGION_OK) stats_destroy(r);
+	}
+	if (res == CLOD_REGION_OK && r->opts.shared) {
+		char name[CLOD_REGION_PREFIX_MAX + sizeof(".shared")];
+		snprintf(name, sizeof(name), "%s.shared", r->opts.prefix);
+		res = shared_open(&r->shared, r->d, name, &r->opts);
+		if (res != CLOD_REGION_OK) {
+			dir_close(r->d);
+			stats_destroy(r);
+		}
+	}
+	if (res == CLOD_REGION_OK) {
+		res = file_cache_create(r);
+		if (res != CLOD_REGION_OK) {
+			if (r->shared) shared_close(r->shared);
+			dir_close(r->d);
+			stats_destroy(r);
+		}
+	}
 	if (res != CLOD_REGION_OK) {
-		mutex_destroy(&r->mtx);
+		mutex_destroy(&r->external_mtx);
+		mutex_destroy(&r->ring_mtx);
+		mutex_destroy(&r->codec_mtx);
 		free(r);
 		return nullptr;
 	}
 
-	r->cache_len = 0;
-	r->cache = nullptr;
+	if (r->opts.io_engine == CLOD_REGION_IO_URING) {
+		ring first = ring_pool_get(r);
+		if (first) ring_pool_put(r, first);
+		else r->opts.io_engine = CLOD_REGION_IO_MMAP;
+	}
+
+	mutex_init(&r->compact_mtx);
+	condvar_init(&r->compact_wake);
+	if (region_index_open(r) != CLOD_REGION_OK || compact_start(r) != CLOD_REGION_OK) {
+		(void)clod_region_close(r);
+		return nullptr;
+	}
 
 	return r;
 }
@@ -124,9 +253,23 @@ enum clod_region_result clod_region_close(struct clod_region *r) {
 		exit(EXIT_FAILURE);
 	}
 
-	mutex_destroy(&r->mtx);
+	// The background compactor uses the directory and file cache.
+	compact_stop(r);
+	condvar_destroy(&r->compact_wake);
+	mutex_destroy(&r->compact_mtx);
+
+	auto const index_res = region_index_close(r);
 	auto const dir_res = dir_close(r->d);
 	auto const fc_res = file_cache_destroy(r);
+	if (r->shared) shared_close(r->shared);
+	codec_destroy(r);
+	ring_pool_destroy(r);
+	external_cache_destroy(r);
+	stats_destroy(r);
+	mutex_destroy(&r->codec_mtx);
+	mutex_destroy(&r->ring_mtx);
+	mutex_destroy(&r->external_mtx);
 	free(r);
+	if (index_res != CLOD_REGION_OK) return index_res;
 	return dir_res != CLOD_REGION_OK ? dir_res : fc_res;
 }
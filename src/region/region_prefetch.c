@@ -0,0 +1,71 @@
+#include <clod/region.h>
+#include "region_impl.h"
+#include "region_file.h"
+#include "batch.h"
+#include "error.h"
+#include <stdlib.h>
+
+// Prefetch the chunks of a batch in one region file, merging chunks that are stored next to each other.
+static void prefetch_file(struct clod_region *region, struct batch_entry *entries, const size_t count) {
+	struct region_file *rf;
+	if (region_file_rdlock(region, &rf, entries[0].region_pos) != CLOD_REGION_OK) return;
+
+	void *data;
+	size_t size;
+	if (file_get(rf->f, &data, &size) != CLOD_REGION_OK || rf->fmt.version == 0) {
+		rbmutex_rdunlock(&rf->mtx);
+		return;
+	}
+
+	// Chunks may move once their stripes are unlocked, which only makes the hint less useful.
+	uint64_t stripes = 0;
+	for (size_t i = 0; i < count; i++) stripes |= region_file_stripe(entries[i].index);
+	region_file_stripes_rdlock(rf, stripes);
+	for (size_t i = 0; i < count; i++) {
+		auto const location = format_location_get(&rf->fmt, data, entries[i].index);
+		entries[i].key = (uint64_t)location.offset << 32 | location.sectors;
+	}
+	region_file_stripes_rdunlock(rf, stripes);
+	batch_sort(entries, count);
+
+	uint64_t start = 0, end = 0;
+	for (size_t i = 0; i < count; i++) {
+		const uint64_t offset = entries[i].key >> 32;
+		const uint64_t sectors = entries[i].key & UINT32_MAX;
+		if (sectors == 0 || offset < rf->fmt.header_sectors) continue;
+
+		if (offset > end) {
+			if (end > start) file_prefetch(rf->f, start * rf->fmt.sector_size, (end - start) * rf->fmt.sector_size);
+			start = offset;
+		}
+		if (offset + sectors > end) end = offset + sectors;
+	}
+	if (end > start) file_prefetch(rf->f, start * rf->fmt.sector_size, (end - start) * rf->fmt.sector_size);
+
+	rbmutex_rdunlock(&rf->mtx);
+}
+
+enum clod_region_result clod_region_prefetch(struct clod_region *region, const int64_t *positions, const size_t count) {
+	REGION_PUBLIC_ENTER(region);
+
+	struct batch_entry *entries = malloc(count * sizeof(entries[0]));
+	if (!entries && count > 0) {
+		REGION_PUBLIC_LEAVE(region);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for %zu prefetches.", count);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		batch_entry_init(&entries[i], positions + i * region->opts.dims, region->opts.dims, i);
+	}
+	batch_sort(entries, count);
+
+	for (size_t start = 0; start < count;) {
+		const size_t end = batch_file_end(entries, count, start);
+		prefetch_file(region, entries + start, end - start);
+		start = end;
+	}
+	free(entries);
+
+	REGION_PUBLIC_LEAVE(region);
+	return CLOD_REGION_OK;
+}
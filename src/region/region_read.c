@@ -1,39 +1,494 @@
 #include <clod/region.h>
+#include <clod/hash.h>
 #include "region_impl.h"
 #include "region_file.h"
+#include "batch.h"
 #include "error.h"
+#include <stdlib.h>
+
+// Make a view of stored chunk data, opening the chunk's file if it is external.
+static enum clod_region_result view_from_chunk(
+	struct clod_region *region,
+	struct region_file *rf,
+	const int64_t *pos,
+	const struct format_chunk *chunk,
+	struct clod_region_view *view
+) {
+	struct external_file *ext = nullptr;
+	const void *chunk_data = chunk->data;
+	size_t chunk_size = chunk->size;
+	if (chunk->external) {
+		auto const res = external_get(region, pos, &ext);
+		if (res != CLOD_REGION_OK) return res;
+
+		void *map;
+		(void)file_get(ext->f, &map, &chunk_size);
+		chunk_data = map;
+	}
+
+	view->data = chunk_data;
+	view->size = chunk_size;
+	view->compression = chunk->compression;
+	view->uncompressed_size = chunk->compression == CLOD_UNCOMPRESSED ? chunk_size : chunk->uncompressed_size;
+	view->checksum = chunk->checksum;
+	view->_internal[0] = (uintptr_t)rf;
+	view->_internal[1] = (uintptr_t)ext;
+	return CLOD_REGION_OK;
+}
+
+// Get a view of a chunk in a region file. The read locks of the region file and the chunk's stripe must be held.
+static enum clod_region_result view_get(
+	struct clod_region *region,
+	struct region_file *rf,
+	const int64_t *pos,
+	const size_t index,
+	struct clod_region_view *view
+) {
+	void *data;
+	size_t size;
+	struct format_chunk chunk;
+	auto res = file_get(rf->f, &data, &size);
+	if (res == CLOD_REGION_OK) res = format_chunk_get(&rf->fmt, data, size, index, &chunk);
+	if (res != CLOD_REGION_OK) return res;
+
+	return view_from_chunk(region, rf, pos, &chunk, view);
+}
+
+// Release resources held by a view, other than its locks.
+static void view_put(struct clod_region *region, const struct clod_region_view *view) {
+	auto const ext = (struct external_file *)view->_internal[1];
+	if (ext) external_put(region, ext);
+}
+
+/**
+ * Acquire a view without entering the region.
+ * seen is set to where reads of the view begin from, for region_file_read_retry.
+ */
+static enum clod_region_result view_acquire(
+	struct clod_region *region,
+	const int64_t *pos,
+	struct clod_region_view *view,
+	uint64_t *seen
+) {
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	const size_t index = chunk_index(pos, region_pos, region->opts.dims);
+
+	const uint64_t stripe = region_file_stripe(index);
+	for (;;) {
+		struct region_file *rf;
+		auto res = region_file_rdlock(region, &rf, region_pos);
+		if (res != CLOD_REGION_OK) return res;
+
+		region_file_stripes_rdlock(rf, stripe);
+		*seen = region_file_read_begin(rf);
+		const size_t mark = error_hold();
+		res = view_get(region, rf, pos, index, view);
+		// Another process may have moved the chunk, or grown the file past the mapping, while it was found.
+		const bool retry = region_file_read_retry(rf, *seen);
+		error_release(mark, !retry);
+		if (res == CLOD_REGION_OK && !retry) {
+			view->_internal[2] = stripe;
+			return res;
+		}
+
+		if (res == CLOD_REGION_OK) view_put(region, view);
+		region_file_stripes_rdunlock(rf, stripe);
+		rbmutex_rdunlock(&rf->mtx);
+		if (!retry) return res;
+	}
+}
+
+// Release a view without leaving the region.
+static void view_release(struct clod_region *region, const struct clod_region_view *view) {
+	auto const rf = (struct region_file *)view->_internal[0];
+
+	view_put(region, view);
+	region_file_stripes_rdunlock(rf, view->_internal[2]);
+	rbmutex_rdunlock(&rf->mtx);
+}
+
+struct region_file *view_region_file(const struct clod_region_view *view) {
+	return (struct region_file *)view->_internal[0];
+}
+
+// Decompress the chunk at index into a buffer, checking it against its checksum if opts.verify calls for it.
+static enum clod_region_result view_decode(
+	struct clod_region *region,
+	const struct clod_region_view *view,
+	const size_t index,
+	uint8_t *buff, const size_t buff_size,
+	size_t *size
+) {
+	enum clod_compression_result res;
+	auto const rf = view_region_file(view);
+	const bool verify = verify_wanted(region, rf, index, view->checksum);
+
+	if (view->compression == CLOD_UNCOMPRESSED) {
+		if (size) *size = view->size;
+		if (buff_size < view->size) return CLOD_REGION_SHORT_BUFFER;
+		if (!size && buff_size != view->size) {
+			return region_error(CLOD_REGION_INVALID_USAGE,
+				"Buffer size %zu does not match chunk size %zu.", buff_size, view->size);
+		}
+		if (!verify) {
+			memcpy(buff, view->data, view->size);
+			return CLOD_REGION_OK;
+		}
+		return verify_check(rf, index, view->checksum, verify_copy(buff, view->data, view->size));
+	}
+
+	// With the size known, a short buffer is reported without decompressing,
+	// and the data is decompressed in one pass straight into the buffer.
+	const size_t known = view->uncompressed_size;
+	if (size && known && buff_size < known) {
+		*size = known;
+		return CLOD_REGION_SHORT_BUFFER;
+	}
+
+	// Corrupted data isn't decompressed, and the data hashed is left in cache for the decompressor.
+	if (verify) {
+		auto const verify_res = verify_check(rf, index, view->checksum, clod_crc32(view->data, view->size));
+		if (verify_res != CLOD_REGION_OK) return verify_res;
+	}
+
+	auto const ctx = codec_decompressor_get(region);
+	if (!ctx) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for decompressor.");
+	}
+	bool done = false;
+	if (size && known) {
+		res = clod_decompress(ctx, buff, known, view->data, view->size, nullptr, view->compression);
+		done = res == CLOD_COMPRESSION_SUCCESS;
+		if (done) *size = known;
+	}
+	// Without a size, or with a stale one, the decompressor finds out the size itself.
+	if (!done) res = clod_decompress(ctx, buff, buff_size, view->data, view->size, size, view->compression);
+	codec_decompressor_put(region, ctx);
+
+	switch (res) {
+		case CLOD_COMPRESSION_SUCCESS:
+			return CLOD_REGION_OK;
+		case CLOD_COMPRESSION_SHORT_BUFFER:
+			return CLOD_REGION_SHORT_BUFFER;
+		case CLOD_COMPRESSION_SHORT_OUTPUT:
+			return region_error(CLOD_REGION_INVALID_USAGE, "Buffer size %zu does not match chunk size.", buff_size);
+		case CLOD_COMPRESSION_MALFORMED:
+			return region_error(CLOD_REGION_MALFORMED, "Failed to decompress chunk data.");
+		case CLOD_COMPRESSION_UNSUPPORTED:
+			return region_error(CLOD_REGION_INVALID_USAGE,
+				"Chunk is compressed with %d, which is not supported by this build.", view->compression);
+		case CLOD_COMPRESSION_ALLOC_FAILED:
+			return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for decompression.");
+	}
+	return region_error(CLOD_REGION_INVALID_USAGE, "Unknown decompression result %d.", res);
+}
+
+// Decompress a chunk with view_decode, counting it in the region's statistics.
+static enum clod_region_result view_decompress(
+	struct clod_region *region,
+	const struct clod_region_view *view,
+	const size_t index,
+	uint8_t *buff, const size_t buff_size,
+	size_t *size
+) {
+	auto const res = view_decode(region, view, index, buff, buff_size, size);
+	if (res == CLOD_REGION_OK) {
+		stats_add(region->stats, STATS_WORD(chunks_read), 1);
+		stats_add(region->stats, STATS_WORD(bytes_read), view->size);
+		stats_add(region->stats, STATS_WORD(bytes_read_uncompressed), size ? *size : buff_size);
+	}
+	return res;
+}
+
+// Read the chunks of a batch in one region file through a ring, so that many reads are in flight at once.
+static void read_file_ring(
+	struct clod_region *region,
+	struct region_file *rf,
+	const ring rg,
+	const char *map, const size_t map_size,
+	struct clod_region_read_request *requests,
+	const struct batch_entry *entries, const size_t count
+) {
+	struct ring_read *reads = malloc(count * sizeof(reads[0]));
+	size_t *slots = malloc(count * sizeof(slots[0]));
+	if (!reads || !slots) {
+		auto const res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for %zu reads.", count);
+		for (size_t i = 0; i < count; i++) requests[entries[i].request].result = res;
+		free(reads);
+		free(slots);
+		return;
+	}
+
+	const size_t sector_size = rf->fmt.sector_size;
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct format_location location;
+		auto const req = &requests[entries[i].request];
+		req->result = format_chunk_locate(&rf->fmt, map, map_size, entries[i].index, &location);
+		if (req->result != CLOD_REGION_OK) continue;
+
+		const size_t offset = location.offset * sector_size;
+		const size_t stored = location.sectors * sector_size;
+		reads[n] = (struct ring_read){
+			.f = rf->f,
+			.offset = offset,
+			.size = map_size - offset < stored ? map_size - offset : stored,
+		};
+		slots[n++] = i;
+	}
+
+	for (size_t done = 0; done < n;) {
+		const size_t wave = ring_read(rg, reads + done, n - done);
+		for (size_t j = done; j < done + wave; j++) {
+			auto const entry = &entries[slots[j]];
+			auto const req = &requests[entry->request];
+			req->result = reads[j].result;
+			if (req->result != CLOD_REGION_OK) continue;
+
+			struct format_chunk chunk;
+			auto const location = format_location_get(&rf->fmt, map, entry->index);
+			req->result = format_chunk_parse(&rf->fmt, entry->index, location, reads[j].data, reads[j].read, &chunk);
+			if (req->result != CLOD_REGION_OK) continue;
+			chunk.uncompressed_size = format_uncompressed_get(&rf->fmt, map, entry->index);
+			chunk.checksum = format_checksum_get(&rf->fmt, map, entry->index);
+
+			struct clod_region_view view;
+			req->result = view_from_chunk(region, rf, req->pos, &chunk, &view);
+			if (req->result != CLOD_REGION_OK) continue;
+
+			req->result = view_decompress(region, &view, entry->index, req->buff, req->buff_size, &req->size);
+			view_put(region, &view);
+		}
+		done += wave;
+	}
+
+	free(reads);
+	free(slots);
+}
+
+// Read the chunks of a batch in one region file.
+// Returns true if the batch overlapped a write by another process and must be read again.
+static bool read_file(
+	struct clod_region *region,
+	struct clod_region_read_request *requests,
+	struct batch_entry *entries, const size_t count
+) {
+	struct region_file *rf;
+	auto res = region_file_rdlock(region, &rf, entries[0].region_pos);
+	if (res != CLOD_REGION_OK) {
+		for (size_t i = 0; i < count; i++) requests[entries[i].request].result = res;
+		return false;
+	}
+
+	uint64_t stripes = 0;
+	for (size_t i = 0; i < count; i++) stripes |= region_file_stripe(entries[i].index);
+	region_file_stripes_rdlock(rf, stripes);
+	const uint64_t seen = region_file_read_begin(rf);
+	const size_t mark = error_hold();
+
+	// Reading in the order chunks are stored lets the kernel's readahead work for us.
+	void *data;
+	size_t size;
+	res = file_get(rf->f, &data, &size);
+	if (res == CLOD_REGION_OK && rf->fmt.version != 0) {
+		for (size_t i = 0; i < count; i++) {
+			entries[i].key = format_location_get(&rf->fmt, data, entries[i].index).offset;
+		}
+		batch_sort(entries, count);
+
+		ring rg;
+		if (region->opts.io_engine == CLOD_REGION_IO_URING && (rg = ring_pool_get(region))) {
+			read_file_ring(region, rf, rg, data, size, requests, entries, count);
+			ring_pool_put(region, rg);
+			const bool retry = region_file_read_retry(rf, seen);
+			error_release(mark, !retry);
+			region_file_stripes_rdunlock(rf, stripes);
+			rbmutex_rdunlock(&rf->mtx);
+			return retry;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		auto const req = &requests[entries[i].request];
+		struct clod_region_view view;
+		req->result = view_get(region, rf, req->pos, entries[i].index, &view);
+		if (req->result != CLOD_REGION_OK) continue;
+
+		req->result = view_decompress(region, &view, entries[i].index, req->buff, req->buff_size, &req->size);
+		view_put(region, &view);
+	}
+
+	const bool retry = region_file_read_retry(rf, seen);
+	error_release(mark, !retry);
+	region_file_stripes_rdunlock(rf, stripes);
+	rbmutex_rdunlock(&rf->mtx);
+	return retry;
+}
+
+// Read a batch of chunks without entering the region.
+static enum clod_region_result read_batch(
+	struct clod_region *region,
+	struct clod_region_read_request *requests,
+	const size_t count
+) {
+	struct batch_entry *entries = malloc(count * sizeof(entries[0]));
+	if (!entries && count > 0) {
+		for (size_t i = 0; i < count; i++) requests[i].result = CLOD_REGION_INVALID_USAGE;
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for %zu reads.", count);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		batch_entry_init(&entries[i], requests[i].pos, region->opts.dims, i);
+	}
+	batch_sort(entries, count);
+
+	for (size_t start = 0; start < count;) {
+		const size_t end = batch_file_end(entries, count, start);
+		while (read_file(region, requests, entries + start, end - start));
+		start = end;
+	}
+	free(entries);
+
+	for (size_t i = 0; i < count; i++) {
+		if (requests[i].result != CLOD_REGION_OK) return requests[i].result;
+	}
+	return CLOD_REGION_OK;
+}
 
 enum clod_region_result clod_region_read(
 	struct clod_region *region,
 	const int64_t *pos,
-	uint8_t *,
-	size_t,
-	size_t *
+	uint8_t *buff,
+	const size_t buff_size,
+	size_t *size
 ) {
 	REGION_PUBLIC_ENTER(region);
+	const uint64_t started = stats_clock();
 
-	mutex_lock(&region->mtx);
+	if (region->opts.io_engine == CLOD_REGION_IO_URING) {
+		struct clod_region_read_request req = { .pos = pos, .buff = buff, .buff_size = buff_size };
+		auto const res = read_batch(region, &req, 1);
+		stats_latency(region->stats, STATS_WORD(read_latency), started);
+		REGION_PUBLIC_LEAVE(region);
 
-	struct region_file *rf;
-	auto res = region_file_get(region, &rf, pos, false);
+		if (size) *size = req.size;
+		if (res == CLOD_REGION_OK && !size && req.size != buff_size) {
+			return region_error(CLOD_REGION_INVALID_USAGE,
+				"Buffer size %zu does not match chunk size %zu.", buff_size, req.size);
+		}
+		return res;
+	}
+
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	const size_t index = chunk_index(pos, region_pos, region->opts.dims);
+	struct clod_region_view view;
+	enum clod_region_result res;
+	bool retry = false;
+	do {
+		uint64_t seen;
+		res = view_acquire(region, pos, &view, &seen);
+		if (res != CLOD_REGION_OK) break;
+
+		const size_t mark = error_hold();
+		res = view_decompress(region, &view, index, buff, buff_size, size);
+		// Data that another process may have overwritten part way through the read is read again.
+		retry = region_file_read_retry(view_region_file(&view), seen);
+		error_release(mark, !retry);
+		view_release(region, &view);
+	} while (retry);
+
+	stats_latency(region->stats, STATS_WORD(read_latency), started);
+	REGION_PUBLIC_LEAVE(region);
+	return res;
+}
+
+enum clod_region_result clod_region_read_many(
+	struct clod_region *region,
+	struct clod_region_read_request *requests,
+	const size_t count
+) {
+	REGION_PUBLIC_ENTER(region);
+	const uint64_t started = stats_clock();
+	auto const res = read_batch(region, requests, count);
+	stats_latency(region->stats, STATS_WORD(read_many_latency), started);
+	REGION_PUBLIC_LEAVE(region);
+	return res;
+}
+
+enum clod_region_result region_read_view(
+	struct clod_region *region,
+	const int64_t *pos,
+	struct clod_region_view *view,
+	uint64_t *seen
+) {
+	REGION_PUBLIC_ENTER(region);
+	const uint64_t started = stats_clock();
+
+	auto const res = view_acquire(region, pos, view, seen);
+	stats_latency(region->stats, STATS_WORD(read_view_latency), started);
 	if (res != CLOD_REGION_OK) {
-		mutex_unlock(&region->mtx);
 		REGION_PUBLIC_LEAVE(region);
 		return res;
 	}
+	stats_add(region->stats, STATS_WORD(chunks_read), 1);
+	stats_add(region->stats, STATS_WORD(bytes_read), view->size);
 
-	rwmutex_rdlock(&rf->mtx);
-	mutex_unlock(&region->mtx);
+	// The region is left when the view is released.
+	return res;
+}
 
-	uint8_t *data;
-	size_t size;
-	res = file_get(rf->f, (void**)&data, &size);
+enum clod_region_result clod_region_read_view(
+	struct clod_region *region,
+	const int64_t *pos,
+	struct clod_region_view *view
+) {
+	uint64_t seen;
+	return region_read_view(region, pos, view, &seen);
+}
+
+void clod_region_view_release(struct clod_region *region, struct clod_region_view *view) {
+	view_release(region, view);
+	view->data = nullptr;
+	view->size = 0;
+	REGION_PUBLIC_LEAVE(region);
+}
+
+enum clod_region_result clod_region_mtime(struct clod_region *region, const int64_t *pos, time_t *mtime) {
+	REGION_PUBLIC_ENTER(region);
+
+	bool found;
+	uint32_t indexed;
+	if (region_index_mtime(region, pos, &found, &indexed)) {
+		if (found) *mtime = (time_t)indexed;
+		REGION_PUBLIC_LEAVE(region);
+		return found ? CLOD_REGION_OK : CLOD_REGION_NOT_FOUND;
+	}
+
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	const size_t index = chunk_index(pos, region_pos, region->opts.dims);
+
+	struct region_file *rf;
+	auto res = region_file_rdlock(region, &rf, region_pos);
 	if (res != CLOD_REGION_OK) {
-		rwmutex_rdunlock(&rf->mtx);
 		REGION_PUBLIC_LEAVE(region);
 		return res;
 	}
 
+	void *data;
+	size_t size;
+	const uint64_t stripe = region_file_stripe(index);
+	region_file_stripes_rdlock(rf, stripe);
+	res = file_get(rf->f, &data, &size);
+	if (res == CLOD_REGION_OK) {
+		if (rf->fmt.version == 0 || format_location_get(&rf->fmt, data, index).sectors == 0) {
+			res = CLOD_REGION_NOT_FOUND;
+		} else {
+			*mtime = (time_t)format_mtime_get(&rf->fmt, data, index);
+		}
+	}
+
+	region_file_stripes_rdunlock(rf, stripe);
+	rbmutex_rdunlock(&rf->mtx);
 	REGION_PUBLIC_LEAVE(region);
 	return res;
 }
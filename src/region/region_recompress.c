@@ -0,0 +1,407 @@
+/**
+ * Recompression rewrites region files the way compaction does, with every chunk compressed again on the way.
+ * The writers of every stripe are held while a file is rewritten, but only its read lock until the new file is ready,
+ * so readers carry on with the old file and only wait for the new one to be swapped in.
+ * A crash before the rename leaves the old file as it was, along with any chunk files written for the new one,
+ * which are otherwise removed when the new file is thrown away.
+ *
+ * Threads each take whole region files from the directory, read their chunks in the order they are stored,
+ * and write them one after another into the new file, which grows as it's filled.
+ * The new file gets a fresh header, as the one it had might not be able to record the new compression method.
+ *
+ * Chunks that can't be decompressed, or don't match their checksum, are copied as they are stored,
+ * so scrubbing still finds them. Chunks kept in chunk files of their own are left there,
+ * as replacing a chunk file can't be made atomic with replacing the region file.
+ */
+#include <clod/region.h>
+#include <clod/hash.h>
+#include "region_impl.h"
+#include "region_file.h"
+#include "filename.h"
+#include "error.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Every stripe of a region file.
+#define STRIPES_ALL UINT64_MAX
+
+struct recompress {
+	struct clod_region *region;
+	enum clod_compression_method method;
+	enum clod_compression_level level;
+
+	struct region_files files;
+
+	// Held to set the result.
+	mutex mtx;
+	enum clod_region_result result;
+};
+
+struct recompress_worker {
+	struct recompress *recompress;
+	thread t;
+	struct clod_decompressor *dctx;
+	struct clod_compressor *cctx;
+	// Decompressed chunk.
+	uint8_t *buff;
+	size_t cap;
+};
+
+// The new file being filled.
+struct recompress_out {
+	struct clod_region *region;
+	file f;
+	struct format fmt;
+	char *map;
+	size_t size;
+	// Next free sector.
+	uint32_t offset;
+	// Chunks moved into chunk files of their own, which the file cache might hold stale,
+	// and which nothing refers to unless the new file is swapped in.
+	bool external[HEADER_CHUNKS];
+};
+
+// Keep the first result that wasn't CLOD_REGION_OK.
+static void recompress_fail(struct recompress *rc, const enum clod_region_result res) {
+	mutex_lock(&rc->mtx);
+	if (rc->result == CLOD_REGION_OK) rc->result = res;
+	mutex_unlock(&rc->mtx);
+}
+
+// Make room for n more bytes after the next free sector of the new file.
+static enum clod_region_result out_reserve(struct recompress_out *out, const size_t n) {
+	const size_t need = (size_t)out->offset * out->fmt.sector_size + n;
+	if (need <= out->size) return CLOD_REGION_OK;
+
+	// The file grows geometrically, and is cut down to size once it's full.
+	auto const res = stats_truncate(out->region->stats, out->f, need > out->size * 2 ? need : out->size * 2);
+	if (res != CLOD_REGION_OK) return res;
+	void *map;
+	(void)file_get(out->f, &map, &out->size);
+	out->map = map;
+	return CLOD_REGION_OK;
+}
+
+// Make room for compressed chunk data at the next free sector of the new file, after room for the chunk header.
+static enum clod_region_result out_reserve_compressed(void *user, const size_t capacity, uint8_t **dst) {
+	struct recompress_out *out = user;
+	auto const res = out_reserve(out, CHUNK_HEADER_SIZE + capacity);
+	if (res == CLOD_REGION_OK) *dst = (uint8_t *)out->map + (size_t)out->offset * out->fmt.sector_size + CHUNK_HEADER_SIZE;
+	return res;
+}
+
+/**
+ * Place stored chunk data at the next free sector of the new file, or in a chunk file if it's too large.
+ * The data is already in place at the start of the sector, after room for the chunk header.
+ */
+static enum clod_region_result out_place(
+	struct recompress_out *out,
+	const int64_t *pos,
+	const size_t index,
+	const uint8_t type,
+	const size_t size,
+	uint32_t *checksum
+) {
+	auto const r = out->region;
+	const uint32_t sector_size = out->fmt.sector_size;
+	char *chunk = out->map + (size_t)out->offset * sector_size;
+	const bool external = CHUNK_HEADER_SIZE + size > (size_t)CHUNK_SECTORS_MAX * sector_size;
+	const uint32_t sectors = (uint32_t)((CHUNK_HEADER_SIZE + (external ? 0 : size) + sector_size - 1) / sector_size);
+	if (out->offset > out->fmt.offset_max) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Recompressed chunks don't fit in a region file.");
+	}
+
+	*checksum = clod_crc32(chunk + CHUNK_HEADER_SIZE, size);
+	if (external) {
+		char filename[REGION_FILENAME_MAX + 1];
+		filename_make(filename, CHUNK_FILE_PREFIX, r->opts.chunk_ext, pos, r->opts.dims);
+		auto const res = dir_replace(r->d, filename, chunk + CHUNK_HEADER_SIZE, size, true, &r->opts);
+		if (res != CLOD_REGION_OK) return res;
+		out->external[index] = true;
+	}
+	beu32_enc(chunk, (uint32_t)(external ? 1 : size + 1));
+	beu8_enc(chunk + 4, (uint8_t)(external ? type | CHUNK_EXTERNAL : type));
+
+	format_location_set(&out->fmt, out->map, index, (struct format_location){ .offset = out->offset, .sectors = sectors });
+	out->offset += sectors;
+	return CLOD_REGION_OK;
+}
+
+// Compress a decompressed chunk into the new file. Returns the size it was compressed to.
+static enum clod_region_result chunk_compress(
+	struct recompress_worker *w,
+	struct recompress_out *out,
+	const uint8_t *data, const size_t data_size,
+	size_t *size
+) {
+	auto const rc = w->recompress;
+	if (rc->method != CLOD_UNCOMPRESSED) {
+		return codec_compress(w->cctx, data, data_size, rc->method, rc->level, out_reserve_compressed, out, size);
+	}
+
+	uint8_t *dst;
+	auto const res = out_reserve_compressed(out, data_size, &dst);
+	if (res != CLOD_REGION_OK) return res;
+	memcpy(dst, data, data_size);
+	*size = data_size;
+	return CLOD_REGION_OK;
+}
+
+/**
+ * Copy a chunk of the old file into the new one, compressing it again unless it's corrupted or external.
+ * Sets malformed if the chunk is corrupted.
+ */
+static enum clod_region_result chunk_recompress(
+	struct recompress_worker *w,
+	struct region_file *rf,
+	const int64_t *region_pos,
+	const char *map, const size_t size,
+	const size_t index,
+	struct recompress_out *out,
+	bool *malformed
+) {
+	auto const r = w->recompress->region;
+	struct format_chunk chunk;
+	auto res = format_chunk_get(&rf->fmt, map, size, index, &chunk);
+	if (res != CLOD_REGION_OK) return res;
+
+	const uint32_t old_checksum = format_checksum_get(&rf->fmt, map, index);
+	const uint32_t old_uncompressed = format_uncompressed_get(&rf->fmt, map, index);
+	format_mtime_set(&out->fmt, out->map, index, format_mtime_get(&rf->fmt, map, index));
+
+	bool intact = !chunk.external && !(old_checksum && clod_crc32(chunk.data, chunk.size) != old_checksum);
+	size_t plain_size = chunk.size;
+	const uint8_t *plain = (const uint8_t *)chunk.data;
+	if (intact && chunk.compression != CLOD_UNCOMPRESSED) {
+		intact = codec_decompress(w->dctx, chunk.data, chunk.size, chunk.compression, old_uncompressed,
+			&w->buff, &w->cap, &plain_size) == CLOD_REGION_OK;
+		plain = w->buff;
+	}
+	if (!chunk.external && !intact) *malformed = true;
+
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+	chunk_pos(region_pos, index, pos, r->opts.dims);
+	uint32_t checksum = 0;
+	if (intact) {
+		size_t stored;
+		res = chunk_compress(w, out, plain, plain_size, &stored);
+		if (res == CLOD_REGION_OK) {
+			res = out_place(out, pos, index, format_compression_encode(&out->fmt, w->recompress->method), stored, &checksum);
+		}
+		format_uncompressed_set(&out->fmt, out->map, index, plain_size);
+		format_checksum_set(&out->fmt, out->map, index, checksum);
+		return res;
+	}
+
+	// Everything else is copied as it's stored, with the checksum it had.
+	const uint8_t type = format_compression_encode(&out->fmt, chunk.compression);
+	if (type == 0) {
+		return region_error(CLOD_REGION_INVALID_USAGE,
+			"Compression %d of a chunk that's kept as it is can't be stored in the new header.", chunk.compression);
+	}
+	const uint32_t sector_size = out->fmt.sector_size;
+	const size_t stored = chunk.external ? 0 : chunk.size;
+	res = out_reserve(out, CHUNK_HEADER_SIZE + stored);
+	if (res != CLOD_REGION_OK) return res;
+	char *dst = out->map + (size_t)out->offset * sector_size;
+	if (chunk.external) {
+		beu32_enc(dst, 1);
+		beu8_enc(dst + 4, (uint8_t)(type | CHUNK_EXTERNAL));
+		format_location_set(&out->fmt, out->map, index, (struct format_location){ .offset = out->offset, .sectors = 1 });
+		out->offset += 1;
+	} else {
+		memcpy(dst + CHUNK_HEADER_SIZE, chunk.data, chunk.size);
+		res = out_place(out, pos, index, type, chunk.size, &checksum);
+	}
+	format_uncompressed_set(&out->fmt, out->map, index, old_uncompressed);
+	format_checksum_set(&out->fmt, out->map, index, old_checksum);
+	return res;
+}
+
+// Recompress a region file whose read lock and every writer lock are held.
+static enum clod_region_result file_recompress_locked(
+	struct recompress_worker *w,
+	struct region_file *rf,
+	const int64_t *region_pos
+) {
+	auto const rc = w->recompress;
+	auto const r = rc->region;
+	if (rf->fmt.version == 0) return CLOD_REGION_OK;
+
+	void *map;
+	size_t size;
+	auto res = file_get(rf->f, &map, &size);
+	if (res != CLOD_REGION_OK) return res;
+	file_prefetch(rf->f, 0, SIZE_MAX);
+
+	// Every writer is held, so the chunks can't move.
+	uint16_t indices[HEADER_CHUNKS];
+	const size_t n = region_file_chunks(rf, map, indices);
+
+	// The header is chosen the way it is for a new file, as if the region used the new method.
+	struct clod_region_opts opts = r->opts;
+	opts.compression = rc->method;
+	opts.sector_size = rf->fmt.sector_size;
+	const int version = region_file_version(&opts);
+
+	struct recompress_out *out = calloc(1, sizeof(*out));
+	if (!out) return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for recompression.");
+	out->region = r;
+	res = region_file_temp_open(r, region_pos, &out->f);
+	if (res != CLOD_REGION_OK) {
+		free(out);
+		return res;
+	}
+
+	const size_t header_size = format_create_size(version, opts.sector_size);
+	res = stats_truncate(r->stats, out->f, header_size > size ? header_size : size);
+	if (res == CLOD_REGION_OK) {
+		void *out_map;
+		(void)file_get(out->f, &out_map, &out->size);
+		out->map = out_map;
+		format_create(&out->fmt, out->map, out->size, version, &opts);
+		out->offset = out->fmt.header_sectors;
+	}
+
+	bool malformed = false;
+	for (size_t i = 0; i < n && res == CLOD_REGION_OK; i++) {
+		res = chunk_recompress(w, rf, region_pos, map, size, indices[i], out, &malformed);
+	}
+	if (res == CLOD_REGION_OK) res = stats_truncate(r->stats, out->f, (size_t)out->offset * out->fmt.sector_size);
+
+	const bool keep = res == CLOD_REGION_OK;
+	res = region_file_swap(r, rf, region_pos, out->f, &out->fmt, keep, res);
+	// The new file was swapped in if the region file has it open, even if syncing the directory failed afterwards.
+	const bool swapped = rf->f == out->f;
+	if (swapped) {
+		// Chunks changed underneath any note of them having been checked.
+		for (size_t i = 0; i < HEADER_CHUNKS; i++) verify_forget(rf, i);
+		// Sizes that weren't known before are now.
+		region_index_reload(r, rf);
+	}
+
+	// Chunk files written for the new file are removed if it was thrown away, as nothing refers to them.
+	region_file_stripes_wrlock(rf, STRIPES_ALL);
+	for (size_t i = 0; i < HEADER_CHUNKS; i++) {
+		if (!out->external[i]) continue;
+		int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+		chunk_pos(region_pos, i, pos, r->opts.dims);
+		external_forget(r, pos);
+		if (!swapped) {
+			char filename[REGION_FILENAME_MAX + 1];
+			filename_make(filename, CHUNK_FILE_PREFIX, r->opts.chunk_ext, pos, r->opts.dims);
+			(void)dir_unlink(r->d, filename);
+		}
+	}
+	region_file_stripes_wrunlock(rf, STRIPES_ALL);
+	free(out);
+
+	if (res == CLOD_REGION_OK && malformed) {
+		return region_error(CLOD_REGION_MALFORMED, "Corrupted chunks were copied without being recompressed.");
+	}
+	return res;
+}
+
+static enum clod_region_result file_recompress(struct recompress_worker *w, const int64_t *region_pos) {
+	auto const r = w->recompress->region;
+	struct region_file *rf;
+	auto res = region_file_get(r, &rf, region_pos, false);
+	if (res != CLOD_REGION_OK) return res == CLOD_REGION_NOT_FOUND ? CLOD_REGION_OK : res;
+
+	// The file stays pinned until its read lock is held, so it can't be evicted meanwhile.
+	region_file_writers_lock(rf, STRIPES_ALL);
+	region_file_lock_pinned(rf);
+
+	res = file_recompress_locked(w, rf, region_pos);
+
+	rbmutex_rdunlock(&rf->mtx);
+	region_file_writers_unlock(rf, STRIPES_ALL);
+	return res;
+}
+
+static void *recompress_worker(void *arg) {
+	struct recompress_worker *w = arg;
+	auto const rc = w->recompress;
+
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	while (region_files_next(&rc->files, region_pos)) {
+		// Files that fail are left as they were, and the rest are still recompressed.
+		auto const res = file_recompress(w, region_pos);
+		if (res != CLOD_REGION_OK) recompress_fail(rc, res);
+	}
+	return nullptr;
+}
+
+enum clod_region_result clod_region_recompress(
+	struct clod_region *region,
+	const enum clod_compression_method method,
+	const enum clod_compression_level level,
+	const uint32_t threads
+) {
+	REGION_PUBLIC_ENTER(region);
+
+	if (region->opts.mode != CLOD_REGION_MODE_RDWR) {
+		REGION_PUBLIC_LEAVE(region);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Attempted to recompress a read-only region.");
+	}
+	// Other processes would be left with the replaced file open.
+	if (region->opts.shared) {
+		REGION_PUBLIC_LEAVE(region);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Attempted to recompress a region shared between processes.");
+	}
+	if (!clod_compression_support(method) || level >= CLOD_COMPRESSION_LEVELS) {
+		REGION_PUBLIC_LEAVE(region);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Compression %d at level %d is not supported by this build.", method, level);
+	}
+
+	const size_t procs = num_procs() > 0 ? (size_t)num_procs() : 1;
+	const size_t n = threads ? threads : procs;
+
+	struct recompress rc = {
+		.region = region,
+		.method = method,
+		.level = level,
+		.result = CLOD_REGION_OK,
+	};
+	auto res = region_files_open(&rc.files, region);
+	if (res != CLOD_REGION_OK) {
+		REGION_PUBLIC_LEAVE(region);
+		return res;
+	}
+	mutex_init(&rc.mtx);
+
+	struct recompress_worker *ws = calloc(n, sizeof(ws[0]));
+	bool ok = ws != nullptr;
+	for (size_t i = 0; ok && i < n; i++) {
+		ws[i].recompress = &rc;
+		ws[i].dctx = clod_decompressor_init();
+		ws[i].cctx = clod_compressor_init();
+		ok = ws[i].dctx && ws[i].cctx;
+	}
+
+	if (!ok) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for recompression.");
+	} else {
+		size_t started = 0;
+		for (; started < n; started++) {
+			if (!thread_create(&ws[started].t, recompress_worker, &ws[started])) {
+				recompress_fail(&rc, region_error(CLOD_REGION_INVALID_USAGE, "Failed to start recompression thread."));
+				break;
+			}
+		}
+		for (size_t i = 0; i < started; i++) thread_join(ws[i].t);
+		res = rc.result;
+	}
+
+	for (size_t i = 0; ws && i < n; i++) {
+		if (ws[i].dctx) clod_decompressor_free(ws[i].dctx);
+		if (ws[i].cctx) clod_compressor_free(ws[i].cctx);
+		free(ws[i].buff);
+	}
+	free(ws);
+	mutex_destroy(&rc.mtx);
+	region_files_close(&rc.files);
+
+	REGION_PUBLIC_LEAVE(region);
+	return res;
+}
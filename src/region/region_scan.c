@@ -0,0 +1,350 @@
+/**
+ * Scanning is a pipeline of two pools of threads sharing a fixed set of buffers.
+ *
+ * I/O threads take positions from a region iterator, so each reads through whole region files,
+ * and copy the stored chunk data into a free buffer, which is where the file's pages are faulted in.
+ * Workers take filled buffers in the order they were filled, decompress them with their own decompressor
+ * into a buffer of their own, and pass the result to the visitor.
+ *
+ * There are only as many buffers as the queue is deep, so I/O threads wait for workers to free one
+ * when they get ahead, and memory use doesn't grow with the size of the region.
+ */
+#include <clod/region.h>
+#include "region_impl.h"
+#include "region_file.h"
+#include "error.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Size of a worker's decompression buffer to begin with. Grown when a chunk doesn't fit.
+#define SCAN_BUFFER_MIN (256 * 1024)
+// Largest decompressed chunk, past which the chunk is assumed to be malformed.
+#define SCAN_BUFFER_MAX ((size_t)1 << 30)
+
+struct scan_item {
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+	// Stored chunk data. Kept between uses so that buffers are recycled.
+	uint8_t *data;
+	size_t size;
+	size_t cap;
+	enum clod_compression_method compression;
+	// Size of the chunk once decompressed, or 0 if it isn't known.
+	size_t uncompressed_size;
+};
+
+struct scan {
+	struct clod_region *region;
+	const struct clod_region_scan_opts *opts;
+	struct clod_region_iter *iter;
+
+	// Held to use the queues and the state below.
+	mutex mtx;
+	// Broadcast when an item is ready, or when the last I/O thread finishes.
+	condvar ready_cv;
+	// Broadcast when an item is freed, or the scan is stopped.
+	condvar free_cv;
+
+	struct scan_item *items;
+	size_t depth;
+	// Stack of free item indices.
+	size_t *free;
+	size_t free_len;
+	// Ring of filled item indices, in the order they were filled.
+	size_t *ready;
+	size_t ready_head;
+	size_t ready_len;
+
+	size_t readers_left;
+	atomic bool stopped;
+	enum clod_region_result result;
+};
+
+// Stop the scan with a result, unless it was already stopped.
+static void scan_stop(struct scan *s, const enum clod_region_result res) {
+	mutex_lock(&s->mtx);
+	if (!s->stopped) {
+		s->stopped = true;
+		s->result = res;
+	}
+	condvar_broadcast(&s->free_cv);
+	condvar_broadcast(&s->ready_cv);
+	mutex_unlock(&s->mtx);
+}
+
+// Pass a chunk that couldn't be read to the error callback, or stop the scan if there isn't one.
+static void scan_error(struct scan *s, const int64_t *pos, const enum clod_region_result res) {
+	if (s->opts->error) s->opts->error(s->opts->user, pos, res);
+	else scan_stop(s, res);
+}
+
+// Copy a chunk's stored data into an item.
+// ahead is the region file the calling I/O thread last read ahead through.
+static enum clod_region_result item_fill(struct scan *s, struct scan_item *item, struct region_file **ahead) {
+	struct clod_region_view view;
+	uint64_t seen;
+	auto const res = region_read_view(s->region, item->pos, &view, &seen);
+	if (res != CLOD_REGION_OK) return res;
+
+	// The thread reads through the whole file in the order it's stored, so all of it is read ahead,
+	// whatever opts.access tells the kernel about other reads.
+	auto const rf = view_region_file(&view);
+	if (rf != *ahead) {
+		file_prefetch(rf->f, 0, SIZE_MAX);
+		*ahead = rf;
+	}
+
+	if (view.size > item->cap) {
+		uint8_t *data = realloc(item->data, view.size);
+		if (!data) {
+			clod_region_view_release(s->region, &view);
+			return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for chunk data.");
+		}
+		item->data = data;
+		item->cap = view.size;
+	}
+	// Chunks are checked against their checksum in the same pass that copies them.
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	const size_t index = chunk_index(item->pos, region_pos, s->region->opts.dims);
+	enum clod_region_result verify_res = CLOD_REGION_OK;
+	const size_t mark = error_hold();
+	if (verify_wanted(s->region, rf, index, view.checksum)) {
+		verify_res = verify_check(rf, index, view.checksum, verify_copy(item->data, view.data, view.size));
+	} else {
+		memcpy(item->data, view.data, view.size);
+	}
+	item->size = view.size;
+	item->compression = view.compression;
+	item->uncompressed_size = view.uncompressed_size;
+	// A copy that another process may have overwritten part way through is made again.
+	const bool retry = region_file_read_retry(rf, seen);
+	error_release(mark, !retry);
+	clod_region_view_release(s->region, &view);
+	return retry ? item_fill(s, item, ahead) : verify_res;
+}
+
+static void *scan_reader(void *arg) {
+	struct scan *s = arg;
+	const size_t pos_size = sizeof(int64_t) * s->region->opts.dims;
+
+	int64_t pos[CLOD_REGION_DIMENSIONS_MAX];
+	struct region_file *ahead = nullptr;
+	while (!s->stopped && clod_region_iter_next(s->iter, pos)) {
+		mutex_lock(&s->mtx);
+		while (!s->stopped && s->free_len == 0) condvar_wait(&s->free_cv, &s->mtx);
+		const bool stopped = s->stopped;
+		const size_t i = stopped ? 0 : s->free[--s->free_len];
+		mutex_unlock(&s->mtx);
+		if (stopped) break;
+
+		auto const item = &s->items[i];
+		memcpy(item->pos, pos, pos_size);
+		auto const res = item_fill(s, item, &ahead);
+
+		mutex_lock(&s->mtx);
+		if (res == CLOD_REGION_OK) {
+			s->ready[(s->ready_head + s->ready_len++) % s->depth] = i;
+			condvar_broadcast(&s->ready_cv);
+		} else {
+			s->free[s->free_len++] = i;
+		}
+		mutex_unlock(&s->mtx);
+		if (res != CLOD_REGION_OK) scan_error(s, pos, res);
+	}
+
+	mutex_lock(&s->mtx);
+	s->readers_left--;
+	condvar_broadcast(&s->ready_cv);
+	mutex_unlock(&s->mtx);
+	return nullptr;
+}
+
+// A worker's decompressor and the buffer it decompresses into.
+struct scan_worker {
+	struct scan *scan;
+	thread t;
+	struct clod_decompressor *ctx;
+	uint8_t *buff;
+	size_t cap;
+};
+
+// Grow a worker's buffer to hold at least cap bytes.
+static enum clod_region_result worker_reserve(struct scan_worker *w, const size_t cap) {
+	if (cap <= w->cap) return CLOD_REGION_OK;
+	if (cap > SCAN_BUFFER_MAX) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk data decompresses to more than %zu bytes.", SCAN_BUFFER_MAX);
+	}
+	uint8_t *buff = realloc(w->buff, cap);
+	if (!buff) return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for decompressed chunk.");
+	w->buff = buff;
+	w->cap = cap;
+	return CLOD_REGION_OK;
+}
+
+// Decompress an item into the worker's buffer, growing it until the chunk fits.
+static enum clod_region_result item_decompress(struct scan_worker *w, const struct scan_item *item, size_t *size) {
+	// When the size is known, the buffer is grown to fit beforehand and the chunk decompressed in one pass.
+	const size_t known = item->uncompressed_size;
+	if (known) {
+		auto const res = worker_reserve(w, known);
+		if (res != CLOD_REGION_OK) return res;
+		if (clod_decompress(w->ctx, w->buff, known, item->data, item->size, nullptr, item->compression) == CLOD_COMPRESSION_SUCCESS) {
+			*size = known;
+			return CLOD_REGION_OK;
+		}
+		// The size might be stale, so the chunk is decompressed again as if it wasn't known.
+	}
+
+	for (;;) {
+		auto const res = clod_decompress(w->ctx, w->buff, w->cap, item->data, item->size, size, item->compression);
+		switch (res) {
+			case CLOD_COMPRESSION_SUCCESS:
+				return CLOD_REGION_OK;
+			case CLOD_COMPRESSION_SHORT_BUFFER:
+				break;
+			case CLOD_COMPRESSION_MALFORMED:
+				return region_error(CLOD_REGION_MALFORMED, "Failed to decompress chunk data.");
+			case CLOD_COMPRESSION_UNSUPPORTED:
+				return region_error(CLOD_REGION_INVALID_USAGE,
+					"Chunk is compressed with %d, which is not supported by this build.", item->compression);
+			default:
+				return region_error(CLOD_REGION_INVALID_USAGE, "Failed to decompress chunk data (%d).", res);
+		}
+
+		// The decompressor might have found out the size it needs.
+		auto const grow = worker_reserve(w, *size > w->cap ? *size : w->cap * 2);
+		if (grow != CLOD_REGION_OK) return grow;
+	}
+}
+
+static void *scan_worker(void *arg) {
+	struct scan_worker *w = arg;
+	auto const s = w->scan;
+
+	for (;;) {
+		mutex_lock(&s->mtx);
+		while (s->ready_len == 0 && s->readers_left > 0) condvar_wait(&s->ready_cv, &s->mtx);
+		if (s->ready_len == 0) {
+			mutex_unlock(&s->mtx);
+			break;
+		}
+		const size_t i = s->ready[s->ready_head];
+		s->ready_head = (s->ready_head + 1) % s->depth;
+		s->ready_len--;
+		mutex_unlock(&s->mtx);
+
+		// Chunks read before the scan stopped are dropped.
+		auto const item = &s->items[i];
+		if (!s->stopped) {
+			const uint8_t *data = item->data;
+			size_t size = item->size;
+			enum clod_region_result res = CLOD_REGION_OK;
+			if (item->compression != CLOD_UNCOMPRESSED) {
+				res = item_decompress(w, item, &size);
+				data = w->buff;
+			}
+
+			if (res != CLOD_REGION_OK) {
+				scan_error(s, item->pos, res);
+			} else {
+				stats_add(s->region->stats, STATS_WORD(bytes_read_uncompressed), size);
+				if (!s->opts->visit(s->opts->user, item->pos, data, size)) scan_stop(s, CLOD_REGION_OK);
+			}
+		}
+
+		mutex_lock(&s->mtx);
+		s->free[s->free_len++] = i;
+		condvar_broadcast(&s->free_cv);
+		mutex_unlock(&s->mtx);
+	}
+	return nullptr;
+}
+
+enum clod_region_result clod_region_scan(struct clod_region *region, const struct clod_region_scan_opts *opts) {
+	REGION_PUBLIC_ENTER(region);
+
+	const size_t procs = num_procs() > 0 ? (size_t)num_procs() : 1;
+	const size_t readers = opts->io_threads ? opts->io_threads : 2;
+	const size_t workers = opts->workers ? opts->workers : procs;
+	const size_t depth = opts->queue_depth ? opts->queue_depth : workers * 4;
+
+	struct scan s = {
+		.region = region,
+		.opts = opts,
+		.depth = depth,
+		.free_len = depth,
+		.readers_left = readers,
+		.result = CLOD_REGION_OK,
+	};
+	s.items = calloc(depth, sizeof(s.items[0]));
+	s.free = malloc(depth * sizeof(s.free[0]));
+	s.ready = malloc(depth * sizeof(s.ready[0]));
+	thread *reader_threads = malloc(readers * sizeof(reader_threads[0]));
+	struct scan_worker *ws = calloc(workers, sizeof(ws[0]));
+	s.iter = clod_region_iter_start(region);
+
+	bool ok = s.items && s.free && s.ready && reader_threads && ws && s.iter;
+	for (size_t i = 0; ok && i < workers; i++) {
+		ws[i].scan = &s;
+		ws[i].ctx = clod_decompressor_init();
+		ws[i].buff = malloc(SCAN_BUFFER_MIN);
+		ws[i].cap = SCAN_BUFFER_MIN;
+		ok = ws[i].ctx && ws[i].buff;
+	}
+
+	enum clod_region_result res;
+	if (!ok) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for scan.");
+	} else {
+		for (size_t i = 0; i < depth; i++) s.free[i] = i;
+		mutex_init(&s.mtx);
+		condvar_init(&s.ready_cv);
+		condvar_init(&s.free_cv);
+
+		size_t readers_started = 0;
+		for (; readers_started < readers; readers_started++) {
+			if (!thread_create(&reader_threads[readers_started], scan_reader, &s)) {
+				scan_stop(&s, region_error(CLOD_REGION_INVALID_USAGE, "Failed to start scan thread."));
+				break;
+			}
+		}
+		// Readers that failed to start won't finish, so they're counted out straight away.
+		mutex_lock(&s.mtx);
+		s.readers_left -= readers - readers_started;
+		condvar_broadcast(&s.ready_cv);
+		mutex_unlock(&s.mtx);
+
+		size_t workers_started = 0;
+		for (; workers_started < workers; workers_started++) {
+			if (!thread_create(&ws[workers_started].t, scan_worker, &ws[workers_started])) {
+				scan_stop(&s, region_error(CLOD_REGION_INVALID_USAGE, "Failed to start scan thread."));
+				break;
+			}
+		}
+		// Without any workers, readers would wait forever for a free buffer.
+		if (workers_started == 0) scan_stop(&s, CLOD_REGION_INVALID_USAGE);
+
+		for (size_t i = 0; i < readers_started; i++) thread_join(reader_threads[i]);
+		for (size_t i = 0; i < workers_started; i++) thread_join(ws[i].t);
+
+		res = s.result;
+		condvar_destroy(&s.free_cv);
+		condvar_destroy(&s.ready_cv);
+		mutex_destroy(&s.mtx);
+	}
+
+	if (s.iter) clod_region_iter_end(s.iter);
+	for (size_t i = 0; ws && i < workers; i++) {
+		if (ws[i].ctx) clod_decompressor_free(ws[i].ctx);
+		free(ws[i].buff);
+	}
+	for (size_t i = 0; s.items && i < depth; i++) free(s.items[i].data);
+	free(ws);
+	free(reader_threads);
+	free(s.ready);
+	free(s.free);
+	free(s.items);
+
+	REGION_PUBLIC_LEAVE(region);
+	return res;
+}
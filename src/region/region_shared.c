@@ -0,0 +1,92 @@
+/**
+ * Regions shared between processes keep each process's view of a region file up to date through the generation
+ * in its shared state, which is counted up as every write begins and ends, so it's odd while one is under way.
+ * Each open file remembers the generation it last saw.
+ *
+ * Writers hold the shared lock for the whole write, so before writing they catch up with whatever other processes
+ * wrote: the mapping is grown to the file's size, the header is read if another process created it,
+ * and the free sectors are rebuilt from the header, as other processes allocated and freed sectors meanwhile.
+ * Readers don't take the shared lock unless another process is part way through a write, which they wait out.
+ * They catch up the mapping and header, then check the generation again once they're done, as a seqlock's readers do,
+ * and read again if a write began or ended meanwhile, without reporting the errors the torn read ran into.
+ */
+#include "region_impl.h"
+#include "region_file.h"
+#include "region_format/journal.h"
+#include "error.h"
+
+// Forget which chunks were checked, as other processes may have rewritten them.
+static void verified_clear(struct region_file *rf) {
+	for (size_t i = 0; i < HEADER_CHUNKS / 64; i++) {
+		if (rf->verified[i]) rf->verified[i] = 0;
+	}
+}
+
+enum clod_region_result region_file_refresh(const struct clod_region *r, struct region_file *rf) {
+	const uint64_t generation = shared_file_generation(rf->shared);
+	if (generation == rf->seen) return CLOD_REGION_OK;
+
+	// The mapping usually grows in place, which readers don't notice.
+	mutex_lock(&rf->refresh_mtx);
+	auto res = rf->fmt.version == 0 ? CLOD_REGION_SHORT_BUFFER : file_refresh(rf->f, false);
+	mutex_unlock(&rf->refresh_mtx);
+
+	if (res == CLOD_REGION_SHORT_BUFFER) {
+		// Moving the mapping or reading the header needs everyone else out of the file.
+		res = region_file_upgrade(rf);
+		if (res == CLOD_REGION_OK) {
+			res = file_refresh(rf->f, true);
+			if (res == CLOD_REGION_OK && rf->fmt.version == 0) {
+				void *data;
+				size_t size;
+				(void)file_get(rf->f, &data, &size);
+				res = format_read(&rf->fmt, data, size);
+				region_file_keep_header(r, rf);
+			}
+			region_file_downgrade(rf);
+		}
+	}
+	if (res != CLOD_REGION_OK) return res;
+
+	verified_clear(rf);
+	rf->seen = generation;
+	return CLOD_REGION_OK;
+}
+
+enum clod_region_result region_file_shared_begin(const struct clod_region *r, struct region_file *rf, const bool died) {
+	auto res = region_file_refresh(r, rf);
+	if (res == CLOD_REGION_OK && died) {
+		res = region_file_upgrade(rf);
+		if (res != CLOD_REGION_OK) return res;
+		res = region_file_recover(r, rf->f, &rf->fmt, rf->pos);
+		region_file_downgrade(rf);
+		if (res != CLOD_REGION_OK) return res;
+
+		// Other processes have to see the repaired header.
+		shared_file_changed(rf->shared);
+		verified_clear(rf);
+		rf->seen = shared_file_generation(rf->shared);
+	}
+	if (res != CLOD_REGION_OK) return res;
+
+	if (rf->synced != rf->seen) {
+		void *data;
+		size_t size;
+		(void)file_get(rf->f, &data, &size);
+		mutex_lock(&rf->sectors_mtx);
+		sectors_destroy(&rf->sectors);
+		const bool ok = sectors_init(&rf->sectors, &rf->fmt, data);
+		mutex_unlock(&rf->sectors_mtx);
+		if (!ok) return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for region file sectors.");
+		rf->synced = rf->seen;
+	}
+
+	shared_file_begin(rf->shared, rf->pos, r->opts.dims);
+	return CLOD_REGION_OK;
+}
+
+void region_file_shared_end(struct region_file *rf) {
+	shared_file_changed(rf->shared);
+	// This process wrote everything since it last caught up, so it's still up to date.
+	rf->synced = rf->seen = shared_file_generation(rf->shared);
+}
@@ -0,0 +1,85 @@
+/**
+ * Statistics are kept as blocks of counters laid out like struct clod_region_stats, one for each of a few threads.
+ * Each thread adds to its own block, so counting on the hot path doesn't bounce a cache line between cores,
+ * and clod_region_stats sums the blocks when it's called.
+ * Threads only share a block once there are more threads than blocks.
+ */
+#include <clod/region.h>
+#include "region_impl.h"
+#include "error.h"
+#include <stdlib.h>
+
+// Number of blocks of counters. Threads are spread across them.
+#define STATS_SHARDS 16
+// Number of counters in a block.
+#define STATS_WORDS (sizeof(struct clod_region_stats) / sizeof(uint64_t))
+
+static_assert(sizeof(struct clod_region_stats) % sizeof(uint64_t) == 0);
+
+struct region_stats {
+	struct {
+		atomic uint64_t words[STATS_WORDS];
+		char pad[64];
+	} shards[STATS_SHARDS];
+};
+
+static atomic size_t next_shard;
+static thread_local size_t thread_shard = SIZE_MAX;
+
+enum clod_region_result stats_create(struct clod_region *r) {
+	r->stats = calloc(1, sizeof(*r->stats));
+	if (!r->stats) return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for statistics.");
+	return CLOD_REGION_OK;
+}
+
+void stats_destroy(struct clod_region *r) {
+	free(r->stats);
+	r->stats = nullptr;
+}
+
+void stats_add(struct region_stats *s, const size_t word, const uint64_t n) {
+	if (thread_shard == SIZE_MAX) thread_shard = next_shard++ % STATS_SHARDS;
+	s->shards[thread_shard].words[word] += n;
+}
+
+uint64_t stats_clock() {
+	struct timespec now;
+	if (!monotonic_now(&now)) return 0;
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+void stats_latency(struct region_stats *s, const size_t histogram, const uint64_t start) {
+	const uint64_t ns = stats_clock() - start;
+	size_t bucket = ns > 1 ? (size_t)(63 - __builtin_clzll(ns)) : 0;
+	if (bucket >= CLOD_REGION_LATENCY_BUCKETS) bucket = CLOD_REGION_LATENCY_BUCKETS - 1;
+	stats_add(s, histogram + bucket, 1);
+}
+
+void stats_wait(struct region_stats *s, const size_t waits, const size_t wait_ns, const uint64_t start) {
+	stats_add(s, waits, 1);
+	stats_add(s, wait_ns, stats_clock() - start);
+}
+
+enum clod_region_result stats_truncate(struct region_stats *s, const file f, const size_t new_size) {
+	void *old_map, *map;
+	size_t old_size, size;
+	(void)file_get(f, &old_map, &old_size);
+	if (old_size == new_size) return CLOD_REGION_OK;
+
+	stats_add(s, STATS_WORD(file_truncates), 1);
+	auto const res = file_truncate(f, new_size);
+	(void)file_get(f, &map, &size);
+	if (old_map && map && map != old_map) stats_add(s, STATS_WORD(file_remaps), 1);
+	return res;
+}
+
+void clod_region_stats(struct clod_region *region, struct clod_region_stats *stats) {
+	REGION_PUBLIC_ENTER(region);
+	uint64_t *words = (uint64_t *)stats;
+	for (size_t i = 0; i < STATS_WORDS; i++) {
+		uint64_t sum = 0;
+		for (size_t j = 0; j < STATS_SHARDS; j++) sum += region->stats->shards[j].words[i];
+		words[i] = sum;
+	}
+	REGION_PUBLIC_LEAVE(region);
+}
@@ -0,0 +1,111 @@
+/**
+ * Chunk data is checked against its checksum in the pass that already touches it:
+ * copies hash each block straight after copying it, while it's still in cache,
+ * and compressed data is hashed just before the decompressor reads it, which leaves it in cache for the decompressor.
+ * Compressed data is usually a fraction of the size of the chunk, so hashing it costs much less than the decompression.
+ *
+ * How often reads are checked is set by opts.verify, and clod_region_scrub checks a whole region file on demand.
+ */
+#include <clod/region.h>
+#include <clod/hash.h>
+#include "region_impl.h"
+#include "region_file.h"
+#include "error.h"
+#include <string.h>
+
+// Bytes copied before they're hashed. Small enough that the block is still in L1 cache.
+#define VERIFY_BLOCK 16384
+
+static thread_local uint32_t sample_reads;
+
+uint32_t verify_copy(void *dst, const void *src, const size_t size) {
+	uint32_t crc = clod_crc32_init();
+	for (size_t done = 0; done < size;) {
+		const size_t n = size - done < VERIFY_BLOCK ? size - done : VERIFY_BLOCK;
+		memcpy((char *)dst + done, (const char *)src + done, n);
+		crc = clod_crc32_add(crc, (const char *)dst + done, n);
+		done += n;
+	}
+	return clod_crc32_finalise(crc);
+}
+
+bool verify_wanted(const struct clod_region *r, struct region_file *rf, const size_t index, const uint32_t checksum) {
+	if (checksum == 0) return false;
+
+	switch (r->opts.verify) {
+		case CLOD_REGION_VERIFY_ALWAYS:
+			return true;
+		case CLOD_REGION_VERIFY_FIRST:
+			return (rf->verified[index / 64] & (uint64_t)1 << (index % 64)) == 0;
+		case CLOD_REGION_VERIFY_SAMPLED:
+			return ++sample_reads % r->opts.verify_sample == 0;
+		default:
+			return false;
+	}
+}
+
+enum clod_region_result verify_check(struct region_file *rf, const size_t index, const uint32_t checksum, const uint32_t crc) {
+	if (crc != checksum) {
+		return region_error(CLOD_REGION_MALFORMED, "Chunk %zu doesn't match its checksum.", index);
+	}
+	rf->verified[index / 64] |= (uint64_t)1 << (index % 64);
+	return CLOD_REGION_OK;
+}
+
+void verify_forget(struct region_file *rf, const size_t index) {
+	rf->verified[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+enum clod_region_result clod_region_scrub(
+	struct clod_region *region,
+	const int64_t *pos,
+	void (*corrupt)(void *user, const int64_t *pos),
+	void *user
+) {
+	REGION_PUBLIC_ENTER(region);
+
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	chunk_index(pos, region_pos, region->opts.dims);
+
+	struct region_file *rf;
+	auto res = region_file_rdlock(region, &rf, region_pos);
+	if (res != CLOD_REGION_OK) {
+		REGION_PUBLIC_LEAVE(region);
+		return res == CLOD_REGION_NOT_FOUND ? CLOD_REGION_OK : res;
+	}
+	rbmutex_rdunlock(&rf->mtx);
+
+	// Each chunk is viewed on its own, so writers are only held up by the chunk being checked.
+	res = CLOD_REGION_OK;
+	for (size_t index = 0; index < HEADER_CHUNKS; index++) {
+		int64_t chunk[CLOD_REGION_DIMENSIONS_MAX];
+		chunk_pos(region_pos, index, chunk, region->opts.dims);
+
+		enum clod_region_result chunk_res;
+		bool retry = false;
+		do {
+			struct clod_region_view view;
+			uint64_t seen;
+			chunk_res = region_read_view(region, chunk, &view, &seen);
+			if (chunk_res != CLOD_REGION_OK) break;
+
+			const uint32_t crc = view.checksum != 0 ? clod_crc32(view.data, view.size) : 0;
+			// A chunk that another process may have overwritten while it was checked is checked again.
+			retry = region_file_read_retry(view_region_file(&view), seen);
+			if (!retry && view.checksum != 0) chunk_res = verify_check(view_region_file(&view), index, view.checksum, crc);
+			clod_region_view_release(region, &view);
+		} while (retry);
+		if (chunk_res == CLOD_REGION_NOT_FOUND) continue;
+
+		if (chunk_res == CLOD_REGION_MALFORMED) {
+			if (corrupt) corrupt(user, chunk);
+			res = CLOD_REGION_MALFORMED;
+		} else if (chunk_res != CLOD_REGION_OK) {
+			res = chunk_res;
+			break;
+		}
+	}
+
+	REGION_PUBLIC_LEAVE(region);
+	return res;
+}
@@ -0,0 +1,643 @@
+#include <clod/region.h>
+#include <clod/hash.h>
+#include "region_impl.h"
+#include "region_file.h"
+#include "batch.h"
+#include "region_format/journal.h"
+#include "filename.h"
+#include "error.h"
+#include <inttypes.h>
+#include <stdlib.h>
+
+// Grow a compressed chunk's buffer to capacity bytes.
+static enum clod_region_result compress_reserve(void *user, const size_t capacity, uint8_t **dst) {
+	char **data = user;
+	char *grown = realloc(*data, capacity);
+	if (!grown) return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for compressed chunk.");
+	*data = grown;
+	*dst = (uint8_t *)grown;
+	return CLOD_REGION_OK;
+}
+
+// Compress chunk data into a newly allocated buffer.
+static enum clod_region_result compress(
+	struct clod_region *region,
+	const uint8_t *buff, const size_t buff_size,
+	char **out, size_t *out_size
+) {
+	auto const ctx = codec_compressor_get(region);
+	if (!ctx) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for compressor.");
+	}
+
+	char *data = nullptr;
+	auto const res = codec_compress(ctx, buff, buff_size, region->opts.compression, CLOD_COMPRESSION_NORMAL,
+		compress_reserve, &data, out_size);
+	codec_compressor_put(region, ctx);
+	if (res != CLOD_REGION_OK) {
+		free(data);
+		return res;
+	}
+	*out = data;
+	return CLOD_REGION_OK;
+}
+
+// Write the chunk file of an external chunk under its staged name, and set its checksum.
+// Nothing reads it until it's put in place, so the chunk's stripe needn't be locked.
+static enum clod_region_result external_stage(
+	struct clod_region *region,
+	const int64_t *pos,
+	const char *data, const size_t size,
+	const bool sync,
+	uint32_t *checksum
+) {
+	char staged[REGION_FILENAME_MAX + 1], kept[REGION_FILENAME_MAX + 1];
+	external_filename(region, staged, pos, EXTERNAL_STAGED);
+	external_filename(region, kept, pos, EXTERNAL_KEPT);
+
+	// A replaced chunk file left behind by an earlier write would be taken for this write's if it's undone.
+	(void)dir_unlink(region->d, kept);
+	*checksum = clod_crc32(data, size);
+	return dir_replace(region->d, staged, data, size, sync, &region->opts);
+}
+
+static void external_delete(struct clod_region *region, const int64_t *pos, const char *suffix) {
+	char filename[REGION_FILENAME_MAX + 1];
+	external_filename(region, filename, pos, suffix);
+	(void)dir_unlink(region->d, filename);
+}
+
+// Write a header to a newly created region file.
+static enum clod_region_result region_file_init(struct clod_region *region, struct region_file *rf) {
+	const int version = region_file_version(&region->opts);
+
+	void *map;
+	size_t size;
+	const size_t header_size = format_create_size(version, region->opts.sector_size);
+	auto res = stats_truncate(region->stats, rf->f, header_size);
+	if (res == CLOD_REGION_OK) res = file_get(rf->f, &map, &size);
+	if (res != CLOD_REGION_OK) return res;
+
+	format_create(&rf->fmt, map, size, version, &region->opts);
+	region_file_keep_header(region, rf);
+	sectors_destroy(&rf->sectors);
+	if (!sectors_init(&rf->sectors, &rf->fmt, map)) {
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for region file sectors.");
+	}
+	return CLOD_REGION_OK;
+}
+
+/**
+ * A chunk being written to a region file.
+ */
+struct chunk_write {
+	const int64_t *pos;
+	size_t index;
+	// Stored chunk data, or null to delete the chunk.
+	const char *data;
+	size_t size;
+	// Size of the chunk data before it was compressed.
+	size_t uncompressed_size;
+	// CRC-32 of the stored chunk data, set once it's stored.
+	uint32_t checksum;
+	// Modification time to record, or 0 for the time of the write.
+	uint32_t mtime;
+
+	// Where the chunk was placed.
+	struct format_location location;
+	bool external;
+	// The chunk being replaced. Its sectors are released once the header no longer refers to them.
+	struct format_chunk old;
+	bool old_valid;
+
+	enum clod_region_result result;
+};
+
+// Allocate sectors for a chunk. The sectors mutex must be held.
+static enum clod_region_result chunk_place(struct clod_region *region, struct region_file *rf, struct chunk_write *w) {
+	w->location = (struct format_location){ .offset = 0, .sectors = 0 };
+	w->external = false;
+	if (!w->data) return CLOD_REGION_OK;
+
+	if (format_compression_encode(&rf->fmt, region->opts.compression) == 0) {
+		return region_error(CLOD_REGION_INVALID_USAGE,
+			"Compression %d can't be stored in this region file's header.", region->opts.compression);
+	}
+
+	const uint32_t sector_size = rf->fmt.sector_size;
+	w->external = CHUNK_HEADER_SIZE + w->size > (size_t)CHUNK_SECTORS_MAX * sector_size;
+
+	const size_t stored = CHUNK_HEADER_SIZE + (w->external ? 0 : w->size);
+	const uint32_t sectors = (uint32_t)((stored + sector_size - 1) / sector_size);
+	const uint32_t offset = sectors_alloc(&rf->sectors, sectors);
+	if (offset == 0 || offset > rf->fmt.offset_max) {
+		if (offset) sectors_free(&rf->sectors, offset, sectors);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate %"PRIu32" sectors in region file.", sectors);
+	}
+	w->location = (struct format_location){ .offset = offset, .sectors = sectors };
+	return CLOD_REGION_OK;
+}
+
+// Copy placed chunk data into the region file, and set its checksum unless it's external.
+static void chunk_store(struct clod_region *region, struct region_file *rf, char *map, struct chunk_write *w) {
+	const uint8_t type = format_compression_encode(&rf->fmt, region->opts.compression);
+	char *chunk = map + (size_t)w->location.offset * rf->fmt.sector_size;
+	beu32_enc(chunk, (uint32_t)(w->external ? 1 : w->size + 1));
+	beu8_enc(chunk + 4, (uint8_t)(w->external ? type | CHUNK_EXTERNAL : type));
+	if (!w->external) w->checksum = verify_copy(chunk + CHUNK_HEADER_SIZE, w->data, w->size);
+}
+
+// Release the sectors of chunks that failed after they were placed.
+static void placed_free(struct region_file *rf, struct chunk_write *writes, const size_t count, const enum clod_region_result res) {
+	mutex_lock(&rf->sectors_mtx);
+	for (size_t i = 0; i < count; i++) {
+		if (writes[i].result != CLOD_REGION_OK) continue;
+		if (writes[i].location.sectors) sectors_free(&rf->sectors, writes[i].location.offset, writes[i].location.sectors);
+		writes[i].result = res;
+	}
+	mutex_unlock(&rf->sectors_mtx);
+}
+
+/**
+ * Put the staged chunk file of a write in place, keeping the chunk file it replaces if the old chunk was external.
+ * The staged file's absence is what tells recovery that the write's change to the header should be kept,
+ * so undoing it stages the new file again before the old one is put back.
+ * The chunk's stripe must be write locked.
+ */
+static enum clod_region_result external_place(struct clod_region *region, const struct chunk_write *w, const bool undo) {
+	char filename[REGION_FILENAME_MAX + 1], staged[REGION_FILENAME_MAX + 1], kept[REGION_FILENAME_MAX + 1];
+	external_filename(region, filename, w->pos, "");
+	external_filename(region, staged, w->pos, EXTERNAL_STAGED);
+	external_filename(region, kept, w->pos, EXTERNAL_KEPT);
+	const bool keep = w->old_valid && w->old.external;
+
+	enum clod_region_result res = CLOD_REGION_OK;
+	if (undo) {
+		(void)dir_rename(region->d, filename, staged);
+		if (keep) (void)dir_rename(region->d, kept, filename);
+	} else {
+		if (keep) res = dir_rename(region->d, filename, kept);
+		if (res == CLOD_REGION_OK) res = dir_rename(region->d, staged, filename);
+		if (res != CLOD_REGION_OK && keep) (void)dir_rename(region->d, kept, filename);
+	}
+	// Readers of the old chunk file are locked out, so it can be dropped from the cache.
+	external_forget(region, w->pos);
+	return res;
+}
+
+// Put the staged chunk files of writes in place, and put back the ones already placed if one can't be.
+// When syncing, the renames are durable before the header refers to the new files.
+static enum clod_region_result externals_place(
+	struct clod_region *region,
+	struct chunk_write *writes, const size_t count,
+	const bool sync
+) {
+	enum clod_region_result res = CLOD_REGION_OK;
+	bool any = false;
+	size_t placed = 0;
+	for (; placed < count; placed++) {
+		auto const w = &writes[placed];
+		if (w->result != CLOD_REGION_OK) continue;
+		if (w->external) {
+			// A write that fails to be placed puts its own chunk files back.
+			res = external_place(region, w, false);
+			if (res != CLOD_REGION_OK) break;
+			any = true;
+		} else if (w->old_valid && w->old.external) {
+			external_forget(region, w->pos);
+		}
+	}
+	if (res == CLOD_REGION_OK && any && sync) res = dir_sync(region->d);
+	if (res == CLOD_REGION_OK) return res;
+
+	while (placed-- > 0) {
+		auto const w = &writes[placed];
+		if (w->result == CLOD_REGION_OK && w->external) (void)external_place(region, w, true);
+	}
+	return res;
+}
+
+/**
+ * Point the header at stored chunks, putting the staged chunk files of external chunks in place.
+ * The changes are journaled first if the header supports it, so a crash part way through can be repaired.
+ * When syncing, the journal is durable before the header changes, and the header before the journal is dropped.
+ * Returns false if the header wasn't changed.
+ */
+static bool header_update(
+	struct clod_region *region,
+	struct region_file *rf,
+	char *map,
+	const struct format_location journal,
+	const struct journal_entry *entries, const size_t count,
+	struct chunk_write *writes, const size_t write_count,
+	const uint64_t stripes,
+	const bool sync,
+	enum clod_region_result *res
+) {
+	const bool journaled = journal.sectors != 0;
+
+	// Readers of the chunks are locked out, so none are left reading old data afterwards.
+	// Views of other chunks hold their stripes while writing, so stripes are taken before the header.
+	region_file_stripes_wrlock(rf, stripes);
+	mutex_lock(&rf->header_mtx);
+	if (journaled) {
+		journal_begin(&rf->fmt, map, journal.offset, entries, count);
+		if (sync) *res = file_sync(rf->f);
+	}
+	// Chunk files are put in place once the journal can undo them, and before the header refers to them.
+	if (*res == CLOD_REGION_OK) *res = externals_place(region, writes, write_count, sync);
+
+	const bool applied = *res == CLOD_REGION_OK;
+	if (applied) {
+		for (size_t i = 0; i < count; i++) {
+			format_location_set(&rf->fmt, map, entries[i].index, entries[i].new_location);
+			format_mtime_set(&rf->fmt, map, entries[i].index, entries[i].new_mtime);
+			format_uncompressed_set(&rf->fmt, map, entries[i].index, entries[i].new_uncompressed_size);
+			format_checksum_set(&rf->fmt, map, entries[i].index, entries[i].new_checksum);
+			verify_forget(rf, entries[i].index);
+		}
+		format_commit(&rf->fmt, map);
+		if (sync) *res = file_sync(rf->f);
+	}
+
+	if (journaled) journal_end(&rf->fmt, map);
+	mutex_unlock(&rf->header_mtx);
+	region_file_stripes_wrunlock(rf, stripes);
+	return applied;
+}
+
+/**
+ * Write chunks to a region file whose read lock and stripe writer locks are held.
+ * Sectors for every chunk are allocated together so the file grows at most once,
+ * and the header is updated once, after all chunk data is in place.
+ * Only creating the header and growing the file lock out readers of other chunks.
+ * The result of each chunk is set in its chunk_write.
+ */
+static enum clod_region_result file_write_locked(
+	struct clod_region *region,
+	struct region_file *rf,
+	struct chunk_write *writes, const size_t count,
+	const bool sync
+) {
+	enum clod_region_result res = CLOD_REGION_OK;
+	if (rf->fmt.version == 0) {
+		bool empty = true;
+		for (size_t i = 0; i < count; i++) if (writes[i].data) empty = false;
+		if (empty) {
+			for (size_t i = 0; i < count; i++) writes[i].result = CLOD_REGION_OK;
+			return CLOD_REGION_OK;
+		}
+
+		res = region_file_upgrade(rf);
+		if (res == CLOD_REGION_OK) {
+			if (rf->fmt.version == 0) res = region_file_init(region, rf);
+			region_file_downgrade(rf);
+		}
+	}
+
+	void *map;
+	size_t file_size;
+	struct journal_entry *entries = nullptr;
+	if (res == CLOD_REGION_OK) res = file_get(rf->f, &map, &file_size);
+	if (res == CLOD_REGION_OK && !(entries = malloc(count * sizeof(entries[0])))) {
+		res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for %zu journal entries.", count);
+	}
+	if (res != CLOD_REGION_OK) {
+		for (size_t i = 0; i < count; i++) writes[i].result = res;
+		return res;
+	}
+
+	// The journal is placed in sectors of its own alongside the chunks.
+	const uint32_t sector_size = rf->fmt.sector_size;
+	struct format_location journal = { .offset = 0, .sectors = 0 };
+	size_t end = file_size;
+	mutex_lock(&rf->sectors_mtx);
+	for (size_t i = 0; i < count; i++) {
+		auto const w = &writes[i];
+		w->result = chunk_place(region, rf, w);
+		const size_t chunk_end = ((size_t)w->location.offset + w->location.sectors) * sector_size;
+		if (w->result == CLOD_REGION_OK && chunk_end > end) end = chunk_end;
+	}
+	if (journal_supported(&rf->fmt)) {
+		const uint32_t sectors = (uint32_t)((journal_size(count) + sector_size - 1) / sector_size);
+		const uint32_t offset = sectors_alloc(&rf->sectors, sectors);
+		if (offset == 0 || offset > rf->fmt.offset_max) {
+			if (offset) sectors_free(&rf->sectors, offset, sectors);
+			res = region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate %"PRIu32" sectors for journal.", sectors);
+		} else {
+			journal = (struct format_location){ .offset = offset, .sectors = sectors };
+			if (((size_t)offset + sectors) * sector_size > end) end = ((size_t)offset + sectors) * sector_size;
+		}
+	}
+	mutex_unlock(&rf->sectors_mtx);
+
+	if (res == CLOD_REGION_OK && end > file_size) {
+		res = region_file_upgrade(rf);
+		if (res == CLOD_REGION_OK) {
+			// Another writer may have grown the file past our sectors already.
+			res = file_get(rf->f, &map, &file_size);
+			if (res == CLOD_REGION_OK && end > file_size) res = stats_truncate(region->stats, rf->f, end);
+			region_file_downgrade(rf);
+		}
+
+		if (res == CLOD_REGION_OK) res = file_get(rf->f, &map, &file_size);
+	}
+	if (res != CLOD_REGION_OK) {
+		placed_free(rf, writes, count, res);
+		if (journal.sectors) {
+			mutex_lock(&rf->sectors_mtx);
+			sectors_free(&rf->sectors, journal.offset, journal.sectors);
+			mutex_unlock(&rf->sectors_mtx);
+		}
+		free(entries);
+		return res;
+	}
+
+	// Only writers change a chunk's location, so the old one can be read without its stripe.
+	const uint32_t now = (uint32_t)time(nullptr);
+	uint64_t stripes = 0;
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		auto const w = &writes[i];
+		if (w->result != CLOD_REGION_OK) continue;
+
+		// Chunks with a corrupted location are left alone, as their sectors might belong to another chunk.
+		w->old_valid = format_chunk_get(&rf->fmt, map, file_size, w->index, &w->old) == CLOD_REGION_OK;
+
+		if (w->data) chunk_store(region, rf, map, w);
+		if (w->external) {
+			// Readers keep the old chunk file until the header is updated, when the new one takes its place.
+			w->result = external_stage(region, w->pos, w->data, w->size, sync, &w->checksum);
+			if (w->result != CLOD_REGION_OK) continue;
+		}
+
+		stripes |= region_file_stripe(w->index);
+		entries[n++] = (struct journal_entry){
+			.index = (uint32_t)w->index,
+			.old_location = format_location_get(&rf->fmt, map, w->index),
+			.old_mtime = format_mtime_get(&rf->fmt, map, w->index),
+			.old_uncompressed_size = format_uncompressed_get(&rf->fmt, map, w->index),
+			.old_checksum = format_checksum_get(&rf->fmt, map, w->index),
+			.new_location = w->location,
+			.new_mtime = w->data ? (w->mtime ? w->mtime : now) : 0,
+			.new_uncompressed_size = w->data && w->uncompressed_size <= UINT32_MAX ? (uint32_t)w->uncompressed_size : 0,
+			.new_checksum = w->data ? w->checksum : 0,
+		};
+	}
+
+	const bool applied = header_update(region, rf, map, journal, entries, n, writes, count, stripes, sync, &res);
+	if (applied) region_index_update(region, rf->pos, entries, n);
+	free(entries);
+
+	// Old data is only released once the header no longer points to it.
+	mutex_lock(&rf->sectors_mtx);
+	if (journal.sectors) sectors_free(&rf->sectors, journal.offset, journal.sectors);
+	for (size_t i = 0; i < count; i++) {
+		auto const w = &writes[i];
+		if (w->result != CLOD_REGION_OK || !applied) {
+			// Chunks that weren't published still hold the sectors they were placed in.
+			if (w->location.sectors) sectors_free(&rf->sectors, w->location.offset, w->location.sectors);
+			continue;
+		}
+		if (w->old_valid) sectors_free(&rf->sectors, w->old.location.offset, w->old.location.sectors);
+	}
+	compact_notify(region, rf);
+	mutex_unlock(&rf->sectors_mtx);
+
+	for (size_t i = 0; i < count; i++) {
+		auto const w = &writes[i];
+		if (w->result != CLOD_REGION_OK) continue;
+		// Chunk files are removed once the journal no longer refers to them.
+		// Staged files of a journaled write that wasn't applied are left for recovery to undo it by, if it comes to that.
+		if (applied && w->old_valid && w->old.external) external_delete(region, w->pos, w->external ? EXTERNAL_KEPT : "");
+		else if (!applied && w->external && !journal.sectors) external_delete(region, w->pos, EXTERNAL_STAGED);
+		if (res != CLOD_REGION_OK) w->result = res;
+	}
+	return res;
+}
+
+// Write chunks to a pinned region file.
+static enum clod_region_result file_write(
+	struct clod_region *region,
+	struct region_file *rf,
+	struct chunk_write *writes, const size_t count,
+	const bool sync
+) {
+	uint64_t stripes = 0;
+	for (size_t i = 0; i < count; i++) stripes |= region_file_stripe(writes[i].index);
+
+	// The file stays pinned until its read lock is held, so it can't be evicted meanwhile.
+	region_file_writers_lock(rf, stripes);
+	const bool died = rf->shared && shared_file_lock(rf->shared, rf->pos, region->opts.dims);
+	region_file_lock_pinned(rf);
+
+	auto res = rf->shared ? region_file_shared_begin(region, rf, died) : CLOD_REGION_OK;
+	if (res == CLOD_REGION_OK) {
+		res = file_write_locked(region, rf, writes, count, sync);
+		if (rf->shared) region_file_shared_end(rf);
+	} else {
+		for (size_t i = 0; i < count; i++) writes[i].result = res;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (writes[i].result != CLOD_REGION_OK || !writes[i].data) continue;
+		stats_add(region->stats, STATS_WORD(chunks_written), 1);
+		stats_add(region->stats, STATS_WORD(bytes_written), writes[i].size);
+		stats_add(region->stats, STATS_WORD(bytes_written_uncompressed), writes[i].uncompressed_size);
+	}
+
+	rbmutex_rdunlock(&rf->mtx);
+	if (rf->shared) shared_file_unlock(rf->shared);
+	region_file_writers_unlock(rf, stripes);
+	return res;
+}
+
+// Compress chunk data unless the region stores it uncompressed.
+static enum clod_region_result chunk_prepare(
+	struct clod_region *region,
+	const uint8_t *buff, const size_t buff_size,
+	struct chunk_write *w, char **compressed
+) {
+	*compressed = nullptr;
+	w->data = (const char *)buff;
+	w->size = buff_size;
+	w->uncompressed_size = buff_size;
+	w->mtime = 0;
+	if (!buff || region->opts.compression == CLOD_UNCOMPRESSED) return CLOD_REGION_OK;
+
+	auto const res = compress(region, buff, buff_size, compressed, &w->size);
+	if (res == CLOD_REGION_OK) w->data = *compressed;
+	return res;
+}
+
+enum clod_region_result clod_region_write(
+	struct clod_region *region,
+	const int64_t *pos,
+	const uint8_t *buff,
+	const size_t buff_size
+) {
+	REGION_PUBLIC_ENTER(region);
+
+	if (region->opts.mode != CLOD_REGION_MODE_RDWR) {
+		REGION_PUBLIC_LEAVE(region);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Attempted to write to a read-only region.");
+	}
+
+	// Compression happens before any locks are taken.
+	const uint64_t started = stats_clock();
+	struct chunk_write w = { .pos = pos };
+	char *compressed;
+	auto res = chunk_prepare(region, buff, buff_size, &w, &compressed);
+	if (res != CLOD_REGION_OK) {
+		stats_latency(region->stats, STATS_WORD(write_latency), started);
+		REGION_PUBLIC_LEAVE(region);
+		return res;
+	}
+
+	int64_t region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	w.index = chunk_index(pos, region_pos, region->opts.dims);
+
+	struct region_file *rf;
+	res = region_file_get(region, &rf, region_pos, buff != nullptr);
+	if (res != CLOD_REGION_OK) {
+		free(compressed);
+		stats_latency(region->stats, STATS_WORD(write_latency), started);
+		REGION_PUBLIC_LEAVE(region);
+		// Deleting a chunk in a region file that doesn't exist is a no-op.
+		return res == CLOD_REGION_NOT_FOUND && !buff ? CLOD_REGION_OK : res;
+	}
+
+	file_write(region, rf, &w, 1, false);
+
+	free(compressed);
+	stats_latency(region->stats, STATS_WORD(write_latency), started);
+	REGION_PUBLIC_LEAVE(region);
+	return w.result;
+}
+
+enum clod_region_result clod_region_write_batch(
+	struct clod_region *region,
+	struct clod_region_write_request *requests,
+	const size_t count
+) {
+	REGION_PUBLIC_ENTER(region);
+
+	if (region->opts.mode != CLOD_REGION_MODE_RDWR) {
+		for (size_t i = 0; i < count; i++) requests[i].result = CLOD_REGION_INVALID_USAGE;
+		REGION_PUBLIC_LEAVE(region);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Attempted to write to a read-only region.");
+	}
+
+	const uint64_t started = stats_clock();
+	struct batch_entry *entries = malloc(count * sizeof(entries[0]));
+	struct chunk_write *writes = malloc(count * sizeof(writes[0]));
+	struct chunk_write *group = malloc(count * sizeof(group[0]));
+	char **compressed = calloc(count, sizeof(compressed[0]));
+	if ((!entries || !writes || !group || !compressed) && count > 0) {
+		free(entries);
+		free(writes);
+		free(group);
+		free(compressed);
+		for (size_t i = 0; i < count; i++) requests[i].result = CLOD_REGION_INVALID_USAGE;
+		REGION_PUBLIC_LEAVE(region);
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for %zu writes.", count);
+	}
+
+	// Compression happens before any locks are taken.
+	size_t pending = 0;
+	for (size_t i = 0; i < count; i++) {
+		auto const req = &requests[i];
+		req->result = chunk_prepare(region, req->buff, req->buff_size, &writes[i], &compressed[i]);
+		if (req->result != CLOD_REGION_OK) continue;
+
+		writes[i].pos = req->pos;
+		batch_entry_init(&entries[pending], req->pos, region->opts.dims, i);
+		entries[pending].key = entries[pending].index;
+		writes[i].index = entries[pending].index;
+		pending++;
+	}
+	batch_sort(entries, pending);
+
+	for (size_t start = 0; start < pending;) {
+		const size_t end = batch_file_end(entries, pending, start);
+
+		// Later writes to the same chunk replace earlier ones.
+		size_t group_len = 0;
+		bool create = false;
+		for (size_t i = start; i < end; i++) {
+			if (i + 1 < end && entries[i + 1].index == entries[i].index) continue;
+			group[group_len] = writes[entries[i].request];
+			create |= group[group_len].data != nullptr;
+			group_len++;
+		}
+
+		struct region_file *rf;
+		auto res = region_file_get(region, &rf, entries[start].region_pos, create);
+		if (res == CLOD_REGION_OK) {
+			file_write(region, rf, group, group_len, true);
+		} else {
+			// Deleting a chunk in a region file that doesn't exist is a no-op.
+			if (res == CLOD_REGION_NOT_FOUND && !create) res = CLOD_REGION_OK;
+			for (size_t i = 0; i < group_len; i++) group[i].result = res;
+		}
+
+		size_t g = 0;
+		for (size_t i = start; i < end; i++) {
+			auto const req = &requests[entries[i].request];
+			if (i + 1 < end && entries[i + 1].index == entries[i].index) {
+				req->result = CLOD_REGION_OK;
+				continue;
+			}
+			req->result = group[g++].result;
+		}
+		start = end;
+	}
+
+	for (size_t i = 0; i < count; i++) free(compressed[i]);
+	free(group);
+	free(compressed);
+	free(writes);
+	free(entries);
+	stats_latency(region->stats, STATS_WORD(write_batch_latency), started);
+	REGION_PUBLIC_LEAVE(region);
+
+	for (size_t i = 0; i < count; i++) {
+		if (requests[i].result != CLOD_REGION_OK) return requests[i].result;
+	}
+	return CLOD_REGION_OK;
+}
+
+enum clod_region_result region_write_copies(
+	struct clod_region *region,
+	const int64_t *region_pos,
+	struct chunk_copy *copies,
+	const size_t count
+) {
+	struct chunk_write *writes = malloc(count * sizeof(writes[0]));
+	if (!writes && count > 0) {
+		for (size_t i = 0; i < count; i++) copies[i].result = CLOD_REGION_INVALID_USAGE;
+		return region_error(CLOD_REGION_INVALID_USAGE, "Failed to allocate memory for %zu writes.", count);
+	}
+
+	int64_t chunk_region_pos[CLOD_REGION_DIMENSIONS_MAX];
+	for (size_t i = 0; i < count; i++) {
+		writes[i] = (struct chunk_write){
+			.pos = copies[i].pos,
+			.index = chunk_index(copies[i].pos, chunk_region_pos, region->opts.dims),
+			.data = (const char *)copies[i].data,
+			.size = copies[i].size,
+			.uncompressed_size = copies[i].uncompressed_size,
+			.mtime = copies[i].mtime,
+		};
+	}
+
+	struct region_file *rf;
+	auto res = region_file_get(region, &rf, region_pos, true);
+	if (res == CLOD_REGION_OK) {
+		res = file_write(region, rf, writes, count, true);
+		for (size_t i = 0; i < count; i++) copies[i].result = writes[i].result;
+	} else {
+		for (size_t i = 0; i < count; i++) copies[i].result = res;
+	}
+	free(writes);
+	return res;
+}
@@ -0,0 +1,37 @@
+/**
+ * Rings own a buffer registered with the kernel, and can only be used by one thread at a time,
+ * so idle ones are kept in a pool shared by all threads using the region.
+ */
+#include "region_impl.h"
+
+ring ring_pool_get(struct clod_region *r) {
+	ring rg = 0;
+
+	mutex_lock(&r->ring_mtx);
+	if (r->rings_len > 0) {
+		rg = r->rings[--r->rings_len];
+	}
+	mutex_unlock(&r->ring_mtx);
+
+	if (!rg && ring_open(&rg) != CLOD_REGION_OK) rg = 0;
+	return rg;
+}
+
+void ring_pool_put(struct clod_region *r, ring rg) {
+	mutex_lock(&r->ring_mtx);
+	// Broken rings are closed rather than handed to another reader.
+	if (r->rings_len < RING_POOL_MAX && !ring_broken(rg)) {
+		r->rings[r->rings_len++] = rg;
+		rg = 0;
+	}
+	mutex_unlock(&r->ring_mtx);
+
+	if (rg) ring_close(rg);
+}
+
+void ring_pool_destroy(struct clod_region *r) {
+	for (size_t i = 0; i < r->rings_len; i++) {
+		ring_close(r->rings[i]);
+	}
+	r->rings_len = 0;
+}
@@ -0,0 +1,138 @@
+/**
+ * Sector allocation for region files.
+ * Placement is best-fit so that holes left by deleted and shrunk chunks are
+ * reused before the file has to grow, and large holes aren't broken up while a smaller one would do.
+ */
+#include "sectors.h"
+#include "region_format/region_header.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WORD_BITS 64
+
+static bool reserve(struct sectors *s, const uint64_t end) {
+	const size_t words = (size_t)((end + WORD_BITS - 1) / WORD_BITS);
+	if (words <= s->words) return true;
+
+	size_t new_words = s->words ? s->words * 2 : 16;
+	while (new_words < words) new_words *= 2;
+
+	uint64_t *used = realloc(s->used, new_words * sizeof(used[0]));
+	if (!used) return false;
+
+	memset(used + s->words, 0, (new_words - s->words) * sizeof(used[0]));
+	s->used = used;
+	s->words = new_words;
+	return true;
+}
+
+static void mark(struct sectors *s, const uint32_t offset, const uint32_t count, const bool used) {
+	const uint64_t end = (uint64_t)offset + count;
+	assert((end + WORD_BITS - 1) / WORD_BITS <= s->words);
+
+	for (uint64_t i = offset; i < end;) {
+		const uint64_t bit = i % WORD_BITS;
+		const uint64_t n = end - i < WORD_BITS - bit ? end - i : WORD_BITS - bit;
+		const uint64_t mask = (n == WORD_BITS ? UINT64_MAX : (UINT64_C(1) << n) - 1) << bit;
+		// Overlapping chunks in a corrupted header mark some sectors twice, so only bits that change are counted.
+		const uint64_t word = s->used[i / WORD_BITS];
+		if (used) {
+			s->count += (uint32_t)__builtin_popcountll(mask & ~word);
+			s->used[i / WORD_BITS] = word | mask;
+		} else {
+			s->count -= (uint32_t)__builtin_popcountll(mask & word);
+			s->used[i / WORD_BITS] = word & ~mask;
+		}
+		i += n;
+	}
+}
+
+// Find the next sector at or after i that is used or free, or end if there isn't one.
+static uint32_t next(const struct sectors *s, uint32_t i, const bool used) {
+	while (i < s->end) {
+		uint64_t word = s->used[i / WORD_BITS];
+		if (!used) word = ~word;
+		word &= UINT64_MAX << (i % WORD_BITS);
+
+		if (word) {
+			i = i - i % WORD_BITS + (uint32_t)__builtin_ctzll(word);
+			return i < s->end ? i : s->end;
+		}
+		i = i - i % WORD_BITS + WORD_BITS;
+	}
+	return s->end;
+}
+
+bool sectors_init(struct sectors *s, const struct format *fmt, const char *file) {
+	memset(s, 0, sizeof(*s));
+	if (fmt->version == 0) return true;
+
+	uint64_t end = fmt->header_sectors;
+	for (size_t i = 0; i < HEADER_CHUNKS; i++) {
+		auto const location = format_location_get(fmt, file, i);
+		if (location.sectors == 0 || location.offset < fmt->header_sectors) continue;
+		if ((uint64_t)location.offset + location.sectors > end) end = (uint64_t)location.offset + location.sectors;
+	}
+	if (end > UINT32_MAX || !reserve(s, end)) return false;
+
+	mark(s, 0, fmt->header_sectors, true);
+	for (size_t i = 0; i < HEADER_CHUNKS; i++) {
+		auto const location = format_location_get(fmt, file, i);
+		if (location.sectors == 0 || location.offset < fmt->header_sectors) continue;
+		mark(s, location.offset, location.sectors, true);
+	}
+	s->end = (uint32_t)end;
+	return true;
+}
+
+void sectors_destroy(struct sectors *s) {
+	free(s->used);
+	memset(s, 0, sizeof(*s));
+}
+
+uint32_t sectors_alloc(struct sectors *s, const uint32_t count) {
+	assert(count > 0);
+
+	uint32_t best = 0;
+	uint32_t best_size = UINT32_MAX;
+	for (uint32_t i = next(s, 0, false); i < s->end;) {
+		const uint32_t j = next(s, i, true);
+		if (j - i >= count && j - i < best_size) {
+			best = i;
+			best_size = j - i;
+			if (best_size == count) break;
+		}
+		i = next(s, j, false);
+	}
+
+	if (best == 0) {
+		if ((uint64_t)s->end + count > UINT32_MAX) return 0;
+		best = s->end;
+	}
+
+	if (!reserve(s, (uint64_t)best + count)) return 0;
+	mark(s, best, count, true);
+	if (best + count > s->end) s->end = best + count;
+	return best;
+}
+
+void sectors_free(struct sectors *s, const uint32_t offset, const uint32_t count) {
+	if (count == 0) return;
+	assert((uint64_t)offset + count <= s->end);
+	mark(s, offset, count, false);
+
+	if (offset + count < s->end) return;
+
+	// The tail of the file is now free.
+	uint32_t end = offset;
+	while (end > 0) {
+		const uint64_t word = s->used[(end - 1) / WORD_BITS] & (UINT64_MAX >> (WORD_BITS - 1 - (end - 1) % WORD_BITS));
+		if (word) {
+			end = (end - 1) - (end - 1) % WORD_BITS + (uint32_t)(WORD_BITS - __builtin_clzll(word));
+			break;
+		}
+		end -= (end - 1) % WORD_BITS + 1;
+	}
+	s->end = end;
+}
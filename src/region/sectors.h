@@ -0,0 +1,39 @@
+#ifndef CLOD_REGION_SECTORS_H
+#define CLOD_REGION_SECTORS_H
+
+#include "region_format/format.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Free-space bitmap of a region file's sectors.
+ * Sectors at or past end are free, and the file can grow to make space for them.
+ */
+struct sectors {
+	uint64_t *used;
+	size_t words;
+	uint32_t end;
+	// Number of sectors in use, including the header's.
+	uint32_t count;
+};
+
+/**
+ * Build the bitmap from the header of a region file.
+ * Returns false on allocation failure.
+ */
+bool sectors_init(struct sectors *s, const struct format *fmt, const char *file);
+void sectors_destroy(struct sectors *s);
+
+/**
+ * Allocate count contiguous sectors, using the smallest hole that fits,
+ * or the end of the file if there isn't one.
+ * Returns the offset of the allocated sectors, or 0 on allocation failure.
+ */
+uint32_t sectors_alloc(struct sectors *s, uint32_t count);
+
+/**
+ * Release sectors previously allocated.
+ */
+void sectors_free(struct sectors *s, uint32_t offset, uint32_t count);
+
+#endif
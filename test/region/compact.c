@@ -0,0 +1,182 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNKS 256
+#define DATA_MAX 12000
+#define SECTOR_SIZE 4096
+#define HEADER_SIZE (8192 + 32768)
+
+static struct clod_region *region;
+static atomic_bool compacting;
+
+static void chunk_pos(int64_t pos[2], const size_t i) {
+	pos[0] = (int64_t)(i % 16);
+	pos[1] = (int64_t)(i / 16);
+}
+
+static size_t chunk_fill(uint8_t *buff, const size_t i, const uint8_t version) {
+	const size_t size = version == 0 ? DATA_MAX - i : 100 + i;
+	for (size_t k = 0; k < size; k++) buff[k] = (uint8_t)(i * 7 + k + version);
+	return size;
+}
+
+static bool chunk_check(const size_t i, const uint8_t version) {
+	int64_t pos[2];
+	chunk_pos(pos, i);
+	uint8_t buff[DATA_MAX], expected[DATA_MAX];
+	size_t size;
+	if (clod_region_read(region, pos, buff, sizeof(buff), &size) != CLOD_REGION_OK) return false;
+	return size == chunk_fill(expected, i, version) && memcmp(buff, expected, size) == 0;
+}
+
+// Every other chunk is shrunk, and every fourth deleted, leaving most of the file unused.
+static void fragment() {
+	uint8_t buff[DATA_MAX];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		check("chunk written", clod_region_write(region, pos, buff, chunk_fill(buff, i, 0)) == CLOD_REGION_OK);
+	}
+	for (size_t i = 0; i < CHUNKS; i += 2) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		const auto res = i % 4 == 0
+			? clod_region_write(region, pos, nullptr, 0)
+			: clod_region_write(region, pos, buff, chunk_fill(buff, i, 1));
+		check("chunk rewritten", res == CLOD_REGION_OK);
+	}
+}
+
+static void check_fragmented() {
+	for (size_t i = 0; i < CHUNKS; i++) {
+		if (i % 4 == 0) {
+			int64_t pos[2];
+			chunk_pos(pos, i);
+			size_t size;
+			uint8_t buff[1];
+			check("deleted chunk missing", clod_region_read(region, pos, buff, sizeof(buff), &size) == CLOD_REGION_NOT_FOUND);
+		} else {
+			const uint8_t version = i % 2 == 0 ? 1 : 0;
+			check("chunk has correct data", chunk_check(i, version));
+		}
+	}
+}
+
+// Size of the region file once every chunk is stored without gaps.
+static size_t compact_size() {
+	size_t size = HEADER_SIZE;
+	uint8_t buff[DATA_MAX];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		if (i % 4 == 0) continue;
+		size += (5 + chunk_fill(buff, i, i % 2 == 0 ? 1 : 0) + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+	}
+	return size;
+}
+
+static size_t file_size(const char *dir) {
+	char filename[256];
+	snprintf(filename, sizeof(filename), "%s/region.0.0.mca", dir);
+	struct stat st;
+	check("region file exists", stat(filename, &st) == 0);
+	return (size_t)st.st_size;
+}
+
+// Reads carry on while the file is compacted.
+static void *reader(void *) {
+	do {
+		for (size_t i = 1; i < CHUNKS; i += 2) check("chunk read while compacting", chunk_check(i, 0));
+	} while (compacting);
+	return nullptr;
+}
+
+int main() {
+	char dir[] = "/tmp/clod_compact_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	opts.compact_budget = 64 * 1024 * 1024;
+	region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	fragment();
+	const size_t fragmented_size = file_size(dir);
+	check("file is fragmented", fragmented_size > compact_size());
+
+	int64_t first[2];
+	chunk_pos(first, 1);
+	time_t mtime;
+	check("mtime read", clod_region_mtime(region, first, &mtime) == CLOD_REGION_OK);
+
+	compacting = true;
+	pthread_t thread;
+	check("thread started", pthread_create(&thread, nullptr, reader, nullptr) == 0);
+	check("region file compacted", clod_region_compact(region, first) == CLOD_REGION_OK);
+	compacting = false;
+	check("thread finished", pthread_join(thread, nullptr) == 0);
+
+	check("file has no gaps", file_size(dir) == compact_size());
+	check_fragmented();
+	time_t compacted_mtime;
+	check("mtime read", clod_region_mtime(region, first, &compacted_mtime) == CLOD_REGION_OK);
+	check("mtime kept", compacted_mtime == mtime);
+
+	// The compacted file can be written to and compacted again, and a missing region file is left alone.
+	uint8_t buff[DATA_MAX];
+	check("chunk written after compacting", clod_region_write(region, first, buff, chunk_fill(buff, 1, 0)) == CLOD_REGION_OK);
+	check("chunk has correct data", chunk_check(1, 0));
+	check("region file compacted again", clod_region_compact(region, first) == CLOD_REGION_OK);
+	check("file has no gaps", file_size(dir) == compact_size());
+	const int64_t missing[2] = {100000, 100000};
+	check("missing region file ignored", clod_region_compact(region, missing) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	opts.mode = CLOD_REGION_MODE_RDONLY;
+	region = clod_region_open(dir, &opts);
+	check("region reopened", region != nullptr);
+	check_fragmented();
+	check("read-only compaction rejected", clod_region_compact(region, first) == CLOD_REGION_INVALID_USAGE);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	// The background compactor finds the fragmented file itself.
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	region = clod_region_open(dir, &opts);
+	check("region reopened", region != nullptr);
+	fragment();
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+	check("file is fragmented", file_size(dir) > compact_size());
+
+	opts.compact_threshold = 20;
+	opts.compact_order = CLOD_REGION_ORDER_RECENT;
+	region = clod_region_open(dir, &opts);
+	check("region reopened", region != nullptr);
+	// Files aren't opened just to see if they need compacting. Writing to one wakes the compactor.
+	nanosleep(&(struct timespec){ .tv_nsec = 100000000 }, nullptr);
+	struct clod_region_stats stats;
+	clod_region_stats(region, &stats);
+	check("no region file opened by the compactor", stats.file_opens == 0);
+	check("file still fragmented", file_size(dir) > compact_size());
+	check("chunk rewritten", clod_region_write(region, first, buff, chunk_fill(buff, 1, 0)) == CLOD_REGION_OK);
+	for (size_t i = 0; i < 500 && file_size(dir) != compact_size(); i++) {
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, nullptr);
+	}
+	check("file compacted in the background", file_size(dir) == compact_size());
+	check_fragmented();
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
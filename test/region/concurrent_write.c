@@ -0,0 +1,124 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WRITERS 4
+#define READERS 4
+#define CHUNKS 8
+#define ROUNDS 40
+#define MAX_SIZE 9000
+
+static struct clod_region *region;
+
+// Chunk data is its position and version followed by bytes derived from them, so any torn read shows.
+static size_t fill(uint8_t *data, const int64_t *pos, const uint32_t version) {
+	const size_t size = 16 + (pos[0] * 131 + version * 977) % (MAX_SIZE - 16);
+	uint32_t x = (uint32_t)pos[0] * 7919 + version;
+	memcpy(data, &pos[0], sizeof(pos[0]));
+	memcpy(data + 8, &version, sizeof(version));
+	for (size_t i = 16; i < size; i++) {
+		x = x * 1664525 + 1013904223;
+		data[i] = (uint8_t)(x >> 24);
+	}
+	return size;
+}
+
+static void *writer(void *arg) {
+	const size_t t = (size_t)(uintptr_t)arg;
+	uint8_t data[MAX_SIZE];
+	for (uint32_t version = 1; version <= ROUNDS; version++) {
+		for (size_t i = 0; i < CHUNKS; i++) {
+			const int64_t pos[2] = {(int64_t)(t * CHUNKS + i), 0};
+			const size_t size = fill(data, pos, version);
+			check("chunk written concurrently", clod_region_write(region, pos, data, size) == CLOD_REGION_OK);
+		}
+	}
+	return nullptr;
+}
+
+static void *reader(void *arg) {
+	const size_t t = (size_t)(uintptr_t)arg;
+	uint8_t data[MAX_SIZE], expected[MAX_SIZE];
+	for (size_t round = 0; round < ROUNDS * 2; round++) {
+		const int64_t pos[2] = {(int64_t)((round * 5 + t) % (WRITERS * CHUNKS)), 0};
+		size_t size;
+		auto const res = clod_region_read(region, pos, data, sizeof(data), &size);
+		if (res == CLOD_REGION_NOT_FOUND) continue;
+		check("chunk read concurrently", res == CLOD_REGION_OK);
+
+		uint32_t version;
+		memcpy(&version, data + 8, sizeof(version));
+		check("concurrent read is consistent", size == fill(expected, pos, version) && memcmp(data, expected, size) == 0);
+	}
+	return nullptr;
+}
+
+int main() {
+	char dir[] = "/tmp/clod_concurrent_write_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	// Leave a hole in the file, so writing a small chunk doesn't need it to grow.
+	// Chunks that readers can find before the writers get to them hold version 0, so readers can check them too.
+	uint8_t data[MAX_SIZE];
+	const int64_t a[2] = {0, 0}, b[2] = {1, 0}, c[2] = {2, 0}, d[2] = {3, 0};
+	memset(data, 0, sizeof(data));
+	check("chunk written", clod_region_write(region, a, data, sizeof(data)) == CLOD_REGION_OK);
+	check("chunk written", clod_region_write(region, b, data, fill(data, b, 0)) == CLOD_REGION_OK);
+	check("chunk deleted", clod_region_write(region, a, nullptr, 0) == CLOD_REGION_OK);
+
+	// A view only holds up writers of its own chunk's stripe.
+	struct clod_region_view view;
+	check("view acquired", clod_region_read_view(region, b, &view) == CLOD_REGION_OK);
+	check("chunk written while another is viewed", clod_region_write(region, c, data, fill(data, c, 0)) == CLOD_REGION_OK);
+	check("chunk deleted while another is viewed", clod_region_write(region, d, nullptr, 0) == CLOD_REGION_OK);
+	clod_region_view_release(region, &view);
+
+	// Writers moving chunks about in one region file while readers check what they see.
+	pthread_t threads[WRITERS + READERS];
+	for (size_t i = 0; i < WRITERS; i++) {
+		check("thread started", pthread_create(&threads[i], nullptr, writer, (void *)(uintptr_t)i) == 0);
+	}
+	for (size_t i = 0; i < READERS; i++) {
+		check("thread started", pthread_create(&threads[WRITERS + i], nullptr, reader, (void *)(uintptr_t)i) == 0);
+	}
+	for (size_t i = 0; i < WRITERS + READERS; i++) {
+		check("thread finished", pthread_join(threads[i], nullptr) == 0);
+	}
+
+	uint8_t expected[MAX_SIZE];
+	for (size_t i = 0; i < WRITERS * CHUNKS; i++) {
+		const int64_t pos[2] = {(int64_t)i, 0};
+		size_t size;
+		check("chunk read", clod_region_read(region, pos, data, sizeof(data), &size) == CLOD_REGION_OK);
+		check("last write kept", size == fill(expected, pos, ROUNDS) && memcmp(data, expected, size) == 0);
+	}
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	// Every chunk still fits where the header says it is.
+	opts.mode = CLOD_REGION_MODE_RDONLY;
+	region = clod_region_open(dir, &opts);
+	check("region reopened", region != nullptr);
+	for (size_t i = 0; i < WRITERS * CHUNKS; i++) {
+		const int64_t pos[2] = {(int64_t)i, 0};
+		size_t size;
+		check("chunk persisted", clod_region_read(region, pos, data, sizeof(data), &size) == CLOD_REGION_OK);
+		check("persisted chunk correct", size == fill(expected, pos, ROUNDS) && memcmp(data, expected, size) == 0);
+	}
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
@@ -0,0 +1,151 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILES 4
+#define CHUNKS 40
+#define MAX_SIZE 6000
+
+static char src_dir[] = "/tmp/clod_convert_src_XXXXXX";
+static char dst_dir[] = "/tmp/clod_convert_dst_XXXXXX";
+
+static size_t fill(uint8_t *data, const int64_t *pos) {
+	const size_t size = 16 + (size_t)(pos[0] * 131 + pos[1] * 977) % (MAX_SIZE - 16);
+	memcpy(data, pos, 16);
+	// Runs of repeated bytes, so the data compresses.
+	for (size_t i = 16; i < size; i++) data[i] = (uint8_t)((pos[1] + (int64_t)(i / 64)) * 31);
+	return size;
+}
+
+static void chunk_pos(int64_t pos[2], const size_t i) {
+	pos[0] = (int64_t)(i % FILES) * 32;
+	pos[1] = (int64_t)(i / FILES);
+}
+
+static struct clod_region *open_region(const char *dir, const uint8_t mode, const enum clod_compression_method compression) {
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = mode;
+	opts.compression = compression;
+	struct clod_region *region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+	return region;
+}
+
+static atomic_size_t converted;
+static size_t stop_after;
+
+static bool count_converted(void *, const int64_t *) {
+	return ++converted != stop_after;
+}
+
+static bool progress_exists() {
+	char path[128];
+	snprintf(path, sizeof(path), "%s/region.convert", dst_dir);
+	return access(path, F_OK) == 0;
+}
+
+// Check every chunk was copied intact, with its modification time, and stored with the compression given.
+static void check_converted(struct clod_region *src, const enum clod_compression_method compression) {
+	struct clod_region *dst = open_region(dst_dir, CLOD_REGION_MODE_RDONLY, compression);
+	uint8_t data[MAX_SIZE], expected[MAX_SIZE];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		size_t size;
+		check("converted chunk read", clod_region_read(dst, pos, data, sizeof(data), &size) == CLOD_REGION_OK);
+		check("converted chunk intact", size == fill(expected, pos) && memcmp(data, expected, size) == 0);
+
+		time_t src_mtime, dst_mtime;
+		check("source mtime read", clod_region_mtime(src, pos, &src_mtime) == CLOD_REGION_OK);
+		check("converted mtime read", clod_region_mtime(dst, pos, &dst_mtime) == CLOD_REGION_OK);
+		check("modification time kept", src_mtime == dst_mtime);
+
+		struct clod_region_view view;
+		check("view acquired", clod_region_read_view(dst, pos, &view) == CLOD_REGION_OK);
+		check("chunk stored with destination's compression", view.compression == compression);
+		clod_region_view_release(dst, &view);
+	}
+	const int64_t missing[2] = {1, 200};
+	size_t size;
+	check("missing chunk still missing", clod_region_read(dst, missing, data, sizeof(data), &size) == CLOD_REGION_NOT_FOUND);
+	check("region closed", clod_region_close(dst) == CLOD_REGION_OK);
+}
+
+static void clear_dst() {
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s/*", dst_dir);
+	check("destination cleared", system(cmd) == 0);
+}
+
+int main() {
+	check("temporary directory created", mkdtemp(src_dir) != nullptr);
+	check("temporary directory created", mkdtemp(dst_dir) != nullptr);
+
+	// Uncompressed chunks can be stored in a vanilla header, so the source is in the compound format.
+	struct clod_region *src = open_region(src_dir, CLOD_REGION_MODE_RDWR, CLOD_UNCOMPRESSED);
+	uint8_t data[MAX_SIZE];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		check("chunk written", clod_region_write(src, pos, data, fill(data, pos)) == CLOD_REGION_OK);
+	}
+	check("region closed", clod_region_close(src) == CLOD_REGION_OK);
+	// Converted chunks must keep their own modification time rather than get the time they're converted.
+	sleep(1);
+	src = open_region(src_dir, CLOD_REGION_MODE_RDONLY, CLOD_UNCOMPRESSED);
+
+	// Recompressed with a different method.
+	struct clod_region *dst = open_region(dst_dir, CLOD_REGION_MODE_RDWR, CLOD_XZ);
+	struct clod_region_convert_opts opts = { .converted = count_converted, .threads = 3 };
+	check("region converted", clod_region_convert(src, dst, &opts) == CLOD_REGION_OK);
+	check("every file converted", converted == FILES);
+	check("progress removed once done", !progress_exists());
+	check("region closed", clod_region_close(dst) == CLOD_REGION_OK);
+	check_converted(src, CLOD_XZ);
+	clear_dst();
+
+	// Copied as stored, with small batches so files are written in several parts.
+	dst = open_region(dst_dir, CLOD_REGION_MODE_RDWR, CLOD_UNCOMPRESSED);
+	opts = (struct clod_region_convert_opts){ .batch_size = 4096 };
+	check("region converted in small batches", clod_region_convert(src, dst, &opts) == CLOD_REGION_OK);
+	check("region converted without options", clod_region_convert(src, dst, nullptr) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(dst) == CLOD_REGION_OK);
+	check_converted(src, CLOD_UNCOMPRESSED);
+	clear_dst();
+
+	// Stopped after the first file, then resumed.
+	dst = open_region(dst_dir, CLOD_REGION_MODE_RDWR, CLOD_BZIP2);
+	converted = 0;
+	stop_after = 1;
+	opts = (struct clod_region_convert_opts){ .converted = count_converted, .threads = 1 };
+	check("conversion stopped", clod_region_convert(src, dst, &opts) == CLOD_REGION_OK);
+	check("one file converted", converted == 1);
+	check("progress kept", progress_exists());
+	check("region closed", clod_region_close(dst) == CLOD_REGION_OK);
+
+	dst = open_region(dst_dir, CLOD_REGION_MODE_RDWR, CLOD_BZIP2);
+	converted = 0;
+	stop_after = 0;
+	opts.threads = 2;
+	check("conversion resumed", clod_region_convert(src, dst, &opts) == CLOD_REGION_OK);
+	check("converted files skipped", converted == FILES - 1);
+	check("progress removed once done", !progress_exists());
+	check("region closed", clod_region_close(dst) == CLOD_REGION_OK);
+	check_converted(src, CLOD_BZIP2);
+
+	dst = open_region(dst_dir, CLOD_REGION_MODE_RDONLY, CLOD_BZIP2);
+	check("read-only destination rejected", clod_region_convert(src, dst, nullptr) == CLOD_REGION_INVALID_USAGE);
+	check("region closed", clod_region_close(dst) == CLOD_REGION_OK);
+	check("region converted into itself rejected", clod_region_convert(src, src, nullptr) == CLOD_REGION_INVALID_USAGE);
+	check("region closed", clod_region_close(src) == CLOD_REGION_OK);
+
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s %s", src_dir, dst_dir);
+	check("temporary directories removed", system(cmd) == 0);
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILES 40
+#define THREADS 8
+
+static struct clod_region *region;
+static int64_t pos[FILES][2];
+
+static void *reader(void *arg) {
+	const size_t offset = (size_t)(uintptr_t)arg;
+	for (size_t round = 0; round < 5; round++) {
+		for (size_t j = 0; j < FILES; j++) {
+			const size_t i = (j + offset) % FILES;
+			size_t value;
+			check("chunk read concurrently", clod_region_read(region, pos[i], (uint8_t *)&value, sizeof(value), nullptr) == CLOD_REGION_OK);
+			check("concurrent read has correct data", value == i);
+		}
+	}
+	return nullptr;
+}
+
+int main() {
+	char dir[] = "/tmp/clod_file_cache_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	opts.max_open_files = 4;
+	region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	// One chunk in each of many more region files than can be open at once.
+	for (size_t i = 0; i < FILES; i++) {
+		pos[i][0] = (int64_t)i * 32;
+		pos[i][1] = -(int64_t)i * 32;
+		check("chunk written", clod_region_write(region, pos[i], (uint8_t *)&i, sizeof(i)) == CLOD_REGION_OK);
+	}
+
+	// A file in use isn't evicted while other files come and go.
+	struct clod_region_view view;
+	check("view acquired", clod_region_read_view(region, pos[0], &view) == CLOD_REGION_OK);
+	for (size_t round = 0; round < 3; round++) {
+		for (size_t i = 0; i < FILES; i++) {
+			size_t value;
+			check("chunk read", clod_region_read(region, pos[i], (uint8_t *)&value, sizeof(value), nullptr) == CLOD_REGION_OK);
+			check("chunk has correct data", value == i);
+		}
+	}
+	size_t first;
+	memcpy(&first, view.data, sizeof(first));
+	check("view still valid", view.size == sizeof(first) && first == 0);
+	clod_region_view_release(region, &view);
+
+	// Threads racing to open and evict the same files.
+	pthread_t threads[THREADS];
+	for (size_t i = 0; i < THREADS; i++) {
+		check("thread started", pthread_create(&threads[i], nullptr, reader, (void *)(uintptr_t)(i * 3)) == 0);
+	}
+	for (size_t i = 0; i < THREADS; i++) {
+		check("thread finished", pthread_join(threads[i], nullptr) == 0);
+	}
+
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
@@ -0,0 +1,221 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// More files than fit the first table of the index, so it has to grow.
+#define FILES 210
+#define PER_FILE 3
+#define CHUNKS (FILES * PER_FILE)
+#define THREADS 4
+// Chunks written by each thread at once, each in a new region file.
+#define THREAD_CHUNKS 60
+
+static char tmp_dir[] = "/tmp/clod_index_XXXXXX";
+
+struct chunk {
+	int64_t pos[2];
+	size_t size;
+	bool exists;
+	bool seen;
+};
+
+static struct chunk chunks[CHUNKS + 1 + THREADS * THREAD_CHUNKS];
+static size_t chunks_len;
+static size_t listed;
+static size_t stop_after;
+static bool unexpected;
+
+static void chunks_init() {
+	for (size_t f = 0; f < FILES; f++) {
+		const int64_t rx = (int64_t)(f % 15) - 7, rz = (int64_t)(f / 15) - 7;
+		for (size_t k = 0; k < PER_FILE; k++) {
+			auto const c = &chunks[chunks_len++];
+			c->pos[0] = rx * 32 + (int64_t)((k * 5 + f) % 32);
+			c->pos[1] = rz * 32 + (int64_t)((k * 11) % 32);
+			c->size = 10 + (f * 3 + k) % 200;
+			// Some chunks are deleted after they're written.
+			c->exists = !(k == 2 && f % 2 == 0);
+		}
+	}
+}
+
+static struct clod_region *open_region(const uint8_t mode, const uint8_t index) {
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = mode;
+	opts.index = index;
+	opts.compression = CLOD_UNCOMPRESSED;
+	// Not vanilla compatible, so files have a libclod header, which records sizes.
+	strcpy(opts.prefix, "chunks");
+	struct clod_region *region = clod_region_open(tmp_dir, &opts);
+	check("region opened", region != nullptr);
+	return region;
+}
+
+static void write_chunk(struct clod_region *region, const struct chunk *c) {
+	uint8_t data[256];
+	memset(data, (int)c->size, sizeof(data));
+	check("chunk written", clod_region_write(region, c->pos, data, c->size) == CLOD_REGION_OK);
+}
+
+static bool found(void *user, const int64_t *pos, const time_t mtime, const size_t size) {
+	struct clod_region *plain = user;
+	listed++;
+	bool match = false;
+	for (size_t i = 0; i < chunks_len; i++) {
+		auto const c = &chunks[i];
+		if (c->pos[0] != pos[0] || c->pos[1] != pos[1]) continue;
+		time_t expected;
+		match = c->exists && !c->seen && c->size == size &&
+			clod_region_mtime(plain, pos, &expected) == CLOD_REGION_OK && expected == mtime;
+		c->seen = true;
+	}
+	if (!match) unexpected = true;
+	return listed != stop_after;
+}
+
+static bool inside(const struct chunk *c, const int64_t *min, const int64_t *max) {
+	return c->pos[0] >= min[0] && c->pos[0] <= max[0] && c->pos[1] >= min[1] && c->pos[1] <= max[1];
+}
+
+// List the chunks in a box, and check they're exactly the chunks that exist there.
+static void check_list(struct clod_region *region, const int64_t *min, const int64_t *max) {
+	struct clod_region *plain = open_region(CLOD_REGION_MODE_RDONLY, 0);
+	for (size_t i = 0; i < chunks_len; i++) chunks[i].seen = false;
+	listed = 0;
+	unexpected = false;
+	check("chunks listed", clod_region_list(region, min, max, found, plain) == CLOD_REGION_OK);
+	check("only existing chunks listed once", !unexpected);
+	for (size_t i = 0; i < chunks_len; i++) {
+		auto const c = &chunks[i];
+		check("every chunk in the box listed", c->seen == (c->exists && inside(c, min, max)));
+	}
+	check("region closed", clod_region_close(plain) == CLOD_REGION_OK);
+}
+
+static const int64_t all_min[2] = {INT64_MIN, INT64_MIN};
+static const int64_t all_max[2] = {INT64_MAX, INT64_MAX};
+static const int64_t box_min[2] = {-40, -70};
+static const int64_t box_max[2] = {100, 5};
+
+static void check_region(struct clod_region *region) {
+	check_list(region, all_min, all_max);
+	check_list(region, box_min, box_max);
+
+	for (size_t i = 0; i < chunks_len; i++) {
+		time_t mtime;
+		auto const res = clod_region_mtime(region, chunks[i].pos, &mtime);
+		check("existence found", res == (chunks[i].exists ? CLOD_REGION_OK : CLOD_REGION_NOT_FOUND));
+	}
+	const int64_t missing[2] = {5000, 5000};
+	time_t mtime;
+	check("chunk in missing file not found", clod_region_mtime(region, missing, &mtime) == CLOD_REGION_NOT_FOUND);
+}
+
+struct writer {
+	struct clod_region *region;
+	const struct chunk *chunks;
+};
+
+static atomic_size_t writers_done;
+
+static bool count(void *, const int64_t *, time_t, size_t) {
+	return true;
+}
+
+static void *writer(void *arg) {
+	const struct writer *w = arg;
+	for (size_t i = 0; i < THREAD_CHUNKS; i++) write_chunk(w->region, &w->chunks[i]);
+	writers_done++;
+	return nullptr;
+}
+
+static uint64_t file_opens(struct clod_region *region) {
+	struct clod_region_stats stats;
+	clod_region_stats(region, &stats);
+	return stats.file_opens;
+}
+
+static bool index_exists() {
+	char path[128];
+	snprintf(path, sizeof(path), "%s/chunks.index", tmp_dir);
+	return access(path, F_OK) == 0;
+}
+
+int main() {
+	check("temporary directory created", mkdtemp(tmp_dir) != nullptr);
+	chunks_init();
+
+	// Kept up to date as chunks are written and deleted.
+	struct clod_region *region = open_region(CLOD_REGION_MODE_RDWR, 1);
+	check("index created", index_exists());
+	for (size_t i = 0; i < chunks_len; i++) write_chunk(region, &chunks[i]);
+	for (size_t i = 0; i < chunks_len; i++) {
+		if (!chunks[i].exists) check("chunk deleted", clod_region_write(region, chunks[i].pos, nullptr, 0) == CLOD_REGION_OK);
+	}
+	check_region(region);
+
+	stop_after = 3;
+	struct clod_region *plain = open_region(CLOD_REGION_MODE_RDONLY, 0);
+	listed = 0;
+	check("listing stopped", clod_region_list(region, all_min, all_max, found, plain) == CLOD_REGION_OK);
+	check("listing stopped when asked", listed == 3);
+	stop_after = 0;
+	check("region closed", clod_region_close(plain) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	// Answered without opening a region file.
+	region = open_region(CLOD_REGION_MODE_RDONLY, 1);
+	check_region(region);
+	check("no region file opened", file_opens(region) == 0);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	// Written without the index, which is then out of date, so region files are read instead.
+	region = open_region(CLOD_REGION_MODE_RDWR, 0);
+	auto const extra = &chunks[chunks_len++];
+	*extra = (struct chunk){ .pos = {3000, -3000}, .size = 77, .exists = true };
+	write_chunk(region, extra);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	region = open_region(CLOD_REGION_MODE_RDONLY, 1);
+	check_region(region);
+	check("region files read", file_opens(region) > 0);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	// Rebuilt from the region files, then written to by several threads at once while chunks are listed.
+	region = open_region(CLOD_REGION_MODE_RDWR, 1);
+	check_region(region);
+	pthread_t threads[THREADS];
+	struct writer writers[THREADS];
+	for (size_t t = 0; t < THREADS; t++) {
+		writers[t] = (struct writer){ .region = region, .chunks = &chunks[chunks_len] };
+		for (size_t i = 0; i < THREAD_CHUNKS; i++) {
+			auto const c = &chunks[chunks_len++];
+			// Every chunk is in a region file of its own, so each write adds to the index.
+			*c = (struct chunk){ .pos = {(int64_t)(t * THREAD_CHUNKS + i) * 32, 10000}, .size = 20 + i, .exists = true };
+		}
+	}
+	for (size_t t = 0; t < THREADS; t++) {
+		check("writer started", pthread_create(&threads[t], nullptr, writer, &writers[t]) == 0);
+	}
+	while (writers_done < THREADS) {
+		check("chunks listed while written", clod_region_list(region, all_min, all_max, count, nullptr) == CLOD_REGION_OK);
+	}
+	for (size_t t = 0; t < THREADS; t++) check("writer finished", pthread_join(threads[t], nullptr) == 0);
+	check_region(region);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+	region = open_region(CLOD_REGION_MODE_RDONLY, 1);
+	check_region(region);
+	check("no region file opened after rebuild", file_opens(region) == 0);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmp_dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
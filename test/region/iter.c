@@ -0,0 +1,87 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNKS 3000
+#define THREADS 8
+
+static struct clod_region *region;
+static struct clod_region_iter *iter;
+static int64_t pos[CHUNKS][2];
+static int seen[CHUNKS];
+static pthread_mutex_t seen_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t find(const int64_t *p) {
+	for (size_t i = 0; i < CHUNKS; i++) {
+		if (pos[i][0] == p[0] && pos[i][1] == p[1]) return i;
+	}
+	return SIZE_MAX;
+}
+
+static void *iterate(void *) {
+	int64_t p[2];
+	while (clod_region_iter_next(iter, p)) {
+		const size_t i = find(p);
+		check("position was written", i != SIZE_MAX);
+		pthread_mutex_lock(&seen_mtx);
+		seen[i]++;
+		pthread_mutex_unlock(&seen_mtx);
+	}
+	return nullptr;
+}
+
+int main() {
+	char dir[] = "/tmp/clod_iter_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	iter = clod_region_iter_start(region);
+	check("iterator started", iter != nullptr);
+	int64_t p[2];
+	check("empty region has no chunks", !clod_region_iter_next(iter, p));
+	clod_region_iter_end(iter);
+
+	// Chunks are spread over region files on both sides of the origin, and some are deleted again.
+	for (size_t i = 0; i < CHUNKS; i++) {
+		pos[i][0] = (int64_t)(i * 37 % 211) - 100;
+		pos[i][1] = (int64_t)(i / 211 * 5) - 30;
+		check("chunk written", clod_region_write(region, pos[i], (uint8_t *)&i, sizeof(i)) == CLOD_REGION_OK);
+	}
+	for (size_t i = 0; i < CHUNKS; i += 10) {
+		check("chunk deleted", clod_region_write(region, pos[i], nullptr, 0) == CLOD_REGION_OK);
+	}
+
+	iter = clod_region_iter_start(region);
+	check("iterator started", iter != nullptr);
+	pthread_t threads[THREADS];
+	for (size_t i = 0; i < THREADS; i++) {
+		check("thread started", pthread_create(&threads[i], nullptr, iterate, nullptr) == 0);
+	}
+	for (size_t i = 0; i < THREADS; i++) {
+		check("thread finished", pthread_join(threads[i], nullptr) == 0);
+	}
+	check("finished iterator stays finished", !clod_region_iter_next(iter, p));
+	clod_region_iter_end(iter);
+
+	for (size_t i = 0; i < CHUNKS; i++) {
+		const int expected = i % 10 == 0 ? 0 : 1;
+		check("every chunk returned once", seen[i] == expected);
+	}
+
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
@@ -0,0 +1,314 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <clod/big_endian.h>
+#include <clod/hash.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNKS 256
+#define ROUNDS 8
+#define DATA_MAX 3000
+
+static struct clod_region_opts opts;
+
+static void chunk_pos(int64_t pos[2], const size_t i) {
+	pos[0] = (int64_t)(i % 16);
+	pos[1] = (int64_t)(i / 16);
+}
+
+// Each version of a chunk has a different size, so rewriting it moves it to other sectors.
+static size_t chunk_fill(uint8_t *buff, const size_t i, const uint32_t version) {
+	const size_t size = 8 + (i * 13 + version * 211) % (DATA_MAX - 8);
+	memcpy(buff, &version, sizeof(version));
+	memcpy(buff + 4, &(uint32_t){ (uint32_t)i }, sizeof(uint32_t));
+	for (size_t k = 8; k < size; k++) buff[k] = (uint8_t)(version * 31 + i + k);
+	return size;
+}
+
+static void writer(const char *dir) {
+	struct clod_region *region = clod_region_open(dir, &opts);
+	if (!region) _exit(1);
+
+	uint8_t buff[DATA_MAX];
+	for (uint32_t version = 1;; version++) {
+		for (size_t i = 0; i < CHUNKS; i++) {
+			int64_t pos[2];
+			chunk_pos(pos, i);
+			const size_t size = chunk_fill(buff, i, version);
+			if (clod_region_write(region, pos, buff, size) != CLOD_REGION_OK) _exit(1);
+		}
+	}
+}
+
+// Every chunk must be missing or hold one whole version.
+static void verify(const char *dir) {
+	struct clod_region *region = clod_region_open(dir, &opts);
+	check("region opened after crash", region != nullptr);
+
+	uint8_t buff[DATA_MAX];
+	uint8_t expected[DATA_MAX];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		size_t size;
+		auto const res = clod_region_read(region, pos, buff, sizeof(buff), &size);
+		if (res == CLOD_REGION_NOT_FOUND) continue;
+		check("chunk read after crash", res == CLOD_REGION_OK);
+
+		uint32_t version;
+		memcpy(&version, buff, sizeof(version));
+		check("chunk has a whole version", size == chunk_fill(expected, i, version) && memcmp(buff, expected, size) == 0);
+	}
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+}
+
+// Offsets in a vanilla compatible region file, which has its libclod header after the vanilla one.
+#define SECTOR 4096
+#define LIBCLOD 8192
+
+// Checksums and sizes of an external chunk's old and new chunk files, which aren't in the region file.
+struct external_change {
+	uint32_t old_crc, new_crc;
+	uint32_t old_size, new_size;
+};
+
+/**
+ * Leave a region file as a crash would while moving chunk 0 to a copy of it at the end of the file,
+ * with the header update journaled but not applied. Returns the chunk's old and new offsets.
+ * If the chunk is external, its chunk files are described by ext.
+ */
+static void journal_move(
+	const char *dir,
+	const bool torn,
+	const struct external_change *ext,
+	uint32_t *old_offset, uint32_t *new_offset
+) {
+	char filename[256];
+	snprintf(filename, sizeof(filename), "%s/region.0.0.mca", dir);
+	const int fd = open(filename, O_RDWR);
+	check("region file opened", fd >= 0);
+
+	char location[4], libclod[12];
+	check("location read", pread(fd, location, 4, 0) == 4);
+	check("libclod header read", pread(fd, libclod, 12, LIBCLOD + 136) == 12);
+	*old_offset = beu24_dec(location);
+	const uint32_t sectors = beu8_dec(location + 3);
+	const off_t end = lseek(fd, 0, SEEK_END);
+	check("file size found", end > 0 && (end & (SECTOR - 1)) == 0);
+	*new_offset = (uint32_t)(end / SECTOR);
+
+	char chunk[SECTOR * 2];
+	check("chunk fits", sectors <= 2);
+	check("chunk read", pread(fd, chunk, sectors * SECTOR, *old_offset * (off_t)SECTOR) == (ssize_t)(sectors * SECTOR));
+	const uint32_t size = beu32_dec(chunk) - 1;
+	const uint32_t crc = clod_crc32(chunk + 5, size);
+	// Only part of the copy reached the disk.
+	if (torn) chunk[5 + size - 1] ^= 0x5a;
+	check("chunk copied", pwrite(fd, chunk, sectors * SECTOR, *new_offset * (off_t)SECTOR) == (ssize_t)(sectors * SECTOR));
+
+	char journal[12 + 44] = {0};
+	const uint32_t generation = (beu32_dec(libclod) + 1) | 1;
+	beu32_enc(journal + 4, generation);
+	beu32_enc(journal + 8, 1);
+	char *entry = journal + 12;
+	beu32_enc(entry + 4, *old_offset);
+	beu32_enc(entry + 8, sectors);
+	beu32_enc(entry + 16, size);
+	beu32_enc(entry + 20, crc);
+	beu32_enc(entry + 24, *new_offset);
+	beu32_enc(entry + 28, sectors);
+	beu32_enc(entry + 36, size);
+	beu32_enc(entry + 40, crc);
+	if (ext) {
+		beu32_enc(entry + 16, ext->old_size);
+		beu32_enc(entry + 20, ext->old_crc);
+		beu32_enc(entry + 36, ext->new_size);
+		beu32_enc(entry + 40, ext->new_crc);
+	}
+	beu32_enc(journal, clod_crc32(journal + 4, sizeof(journal) - 4));
+	const off_t journal_offset = (*new_offset + sectors) * (off_t)SECTOR;
+	check("journal written", pwrite(fd, journal, sizeof(journal), journal_offset) == sizeof(journal));
+	check("file padded", ftruncate(fd, journal_offset + SECTOR) == 0);
+
+	beu32_enc(libclod, generation);
+	beu32_enc(libclod + 4, *new_offset + sectors);
+	beu32_enc(libclod + 8, sizeof(journal));
+	check("header update begun", pwrite(fd, libclod, 12, LIBCLOD + 136) == 12);
+	check("region file closed", close(fd) == 0);
+}
+
+// Chunks too large for a vanilla region file, stored in chunk files of their own.
+#define EXTERNAL_SIZE (1100 * 1000)
+static uint8_t external_buff[EXTERNAL_SIZE];
+
+static uint32_t external_fill(const uint32_t version) {
+	memcpy(external_buff, &version, sizeof(version));
+	for (size_t k = 4; k < EXTERNAL_SIZE; k++) external_buff[k] = (uint8_t)(version * 7 + k / 3);
+	return clod_crc32(external_buff, EXTERNAL_SIZE);
+}
+
+static void external_put(const char *dir, const char *name, const uint32_t version) {
+	char filename[256];
+	snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+	external_fill(version);
+	FILE *f = fopen(filename, "wb");
+	check("chunk file created", f != nullptr);
+	check("chunk file written", fwrite(external_buff, 1, EXTERNAL_SIZE, f) == EXTERNAL_SIZE);
+	check("chunk file closed", fclose(f) == 0);
+}
+
+static bool external_exists(const char *dir, const char *name) {
+	char filename[256];
+	snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+	return access(filename, F_OK) == 0;
+}
+
+static void external_rename(const char *dir, const char *from, const char *to) {
+	char old_name[256], new_name[256];
+	snprintf(old_name, sizeof(old_name), "%s/%s", dir, from);
+	snprintf(new_name, sizeof(new_name), "%s/%s", dir, to);
+	check("chunk file renamed", rename(old_name, new_name) == 0);
+}
+
+// Read the external chunk 0, which must hold one whole version, and return the version.
+static uint32_t external_version(const char *dir) {
+	static uint8_t buff[EXTERNAL_SIZE];
+	struct clod_region *region = clod_region_open(dir, &opts);
+	check("region opened after crash", region != nullptr);
+	size_t size;
+	check("external chunk read after crash",
+		clod_region_read(region, (int64_t[2]){0, 0}, buff, sizeof(buff), &size) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	uint32_t version;
+	memcpy(&version, buff, sizeof(version));
+	external_fill(version);
+	check("external chunk has a whole version", size == EXTERNAL_SIZE && memcmp(buff, external_buff, size) == 0);
+	return version;
+}
+
+static uint32_t chunk_offset(const char *dir) {
+	char filename[256];
+	snprintf(filename, sizeof(filename), "%s/region.0.0.mca", dir);
+	const int fd = open(filename, O_RDONLY);
+	check("region file opened", fd >= 0);
+	char location[4];
+	check("location read", pread(fd, location, 4, 0) == 4);
+	check("region file closed", close(fd) == 0);
+	return beu24_dec(location);
+}
+
+int main() {
+	char dir[] = "/tmp/clod_journal_recover_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	opts.sector_size = 512;
+
+	// Writers killed at arbitrary points leave the region readable and every chunk whole.
+	srand((unsigned)time(nullptr));
+	for (size_t round = 0; round < ROUNDS; round++) {
+		const pid_t pid = fork();
+		check("writer started", pid >= 0);
+		if (pid == 0) writer(dir);
+
+		usleep((useconds_t)(20000 + rand() % 100000));
+		check("writer killed", kill(pid, SIGKILL) == 0);
+		int status;
+		check("writer stopped", waitpid(pid, &status, 0) == pid);
+		check("writer was killed", WIFSIGNALED(status));
+		verify(dir);
+	}
+
+	// A header left with an odd generation and no journal has a stale checksum, which is repaired on open.
+	char filename[256];
+	snprintf(filename, sizeof(filename), "%s/region.0.0.mca", dir);
+	const int fd = open(filename, O_RDWR);
+	check("region file opened", fd >= 0);
+	uint8_t field[12] = {0};
+	check("generation read", pread(fd, field, 4, 136) == 4);
+	field[3] |= 1;
+	check("generation made odd", pwrite(fd, field, 12, 136) == 12);
+	check("checksum corrupted", pwrite(fd, "\xde\xad\xbe\xef", 4, 128) == 4);
+	check("region file closed", close(fd) == 0);
+
+	verify(dir);
+	opts.mode = CLOD_REGION_MODE_RDONLY;
+	verify(dir);
+
+	// Chunk data torn after its header reached the disk fails its checksum, so the old chunk is kept.
+	char vanilla[] = "/tmp/clod_journal_torn_XXXXXX";
+	check("temporary directory created", mkdtemp(vanilla) != nullptr);
+	opts = (struct clod_region_opts){0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	struct clod_region *region = clod_region_open(vanilla, &opts);
+	check("region opened", region != nullptr);
+	uint8_t buff[DATA_MAX];
+	check("chunk written", clod_region_write(region, (int64_t[2]){0, 0}, buff, chunk_fill(buff, 0, 1)) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	uint32_t old_offset, new_offset;
+	journal_move(vanilla, true, nullptr, &old_offset, &new_offset);
+	verify(vanilla);
+	check("torn chunk not used", chunk_offset(vanilla) == old_offset);
+
+	journal_move(vanilla, false, nullptr, &old_offset, &new_offset);
+	verify(vanilla);
+	check("whole chunk used", chunk_offset(vanilla) == new_offset);
+
+	// A new chunk file is staged before the journal, and renamed into place while the header is updated.
+	// Recovery keeps the change only if the staged file was renamed, and puts back the chunk file it replaced if not.
+	char external[] = "/tmp/clod_journal_external_XXXXXX";
+	check("temporary directory created", mkdtemp(external) != nullptr);
+	region = clod_region_open(external, &opts);
+	check("region opened", region != nullptr);
+	const struct external_change ext = {
+		.old_crc = external_fill(2), .new_crc = external_fill(3),
+		.old_size = EXTERNAL_SIZE, .new_size = EXTERNAL_SIZE,
+	};
+	external_fill(2);
+	check("external chunk written", clod_region_write(region, (int64_t[2]){0, 0}, external_buff, EXTERNAL_SIZE) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	external_put(external, "c.0.0.mcc.new", 3);
+	journal_move(external, false, &ext, &old_offset, &new_offset);
+	check("unplaced chunk file not used", external_version(external) == 2 && chunk_offset(external) == old_offset);
+	check("unplaced chunk file removed", !external_exists(external, "c.0.0.mcc.new"));
+
+	external_rename(external, "c.0.0.mcc", "c.0.0.mcc.old");
+	external_put(external, "c.0.0.mcc.new", 3);
+	journal_move(external, false, &ext, &old_offset, &new_offset);
+	check("replaced chunk file put back", external_version(external) == 2 && chunk_offset(external) == old_offset);
+	check("chunk files tidied", !external_exists(external, "c.0.0.mcc.new") && !external_exists(external, "c.0.0.mcc.old"));
+
+	external_rename(external, "c.0.0.mcc", "c.0.0.mcc.old");
+	external_put(external, "c.0.0.mcc", 3);
+	journal_move(external, false, &ext, &old_offset, &new_offset);
+	check("placed chunk file used", external_version(external) == 3 && chunk_offset(external) == new_offset);
+	check("replaced chunk file removed", !external_exists(external, "c.0.0.mcc.old"));
+
+	// Writes leave only the chunk file in place.
+	region = clod_region_open(external, &opts);
+	check("region opened", region != nullptr);
+	external_fill(4);
+	check("external chunk rewritten", clod_region_write(region, (int64_t[2]){0, 0}, external_buff, EXTERNAL_SIZE) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+	check("rewritten chunk read", external_version(external) == 4);
+	check("no chunk files left over", !external_exists(external, "c.0.0.mcc.new") && !external_exists(external, "c.0.0.mcc.old"));
+
+	char cmd[192];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s %s %s", dir, vanilla, external);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
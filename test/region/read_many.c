@@ -0,0 +1,90 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNKS 64
+
+int main() {
+	char dir[] = "/tmp/clod_read_many_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	struct clod_region *region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	// Chunks straddle two region files, and are written in the reverse of the order they're requested.
+	int64_t pos[CHUNKS + 2][2];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		pos[i][0] = (int64_t)i - CHUNKS / 2;
+		pos[i][1] = 3;
+	}
+	for (size_t i = CHUNKS; i-- > 0;) {
+		char data[64];
+		const int len = snprintf(data, sizeof(data), "chunk %zu", i);
+		check("chunk written", clod_region_write(region, pos[i], (uint8_t *)data, (size_t)len) == CLOD_REGION_OK);
+	}
+	pos[CHUNKS][0] = 0;
+	pos[CHUNKS][1] = 4;
+	pos[CHUNKS + 1][0] = 1000;
+	pos[CHUNKS + 1][1] = 1000;
+
+	check("chunks prefetched", clod_region_prefetch(region, &pos[0][0], CHUNKS + 2) == CLOD_REGION_OK);
+
+	struct clod_region_read_request requests[CHUNKS + 3];
+	uint8_t buffs[CHUNKS + 3][64];
+	for (size_t i = 0; i < CHUNKS + 2; i++) {
+		requests[i] = (struct clod_region_read_request){ .pos = pos[i], .buff = buffs[i], .buff_size = sizeof(buffs[i]) };
+	}
+	requests[CHUNKS + 2] = (struct clod_region_read_request){ .pos = pos[0], .buff = buffs[CHUNKS + 2], .buff_size = 2 };
+
+	check("first failure returned", clod_region_read_many(region, requests, CHUNKS + 3) == CLOD_REGION_NOT_FOUND);
+	for (size_t i = 0; i < CHUNKS; i++) {
+		char data[64];
+		const int len = snprintf(data, sizeof(data), "chunk %zu", i);
+		check("chunk read", requests[i].result == CLOD_REGION_OK);
+		check("chunk has correct size", requests[i].size == (size_t)len);
+		check("chunk has correct data", memcmp(requests[i].buff, data, (size_t)len) == 0);
+	}
+	check("missing chunk", requests[CHUNKS].result == CLOD_REGION_NOT_FOUND);
+	check("missing region file", requests[CHUNKS + 1].result == CLOD_REGION_NOT_FOUND);
+	check("short buffer", requests[CHUNKS + 2].result == CLOD_REGION_SHORT_BUFFER);
+	check("short buffer returns size", requests[CHUNKS + 2].size == strlen("chunk 0"));
+
+	check("all chunks read", clod_region_read_many(region, requests, CHUNKS) == CLOD_REGION_OK);
+	check("empty batch", clod_region_read_many(region, requests, 0) == CLOD_REGION_OK);
+
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	// The same reads through io_uring, or mmap where it isn't available.
+	opts.mode = CLOD_REGION_MODE_RDONLY;
+	opts.io_engine = CLOD_REGION_IO_URING;
+	region = clod_region_open(dir, &opts);
+	check("region reopened", region != nullptr);
+	for (size_t i = 0; i < CHUNKS + 3; i++) requests[i].size = 0;
+	check("first failure returned", clod_region_read_many(region, requests, CHUNKS + 3) == CLOD_REGION_NOT_FOUND);
+	for (size_t i = 0; i < CHUNKS; i++) {
+		char data[64];
+		const int len = snprintf(data, sizeof(data), "chunk %zu", i);
+		check("chunk read", requests[i].result == CLOD_REGION_OK);
+		check("chunk has correct size", requests[i].size == (size_t)len);
+		check("chunk has correct data", memcmp(requests[i].buff, data, (size_t)len) == 0);
+	}
+	check("missing chunk", requests[CHUNKS].result == CLOD_REGION_NOT_FOUND);
+	check("short buffer", requests[CHUNKS + 2].result == CLOD_REGION_SHORT_BUFFER);
+
+	uint8_t buff[64];
+	check("exact size read", clod_region_read(region, pos[0], buff, strlen("chunk 0"), nullptr) == CLOD_REGION_OK);
+	check("exact size read has correct data", memcmp(buff, "chunk 0", strlen("chunk 0")) == 0);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define THREADS_MAX 64
+#define READS_PER_THREAD 20000
+#define CHUNKS 1024
+#define NS_IN_SEC 1000000000
+
+static struct clod_region *region;
+static int64_t pos[CHUNKS][2];
+
+static void *reader(void *arg) {
+	const size_t offset = (size_t)(uintptr_t)arg;
+	for (size_t i = 0; i < READS_PER_THREAD; i++) {
+		const size_t c = (i * 7 + offset) % CHUNKS;
+		uint64_t value;
+		check("chunk read", clod_region_read(region, pos[c], (uint8_t *)&value, sizeof(value), nullptr) == CLOD_REGION_OK);
+		check("chunk has correct data", value == c);
+	}
+	return nullptr;
+}
+
+// Readers of chunks in one region file all share its locks, so this shows how well read locking scales.
+int main() {
+	char dir[] = "/tmp/clod_read_scaling_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	for (uint64_t i = 0; i < CHUNKS; i++) {
+		pos[i][0] = (int64_t)(i % 32);
+		pos[i][1] = (int64_t)(i / 32);
+		check("chunk written", clod_region_write(region, pos[i], (uint8_t *)&i, sizeof(i)) == CLOD_REGION_OK);
+	}
+
+	pthread_t threads[THREADS_MAX];
+	for (size_t n = 1; n <= THREADS_MAX; n *= 2) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (size_t i = 0; i < n; i++) {
+			check("thread started", pthread_create(&threads[i], nullptr, reader, (void *)(uintptr_t)(i * 131)) == 0);
+		}
+		for (size_t i = 0; i < n; i++) {
+			check("thread finished", pthread_join(threads[i], nullptr) == 0);
+		}
+
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		const uint64_t ns_diff = (uint64_t)(end.tv_nsec - start.tv_nsec) +
+			(uint64_t)(end.tv_sec - start.tv_sec) * NS_IN_SEC;
+
+		printf("%2zu threads: %"PRIu64" reads/s\n", n, (uint64_t)n * READS_PER_THREAD * NS_IN_SEC / ns_diff);
+	}
+
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
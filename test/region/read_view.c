@@ -0,0 +1,82 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <clod/big_endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SECTOR 4096
+
+static char file[SECTOR * 4];
+
+static void put_chunk(const size_t index, const uint32_t sector, const char *data) {
+	const size_t size = strlen(data);
+	beu24_enc(file + index * 4, sector);
+	beu8_enc(file + index * 4 + 3, 1);
+	beu32_enc(file + sector * SECTOR, (uint32_t)size + 1);
+	beu8_enc(file + sector * SECTOR + 4, 3);
+	memcpy(file + sector * SECTOR + 5, data, size);
+}
+
+int main() {
+	char dir[] = "/tmp/clod_read_view_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	char path[256];
+	snprintf(path, sizeof(path), "%s/region.-1.0.mca", dir);
+	put_chunk(31, 2, "hello region");
+	put_chunk(0, 3, "another chunk");
+	FILE *f = fopen(path, "wb");
+	check("region file created", f != nullptr);
+	check("region file written", fwrite(file, sizeof(file), 1, f) == 1);
+	fclose(f);
+
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDONLY;
+	opts.compression = CLOD_UNCOMPRESSED;
+	strcpy(opts.region_ext, "mca");
+	struct clod_region *region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	struct clod_region_view view;
+	check("view acquired", clod_region_read_view(region, (int64_t[]){-1, 0}, &view) == CLOD_REGION_OK);
+	check("view has stored size", view.size == strlen("hello region"));
+	check("view has stored data", memcmp(view.data, "hello region", view.size) == 0);
+	check("view has stored compression", view.compression == CLOD_UNCOMPRESSED);
+	check("view has uncompressed size", view.uncompressed_size == strlen("hello region"));
+	clod_region_view_release(region, &view);
+
+	uint8_t buff[64];
+	size_t size;
+	check("chunk read", clod_region_read(region, (int64_t[]){-32, 0}, buff, sizeof(buff), &size) == CLOD_REGION_OK);
+	check("chunk has correct size", size == strlen("another chunk"));
+	check("chunk has correct data", memcmp(buff, "another chunk", size) == 0);
+	check("exact size read", clod_region_read(region, (int64_t[]){-32, 0}, buff, size, nullptr) == CLOD_REGION_OK);
+	check("short buffer", clod_region_read(region, (int64_t[]){-32, 0}, buff, 4, &size) == CLOD_REGION_SHORT_BUFFER);
+	check("short buffer returns size", size == strlen("another chunk"));
+
+	check("missing chunk", clod_region_read_view(region, (int64_t[]){-2, 0}, &view) == CLOD_REGION_NOT_FOUND);
+	check("missing region file", clod_region_read_view(region, (int64_t[]){0, 0}, &view) == CLOD_REGION_NOT_FOUND);
+
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	// Growing a file needs it to itself, which a thread holding a view of it can't have.
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+	check("chunk written", clod_region_write(region, (int64_t[]){0, 0}, (const uint8_t *)"viewed", 6) == CLOD_REGION_OK);
+	check("view acquired", clod_region_read_view(region, (int64_t[]){0, 0}, &view) == CLOD_REGION_OK);
+	check("growing file while holding a view fails",
+		clod_region_write(region, (int64_t[]){1, 0}, (const uint8_t *)"grows", 5) == CLOD_REGION_INVALID_USAGE);
+	clod_region_view_release(region, &view);
+	check("file grown once view released", clod_region_write(region, (int64_t[]){1, 0}, (const uint8_t *)"grows", 5) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/region.0.0.mca", dir);
+	unlink(path);
+	rmdir(dir);
+	return 0;
+}
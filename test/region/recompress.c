@@ -0,0 +1,162 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILES 4
+#define CHUNKS 80
+#define MAX_SIZE 6000
+// Too large for a region file even once compressed, so it's kept in a chunk file of its own.
+#define EXTERNAL_SIZE (1536 * 1024)
+
+static char tmp_dir[] = "/tmp/clod_recompress_XXXXXX";
+
+static size_t fill(uint8_t *data, const int64_t *pos) {
+	const size_t size = 16 + (size_t)(pos[0] * 131 + pos[1] * 977) % (MAX_SIZE - 16);
+	memcpy(data, pos, 16);
+	// Runs of repeated bytes, so the data compresses.
+	for (size_t i = 16; i < size; i++) data[i] = (uint8_t)((pos[1] + (int64_t)(i / 64)) * 31);
+	return size;
+}
+
+static void fill_external(uint8_t *data) {
+	uint64_t x = 0x9e3779b97f4a7c15;
+	for (size_t i = 0; i < EXTERNAL_SIZE; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		data[i] = (uint8_t)x;
+	}
+}
+
+static void chunk_pos(int64_t pos[2], const size_t i) {
+	pos[0] = (int64_t)(i % FILES) * 32;
+	pos[1] = (int64_t)(i / FILES);
+}
+
+static const int64_t external_pos[2] = {5, 31};
+
+static struct clod_region *open_region(const uint8_t mode) {
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = mode;
+	opts.compression = CLOD_XZ;
+	struct clod_region *region = clod_region_open(tmp_dir, &opts);
+	check("region opened", region != nullptr);
+	return region;
+}
+
+static atomic_bool stop;
+static atomic_size_t reads;
+
+// Reads chunks over and over while the region is recompressed underneath.
+static void *reader(void *arg) {
+	struct clod_region *region = arg;
+	uint8_t data[MAX_SIZE], expected[MAX_SIZE];
+	for (size_t i = 0; !stop; i = (i + 1) % CHUNKS) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		size_t size;
+		check("chunk read during recompression", clod_region_read(region, pos, data, sizeof(data), &size) == CLOD_REGION_OK);
+		check("chunk intact during recompression", size == fill(expected, pos) && memcmp(data, expected, size) == 0);
+		reads++;
+	}
+	return nullptr;
+}
+
+static void check_recompressed(struct clod_region *region, const time_t *mtimes, const enum clod_compression_method compression) {
+	uint8_t data[MAX_SIZE], expected[MAX_SIZE];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		size_t size;
+		check("recompressed chunk read", clod_region_read(region, pos, data, sizeof(data), &size) == CLOD_REGION_OK);
+		check("recompressed chunk intact", size == fill(expected, pos) && memcmp(data, expected, size) == 0);
+
+		time_t mtime;
+		check("mtime read", clod_region_mtime(region, pos, &mtime) == CLOD_REGION_OK);
+		check("modification time kept", mtime == mtimes[i]);
+
+		struct clod_region_view view;
+		check("view acquired", clod_region_read_view(region, pos, &view) == CLOD_REGION_OK);
+		check("chunk stored with new compression", view.compression == compression);
+		clod_region_view_release(region, &view);
+	}
+
+	uint8_t *big = malloc(EXTERNAL_SIZE), *big_expected = malloc(EXTERNAL_SIZE);
+	check("buffers allocated", big && big_expected);
+	fill_external(big_expected);
+	size_t size;
+	check("external chunk read", clod_region_read(region, external_pos, big, EXTERNAL_SIZE, &size) == CLOD_REGION_OK);
+	check("external chunk intact", size == EXTERNAL_SIZE && memcmp(big, big_expected, size) == 0);
+	free(big);
+	free(big_expected);
+}
+
+int main() {
+	check("temporary directory created", mkdtemp(tmp_dir) != nullptr);
+
+	struct clod_region *region = open_region(CLOD_REGION_MODE_RDWR);
+	uint8_t data[MAX_SIZE];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		check("chunk written", clod_region_write(region, pos, data, fill(data, pos)) == CLOD_REGION_OK);
+	}
+	uint8_t *big = malloc(EXTERNAL_SIZE);
+	check("buffer allocated", big != nullptr);
+	fill_external(big);
+	check("external chunk written", clod_region_write(region, external_pos, big, EXTERNAL_SIZE) == CLOD_REGION_OK);
+	free(big);
+
+	time_t mtimes[CHUNKS];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		check("mtime read", clod_region_mtime(region, pos, &mtimes[i]) == CLOD_REGION_OK);
+	}
+	// Recompressed chunks must keep their own modification time rather than get the time they're recompressed.
+	sleep(1);
+
+	pthread_t t;
+	check("reader started", pthread_create(&t, nullptr, reader, region) == 0);
+	while (reads == 0) sched_yield();
+	check("region recompressed", clod_region_recompress(region, CLOD_BZIP2, CLOD_COMPRESSION_HIGHEST, 3) == CLOD_REGION_OK);
+	stop = true;
+	check("reader finished", pthread_join(t, nullptr) == 0);
+	check_recompressed(region, mtimes, CLOD_BZIP2);
+
+	// Writes after recompression still use the region's own compression.
+	int64_t pos[2];
+	chunk_pos(pos, 0);
+	check("chunk written after recompression", clod_region_write(region, pos, data, fill(data, pos)) == CLOD_REGION_OK);
+	struct clod_region_view view;
+	check("view acquired", clod_region_read_view(region, pos, &view) == CLOD_REGION_OK);
+	check("new write uses region's compression", view.compression == CLOD_XZ);
+	clod_region_view_release(region, &view);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	// Once reopened, the recompressed files are read from disk.
+	region = open_region(CLOD_REGION_MODE_RDWR);
+	check("region recompressed back", clod_region_recompress(region, CLOD_XZ, CLOD_COMPRESSION_LOWEST, 0) == CLOD_REGION_OK);
+	check("mtime read", clod_region_mtime(region, pos, &mtimes[0]) == CLOD_REGION_OK);
+	check_recompressed(region, mtimes, CLOD_XZ);
+	for (size_t i = 0; i < FILES; i++) {
+		chunk_pos(pos, i);
+		check("recompressed file scrubbed", clod_region_scrub(region, pos, nullptr, nullptr) == CLOD_REGION_OK);
+	}
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	region = open_region(CLOD_REGION_MODE_RDONLY);
+	check("read-only region rejected", clod_region_recompress(region, CLOD_BZIP2, CLOD_COMPRESSION_NORMAL, 1) == CLOD_REGION_INVALID_USAGE);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmp_dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
@@ -0,0 +1,112 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNKS 1500
+// One chunk is larger than a worker's buffer starts out, so the buffer has to grow.
+#define LARGE_CHUNK 700
+#define LARGE_SIZE (600 * 1024)
+
+static int seen[CHUNKS];
+static size_t visited;
+static size_t errors;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t chunk_index(const int64_t *pos) {
+	return (size_t)((pos[1] + 20) * 100 + pos[0] + 50);
+}
+
+static void chunk_pos(int64_t pos[2], const size_t i) {
+	pos[0] = (int64_t)(i % 100) - 50;
+	pos[1] = (int64_t)(i / 100) - 20;
+}
+
+static size_t chunk_fill(uint8_t *buff, const size_t i) {
+	const size_t size = i == LARGE_CHUNK ? LARGE_SIZE : 64 + i % 900;
+	for (size_t k = 0; k < size; k++) buff[k] = (uint8_t)(k % 13 == 0 ? i : k);
+	return size;
+}
+
+static bool visit(void *, const int64_t *pos, const uint8_t *data, const size_t size) {
+	const size_t i = chunk_index(pos);
+	check("visited position was written", i < CHUNKS);
+
+	uint8_t *buff = malloc(LARGE_SIZE);
+	check("buffer allocated", buff != nullptr);
+	check("visited chunk has correct data", size == chunk_fill(buff, i) && memcmp(buff, data, size) == 0);
+	free(buff);
+
+	pthread_mutex_lock(&mtx);
+	seen[i]++;
+	visited++;
+	pthread_mutex_unlock(&mtx);
+	return true;
+}
+
+static bool visit_some(void *, const int64_t *, const uint8_t *, size_t) {
+	pthread_mutex_lock(&mtx);
+	const bool more = ++visited < 10;
+	pthread_mutex_unlock(&mtx);
+	return more;
+}
+
+static void error(void *, const int64_t *, enum clod_region_result) {
+	pthread_mutex_lock(&mtx);
+	errors++;
+	pthread_mutex_unlock(&mtx);
+}
+
+int main() {
+	char dir[] = "/tmp/clod_scan_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	// Use whichever real compression this build has, so that workers decompress.
+	const enum clod_compression_method methods[] = { CLOD_ZLIB, CLOD_LZ4F, CLOD_ZSTD, CLOD_XZ, CLOD_BZIP2 };
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		if (clod_compression_support(methods[i])) {
+			opts.compression = methods[i];
+			break;
+		}
+	}
+	struct clod_region *region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	struct clod_region_scan_opts scan = { .visit = visit, .error = error, .workers = 3, .queue_depth = 5 };
+	check("empty region scanned", clod_region_scan(region, &scan) == CLOD_REGION_OK);
+	check("nothing visited", visited == 0);
+
+	uint8_t *buff = malloc(LARGE_SIZE);
+	check("buffer allocated", buff != nullptr);
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		check("chunk written", clod_region_write(region, pos, buff, chunk_fill(buff, i)) == CLOD_REGION_OK);
+	}
+	free(buff);
+
+	check("region scanned", clod_region_scan(region, &scan) == CLOD_REGION_OK);
+	check("no errors", errors == 0);
+	check("every chunk visited", visited == CHUNKS);
+	for (size_t i = 0; i < CHUNKS; i++) check("every chunk visited once", seen[i] == 1);
+
+	// Default threads and queue, with the visitor stopping the scan.
+	visited = 0;
+	struct clod_region_scan_opts stop = { .visit = visit_some };
+	check("stopped scan succeeds", clod_region_scan(region, &stop) == CLOD_REGION_OK);
+	check("scan stopped early", visited >= 10 && visited < CHUNKS);
+
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
@@ -0,0 +1,157 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PROCESSES 3
+#define CHUNKS 24
+#define ROUNDS 30
+#define MAX_SIZE 9000
+
+static char dir[] = "/tmp/clod_shared_XXXXXX";
+
+// Chunk data is its position and version followed by bytes derived from them, so any torn read shows.
+static size_t fill(uint8_t *data, const int64_t *pos, const uint32_t version) {
+	const size_t size = 16 + (size_t)(pos[0] * 131 + pos[1] * 31 + version * 977) % (MAX_SIZE - 16);
+	uint32_t x = (uint32_t)(pos[0] * 7919 + pos[1]) + version;
+	memcpy(data, &pos[0], sizeof(pos[0]));
+	memcpy(data + 8, &version, sizeof(version));
+	for (size_t i = 16; i < size; i++) {
+		x = x * 1664525 + 1013904223;
+		data[i] = (uint8_t)(x >> 24);
+	}
+	return size;
+}
+
+// Chunks of each process are interleaved with the others' in two region files.
+static void chunk_pos(int64_t pos[2], const size_t process, const size_t i) {
+	const size_t n = i * PROCESSES + process;
+	pos[0] = (int64_t)(n % 2) * 32;
+	pos[1] = (int64_t)(n / 2);
+}
+
+static struct clod_region *open_region() {
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	opts.verify = CLOD_REGION_VERIFY_ALWAYS;
+	opts.shared = 1;
+	struct clod_region *region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+	return region;
+}
+
+static void read_consistent(struct clod_region *region, const int64_t *pos) {
+	uint8_t data[MAX_SIZE], expected[MAX_SIZE];
+	size_t size;
+	auto const res = clod_region_read(region, pos, data, sizeof(data), &size);
+	if (res == CLOD_REGION_NOT_FOUND) return;
+	check("chunk read while other processes write", res == CLOD_REGION_OK);
+
+	uint32_t version;
+	memcpy(&version, data + 8, sizeof(version));
+	check("read is consistent", size == fill(expected, pos, version) && memcmp(data, expected, size) == 0);
+}
+
+// Write this process's chunks over and over, reading the other processes' chunks in between.
+static void writer(const size_t process) {
+	struct clod_region *region = open_region();
+	uint8_t data[MAX_SIZE];
+	for (uint32_t version = 1; version <= ROUNDS; version++) {
+		for (size_t i = 0; i < CHUNKS; i++) {
+			int64_t pos[2];
+			chunk_pos(pos, process, i);
+			const size_t size = fill(data, pos, version);
+			check("chunk written while other processes write", clod_region_write(region, pos, data, size) == CLOD_REGION_OK);
+
+			chunk_pos(pos, (process + 1) % PROCESSES, i);
+			read_consistent(region, pos);
+		}
+	}
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+}
+
+// Write until killed.
+static void doomed_writer() {
+	struct clod_region *region = open_region();
+	uint8_t data[MAX_SIZE];
+	for (uint32_t version = ROUNDS + 1;; version++) {
+		for (size_t i = 0; i < CHUNKS; i++) {
+			int64_t pos[2];
+			chunk_pos(pos, 0, i);
+			const size_t size = fill(data, pos, version);
+			check("chunk written until killed", clod_region_write(region, pos, data, size) == CLOD_REGION_OK);
+		}
+	}
+}
+
+int main() {
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	pid_t pids[PROCESSES];
+	for (size_t p = 0; p < PROCESSES; p++) {
+		pids[p] = fork();
+		check("process forked", pids[p] >= 0);
+		if (pids[p] == 0) {
+			writer(p);
+			exit(0);
+		}
+	}
+	for (size_t p = 0; p < PROCESSES; p++) {
+		int status;
+		check("writer process finished", waitpid(pids[p], &status, 0) == pids[p]);
+		check("writer process succeeded", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+
+	struct clod_region *region = open_region();
+	uint8_t data[MAX_SIZE], expected[MAX_SIZE];
+	for (size_t p = 0; p < PROCESSES; p++) {
+		for (size_t i = 0; i < CHUNKS; i++) {
+			int64_t pos[2];
+			chunk_pos(pos, p, i);
+			size_t size;
+			check("every process's last write kept", clod_region_read(region, pos, data, sizeof(data), &size) == CLOD_REGION_OK);
+			check("last write intact", size == fill(expected, pos, ROUNDS) && memcmp(data, expected, size) == 0);
+		}
+	}
+
+	// A writer killed at any point leaves its lock to the next writer, which repairs the file.
+	// This process keeps the files open throughout, so the repair is made by a writer, not on opening.
+	const pid_t doomed = fork();
+	check("process forked", doomed >= 0);
+	if (doomed == 0) doomed_writer();
+	usleep(50000);
+	check("writer killed", kill(doomed, SIGKILL) == 0);
+	int status;
+	check("killed writer reaped", waitpid(doomed, &status, 0) == doomed && WIFSIGNALED(status));
+
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, 0, i);
+		read_consistent(region, pos);
+		const size_t size = fill(data, pos, ROUNDS * 2);
+		check("chunk written after writer died", clod_region_write(region, pos, data, size) == CLOD_REGION_OK);
+	}
+	for (size_t p = 0; p < PROCESSES; p++) {
+		for (size_t i = 0; i < CHUNKS; i++) {
+			int64_t pos[2];
+			chunk_pos(pos, p, i);
+			read_consistent(region, pos);
+		}
+	}
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	region = open_region();
+	check("shared region can't be compacted", clod_region_compact(region, (int64_t[]){ 0, 0 }) == CLOD_REGION_INVALID_USAGE);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
@@ -0,0 +1,116 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNKS 64
+#define THREADS 4
+#define CHUNK_SIZE 3000
+
+static struct clod_region *region;
+
+static void chunk_pos(int64_t pos[2], const size_t i) {
+	// Chunks are spread over several region files, so the cache has to evict them.
+	pos[0] = (int64_t)(i / 16) * 32;
+	pos[1] = (int64_t)(i % 16);
+}
+
+static uint64_t histogram_total(const uint64_t *buckets) {
+	uint64_t total = 0;
+	for (size_t i = 0; i < CLOD_REGION_LATENCY_BUCKETS; i++) total += buckets[i];
+	return total;
+}
+
+static void *read_all(void *) {
+	uint8_t buff[CHUNK_SIZE];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		size_t size;
+		check("chunk read", clod_region_read(region, pos, buff, sizeof(buff), &size) == CLOD_REGION_OK);
+	}
+	return nullptr;
+}
+
+int main() {
+	char dir[] = "/tmp/clod_stats_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	opts.max_open_files = 2;
+	region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	struct clod_region_stats stats;
+	clod_region_stats(region, &stats);
+	check("new region has no reads", stats.chunks_read == 0 && histogram_total(stats.read_latency) == 0);
+
+	uint8_t data[CHUNK_SIZE];
+	memset(data, 7, sizeof(data));
+	for (size_t i = 0; i < CHUNKS; i++) {
+		int64_t pos[2];
+		chunk_pos(pos, i);
+		check("chunk written", clod_region_write(region, pos, data, sizeof(data)) == CLOD_REGION_OK);
+	}
+	const int64_t deleted[2] = {0, 0};
+	check("chunk deleted", clod_region_write(region, deleted, nullptr, 0) == CLOD_REGION_OK);
+
+	clod_region_stats(region, &stats);
+	check("writes counted", stats.chunks_written == CHUNKS);
+	check("written bytes counted", stats.bytes_written == CHUNKS * CHUNK_SIZE);
+	check("uncompressed written bytes counted", stats.bytes_written_uncompressed == CHUNKS * CHUNK_SIZE);
+	check("write latency counted", histogram_total(stats.write_latency) == CHUNKS + 1);
+	check("region files grew", stats.file_truncates > 0);
+	// Writeable files grow inside the address space reserved for them.
+	check("region files grew in place", sizeof(void *) < 8 || stats.file_remaps == 0);
+	check("region files opened", stats.file_opens >= 4 && stats.file_misses >= stats.file_opens);
+	check("region files found open", stats.file_hits > 0);
+	check("region files evicted", stats.file_evictions > 0);
+
+	// The deleted chunk is written again so every read succeeds.
+	check("chunk written", clod_region_write(region, deleted, data, sizeof(data)) == CLOD_REGION_OK);
+
+	pthread_t threads[THREADS];
+	for (size_t i = 0; i < THREADS; i++) {
+		check("thread started", pthread_create(&threads[i], nullptr, read_all, nullptr) == 0);
+	}
+	for (size_t i = 0; i < THREADS; i++) {
+		check("thread finished", pthread_join(threads[i], nullptr) == 0);
+	}
+
+	clod_region_stats(region, &stats);
+	check("reads from every thread counted", stats.chunks_read == THREADS * CHUNKS);
+	check("read bytes counted", stats.bytes_read == THREADS * CHUNKS * CHUNK_SIZE);
+	check("uncompressed read bytes counted", stats.bytes_read_uncompressed == THREADS * CHUNKS * CHUNK_SIZE);
+	check("read latency counted", histogram_total(stats.read_latency) == THREADS * CHUNKS);
+
+	struct clod_region_view view;
+	check("view acquired", clod_region_read_view(region, deleted, &view) == CLOD_REGION_OK);
+	clod_region_view_release(region, &view);
+	const int64_t missing[2] = {1000, 1000};
+	uint8_t buff[CHUNK_SIZE];
+	struct clod_region_read_request requests[2] = {
+		{ .pos = deleted, .buff = buff, .buff_size = sizeof(buff) },
+		{ .pos = missing, .buff = buff, .buff_size = sizeof(buff) },
+	};
+	check("missing chunk not found", clod_region_read_many(region, requests, 2) == CLOD_REGION_NOT_FOUND);
+
+	clod_region_stats(region, &stats);
+	check("view counted", histogram_total(stats.read_view_latency) == 1);
+	check("batch counted once", histogram_total(stats.read_many_latency) == 1);
+	check("only chunks found are counted as read", stats.chunks_read == THREADS * CHUNKS + 2);
+	check("views aren't counted as decompressed", stats.bytes_read_uncompressed == (THREADS * CHUNKS + 1) * CHUNK_SIZE);
+
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
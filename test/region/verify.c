@@ -0,0 +1,169 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <clod/compression.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE 5000
+#define PROBE 32
+
+static const int64_t good[2] = {3, 4};
+static const int64_t bad[2] = {4, 4};
+static uint8_t buff[CHUNK_SIZE];
+static size_t corrupted;
+
+static void fill(uint8_t *data, const size_t size, uint32_t x) {
+	for (size_t i = 0; i < size; i++) {
+		x = x * 1664525 + 1013904223;
+		data[i] = (uint8_t)(x >> 24 & 0x0F);
+	}
+}
+
+static struct clod_region *open_region(const char *dir, const enum clod_compression_method compression, const uint8_t verify) {
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = compression;
+	opts.verify = verify;
+	opts.verify_sample = 1;
+	struct clod_region *region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+	return region;
+}
+
+// Flip a byte in the middle of the stored data that starts with probe, in whichever file holds it.
+static bool corrupt_file(const char *dir, const uint8_t *probe, const size_t stored) {
+	DIR *d = opendir(dir);
+	if (!d) return false;
+
+	bool found = false;
+	struct dirent *e;
+	while (!found && (e = readdir(d))) {
+		char path[512];
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		FILE *f = fopen(path, "r+b");
+		if (!f) continue;
+
+		fseek(f, 0, SEEK_END);
+		const long size = ftell(f);
+		uint8_t *data = size > 0 ? malloc((size_t)size) : nullptr;
+		fseek(f, 0, SEEK_SET);
+		if (data && fread(data, (size_t)size, 1, f) == 1) {
+			for (long i = 0; i + PROBE <= size; i++) {
+				if (memcmp(data + i, probe, PROBE) != 0) continue;
+				fseek(f, i + (long)(stored / 2), SEEK_SET);
+				fputc(data[i + (long)(stored / 2)] ^ 0x55, f);
+				found = true;
+				break;
+			}
+		}
+		free(data);
+		fclose(f);
+	}
+	closedir(d);
+	return found;
+}
+
+static void on_corrupt(void *, const int64_t *pos) {
+	check("corrupt chunk reported", pos[0] == bad[0] && pos[1] == bad[1]);
+	corrupted++;
+}
+
+static bool scan_visit(void *, const int64_t *pos, const uint8_t *, size_t) {
+	check("corrupt chunk not visited", pos[0] != bad[0] || pos[1] != bad[1]);
+	return true;
+}
+
+static void scan_error(void *, const int64_t *pos, const enum clod_region_result res) {
+	check("scan reports corrupt chunk", pos[0] == bad[0] && pos[1] == bad[1] && res == CLOD_REGION_MALFORMED);
+	corrupted++;
+}
+
+static void run(const enum clod_compression_method compression) {
+	char dir[] = "/tmp/clod_verify_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	uint8_t data[CHUNK_SIZE];
+	struct clod_region *region = open_region(dir, compression, CLOD_REGION_VERIFY_ALWAYS);
+	fill(data, sizeof(data), 1);
+	check("chunk written", clod_region_write(region, good, data, sizeof(data)) == CLOD_REGION_OK);
+	fill(data, sizeof(data), 2);
+	check("chunk written", clod_region_write(region, bad, data, sizeof(data)) == CLOD_REGION_OK);
+
+	size_t size;
+	check("intact chunk read", clod_region_read(region, bad, buff, sizeof(buff), &size) == CLOD_REGION_OK);
+	check("intact scrub", clod_region_scrub(region, good, on_corrupt, nullptr) == CLOD_REGION_OK);
+
+	struct clod_region_view view;
+	uint8_t probe[PROBE];
+	check("view acquired", clod_region_read_view(region, bad, &view) == CLOD_REGION_OK);
+	check("view has checksum", view.checksum != 0);
+	check("stored data is long enough to find", view.size >= PROBE * 2);
+	memcpy(probe, view.data, PROBE);
+	const size_t stored = view.size;
+	clod_region_view_release(region, &view);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	check("chunk corrupted", corrupt_file(dir, probe, stored));
+
+	region = open_region(dir, compression, CLOD_REGION_VERIFY_ALWAYS);
+	check("corrupt chunk detected", clod_region_read(region, bad, buff, sizeof(buff), &size) == CLOD_REGION_MALFORMED);
+	check("intact chunk read", clod_region_read(region, good, buff, sizeof(buff), &size) == CLOD_REGION_OK);
+	struct clod_region_read_request requests[2] = {
+		{ .pos = good, .buff = buff, .buff_size = sizeof(buff) },
+		{ .pos = bad, .buff = buff, .buff_size = sizeof(buff) },
+	};
+	check("batch read", clod_region_read_many(region, requests, 2) == CLOD_REGION_MALFORMED);
+	check("batch detects corrupt chunk", requests[0].result == CLOD_REGION_OK && requests[1].result == CLOD_REGION_MALFORMED);
+
+	corrupted = 0;
+	struct clod_region_scan_opts scan = { .visit = scan_visit, .error = scan_error };
+	check("region scanned", clod_region_scan(region, &scan) == CLOD_REGION_OK);
+	check("scan reported corrupt chunk once", corrupted == 1);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	region = open_region(dir, compression, CLOD_REGION_VERIFY_FIRST);
+	check("first read detects corrupt chunk", clod_region_read(region, bad, buff, sizeof(buff), &size) == CLOD_REGION_MALFORMED);
+	check("intact chunk read", clod_region_read(region, good, buff, sizeof(buff), &size) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	region = open_region(dir, compression, CLOD_REGION_VERIFY_SAMPLED);
+	check("sampled read detects corrupt chunk", clod_region_read(region, bad, buff, sizeof(buff), &size) == CLOD_REGION_MALFORMED);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	// Only scrubbing checks checksums, so reads of uncompressed data return it as it is.
+	region = open_region(dir, compression, CLOD_REGION_VERIFY_SCRUB);
+	if (compression == CLOD_UNCOMPRESSED) {
+		check("unchecked read", clod_region_read(region, bad, buff, sizeof(buff), &size) == CLOD_REGION_OK);
+	}
+	corrupted = 0;
+	check("scrub detects corrupt chunk", clod_region_scrub(region, good, on_corrupt, nullptr) == CLOD_REGION_MALFORMED);
+	check("scrub reported corrupt chunk once", corrupted == 1);
+	check("missing region file scrubbed", clod_region_scrub(region, (int64_t[]){ 1000, 1000 }, nullptr, nullptr) == CLOD_REGION_OK);
+
+	// Rewriting the chunk gives it a new checksum.
+	fill(data, sizeof(data), 3);
+	check("corrupt chunk rewritten", clod_region_write(region, bad, data, sizeof(data)) == CLOD_REGION_OK);
+	check("rewritten scrub", clod_region_scrub(region, bad, on_corrupt, nullptr) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+}
+
+int main() {
+	run(CLOD_UNCOMPRESSED);
+
+	const enum clod_compression_method methods[] = { CLOD_ZLIB, CLOD_LZ4F, CLOD_ZSTD, CLOD_XZ, CLOD_BZIP2 };
+	for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		if (clod_compression_support(methods[i])) {
+			run(methods[i]);
+			break;
+		}
+	}
+	return 0;
+}
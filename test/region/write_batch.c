@@ -0,0 +1,72 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNKS 200
+
+int main() {
+	char dir[] = "/tmp/clod_write_batch_XXXXXX";
+	check("temporary directory created", mkdtemp(dir) != nullptr);
+
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = CLOD_UNCOMPRESSED;
+	struct clod_region *region = clod_region_open(dir, &opts);
+	check("region opened", region != nullptr);
+
+	// Chunks are spread over several region files, and the last chunk is written twice.
+	int64_t pos[CHUNKS][2];
+	char data[CHUNKS + 1][64];
+	struct clod_region_write_request requests[CHUNKS + 1];
+	for (size_t i = 0; i < CHUNKS; i++) {
+		pos[i][0] = (int64_t)(i * 7) - 500;
+		pos[i][1] = (int64_t)(i % 3) * 40;
+		const int len = snprintf(data[i], sizeof(data[i]), "batched chunk %zu", i);
+		requests[i] = (struct clod_region_write_request){ .pos = pos[i], .buff = (uint8_t *)data[i], .buff_size = (size_t)len };
+	}
+	const int len = snprintf(data[CHUNKS], sizeof(data[CHUNKS]), "replaced");
+	requests[CHUNKS] = (struct clod_region_write_request){ .pos = pos[CHUNKS - 1], .buff = (uint8_t *)data[CHUNKS], .buff_size = (size_t)len };
+	check("batch written", clod_region_write_batch(region, requests, CHUNKS + 1) == CLOD_REGION_OK);
+	for (size_t i = 0; i < CHUNKS + 1; i++) check("chunk written", requests[i].result == CLOD_REGION_OK);
+
+	uint8_t buff[64];
+	size_t size;
+	for (size_t i = 0; i < CHUNKS - 1; i++) {
+		check("chunk read", clod_region_read(region, pos[i], buff, sizeof(buff), &size) == CLOD_REGION_OK);
+		check("chunk has correct data", size == strlen(data[i]) && memcmp(buff, data[i], size) == 0);
+	}
+	check("replaced chunk read", clod_region_read(region, pos[CHUNKS - 1], buff, sizeof(buff), &size) == CLOD_REGION_OK);
+	check("last write kept", size == strlen("replaced") && memcmp(buff, "replaced", size) == 0);
+
+	// Delete every other chunk, including chunks in a region file that doesn't exist.
+	int64_t missing[2] = {100000, 100000};
+	struct clod_region_write_request deletes[CHUNKS / 2 + 1];
+	for (size_t i = 0; i < CHUNKS / 2; i++) {
+		deletes[i] = (struct clod_region_write_request){ .pos = pos[i * 2] };
+	}
+	deletes[CHUNKS / 2] = (struct clod_region_write_request){ .pos = missing };
+	check("batch deleted", clod_region_write_batch(region, deletes, CHUNKS / 2 + 1) == CLOD_REGION_OK);
+	for (size_t i = 0; i < CHUNKS - 1; i++) {
+		const auto res = clod_region_read(region, pos[i], buff, sizeof(buff), &size);
+		check("deleted chunk missing", (i & 1) == 0 ? res == CLOD_REGION_NOT_FOUND : res == CLOD_REGION_OK);
+	}
+	check("empty batch", clod_region_write_batch(region, requests, 0) == CLOD_REGION_OK);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	opts.mode = CLOD_REGION_MODE_RDONLY;
+	region = clod_region_open(dir, &opts);
+	check("region reopened", region != nullptr);
+	check("chunk persisted", clod_region_read(region, pos[1], buff, sizeof(buff), &size) == CLOD_REGION_OK);
+	check("persisted chunk has correct data", size == strlen(data[1]) && memcmp(buff, data[1], size) == 0);
+	check("read-only batch rejected", clod_region_write_batch(region, requests, 1) == CLOD_REGION_INVALID_USAGE);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	check("temporary directory removed", system(cmd) == 0);
+	return 0;
+}
@@ -0,0 +1,142 @@
+#include "../test.h"
+#include <clod/region.h>
+#include <clod/compression.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LARGE (2 * 1024 * 1024)
+
+static uint8_t large[LARGE];
+static uint8_t buff[LARGE];
+
+static void fill(uint8_t *data, const size_t size, const uint32_t seed) {
+	uint32_t x = seed;
+	for (size_t i = 0; i < size; i++) {
+		x = x * 1664525 + 1013904223;
+		data[i] = (uint8_t)(x >> 24);
+	}
+}
+
+static bool read_matches(struct clod_region *region, const int64_t *pos, const uint8_t *data, const size_t size) {
+	size_t read_size;
+	if (clod_region_read(region, pos, buff, sizeof(buff), &read_size) != CLOD_REGION_OK) return false;
+	return read_size == size && memcmp(buff, data, size) == 0;
+}
+
+static void run(const char *dir, struct clod_region_opts *opts) {
+	struct clod_region *region = clod_region_open(dir, opts);
+	check("region opened", region != nullptr);
+
+	const int64_t a[3] = {5, -7, 1};
+	const int64_t b[3] = {6, -7, 1};
+	const int64_t c[3] = {7, -7, 1};
+	uint8_t small[3000];
+	fill(small, sizeof(small), 1);
+
+	check("missing chunk deleted", clod_region_write(region, a, nullptr, 0) == CLOD_REGION_OK);
+	check("chunk written", clod_region_write(region, a, small, sizeof(small)) == CLOD_REGION_OK);
+	check("chunk read back", read_matches(region, a, small, sizeof(small)));
+
+	time_t mtime;
+	check("mtime read", clod_region_mtime(region, a, &mtime) == CLOD_REGION_OK);
+	check("mtime is recent", mtime > 0 && mtime <= time(nullptr));
+	check("missing mtime", clod_region_mtime(region, b, &mtime) == CLOD_REGION_NOT_FOUND);
+
+	fill(large, 20000, 2);
+	check("neighbour written", clod_region_write(region, b, large, 20000) == CLOD_REGION_OK);
+	check("chunk grown", clod_region_write(region, a, large, 20000) == CLOD_REGION_OK);
+	check("grown chunk read back", read_matches(region, a, large, 20000));
+	check("chunk shrunk", clod_region_write(region, a, small, 100) == CLOD_REGION_OK);
+	check("shrunk chunk read back", read_matches(region, a, small, 100));
+	check("neighbour intact", read_matches(region, b, large, 20000));
+
+	size_t needed = 0;
+	check("short buffer reports chunk size", clod_region_read(region, b, buff, 100, &needed) == CLOD_REGION_SHORT_BUFFER);
+	check("reported size is exact", needed == 20000);
+	check("exact size read", clod_region_read(region, b, buff, 20000, nullptr) == CLOD_REGION_OK);
+	check("wrong exact size rejected", clod_region_read(region, b, buff, 20001, nullptr) != CLOD_REGION_OK);
+
+	fill(large, sizeof(large), 3);
+	check("external chunk written", clod_region_write(region, c, large, sizeof(large)) == CLOD_REGION_OK);
+	check("external chunk read back", read_matches(region, c, large, sizeof(large)));
+	check("external chunk read again", read_matches(region, c, large, sizeof(large)));
+	fill(large, sizeof(large), 4);
+	check("external chunk rewritten", clod_region_write(region, c, large, sizeof(large)) == CLOD_REGION_OK);
+	check("rewritten external chunk read back", read_matches(region, c, large, sizeof(large)));
+	check("external chunk replaced", clod_region_write(region, c, small, sizeof(small)) == CLOD_REGION_OK);
+	check("replaced chunk read back", read_matches(region, c, small, sizeof(small)));
+
+	check("chunk deleted", clod_region_write(region, a, nullptr, 0) == CLOD_REGION_OK);
+	check("deleted chunk missing", clod_region_read(region, a, buff, sizeof(buff), nullptr) == CLOD_REGION_NOT_FOUND);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+
+	opts->mode = CLOD_REGION_MODE_RDONLY;
+	region = clod_region_open(dir, opts);
+	check("region reopened", region != nullptr);
+	check("chunk persisted", read_matches(region, c, small, sizeof(small)));
+	check("read-only write rejected", clod_region_write(region, c, small, 1) == CLOD_REGION_INVALID_USAGE);
+	check("region closed", clod_region_close(region) == CLOD_REGION_OK);
+}
+
+int main() {
+	char vanilla[] = "/tmp/clod_write_vanilla_XXXXXX";
+	check("temporary directory created", mkdtemp(vanilla) != nullptr);
+	struct clod_region_opts opts = {0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.compression = clod_compression_support(CLOD_ZLIB) ? CLOD_ZLIB : CLOD_UNCOMPRESSED;
+	opts.access = CLOD_REGION_ACCESS_SEQUENTIAL;
+	run(vanilla, &opts);
+
+	char libclod[] = "/tmp/clod_write_libclod_XXXXXX";
+	check("temporary directory created", mkdtemp(libclod) != nullptr);
+	opts = (struct clod_region_opts){0};
+	opts.version = CLOD_REGION_VERSION;
+	opts.mode = CLOD_REGION_MODE_RDWR;
+	opts.dims = 3;
+	opts.sector_size = 1024;
+	opts.compression = CLOD_UNCOMPRESSED;
+	opts.access = 9;
+	check("invalid access pattern rejected", clod_region_open(libclod, &opts) == nullptr);
+	opts.access = CLOD_REGION_ACCESS_RANDOM;
+	opts.map_flags = CLOD_REGION_MAP_HUGE_PAGES | CLOD_REGION_MAP_LOCK_HEADERS;
+	opts.populate_max = 1024 * 1024;
+	run(libclod, &opts);
+
+	// Compression that the vanilla header can't store.
+	char cmd[256];
+	char xz[] = "/tmp/clod_write_xz_XXXXXX";
+	check("temporary directory created", mkdtemp(xz) != nullptr);
+	if (clod_compression_support(CLOD_XZ)) {
+		opts = (struct clod_region_opts){0};
+		opts.version = CLOD_REGION_VERSION;
+		opts.mode = CLOD_REGION_MODE_RDWR;
+		opts.compression = CLOD_XZ;
+		run(xz, &opts);
+
+		// Options from a program built against version 1, which end before the fields added since.
+		char old[] = "/tmp/clod_write_v1_XXXXXX";
+		check("temporary directory created", mkdtemp(old) != nullptr);
+		opts.version = 1;
+		opts.mode = CLOD_REGION_MODE_RDWR;
+		// Invalid, but past the end of version 1 options, so never read.
+		opts.io_engine = 9;
+		const size_t v1_size = offsetof(struct clod_region_opts, io_engine);
+		struct clod_region_opts *v1 = malloc(v1_size);
+		check("options allocated", v1 != nullptr);
+		memcpy(v1, &opts, v1_size);
+		run(old, v1);
+		free(v1);
+		opts.version = CLOD_REGION_VERSION + 1;
+		check("newer version rejected", clod_region_open(old, &opts) == nullptr);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", old);
+		check("temporary directory removed", system(cmd) == 0);
+	}
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s %s %s", vanilla, libclod, xz);
+	check("temporary directories removed", system(cmd) == 0);
+	return 0;
+}
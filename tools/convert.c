@@ -0,0 +1,121 @@
+/**
+ * clod-convert copies the region files of a world into a libclod region, recompressing chunks on the way.
+ *
+ * Usage: clod-convert [-c compression] [-j threads] [-b batch MiB] SOURCE DEST
+ *
+ * SOURCE is a directory of vanilla region files, such as a world's region directory.
+ * DEST is created if it doesn't exist. Chunks are stored with the compression given, or the default for DEST.
+ * Conversion can be interrupted and run again with the same arguments, which picks up where it left off.
+ */
+#include <clod/region.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const struct {
+	const char *name;
+	enum clod_compression_method method;
+} methods[] = {
+	{ "none", CLOD_UNCOMPRESSED },
+	{ "gzip", CLOD_GZIP },
+	{ "zlib", CLOD_ZLIB },
+	{ "deflate", CLOD_DEFLATE },
+	{ "lz4", CLOD_LZ4F },
+	{ "xz", CLOD_XZ },
+	{ "zstd", CLOD_ZSTD },
+	{ "bzip2", CLOD_BZIP2 },
+	{ "minecraft-lz4", CLOD_MINECRAFT_LZ4 },
+};
+
+static atomic_size_t files;
+static atomic_size_t errors;
+
+static bool converted(void *, const int64_t *) {
+	fprintf(stderr, "\r%zu region files converted", ++files);
+	return true;
+}
+
+static void error(void *, const int64_t *pos, const enum clod_region_result result) {
+	errors++;
+	fprintf(stderr, "\nChunk %lld, %lld left out (%d).\n", (long long)pos[0], (long long)pos[1], result);
+}
+
+static int usage(const char *argv0) {
+	fprintf(stderr, "Usage: %s [-c compression] [-j threads] [-b batch MiB] SOURCE DEST\n", argv0);
+	fprintf(stderr, "Compression is one of:");
+	for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) fprintf(stderr, " %s", methods[i].name);
+	fprintf(stderr, "\n");
+	return 2;
+}
+
+int main(const int argc, char **argv) {
+	struct clod_region_opts dst_opts = {0};
+	dst_opts.version = CLOD_REGION_VERSION;
+	dst_opts.mode = CLOD_REGION_MODE_RDWR;
+	struct clod_region_convert_opts opts = {0};
+	opts.converted = converted;
+	opts.error = error;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:j:b:")) != -1) {
+		switch (opt) {
+			case 'c': {
+				bool found = false;
+				for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+					if (strcmp(optarg, methods[i].name) == 0) {
+						dst_opts.compression = methods[i].method;
+						found = true;
+					}
+				}
+				if (!found) return usage(argv[0]);
+				if (!clod_compression_support(dst_opts.compression)) {
+					fprintf(stderr, "%s compression isn't supported by this build of libclod.\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			case 'j':
+				opts.threads = (uint32_t)strtoul(optarg, nullptr, 10);
+				break;
+			case 'b':
+				opts.batch_size = (uint32_t)strtoul(optarg, nullptr, 10) * 1024 * 1024;
+				break;
+			default:
+				return usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2) return usage(argv[0]);
+
+	struct clod_region_opts src_opts = {0};
+	src_opts.version = CLOD_REGION_VERSION;
+	src_opts.mode = CLOD_REGION_MODE_RDONLY;
+	src_opts.access = CLOD_REGION_ACCESS_SEQUENTIAL;
+	// Nothing is written to the source, so it doesn't need a compression method for new chunks.
+	src_opts.compression = CLOD_UNCOMPRESSED;
+	// Every chunk is checked as it's converted.
+	src_opts.verify = CLOD_REGION_VERIFY_SCRUB;
+	struct clod_region *src = clod_region_open(argv[optind], &src_opts);
+	if (!src) return 1;
+
+	(void)mkdir(argv[optind + 1], 0775);
+	struct clod_region *dst = clod_region_open(argv[optind + 1], &dst_opts);
+	if (!dst) {
+		(void)clod_region_close(src);
+		return 1;
+	}
+
+	auto const res = clod_region_convert(src, dst, &opts);
+	fprintf(stderr, "\n");
+	const bool closed = clod_region_close(dst) == CLOD_REGION_OK;
+	(void)clod_region_close(src);
+
+	if (res != CLOD_REGION_OK || !closed) return 1;
+	if (errors) {
+		fprintf(stderr, "%zu chunks couldn't be converted.\n", (size_t)errors);
+		return 1;
+	}
+	return 0;
+}